@@ -10,6 +10,8 @@ elif [ "$1" == "server" ]; then
     cmake --build $BUILD_DIR --target npchat -j$(nproc)
 elif [ "$1" == "client" ]; then
     cmake --build $BUILD_DIR --target npchat_js -j$(nproc)
+elif [ "$1" == "bench" ]; then
+    cmake --build $BUILD_DIR --target npchat_bench -j$(nproc)
 fi
 
 [ ! "$1" == "run" ] && exit 0
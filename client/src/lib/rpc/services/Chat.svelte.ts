@@ -2,8 +2,10 @@ import type {
   UserId,
   Contact,
   RegisteredUser,
+  Chat,
   ChatMessage,
-  ChatId, MessageId, ContactList, ChatAttachment, ChatMessageContent } from '../npchat';
+  ChatId, MessageId, AttachmentId, UploadId, ContactList, ChatAttachment, ChatMessageContent,
+  PresenceUpdate } from '../npchat';
 import { _IChatListener_Servant } from '../npchat';
 import { poa } from '../index';
 import { authService } from './Auth';
@@ -26,16 +28,32 @@ interface ChatHistory {
   messages: ChatMessage[];
   hasMore: boolean;
   isLoading: boolean;
-  offset: number;
+  before: MessageId; // Cursor for the next (older) page, 0 before the first load
 }
 
 class ChatServiceImpl {
   private chatListener: ChatListenerImpl | null = null;
+  private listenerObjectId: ReturnType<typeof poa.activate_object> | null = null;
+  private resubscribing = false;
   private registeredUser: RegisteredUser | null = null;
 
   // Constants for pagination
   private readonly MESSAGES_PER_PAGE = 50;
   private readonly MAX_CACHED_MESSAGES = 200;
+  // Newest messages per chat fetched with the chat list on login
+  private readonly PREVIEW_MESSAGES = 20;
+
+  // Attachments are downloaded and uploaded in chunks of this size (the server caps chunks at 1 MiB)
+  private readonly ATTACHMENT_CHUNK_SIZE = 1024 * 1024;
+
+  // Catch-up page size, and how long received messages wait to be acknowledged together
+  private readonly PENDING_PAGE_SIZE = 200;
+  private readonly ACK_DELAY_MS = 1000;
+
+  // While typing, SetTyping(true) is repeated at this interval; the server expires it after 6 s without one.
+  // Typing stops after TYPING_IDLE_MS without a keystroke.
+  private readonly TYPING_REFRESH_MS = 3000;
+  private readonly TYPING_IDLE_MS = 4000;
 
   // State for real-time notifications
   public notifications = $state<ChatNotification[]>([]);
@@ -45,6 +63,12 @@ class ChatServiceImpl {
   // State for chat histories with pagination
   public chatHistories = $state<Map<ChatId, ChatHistory>>(new Map());
 
+  // Online and typing state of the other participants, by chat and user
+  public presence = $state<Map<ChatId, Map<UserId, PresenceUpdate>>>(new Map());
+
+  // Previews of Picture and Video attachments, by attachment id, as the server makes them
+  public previews = $state<Map<AttachmentId, Uint8Array>>(new Map());
+
   // Callbacks for UI updates
   private onNewMessageCallbacks = new Set<(notification: ChatNotification) => void>();
   private onChatUpdateCallbacks = new Set<(chatId: ChatId, update: ChatUpdate) => void>();
@@ -53,6 +77,21 @@ class ChatServiceImpl {
   // Local cache of contacts
   private contacts = new Map<UserId, Contact>();
 
+  // Downloaded attachment content, by attachment id
+  private attachments = new Map<AttachmentId, Promise<Uint8Array>>();
+
+  // Previews asked for, so each is fetched once; OnAttachmentPreviewReady fetches it again
+  private previewRequests = new Set<AttachmentId>();
+
+  // Received messages not yet acknowledged to the server
+  private pendingAcks: MessageId[] = [];
+  private ackTimer: ReturnType<typeof setTimeout> | null = null;
+
+  // Our own typing state: the chat we last reported typing in and when
+  private typingChatId: ChatId | null = null;
+  private typingSentAt = 0;
+  private typingIdleTimer: ReturnType<typeof setTimeout> | null = null;
+
   // WebRTC event callbacks
   private onCallInitiatedCallbacks = new Set<(callId: string, chatId: ChatId, callerId: UserId, offer: string) => void>();
   private onCallAnsweredCallbacks = new Set<(callId: string, answer: string) => void>();
@@ -71,10 +110,13 @@ class ChatServiceImpl {
 
       // Create and register global ChatListener
       this.chatListener = new ChatListenerImpl(this);
-      const listenerObjectId = poa.activate_object(this.chatListener);
+      this.listenerObjectId = poa.activate_object(this.chatListener);
 
       // Subscribe to events for all chats
-      await this.registeredUser.SubscribeToEvents(listenerObjectId);
+      await this.registeredUser.SubscribeToEvents(this.listenerObjectId);
+
+      // Then fetch what was sent while we were away
+      await this.fetchPendingMessages();
 
       console.log('Global chat service initialized');
     } catch (error) {
@@ -82,6 +124,39 @@ class ChatServiceImpl {
     }
   }
 
+  // Drains the server-side queue of messages sent to this user and not acknowledged yet
+  private async fetchPendingMessages() {
+    if (!this.registeredUser) return;
+
+    let after: MessageId = 0;
+    for (;;) {
+      const messages = await this.registeredUser.GetPendingMessages(after, this.PENDING_PAGE_SIZE);
+      for (const message of messages) {
+        this.onMessageReceived(message.messageId, message, false);
+      }
+      if (messages.length > 0) {
+        await this.registeredUser.AckMessages(messages.map(m => m.messageId));
+        after = messages[messages.length - 1].messageId;
+      }
+      if (messages.length < this.PENDING_PAGE_SIZE) break;
+    }
+  }
+
+  // Acknowledges a pushed message; acks are sent in batches
+  private acknowledge(messageId: MessageId) {
+    this.pendingAcks.push(messageId);
+    if (this.ackTimer) return;
+
+    this.ackTimer = setTimeout(() => {
+      const ids = this.pendingAcks;
+      this.pendingAcks = [];
+      this.ackTimer = null;
+      this.registeredUser?.AckMessages(ids).catch(error => {
+        console.error('Failed to acknowledge messages:', error);
+      });
+    }, this.ACK_DELAY_MS);
+  }
+
   cleanup() {
     if (this.chatListener) {
       try {
@@ -90,10 +165,27 @@ class ChatServiceImpl {
       } catch (error) {
         console.error('Error removing global ChatListener:', error);
       }
+      this.listenerObjectId = null;
+    }
+
+    // Unacknowledged messages stay queued on the server and are fetched again next time
+    if (this.ackTimer) {
+      clearTimeout(this.ackTimer);
+      this.ackTimer = null;
     }
+    this.pendingAcks = [];
+
+    if (this.typingIdleTimer) {
+      clearTimeout(this.typingIdleTimer);
+      this.typingIdleTimer = null;
+    }
+    this.typingChatId = null;
 
     // Clear all state
     this.chatHistories.clear();
+    this.presence = new Map();
+    this.previews = new Map();
+    this.previewRequests.clear();
     this.chatUpdates.clear();
     this.notifications.length = 0;
     this.activeChatId = null;
@@ -114,6 +206,64 @@ class ChatServiceImpl {
     if (chatId && !this.chatHistories.has(chatId)) {
       await this.loadChatHistory(chatId);
     }
+
+    if (chatId) {
+      this.markChatAsRead(chatId);
+    }
+  }
+
+  // Seed unread counts from the chat list; the server keeps them across sessions
+  setUnreadCounts(chats: Chat[]) {
+    for (const chat of chats) {
+      const update: ChatUpdate = {
+        ...this.chatUpdates.get(chat.id),
+        chatId: chat.id,
+        unreadCount: this.activeChatId === chat.id ? 0 : chat.unreadCount
+      };
+      this.chatUpdates.set(chat.id, update);
+      this.onChatUpdateCallbacks.forEach(callback => callback(chat.id, update));
+    }
+  }
+
+  // Loads the chat list together with the newest messages of every chat in one call,
+  // so opening any of them right after login needs no round trip
+  async loadChatsWithPreview(registeredUser: RegisteredUser): Promise<Chat[]> {
+    const previews = await registeredUser.GetChatsWithPreview(this.PREVIEW_MESSAGES);
+    for (const { chat, messages } of previews) {
+      if (this.chatHistories.has(chat.id)) continue;
+      this.chatHistories.set(chat.id, {
+        chatId: chat.id,
+        messages,
+        hasMore: messages.length === this.PREVIEW_MESSAGES,
+        isLoading: false,
+        before: messages.length > 0 ? messages[0].messageId : 0
+      });
+      if (messages.length > 0) {
+        this.chatUpdates.set(chat.id, {
+          ...this.chatUpdates.get(chat.id),
+          chatId: chat.id,
+          lastMessage: messages[messages.length - 1],
+          unreadCount: this.chatUpdates.get(chat.id)?.unreadCount ?? 0
+        });
+      }
+    }
+    // Trigger Svelte reactivity
+    this.chatHistories = new Map(this.chatHistories);
+
+    const chats = previews.map(p => p.chat);
+    this.setUnreadCounts(chats);
+    return chats;
+  }
+
+  // Moves the server-side read watermark to the newest loaded message of the chat
+  private markChatAsRead(chatId: ChatId) {
+    const messages = this.chatHistories.get(chatId)?.messages;
+    const last = messages?.[messages.length - 1];
+    if (!this.registeredUser || !last) return;
+
+    this.registeredUser.MarkMessageAsRead(last.messageId).catch(error => {
+      console.error('Failed to mark chat', chatId, 'as read:', error);
+    });
   }
 
   // Send a message through the registered user
@@ -122,6 +272,15 @@ class ChatServiceImpl {
       throw new Error('Chat service not initialized');
     }
 
+    // Anything larger than a chunk is uploaded ahead of the message and referenced by upload id
+    if (attachment && attachment.data.length > this.ATTACHMENT_CHUNK_SIZE) {
+      const upload = await this.uploadAttachment(attachment.data);
+      attachment = { ...attachment, data: new Uint8Array(0), upload };
+    }
+
+    // The server clears our typing state when the message arrives
+    this.resetTyping();
+
     const chatMessage: ChatMessageContent = {
       text: text.trim(),
       attachment: attachment
@@ -130,8 +289,111 @@ class ChatServiceImpl {
     return await this.registeredUser.SendMessage(chatId, chatMessage);
   }
 
+  private async uploadAttachment(data: Uint8Array): Promise<UploadId> {
+    if (!this.registeredUser) {
+      throw new Error('Chat service not initialized');
+    }
+
+    const upload = await this.registeredUser.BeginUpload(data.length);
+    let offset = 0;
+    while (offset < data.length) {
+      // The server answers with what it has received, which is where the next chunk starts
+      offset = await this.registeredUser.UploadChunk(upload, offset,
+        data.subarray(offset, offset + this.ATTACHMENT_CHUNK_SIZE));
+    }
+    await this.registeredUser.CommitUpload(upload);
+    return upload;
+  }
+
+  // Returns the attachment with its content, downloading it on first use.
+  // Messages from the server only reference attachment content by id.
+  async resolveAttachment(attachment: ChatAttachment): Promise<ChatAttachment> {
+    if (attachment.data.length > 0 || !attachment.id) {
+      return attachment;
+    }
+
+    let content = this.attachments.get(attachment.id);
+    if (!content) {
+      content = this.downloadAttachment(attachment.id, attachment.size);
+      this.attachments.set(attachment.id, content);
+      // Allow a retry if the download failed
+      content.catch(() => this.attachments.delete(attachment.id));
+    }
+
+    return { ...attachment, data: await content };
+  }
+
+  // Fetches the preview of a Picture or Video attachment from the server, once.
+  // The server makes previews after the message is sent; until then there is none.
+  loadPreview(attachment: ChatAttachment): void {
+    if (!attachment.id || this.previewRequests.has(attachment.id)) {
+      return;
+    }
+    this.previewRequests.add(attachment.id);
+    void this.fetchPreview(attachment.id);
+  }
+
+  // The server fell behind sending us events and unsubscribed us: subscribe again
+  // and fetch what was lost from the pending queue
+  async onEventsDropped() {
+    if (!this.registeredUser || this.listenerObjectId === null || this.resubscribing) {
+      return;
+    }
+
+    this.resubscribing = true;
+    try {
+      console.warn('Chat events were dropped by the server, subscribing again');
+      await this.registeredUser.SubscribeToEvents(this.listenerObjectId);
+      await this.fetchPendingMessages();
+    } catch (error) {
+      console.error('Failed to subscribe to chat events again:', error);
+    } finally {
+      this.resubscribing = false;
+    }
+  }
+
+  onAttachmentPreviewReady(attachmentId: AttachmentId) {
+    // Only previews of messages that are on screen were asked for
+    if (this.previewRequests.has(attachmentId) && !this.previews.has(attachmentId)) {
+      void this.fetchPreview(attachmentId);
+    }
+  }
+
+  private async fetchPreview(id: AttachmentId): Promise<void> {
+    if (!this.registeredUser) {
+      return;
+    }
+
+    try {
+      const preview = await this.registeredUser.GetAttachmentPreview(id);
+      if (preview.length > 0) {
+        this.previews.set(id, preview);
+        this.previews = new Map(this.previews);
+      }
+    } catch (error) {
+      console.error('Failed to load attachment preview:', error);
+      this.previewRequests.delete(id);
+    }
+  }
+
+  private async downloadAttachment(id: AttachmentId, size: number): Promise<Uint8Array> {
+    if (!this.registeredUser) {
+      throw new Error('Chat service not initialized');
+    }
+
+    const data = new Uint8Array(size);
+    let offset = 0;
+    while (offset < size) {
+      const chunk = await this.registeredUser.GetAttachment(id, offset, this.ATTACHMENT_CHUNK_SIZE);
+      if (chunk.length === 0) break;
+      data.set(chunk, offset);
+      offset += chunk.length;
+    }
+    return data.subarray(0, offset);
+  }
+
   // Load chat history for a specific chat
-  private async loadChatHistory(chatId: ChatId, offset: number = 0): Promise<void> {
+  private async loadChatHistory(chatId: ChatId, before: MessageId = 0): Promise<void> {
     if (!this.registeredUser) {
       throw new Error('Chat service not initialized');
     }
@@ -144,7 +406,7 @@ class ChatServiceImpl {
         messages: [],
         hasMore: true,
         isLoading: false,
-        offset: 0
+        before: 0
       };
       this.chatHistories.set(chatId, history);
     }
@@ -157,11 +419,11 @@ class ChatServiceImpl {
     history.isLoading = true;
 
     try {
-      console.log(`Loading chat history for chat ${chatId}, offset: ${offset}, limit: ${this.MESSAGES_PER_PAGE}`);
+      console.log(`Loading chat history for chat ${chatId}, before: ${before}, limit: ${this.MESSAGES_PER_PAGE}`);
 
-      const messages = await this.registeredUser.GetChatHistory(chatId, this.MESSAGES_PER_PAGE, offset);
+      const messages = await this.registeredUser.GetChatHistoryBefore(chatId, before, this.MESSAGES_PER_PAGE);
 
-      if (offset === 0) {
+      if (before === 0) {
         // Initial load - replace messages
         history.messages = messages;
       } else {
@@ -171,14 +433,13 @@ class ChatServiceImpl {
 
       // Update pagination state
       history.hasMore = messages.length === this.MESSAGES_PER_PAGE;
-      history.offset = offset + messages.length;
+      if (messages.length > 0) {
+        history.before = messages[0].messageId;
+      }
 
-      // Limit cache size to prevent memory issues
+      // Limit cache size to prevent memory issues (the oldest message, and so the cursor, is kept)
       if (history.messages.length > this.MAX_CACHED_MESSAGES) {
-        const excess = history.messages.length - this.MAX_CACHED_MESSAGES;
         history.messages = history.messages.slice(0, this.MAX_CACHED_MESSAGES);
-        // Adjust offset since we removed messages
-        history.offset = Math.max(0, history.offset - excess);
       }
 
       console.log(`Loaded ${messages.length} messages for chat ${chatId}. Total: ${history.messages.length}, hasMore: ${history.hasMore}`);
@@ -202,7 +463,7 @@ class ChatServiceImpl {
       return false;
     }
 
-    await this.loadChatHistory(chatId, history.offset);
+    await this.loadChatHistory(chatId, history.before);
     return this.chatHistories.get(chatId)?.hasMore || false;
   }
 
@@ -214,8 +475,9 @@ class ChatServiceImpl {
     await this.loadChatHistory(chatId, 0);
   }
 
-  // Handle incoming message notification
-  onMessageReceived(messageId: MessageId, message: ChatMessage) {
+  // Handle incoming message notification. `live` is false for messages fetched while
+  // catching up: those are already counted in the unread counts from the server.
+  onMessageReceived(messageId: MessageId, message: ChatMessage, live = true) {
     const notification: ChatNotification = {
       chatId: message.chatId,
       messageId,
@@ -227,7 +489,7 @@ class ChatServiceImpl {
     this.notifications.push(notification);
 
     // If message is from a different chat than the one currently open, show a browser notification
-    if (this.activeChatId !== null && message.chatId !== this.activeChatId) {
+    if (live && this.activeChatId !== null && message.chatId !== this.activeChatId) {
       try {
         if ("Notification" in window) {
           // Request permission once
@@ -262,7 +524,9 @@ class ChatServiceImpl {
         if (history.messages.length > this.MAX_CACHED_MESSAGES) {
           const excess = history.messages.length - this.MAX_CACHED_MESSAGES;
           history.messages = history.messages.slice(excess);
-          history.offset = Math.max(0, history.offset - excess);
+          // Older messages are reloaded from the new oldest one
+          history.before = history.messages[0].messageId;
+          history.hasMore = true;
         }
       }
     }
@@ -274,11 +538,19 @@ class ChatServiceImpl {
     const chatUpdate: ChatUpdate = {
       chatId: message.chatId,
       lastMessage: message,
-      unreadCount: isActiveChat ? 0 : (existingUpdate?.unreadCount || 0) + 1
+      unreadCount: isActiveChat ? 0 : (existingUpdate?.unreadCount || 0) + (live ? 1 : 0)
     };
 
     this.chatUpdates.set(message.chatId, chatUpdate);
 
+    if (isActiveChat) {
+      this.markChatAsRead(message.chatId);
+    }
+
+    if (live) {
+      this.acknowledge(messageId);
+    }
+
     // Notify callbacks
     this.onNewMessageCallbacks.forEach(callback => callback(notification));
     this.onChatUpdateCallbacks.forEach(callback => callback(message.chatId, chatUpdate));
@@ -298,6 +570,85 @@ class ChatServiceImpl {
     // Could trigger contact list refresh
   }
 
+  onPresenceBatch(updates: PresenceUpdate[]) {
+    const self = authService.authState.userData?.userId;
+    for (const update of updates) {
+      if (update.userId === self) continue;
+      let chat = this.presence.get(update.chatId);
+      if (!chat) {
+        chat = new Map();
+        this.presence.set(update.chatId, chat);
+      }
+      if (update.online || update.typing) {
+        chat.set(update.userId, update);
+      } else {
+        chat.delete(update.userId);
+      }
+    }
+    // Trigger Svelte reactivity
+    this.presence = new Map(this.presence);
+  }
+
+  // Current presence of a chat; later changes arrive through OnPresenceBatch
+  async loadChatPresence(chatId: ChatId) {
+    if (!this.registeredUser) return;
+    try {
+      const updates = await this.registeredUser.GetChatPresence(chatId);
+      this.presence.set(chatId, new Map());
+      this.onPresenceBatch(updates);
+    } catch (error) {
+      console.error('Failed to load chat presence:', error);
+    }
+  }
+
+  // Users other than us currently typing in the chat
+  typingUsers(chatId: ChatId): UserId[] {
+    const chat = this.presence.get(chatId);
+    if (!chat) return [];
+    return [...chat.values()].filter(p => p.typing).map(p => p.userId);
+  }
+
+  isOnline(chatId: ChatId, userId: UserId): boolean {
+    return this.presence.get(chatId)?.get(userId)?.online ?? false;
+  }
+
+  // Called on every keystroke in the message input; reports at most one SetTyping per refresh interval
+  noteTyping(chatId: ChatId) {
+    if (!this.registeredUser) return;
+
+    const now = Date.now();
+    if (this.typingChatId !== null && this.typingChatId !== chatId) {
+      this.stopTyping();
+    }
+    if (this.typingChatId !== chatId || now - this.typingSentAt >= this.TYPING_REFRESH_MS) {
+      this.typingChatId = chatId;
+      this.typingSentAt = now;
+      this.registeredUser.SetTyping(chatId, true).catch(error => {
+        console.error('Failed to report typing:', error);
+      });
+    }
+
+    if (this.typingIdleTimer) clearTimeout(this.typingIdleTimer);
+    this.typingIdleTimer = setTimeout(() => this.stopTyping(), this.TYPING_IDLE_MS);
+  }
+
+  stopTyping() {
+    const chatId = this.typingChatId;
+    this.resetTyping();
+    if (chatId === null || !this.registeredUser) return;
+    this.registeredUser.SetTyping(chatId, false).catch(error => {
+      console.error('Failed to report typing:', error);
+    });
+  }
+
+  private resetTyping() {
+    if (this.typingIdleTimer) {
+      clearTimeout(this.typingIdleTimer);
+      this.typingIdleTimer = null;
+    }
+    this.typingChatId = null;
+  }
+
   // Subscribe to new message notifications
   onNewMessage(callback: (notification: ChatNotification) => void) {
     this.onNewMessageCallbacks.add(callback);
@@ -427,7 +778,7 @@ class ChatServiceImpl {
       messageCount: history?.messages.length || 0,
       hasMore: history?.hasMore || false,
       isLoading: history?.isLoading || false,
-      offset: history?.offset || 0
+      before: history?.before || 0
     };
   }
 
@@ -486,6 +837,18 @@ class ChatListenerImpl extends _IChatListener_Servant {
     this.chatService.onContactListUpdated(contacts);
   }
 
+  OnPresenceBatch(updates: PresenceUpdate[]): void {
+    this.chatService.onPresenceBatch(updates);
+  }
+
+  OnAttachmentPreviewReady(_chatId: ChatId, _messageId: MessageId, attachmentId: AttachmentId): void {
+    this.chatService.onAttachmentPreviewReady(attachmentId);
+  }
+
+  OnEventsDropped(): void {
+    void this.chatService.onEventsDropped();
+  }
+
   // WebRTC event handlers
   OnCallInitiated(callId: string, chatId: ChatId, callerId: UserId, offer: string): void {
     console.log('Call initiated:', { callId, chatId, callerId });
@@ -497,9 +860,11 @@ class ChatListenerImpl extends _IChatListener_Servant {
     this.chatService.triggerCallAnswered(callId, answer);
   }
 
-  OnIceCandidate(callId: string, candidate: string): void {
-    console.log('ICE candidate received:', { callId });
-    this.chatService.triggerIceCandidate(callId, candidate);
+  OnIceCandidates(callId: string, candidates: string[]): void {
+    console.log('ICE candidates received:', { callId, count: candidates.length });
+    for (const candidate of candidates) {
+      this.chatService.triggerIceCandidate(callId, candidate);
+    }
   }
 
   OnCallEnded(callId: string, reason: string): void {
@@ -0,0 +1,148 @@
+#include "Dataset.hpp"
+
+#include <array>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include <spdlog/spdlog.h>
+#include "services/db/Migrations.hpp"
+
+namespace {
+constexpr std::array vocabulary = {
+  "hello", "meeting", "tomorrow", "release", "deploy", "coffee", "review", "branch", "server", "lunch",
+  "weekend", "build", "ticket", "design", "photo", "video", "call", "later", "thanks", "question",
+  "schedule", "budget", "report", "client", "invoice", "travel", "airport", "hotel", "dinner", "music",
+  "football", "weather", "holiday", "birthday", "project", "deadline", "update", "database", "network", "laptop",
+};
+
+constexpr std::string_view insert_user_sql =
+  "INSERT INTO users (username, email, password_hash, created_at) VALUES (?, ?, ?, ?)";
+
+constexpr std::string_view insert_message_sql =
+  "INSERT INTO messages (chat_id, sender_id, content, timestamp) VALUES (?, ?, ?, ?)";
+
+// Runs `stmt` and resets it; throws on failure
+void step(sqlite3* db, sqlite3_stmt* stmt) {
+  auto rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_DONE) throw std::runtime_error(std::string("Insert failed: ") + sqlite3_errmsg(db));
+}
+} // namespace
+
+std::string_view dataset_word(std::size_t i) noexcept { return vocabulary[i % vocabulary.size()]; }
+
+std::size_t dataset_word_count() noexcept { return vocabulary.size(); }
+
+std::string dataset_username(std::size_t index) { return fmt::format("bench{:05}", index + 1); }
+
+ServiceStack::ServiceStack(const std::filesystem::path& data_dir, std::size_t readers)
+  : database(std::make_shared<Database>((data_dir / "npchat.sqlite3").generic_string(), readers))
+  , batcher(std::make_shared<WriteBatcher>(database, WriteBatcher::Options{}))
+  , archive(std::make_shared<MessageArchive>(database, MessageArchive::Options{.directory = data_dir / "archive"}))
+  , store(std::make_shared<SqliteMessageStore>(database, batcher, archive))
+  , blobs(std::make_shared<BlobStore>(data_dir / "blobs"))
+  , uploads(std::make_shared<UploadService>(blobs, UploadService::Options{}))
+  , membership(std::make_shared<ChatMembership>(database))
+  , users(std::make_shared<UserIndex>(database))
+  , tail(std::make_shared<ChatTailCache>(ChatTailCache::Options{}))
+  , chats(std::make_shared<ChatService>(database, store, archive, blobs, membership, tail, uploads))
+  , messages(std::make_shared<MessageService>(database, store, archive, tail))
+  , contacts(std::make_shared<ContactService>(database, users))
+{
+}
+
+void populate(const std::filesystem::path& data_dir, const DatasetOptions& options) {
+  if (options.users < options.chat_size || options.chat_size == 0) {
+    throw std::runtime_error("Every chat needs between 1 and --users participants");
+  }
+  if (std::filesystem::exists(data_dir / "npchat.sqlite3")) {
+    throw std::runtime_error("The data directory already has a database: " + data_dir.string());
+  }
+  std::filesystem::create_directories(data_dir);
+
+  auto started = std::chrono::steady_clock::now();
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  {
+    // The services expect the schema to be there already, as the server does
+    Database database((data_dir / "npchat.sqlite3").generic_string(), 1);
+    migrateSchema(database);
+  }
+
+  ServiceStack stack(data_dir, 1);
+  auto db = stack.database->getConnection();
+
+  // One hash for everybody: the password is the same and verifying it is the cost being modelled
+  AuthCrypto crypto(AuthCrypto::Options{.threads = 1, .cost = options.kdf_cost});
+  auto password_hash = crypto.hash(options.password);
+
+  stack.database->execute("BEGIN");
+  auto insert_user = stack.database->prepareStatement(std::string(insert_user_sql));
+  for (std::size_t i = 0; i < options.users; ++i) {
+    auto username = dataset_username(i);
+    auto email = username + "@bench.local";
+    sqlite3_bind_text(insert_user, 1, username.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insert_user, 2, email.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(insert_user, 3, password_hash.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(insert_user, 4, now);
+    step(db, insert_user);
+  }
+  sqlite3_finalize(insert_user);
+  stack.database->execute("COMMIT");
+
+  // User ids are 1..users, in the order they were inserted
+  std::vector<std::vector<std::uint32_t>> members(options.group_chats);
+  std::vector<npchat::ChatId> chat_ids;
+  chat_ids.reserve(options.group_chats);
+  for (std::size_t c = 0; c < options.group_chats; ++c) {
+    for (std::size_t k = 0; k < options.chat_size; ++k) {
+      members[c].push_back(static_cast<std::uint32_t>((c * options.chat_size + k) % options.users + 1));
+    }
+    chat_ids.push_back(stack.chats->createChat(members[c].front(), members[c]));
+  }
+
+  // Messages of all chats interleaved, the way they arrive in production
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<std::size_t> word(0, vocabulary.size() - 1);
+  std::uniform_int_distribution<std::size_t> length(3, 12);
+
+  auto total = options.group_chats * options.messages_per_chat;
+  auto span = static_cast<std::int64_t>(options.days) * 86400;
+  auto insert_message = stack.database->prepareStatement(std::string(insert_message_sql));
+  std::string text;
+  std::size_t inserted = 0;
+
+  stack.database->execute("BEGIN");
+  for (std::size_t m = 0; m < options.messages_per_chat; ++m) {
+    for (std::size_t c = 0; c < options.group_chats; ++c) {
+      text.clear();
+      for (auto n = length(rng); n > 0; --n) {
+        if (!text.empty()) text += ' ';
+        text += vocabulary[word(rng)];
+      }
+      auto timestamp = now - span + static_cast<std::int64_t>(inserted * span / std::max<std::size_t>(1, total));
+      sqlite3_bind_int(insert_message, 1, chat_ids[c]);
+      sqlite3_bind_int(insert_message, 2, members[c][m % members[c].size()]);
+      sqlite3_bind_text(insert_message, 3, text.data(), static_cast<int>(text.size()), SQLITE_TRANSIENT);
+      sqlite3_bind_int64(insert_message, 4, timestamp);
+      step(db, insert_message);
+
+      if (++inserted % 100000 == 0) {
+        stack.database->execute("COMMIT");
+        spdlog::info("Inserted {} of {} messages", inserted, total);
+        stack.database->execute("BEGIN");
+      }
+    }
+  }
+  sqlite3_finalize(insert_message);
+  // Everything generated counts as delivered; the unread counters stay as the triggers left them
+  stack.database->execute("DELETE FROM delivery_queue");
+  stack.database->execute("COMMIT");
+  stack.database->execute("PRAGMA wal_checkpoint(TRUNCATE)");
+
+  spdlog::info("Populated {} with {} users, {} chats and {} messages in {:.1f}s", data_dir.string(), options.users,
+               options.group_chats, inserted,
+               std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "services/db/AuthCrypto.hpp"
+#include "services/db/BlobStore.hpp"
+#include "services/db/ChatMembership.hpp"
+#include "services/db/ChatService.hpp"
+#include "services/db/ChatTailCache.hpp"
+#include "services/db/ContactService.hpp"
+#include "services/db/Database.hpp"
+#include "services/db/MessageArchive.hpp"
+#include "services/db/MessageService.hpp"
+#include "services/db/SqliteMessageStore.hpp"
+#include "services/db/UploadService.hpp"
+#include "services/db/UserIndex.hpp"
+#include "services/db/WriteBatcher.hpp"
+
+// Synthetic data set shared by the service benchmarks and the load generator.
+//
+// Users are named bench00001, bench00002, ... and all have the same password.
+// Every group chat has `chat_size` consecutive users (wrapping around), so each
+// user is in about group_chats * chat_size / users chats. Message texts are
+// drawn from a fixed vocabulary, so searches for its words have hits.
+struct DatasetOptions {
+  std::size_t users = 1000;
+  std::size_t group_chats = 200;
+  std::size_t chat_size = 20;
+  std::size_t messages_per_chat = 2000;
+  unsigned days = 90; // Message timestamps are spread over this many days back from now
+  std::string password = "bench-password";
+  unsigned kdf_cost = 10; // Kept low: the population step hashes once, logins verify per user
+};
+
+// Word `i` of the vocabulary the message texts are made of
+std::string_view dataset_word(std::size_t i) noexcept;
+std::size_t dataset_word_count() noexcept;
+
+std::string dataset_username(std::size_t index); // 0-based
+
+// The SQLite services wired as in main.cpp, over <data_dir>/npchat.sqlite3
+struct ServiceStack {
+  std::shared_ptr<Database> database;
+  std::shared_ptr<WriteBatcher> batcher;
+  std::shared_ptr<MessageArchive> archive;
+  std::shared_ptr<SqliteMessageStore> store;
+  std::shared_ptr<BlobStore> blobs;
+  std::shared_ptr<UploadService> uploads;
+  std::shared_ptr<ChatMembership> membership;
+  std::shared_ptr<UserIndex> users;
+  std::shared_ptr<ChatTailCache> tail;
+  std::shared_ptr<ChatService> chats;
+  std::shared_ptr<MessageService> messages;
+  std::shared_ptr<ContactService> contacts;
+
+  ServiceStack(const std::filesystem::path& data_dir, std::size_t readers);
+};
+
+// Creates a fresh <data_dir>/npchat.sqlite3 with the schema migrations and fills it; throws if it already exists
+void populate(const std::filesystem::path& data_dir, const DatasetOptions& options);
@@ -0,0 +1,356 @@
+#include "LoadGenerator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <nprpc/nprpc.hpp>
+#include <nplib/utils/thread_pool.hpp>
+#include <spdlog/spdlog.h>
+
+#ifndef _WIN32
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+#include "Dataset.hpp"
+#include "Stats.hpp"
+#include "services/rpc/PayloadCodec.hpp"
+#include "npchat_stub/npchat.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Texts sent by the load generator start with this and the send time
+constexpr std::string_view stamp_prefix = "lg:";
+
+std::uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+constexpr std::uint32_t pending_page_size = 200;
+
+// Fetches and acknowledges what was sent to the user while it was away, like the browser
+// client does after subscribing, but through GetPendingMessagesEncoded
+std::size_t drain_pending(npchat::RegisteredUser& user, const PayloadCodec& codec) {
+  std::size_t fetched = 0;
+  npchat::MessageId after = 0;
+  for (;;) {
+    auto messages = codec.decodeMessages(user.GetPendingMessagesEncoded(after, pending_page_size));
+    if (messages.empty()) return fetched;
+
+    std::vector<npchat::MessageId> ids;
+    ids.reserve(messages.size());
+    for (const auto& message : messages) ids.push_back(message.messageId);
+    user.AckMessages(ids);
+
+    fetched += messages.size();
+    after = ids.back();
+    if (messages.size() < pending_page_size) return fetched;
+  }
+}
+
+// What one process measured
+struct WorkerResult {
+  std::uint64_t logged_in = 0;
+  std::uint64_t sent = 0;
+  std::uint64_t send_errors = 0;
+  std::uint64_t received = 0;
+  std::uint64_t send_window_us = 0;
+  std::vector<std::uint64_t> send_us;     // SendMessage round trips
+  std::vector<std::uint64_t> delivery_us; // Send -> OnMessageReceived, one per recipient
+};
+
+// Received messages of one user, acknowledged by the user's sending thread
+struct Inbox {
+  std::mutex mutex;
+  std::vector<npchat::MessageId> unacked;
+};
+
+class BenchListener final : public npchat::IChatListener_Servant {
+  Inbox& inbox_;
+  std::mutex& samples_mutex_;
+  std::vector<std::uint64_t>& delivery_us_;
+  std::atomic<std::uint64_t>& received_;
+
+public:
+  BenchListener(Inbox& inbox, std::mutex& samples_mutex, std::vector<std::uint64_t>& delivery_us,
+                std::atomic<std::uint64_t>& received)
+    : inbox_(inbox)
+    , samples_mutex_(samples_mutex)
+    , delivery_us_(delivery_us)
+    , received_(received) {}
+
+  void OnMessageReceived(npchat::MessageId messageId, npchat::flat::ChatMessage_Direct message) override {
+    auto arrived = now_ns();
+    {
+      std::lock_guard lock(inbox_.mutex);
+      inbox_.unacked.push_back(messageId);
+    }
+
+    std::string_view text = message.content().text();
+    if (!text.starts_with(stamp_prefix)) return;
+    text.remove_prefix(stamp_prefix.size());
+    std::uint64_t sent = 0;
+    if (std::from_chars(text.data(), text.data() + text.size(), sent).ec != std::errc{} || sent > arrived) return;
+
+    received_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(samples_mutex_);
+    delivery_us_.push_back((arrived - sent) / 1000);
+  }
+
+  void OnMessageDelivered(npchat::ChatId, npchat::MessageId) override {}
+  void OnContactListUpdated(::nprpc::flat::Span_ref<npchat::flat::Contact, npchat::flat::Contact_Direct>) override {}
+  void OnCallInitiated(::nprpc::flat::Span<char>, npchat::ChatId, npchat::UserId, ::nprpc::flat::Span<char>) override {}
+  void OnCallAnswered(::nprpc::flat::Span<char>, ::nprpc::flat::Span<char>) override {}
+  void OnIceCandidates(::nprpc::flat::Span<char>,
+                       ::nprpc::flat::Span_ref<::nprpc::flat::String, ::nprpc::flat::String_Direct1>) override {}
+  void OnCallEnded(::nprpc::flat::Span<char>, ::nprpc::flat::Span<char>) override {}
+  void OnPresenceBatch(::nprpc::flat::Span_ref<npchat::flat::PresenceUpdate, npchat::flat::PresenceUpdate_Direct>) override {}
+  void OnAttachmentPreviewReady(npchat::ChatId, npchat::MessageId, npchat::AttachmentId) override {}
+  void OnEventsDropped() override {}
+};
+
+struct Session {
+  std::unique_ptr<npchat::RegisteredUser> user;
+  std::unique_ptr<BenchListener> listener;
+  std::vector<npchat::ChatId> chats;
+  Inbox inbox;
+};
+
+// Logs in users [first, first + count) and sends for options.duration
+WorkerResult run_worker(const LoadOptions& options, std::size_t first, std::size_t count) {
+  WorkerResult result;
+  std::mutex samples_mutex;
+  std::atomic<std::uint64_t> received{0};
+
+  auto rpc = nprpc::RpcBuilder()
+    .set_debug_level(nprpc::DebugLevel::DebugLevel_Critical)
+    .build(thread_pool::get_instance().ctx());
+
+  auto poa = nprpc::PoaBuilder(rpc)
+    .with_max_objects(static_cast<std::uint32_t>(count))
+    .with_lifespan(nprpc::PoaPolicy::Lifespan::Transient)
+    .build();
+
+  nprpc::Object* obj = nullptr;
+  if (!rpc->get_nameserver(options.nameserver)->Resolve(options.object_name, obj)) {
+    throw std::runtime_error("The nameserver at " + options.nameserver + " has no " + options.object_name);
+  }
+  std::unique_ptr<npchat::Authorizator> authorizator(nprpc::narrow<npchat::Authorizator>(obj));
+  if (!authorizator) throw std::runtime_error(options.object_name + " is not an Authorizator");
+
+  PayloadCodec codec(PayloadCodec::Options{});
+  auto accepted = PayloadCodec::available() ? npchat::PayloadEncoding::Zstd : npchat::PayloadEncoding::Identity;
+
+  std::vector<std::unique_ptr<Session>> sessions;
+  for (std::size_t i = first; i < first + count; ++i) {
+    auto session = std::make_unique<Session>();
+    try {
+      auto data = authorizator->LogIn(dataset_username(i), options.password);
+      session->user.reset(nprpc::narrow<npchat::RegisteredUser>(nprpc::impl::create_object(data.registeredUser)));
+      // Like the browser client: the listener is called back over the connection it was sent on
+      session->listener = std::make_unique<BenchListener>(session->inbox, samples_mutex, result.delivery_us, received);
+      session->user->SubscribeToEvents(
+        poa->activate_object(session->listener.get(), nprpc::ObjectActivationFlags::ALLOW_WEBSOCKET));
+      session->user->SetPayloadEncoding(accepted, 0);
+      if (auto pending = drain_pending(*session->user, codec)) {
+        spdlog::debug("{} had {} pending messages", dataset_username(i), pending);
+      }
+      for (const auto& chat : session->user->GetChats()) session->chats.push_back(chat.id);
+    } catch (const std::exception& e) {
+      spdlog::error("{} could not log in: {}", dataset_username(i), e.what());
+      continue;
+    }
+    if (!session->chats.empty()) sessions.push_back(std::move(session));
+  }
+  result.logged_in = sessions.size();
+  if (sessions.empty()) return result;
+
+  std::atomic<std::uint64_t> sent{0}, send_errors{0};
+  std::vector<std::vector<std::uint64_t>> send_us(std::max<std::size_t>(1, options.senders));
+  auto interval = options.rate > 0
+    ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(send_us.size() / options.rate))
+    : Clock::duration::zero();
+
+  auto started = Clock::now();
+  auto deadline = started + options.duration;
+  std::vector<std::thread> senders;
+  for (std::size_t s = 0; s < send_us.size(); ++s) {
+    senders.emplace_back([&, s] {
+      std::mt19937 rng(static_cast<unsigned>(first * 31 + s));
+      auto next = Clock::now();
+      // Sessions s, s + senders, ... belong to this thread
+      for (std::size_t k = 0; Clock::now() < deadline; ++k) {
+        auto& session = *sessions[(s + k * send_us.size()) % sessions.size()];
+
+        std::vector<npchat::MessageId> acks;
+        {
+          std::lock_guard lock(session.inbox.mutex);
+          acks.swap(session.inbox.unacked);
+        }
+
+        try {
+          if (!acks.empty()) session.user->AckMessages(acks);
+
+          auto chat_id = session.chats[std::uniform_int_distribution<std::size_t>(0, session.chats.size() - 1)(rng)];
+          auto text = fmt::format("{}{} {} {}", stamp_prefix, now_ns(), dataset_word(rng()), dataset_word(rng()));
+          auto t0 = Clock::now();
+          session.user->SendMessage(chat_id, npchat::ChatMessageContent{.text = std::move(text)});
+          send_us[s].push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count());
+          sent.fetch_add(1, std::memory_order_relaxed);
+        } catch (const std::exception&) {
+          send_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (interval != Clock::duration::zero()) {
+          next += interval;
+          std::this_thread::sleep_until(next);
+        }
+      }
+    });
+  }
+  for (auto& sender : senders) sender.join();
+  result.send_window_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - started).count();
+
+  // Messages still on their way are counted if they arrive within the drain time
+  std::this_thread::sleep_for(options.drain);
+
+  for (auto& session : sessions) session->user.reset();
+  // No listener is called once the pool has stopped
+  thread_pool::get_instance().stop();
+  thread_pool::get_instance().wait();
+
+  result.sent = sent;
+  result.send_errors = send_errors;
+  result.received = received;
+  for (auto& s : send_us) result.send_us.insert(result.send_us.end(), s.begin(), s.end());
+  return result;
+}
+
+#ifndef _WIN32
+void write_all(int fd, const void* data, std::size_t size) {
+  auto p = static_cast<const char*>(data);
+  while (size > 0) {
+    auto n = ::write(fd, p, size);
+    if (n <= 0) throw std::runtime_error("Failed to report to the parent process");
+    p += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+
+bool read_all(int fd, void* data, std::size_t size) {
+  auto p = static_cast<char*>(data);
+  while (size > 0) {
+    auto n = ::read(fd, p, size);
+    if (n <= 0) return false;
+    p += n;
+    size -= static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+void send_result(int fd, const WorkerResult& r) {
+  std::uint64_t header[] = {r.logged_in, r.sent, r.send_errors, r.received, r.send_window_us,
+                            r.send_us.size(), r.delivery_us.size()};
+  write_all(fd, header, sizeof(header));
+  write_all(fd, r.send_us.data(), r.send_us.size() * sizeof(std::uint64_t));
+  write_all(fd, r.delivery_us.data(), r.delivery_us.size() * sizeof(std::uint64_t));
+}
+
+bool receive_result(int fd, WorkerResult& r) {
+  std::uint64_t header[7];
+  if (!read_all(fd, header, sizeof(header))) return false;
+  r.logged_in = header[0];
+  r.sent = header[1];
+  r.send_errors = header[2];
+  r.received = header[3];
+  r.send_window_us = header[4];
+  r.send_us.resize(header[5]);
+  r.delivery_us.resize(header[6]);
+  return read_all(fd, r.send_us.data(), r.send_us.size() * sizeof(std::uint64_t)) &&
+         read_all(fd, r.delivery_us.data(), r.delivery_us.size() * sizeof(std::uint64_t));
+}
+#endif
+
+// Runs one worker per slice of users; in child processes where fork() exists
+std::vector<WorkerResult> run_workers(const LoadOptions& options) {
+  auto processes = std::clamp<std::size_t>(options.processes, 1, std::max<std::size_t>(1, options.users));
+#ifdef _WIN32
+  processes = 1;
+#endif
+  std::vector<WorkerResult> results;
+  if (processes == 1) {
+    results.push_back(run_worker(options, 0, options.users));
+    return results;
+  }
+
+#ifndef _WIN32
+  std::vector<std::pair<pid_t, int>> children;
+  for (std::size_t p = 0; p < processes; ++p) {
+    auto first = options.users * p / processes;
+    auto count = options.users * (p + 1) / processes - first;
+
+    int fds[2];
+    if (::pipe(fds) != 0) throw std::runtime_error("pipe() failed");
+    auto pid = ::fork();
+    if (pid < 0) throw std::runtime_error("fork() failed");
+    if (pid == 0) {
+      ::close(fds[0]);
+      int status = EXIT_SUCCESS;
+      try {
+        send_result(fds[1], run_worker(options, first, count));
+      } catch (const std::exception& e) {
+        spdlog::error("Load worker {} failed: {}", p, e.what());
+        status = EXIT_FAILURE;
+      }
+      ::close(fds[1]);
+      ::_exit(status);
+    }
+    ::close(fds[1]);
+    children.emplace_back(pid, fds[0]);
+  }
+
+  for (auto [pid, fd] : children) {
+    WorkerResult result;
+    if (receive_result(fd, result)) results.push_back(std::move(result));
+    ::close(fd);
+    ::waitpid(pid, nullptr, 0);
+  }
+#endif
+  return results;
+}
+} // namespace
+
+void run_load(const LoadOptions& options) {
+  spdlog::info("Load: {} users over {} processes, {} senders each, {} msg/s per process for {}s",
+               options.users, options.processes, options.senders, options.rate, options.duration.count());
+
+  auto results = run_workers(options);
+
+  WorkerResult total;
+  Samples send, delivery;
+  for (auto& r : results) {
+    total.logged_in += r.logged_in;
+    total.sent += r.sent;
+    total.send_errors += r.send_errors;
+    total.received += r.received;
+    total.send_window_us = std::max(total.send_window_us, r.send_window_us);
+    send.merge(r.send_us);
+    delivery.merge(r.delivery_us);
+  }
+
+  auto window = std::chrono::microseconds(total.send_window_us);
+  fmt::print("{} of {} users logged in from {} processes\n", total.logged_in, options.users, results.size());
+  fmt::print("sent {} messages ({} failed), {} deliveries to listeners\n", total.sent, total.send_errors, total.received);
+  print_header();
+  print_row("SendMessage", send, window);
+  print_row("send -> OnMessageReceived", delivery, window);
+}
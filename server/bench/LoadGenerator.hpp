@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Drives a running server over nprpc like many browser sessions would.
+//
+// The users of a data set made by populate() log in, subscribe a ChatListener
+// and send to their group chats. Every message carries the time it was sent,
+// so the listeners of the other participants measure send -> OnMessageReceived
+// latency as it arrives. Users are split over `processes` processes, each with
+// its own nprpc connection, and the report merges them.
+struct LoadOptions {
+  std::string nameserver = "127.0.0.1"; // Where the server registered itself (npchat --nameserver)
+  std::string object_name = "npchat";
+  std::string password = "bench-password";
+  std::size_t users = 100;   // bench00001 .. bench<users>
+  std::size_t processes = 4;
+  std::size_t senders = 4;   // Sending threads per process
+  double rate = 200;         // Messages per second per process; 0 = as fast as the server answers
+  std::chrono::seconds duration{30};
+  std::chrono::seconds drain{3};  // How long to keep listening after the last send
+};
+
+void run_load(const LoadOptions& options);
@@ -0,0 +1,246 @@
+#include "ServiceBench.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Dataset.hpp"
+#include "Stats.hpp"
+#include "services/rpc/PayloadCodec.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view participants_sql =
+  "SELECT chat_id, user_id FROM chat_participants WHERE left_at IS NULL ORDER BY chat_id";
+
+struct Chats {
+  std::vector<npchat::ChatId> ids;
+  std::vector<std::vector<std::uint32_t>> members; // Parallel to ids
+  std::vector<std::uint32_t> users;                // Everyone in at least one chat
+};
+
+Chats load_chats(Database& database) {
+  Chats chats;
+  std::map<npchat::ChatId, std::vector<std::uint32_t>> by_chat;
+  {
+    auto reader = database.reader();
+    auto stmt = reader.statement(participants_sql);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      by_chat[sqlite3_column_int(stmt, 0)].push_back(sqlite3_column_int(stmt, 1));
+    }
+    sqlite3_reset(stmt);
+  }
+
+  std::vector<bool> seen;
+  for (auto& [chat_id, members] : by_chat) {
+    for (auto user_id : members) {
+      if (user_id >= seen.size()) seen.resize(user_id + 1);
+      if (!seen[user_id]) chats.users.push_back(user_id);
+      seen[user_id] = true;
+    }
+    chats.ids.push_back(chat_id);
+    chats.members.push_back(std::move(members));
+  }
+  if (chats.ids.empty()) throw std::runtime_error("The data set has no chats; run `npchat_bench populate` first");
+  return chats;
+}
+
+// Encoded pages must decode to what was encoded, with and without zstd; throws if they don't
+void check_payload_round_trip(const npchat::MessageList& page) {
+  // Every payload is compressed, however small
+  PayloadCodec codec(PayloadCodec::Options{.threshold = 0, .max_raw_size = 1024 * 1024});
+
+  std::vector<npchat::PayloadEncoding> encodings{npchat::PayloadEncoding::Identity};
+  if (PayloadCodec::available()) encodings.push_back(npchat::PayloadEncoding::Zstd);
+
+  for (auto encoding : encodings) {
+    auto encoded = codec.encodeMessages(page, codec.negotiate(encoding, 0));
+    auto decoded = codec.decodeMessages(std::move(encoded));
+    if (decoded.size() != page.size()) throw std::runtime_error("Payload round trip: message count differs");
+    for (std::size_t i = 0; i < page.size(); ++i) {
+      if (decoded[i].messageId != page[i].messageId || decoded[i].content.text != page[i].content.text) {
+        throw std::runtime_error("Payload round trip: message " + std::to_string(page[i].messageId) + " differs");
+      }
+    }
+  }
+
+  // A peer can't make decode() allocate more than max_raw_size
+  npchat::EncodedPayload oversized{.encoding = npchat::PayloadEncoding::Zstd, .rawSize = 1024 * 1024 + 1, .data = {}};
+  try {
+    codec.decode(oversized);
+  } catch (const std::runtime_error&) {
+    spdlog::info("Payload round trip: ok");
+    return;
+  }
+  throw std::runtime_error("Payload round trip: oversized payload was accepted");
+}
+
+std::string random_text(std::mt19937& rng) {
+  std::uniform_int_distribution<std::size_t> word(0, dataset_word_count() - 1);
+  std::string text;
+  for (int i = 0; i < 8; ++i) {
+    if (!text.empty()) text += ' ';
+    text += dataset_word(word(rng));
+  }
+  return text;
+}
+
+// Runs op(rng) `iterations` times on the calling thread
+template <typename F>
+void run_case(std::string_view name, std::size_t iterations, F&& op) {
+  std::mt19937 rng(1);
+  Samples samples;
+  samples.reserve(iterations);
+
+  auto started = Clock::now();
+  for (std::size_t i = 0; i < iterations; ++i) {
+    auto t0 = Clock::now();
+    op(rng);
+    samples.add(Clock::now() - t0);
+  }
+  print_row(name, samples, Clock::now() - started);
+}
+
+// Runs op(rng) `iterations` times in total, spread over `threads` threads
+template <typename F>
+void run_concurrent_case(std::string_view name, std::size_t iterations, std::size_t threads, F&& op) {
+  std::vector<Samples> per_thread(threads);
+  std::vector<std::thread> workers;
+  std::atomic<std::size_t> next{0};
+
+  auto started = Clock::now();
+  for (std::size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::mt19937 rng(static_cast<unsigned>(t + 1));
+      while (next.fetch_add(1, std::memory_order_relaxed) < iterations) {
+        auto t0 = Clock::now();
+        op(rng);
+        per_thread[t].add(Clock::now() - t0);
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  auto wall = Clock::now() - started;
+
+  Samples samples;
+  for (auto& s : per_thread) samples.merge(s.values());
+  print_row(name, samples, wall);
+}
+} // namespace
+
+void run_service_bench(const ServiceBenchOptions& options) {
+  ServiceStack stack(options.data_dir, options.readers);
+  auto chats = load_chats(*stack.database);
+  auto n = options.iterations;
+  auto threads = std::max<std::size_t>(1, options.threads);
+
+  spdlog::info("{} chats, {} users, {} iterations per case, {} threads for concurrent cases",
+               chats.ids.size(), chats.users.size(), n, threads);
+  // Per-call service logging would drown the report
+  spdlog::set_level(spdlog::level::warn);
+
+  auto pick_chat = [&] (std::mt19937& rng) {
+    return std::uniform_int_distribution<std::size_t>(0, chats.ids.size() - 1)(rng);
+  };
+  auto pick_user = [&] (std::mt19937& rng) {
+    return chats.users[std::uniform_int_distribution<std::size_t>(0, chats.users.size() - 1)(rng)];
+  };
+  auto send = [&] (std::mt19937& rng) {
+    auto c = pick_chat(rng);
+    auto& members = chats.members[c];
+    auto sender = members[std::uniform_int_distribution<std::size_t>(0, members.size() - 1)(rng)];
+    stack.chats->sendMessage(sender, chats.ids[c], npchat::ChatMessageContent{.text = random_text(rng)});
+  };
+
+  print_header();
+
+  // Sending: one sender waits out every group commit window, many share them
+  run_case("sendMessage", n, send);
+  run_concurrent_case(fmt::format("sendMessage x{}", threads), n, threads, send);
+
+  for (std::uint32_t offset : {0u, 100u, 1000u, 10000u}) {
+    run_case(fmt::format("getMessages offset={}", offset), n, [&] (std::mt19937& rng) {
+      stack.chats->getMessages(chats.ids[pick_chat(rng)], 50, offset);
+    });
+  }
+
+  // Opening a chat: the newest page, from the tail cache once it is warm and from the store without it
+  run_case("getMessagesBefore newest", n, [&] (std::mt19937& rng) {
+    stack.chats->getMessagesBefore(chats.ids[pick_chat(rng)], 0, 50);
+  });
+  run_case("getMessagesBefore newest, store", n, [&] (std::mt19937& rng) {
+    stack.store->getMessagesBefore(chats.ids[pick_chat(rng)], 0, 50);
+  });
+
+  // What GetChatHistoryBeforeEncoded adds to a page; the ratio is in npchat_payload_bytes_total
+  check_payload_round_trip(stack.chats->getMessagesBefore(chats.ids.front(), 0, 50));
+  if (PayloadCodec::available()) {
+    PayloadCodec codec(PayloadCodec::Options{});
+    auto session = codec.negotiate(npchat::PayloadEncoding::Zstd, 0);
+    run_case("encodeMessages 50, zstd", n, [&] (std::mt19937& rng) {
+      codec.encodeMessages(stack.chats->getMessagesBefore(chats.ids[pick_chat(rng)], 0, 50), session);
+    });
+    // What the load generator pays for each page it fetches
+    auto page = codec.encodeMessages(stack.chats->getMessagesBefore(chats.ids.front(), 0, 50), session);
+    run_case("decodeMessages 50, zstd", n, [&] (std::mt19937&) {
+      codec.decodeMessages(page);
+    });
+  }
+
+  run_case("searchMessages word", n, [&] (std::mt19937& rng) {
+    auto word = dataset_word(std::uniform_int_distribution<std::size_t>(0, dataset_word_count() - 1)(rng));
+    stack.messages->searchMessages(pick_user(rng), word, 0, 20);
+  });
+  run_case("searchMessages two words, in chat", n, [&] (std::mt19937& rng) {
+    auto c = pick_chat(rng);
+    auto words = std::uniform_int_distribution<std::size_t>(0, dataset_word_count() - 1);
+    auto query = fmt::format("{} {}", dataset_word(words(rng)), dataset_word(words(rng)).substr(0, 3));
+    stack.messages->searchMessages(chats.members[c].front(), query, chats.ids[c], 20);
+  });
+  run_concurrent_case(fmt::format("searchMessages x{}", threads), n, threads, [&] (std::mt19937& rng) {
+    auto word = dataset_word(std::uniform_int_distribution<std::size_t>(0, dataset_word_count() - 1)(rng));
+    stack.messages->searchMessages(pick_user(rng), word, 0, 20);
+  });
+
+  // The contact search box: a bench%05d prefix narrows to one user, a digit run inside the name to a few
+  run_case("searchUsers prefix", n, [&] (std::mt19937& rng) {
+    auto name = dataset_username(std::uniform_int_distribution<std::size_t>(0, chats.users.size() - 1)(rng));
+    stack.contacts->searchUsers(pick_user(rng), name.substr(0, 8), 20);
+  });
+  run_case("searchUsers infix", n, [&] (std::mt19937& rng) {
+    auto name = dataset_username(std::uniform_int_distribution<std::size_t>(0, chats.users.size() - 1)(rng));
+    stack.contacts->searchUsers(pick_user(rng), name.substr(6, 3), 20);
+  });
+  run_case("UserIndex load", std::max<std::size_t>(1, n / 100), [&] (std::mt19937&) {
+    UserIndex users(stack.database);
+  });
+
+  run_case("getUnreadMessageCount", n, [&] (std::mt19937& rng) {
+    stack.messages->getUnreadMessageCount(pick_user(rng));
+  });
+
+  // What SubscribeToEvents and the client's first calls after it cost: the membership index the
+  // listeners are routed through has to be built once, then every session lists its chats
+  run_case("ChatMembership index load", std::max<std::size_t>(1, n / 100), [&] (std::mt19937&) {
+    ChatMembership membership(stack.database);
+  });
+  run_case("getUserChatsWithDetails", n, [&] (std::mt19937& rng) {
+    stack.chats->getUserChatsWithDetails(pick_user(rng));
+  });
+  run_concurrent_case(fmt::format("getUserChatsWithDetails x{}", threads), n, threads, [&] (std::mt19937& rng) {
+    stack.chats->getUserChatsWithDetails(pick_user(rng));
+  });
+  run_case("getUserChatsWithPreview 20", n, [&] (std::mt19937& rng) {
+    stack.chats->getUserChatsWithPreview(pick_user(rng), 20);
+  });
+  run_case("getLatestMessages 20, store", n, [&] (std::mt19937& rng) {
+    auto chat_ids = stack.chats->getUserChats(pick_user(rng));
+    stack.store->getLatestMessages(chat_ids, 20);
+  });
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+
+// Microbenchmarks of the service layer, called in-process against a data set
+// made by populate(). Sending appends messages to the data set.
+struct ServiceBenchOptions {
+  std::filesystem::path data_dir;
+  std::size_t readers = 0;     // Database reader connections (0 = one per hardware thread)
+  std::size_t iterations = 2000;
+  std::size_t threads = 8;     // For the concurrent cases
+};
+
+void run_service_bench(const ServiceBenchOptions& options);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include <fmt/format.h>
+
+// Latency samples of one benchmark case, in microseconds
+class Samples {
+  std::vector<std::uint64_t> us_;
+
+public:
+  void reserve(std::size_t n) { us_.reserve(n); }
+  void add(std::chrono::nanoseconds elapsed) { us_.push_back(elapsed.count() / 1000); }
+  void add_us(std::uint64_t us) { us_.push_back(us); }
+  void merge(const std::vector<std::uint64_t>& us) { us_.insert(us_.end(), us.begin(), us.end()); }
+
+  std::size_t size() const noexcept { return us_.size(); }
+  const std::vector<std::uint64_t>& values() const noexcept { return us_; }
+
+  // q in [0, 1]; sorts the samples
+  std::uint64_t quantile(double q) {
+    if (us_.empty()) return 0;
+    std::sort(us_.begin(), us_.end());
+    auto index = static_cast<std::size_t>(q * static_cast<double>(us_.size() - 1) + 0.5);
+    return us_[std::min(index, us_.size() - 1)];
+  }
+};
+
+inline void print_header() {
+  fmt::print("{:<34} {:>8} {:>11} {:>9} {:>9} {:>9} {:>9}\n",
+             "case", "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+}
+
+// One line of the report; `wall` is the time the whole case took
+inline void print_row(std::string_view name, Samples& samples, std::chrono::nanoseconds wall) {
+  auto seconds = std::chrono::duration<double>(wall).count();
+  auto rate = seconds > 0 ? static_cast<double>(samples.size()) / seconds : 0.0;
+  fmt::print("{:<34} {:>8} {:>11.0f} {:>9} {:>9} {:>9} {:>9}\n",
+             name, samples.size(), rate, samples.quantile(0.5), samples.quantile(0.9),
+             samples.quantile(0.99), samples.quantile(1.0));
+}
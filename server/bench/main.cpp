@@ -0,0 +1,86 @@
+// Copyright (c) 2025 nikitapnn1@gmail.com
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <spdlog/spdlog.h>
+#include <boost/program_options.hpp>
+
+#include "Dataset.hpp"
+#include "LoadGenerator.hpp"
+#include "ServiceBench.hpp"
+
+// npchat_bench populate --data-dir DIR    synthetic data set for the two below
+// npchat_bench services --data-dir DIR    service layer microbenchmarks, in-process
+// npchat_bench load --nameserver HOST     nprpc load against a running npchat serving DIR
+int main(int argc, char *argv[]) {
+  namespace po = boost::program_options;
+
+  std::string mode, data_dir;
+  DatasetOptions dataset;
+  ServiceBenchOptions services;
+  LoadOptions load;
+  unsigned duration_s, drain_s;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("help", "produce help message")
+    ("mode", po::value<std::string>(&mode)->required(), "populate, services or load")
+    ("data-dir", po::value<std::string>(&data_dir)->default_value("bench_data"), "Data directory of the data set")
+    ("users", po::value<std::size_t>(&dataset.users)->default_value(dataset.users), "populate: number of users; load: users that log in")
+    ("chats", po::value<std::size_t>(&dataset.group_chats)->default_value(dataset.group_chats), "populate: number of group chats")
+    ("chat-size", po::value<std::size_t>(&dataset.chat_size)->default_value(dataset.chat_size), "populate: participants per chat")
+    ("messages-per-chat", po::value<std::size_t>(&dataset.messages_per_chat)->default_value(dataset.messages_per_chat), "populate: messages per chat")
+    ("password", po::value<std::string>(&dataset.password)->default_value(dataset.password), "Password of every user")
+    ("iterations", po::value<std::size_t>(&services.iterations)->default_value(services.iterations), "services: calls per case")
+    ("threads", po::value<std::size_t>(&services.threads)->default_value(services.threads), "services: threads of the concurrent cases")
+    ("db-readers", po::value<std::size_t>(&services.readers)->default_value(0), "services: read-only database connections (0 = one per hardware thread)")
+    ("nameserver", po::value<std::string>(&load.nameserver)->default_value(load.nameserver), "load: nameserver the server registered with")
+    ("object-name", po::value<std::string>(&load.object_name)->default_value(load.object_name), "load: name of the Authorizator in the nameserver")
+    ("processes", po::value<std::size_t>(&load.processes)->default_value(load.processes), "load: processes, each with its own connection")
+    ("senders", po::value<std::size_t>(&load.senders)->default_value(load.senders), "load: sending threads per process")
+    ("rate", po::value<double>(&load.rate)->default_value(load.rate), "load: messages per second per process (0 = unthrottled)")
+    ("duration", po::value<unsigned>(&duration_s)->default_value(30), "load: seconds of sending")
+    ("drain", po::value<unsigned>(&drain_s)->default_value(3), "load: seconds to wait for deliveries after the last send");
+
+  po::positional_options_description positional;
+  positional.add("mode", 1);
+
+  try {
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    if (vm.count("help")) {
+      std::cout << "Usage: npchat_bench populate|services|load [options]\n" << desc << "\n";
+      return 0;
+    }
+    po::notify(vm);
+  } catch (std::exception& e) {
+    std::cerr << "Exception during command line parsing: " << e.what() << std::endl;
+    return -1;
+  }
+
+  spdlog::set_level(spdlog::level::info);
+
+  try {
+    if (mode == "populate") {
+      populate(data_dir, dataset);
+    } else if (mode == "services") {
+      services.data_dir = data_dir;
+      run_service_bench(services);
+    } else if (mode == "load") {
+      load.users = dataset.users;
+      load.password = dataset.password;
+      load.duration = std::chrono::seconds(duration_s);
+      load.drain = std::chrono::seconds(drain_s);
+      run_load(load);
+    } else {
+      throw std::runtime_error("Unknown mode: " + mode);
+    }
+  } catch (std::exception& ex) {
+    spdlog::critical("Exception occurred: {}", ex.what());
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
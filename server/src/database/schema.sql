@@ -1,5 +1,6 @@
 -- NPChat Database Schema
 -- SQLite DDL for chat application with authentication, contacts, and messaging
+-- Frozen as schema migration 1: changes go into numbered migrations in services/db/Migrations.cpp
 
 -- Users table for authentication
 CREATE TABLE IF NOT EXISTS users (
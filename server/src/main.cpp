@@ -1,11 +1,14 @@
 // Copyright (c) 2025 nikitapnn1@gmail.com
 
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <iostream>
 #include <cassert>
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <future>
 
 #include <spdlog/spdlog.h>
 
@@ -19,14 +22,31 @@
 
 #include "services/boost/di.hpp"
 
+#include "services/db/AuthCrypto.hpp"
+#include "services/db/BlobStore.hpp"
+#include "services/db/ChatMembership.hpp"
 #include "services/db/Database.hpp"
+#include "services/db/MediaPipeline.hpp"
+#include "services/db/MessageArchive.hpp"
+#include "services/db/MessageStore.hpp"
+#include "services/db/Migrations.hpp"
+#include "services/db/SqliteMessageStore.hpp"
+#include "services/db/PresenceService.hpp"
+#include "services/db/SessionCache.hpp"
+#include "services/db/UploadService.hpp"
+#include "services/db/UserIndex.hpp"
+#include "services/db/WriteBatcher.hpp"
 #include "services/db/AuthService.hpp"
 #include "services/db/ContactService.hpp"
 #include "services/db/MessageService.hpp"
 #include "services/db/ChatService.hpp"
+#include "services/db/ChatTailCache.hpp"
 #include "services/db/WebRTCService.hpp"
 
+#include "services/metrics/MetricsServer.hpp"
+
 #include "services/rpc/Authorizator.hpp"
+#include "services/rpc/PayloadCodec.hpp"
 #include "services/client/ChatObserver.hpp"
 
 DEFINE_HOST_JSON_STRUCT(authorizator)
@@ -37,9 +57,17 @@ int main(int argc, char *argv[]) {
   namespace fs = std::filesystem;
 
   HostJson host_json;
-  std::string hostname, http_dir, data_dir, public_cert, private_key, dh_params;
-  unsigned short port;
-  bool log_trace = false;
+  std::string hostname, http_dir, data_dir, public_cert, private_key, dh_params, nameserver,
+    metrics_address, zstd_dictionary, ffmpeg;
+  unsigned short port, metrics_port;
+  std::size_t db_readers, db_batch_size, delivery_queue_limit, observer_shards, listener_queue_limit, listener_threads, session_cache_size, auth_threads,
+    tail_cache_messages, tail_cache_mb, compress_threshold, db_cache_mb, db_mmap_mb, warm_up_chats, media_threads,
+    media_queue_limit;
+  unsigned presence_window_ms;
+  int zstd_level;
+  unsigned db_batch_window_ms, delivery_ttl_days, session_cache_ttl_s, session_flush_interval_s, kdf_cost, hot_months, archive_interval_min,
+    upload_max_mb, session_poa_size, preview_size;
+  bool log_trace = false, warm_up = false;
 
   po::options_description desc("Allowed options");
   desc.add_options()
@@ -51,8 +79,42 @@ int main(int argc, char *argv[]) {
     ("public-cert", po::value<std::string>(&public_cert)->default_value(""), "Path to the public certificate")
     ("private-key", po::value<std::string>(&private_key)->default_value(""), "Path to the certificate private key")
     ("dh-params", po::value<std::string>(&dh_params)->default_value(""), "Path to Diffie-Hellman parameters")
+    ("db-readers", po::value<std::size_t>(&db_readers)->default_value(0), "Number of read-only database connections (0 = one per hardware thread)")
+    ("db-cache-mb", po::value<std::size_t>(&db_cache_mb)->default_value(16), "SQLite page cache of each database connection, in MiB")
+    ("db-mmap-mb", po::value<std::size_t>(&db_mmap_mb)->default_value(256), "How much of the database file is memory-mapped, in MiB (0 = no mmap)")
+    ("db-batch-size", po::value<std::size_t>(&db_batch_size)->default_value(64), "Maximum number of rows committed in one write transaction")
+    ("db-batch-window-ms", po::value<unsigned>(&db_batch_window_ms)->default_value(2), "How long a write may wait for other writes to join its transaction")
+    ("delivery-ttl-days", po::value<unsigned>(&delivery_ttl_days)->default_value(30), "Days an unacknowledged message stays queued for its recipient (0 = no limit)")
+    ("delivery-queue-limit", po::value<std::size_t>(&delivery_queue_limit)->default_value(10000), "Unacknowledged messages kept queued per user; older ones are dropped (0 = no limit)")
+    ("hot-months", po::value<unsigned>(&hot_months)->default_value(0), "Whole months of messages kept in the main database before the current one; older ones are moved to monthly files, where they can no longer be edited or found by search (0 = never)")
+    ("archive-interval", po::value<unsigned>(&archive_interval_min)->default_value(60), "Minutes between passes moving old messages out of the main database")
+    ("upload-max-mb", po::value<unsigned>(&upload_max_mb)->default_value(512), "Largest attachment accepted through chunked uploads, in MiB (at most 4095)")
+    ("media-threads", po::value<std::size_t>(&media_threads)->default_value(2), "Threads making previews of picture and video attachments (0 = no previews)")
+    ("media-queue-limit", po::value<std::size_t>(&media_queue_limit)->default_value(256), "Previews waiting to be made before new attachments go without one")
+    ("preview-size", po::value<unsigned>(&preview_size)->default_value(320), "Longest side of an attachment preview, in pixels")
+    ("ffmpeg", po::value<std::string>(&ffmpeg)->default_value("ffmpeg"), "ffmpeg executable that makes the previews")
+    ("presence-window-ms", po::value<unsigned>(&presence_window_ms)->default_value(200), "How long presence and typing changes are collected before they are pushed together")
+    ("compress-threshold", po::value<std::size_t>(&compress_threshold)->default_value(1024), "Smallest Encoded* reply payload compressed for sessions that negotiated zstd, in bytes")
+    ("zstd-level", po::value<int>(&zstd_level)->default_value(3), "zstd compression level of Encoded* replies")
+    ("zstd-dictionary", po::value<std::string>(&zstd_dictionary)->default_value(""), "zstd dictionary trained on chat and SDP traffic (zstd --train), offered to clients with GetCompressionDictionary")
+    ("observer-shards", po::value<std::size_t>(&observer_shards)->default_value(0), "Number of strands chat notifications are spread over (0 = one per hardware thread)")
+    ("listener-queue-limit", po::value<std::size_t>(&listener_queue_limit)->default_value(256), "Notifications queued for one client before it is told to resubscribe and unsubscribed")
+    ("listener-threads", po::value<std::size_t>(&listener_threads)->default_value(0), "Threads sending notifications to clients (0 = one per hardware thread)")
+    ("session-poa-size", po::value<unsigned>(&session_poa_size)->default_value(1024), "Logged-in sessions per nprpc POA; more POAs are added as sessions grow")
+    ("session-cache-size", po::value<std::size_t>(&session_cache_size)->default_value(100000), "Maximum number of sessions cached in memory")
+    ("session-cache-ttl", po::value<unsigned>(&session_cache_ttl_s)->default_value(300), "Seconds a cached session is trusted before it is looked up again")
+    ("session-flush-interval", po::value<unsigned>(&session_flush_interval_s)->default_value(30), "Seconds between writes of session activity to the database")
+    ("tail-cache-messages", po::value<std::size_t>(&tail_cache_messages)->default_value(100), "Newest messages of each open chat kept in memory")
+    ("tail-cache-mb", po::value<std::size_t>(&tail_cache_mb)->default_value(64), "Memory budget of the chat tail cache in MiB")
+    ("warm-up", po::bool_switch(&warm_up)->default_value(false), "Before accepting connections, load the recently active sessions and the tails of the most recent chats into memory")
+    ("warm-up-chats", po::value<std::size_t>(&warm_up_chats)->default_value(1000), "Number of the most recently active chats whose tails --warm-up loads")
+    ("auth-threads", po::value<std::size_t>(&auth_threads)->default_value(0), "Number of threads for password hashing (0 = half the hardware threads)")
+    ("kdf-cost", po::value<unsigned>(&kdf_cost)->default_value(15), "scrypt cost as log2(N) for new password hashes (10-22); older hashes are upgraded on login")
+    ("nameserver", po::value<std::string>(&nameserver)->default_value(""), "Also register the authorizator as \"npchat\" with the nprpc nameserver at this address, for C++ clients such as npchat_bench")
+    ("metrics-port", po::value<unsigned short>(&metrics_port)->default_value(0), "Port of the Prometheus /metrics endpoint (0 = disabled)")
+    ("metrics-address", po::value<std::string>(&metrics_address)->default_value("127.0.0.1"), "Address the /metrics endpoint listens on")
     ("get-sha256", po::value<std::string>(), "Return SHA256 of the password")
-    ("trace", po::bool_switch(&log_trace)->default_value(false), "Enable log trace");
+    ("trace", po::bool_switch(&log_trace)->default_value(false), "Enable log trace, including every RPC call");
 
   try {
     po::variables_map vm;
@@ -76,7 +138,8 @@ int main(int argc, char *argv[]) {
   try {
     auto builder = nprpc::RpcBuilder();
     builder
-      .set_debug_level(nprpc::DebugLevel::DebugLevel_EveryCall)
+      // Logging every call costs more than serving most of them; --trace turns it back on
+      .set_debug_level(log_trace ? nprpc::DebugLevel::DebugLevel_EveryCall : nprpc::DebugLevel::DebugLevel_Critical)
       .set_listen_http_port(port)
       .set_http_root_dir(http_dir)
       .set_hostname(hostname);
@@ -88,14 +151,68 @@ int main(int argc, char *argv[]) {
     if (use_ssl)
       builder.enable_ssl_server(public_cert, private_key, dh_params);
 
+    auto startup = std::chrono::steady_clock::now();
     auto rpc = builder.build(thread_pool::get_instance().ctx());
     auto data_path = fs::canonical(fs::path(data_dir));
+    auto database = std::make_shared<Database>(
+      (data_path / "npchat.sqlite3").generic_string(), db_readers, Database::Options{
+        .cache_mb = db_cache_mb,
+        .mmap_mb = db_mmap_mb
+      });
+    migrateSchema(*database);
+    auto writeBatcher = std::make_shared<WriteBatcher>(database, WriteBatcher::Options{
+      .batch_size = std::max<std::size_t>(1, db_batch_size),
+      .window = std::chrono::milliseconds(db_batch_window_ms),
+      .delivery_ttl = std::chrono::hours(24 * delivery_ttl_days),
+      .delivery_queue_limit = delivery_queue_limit
+    });
+    auto messageArchive = std::make_shared<MessageArchive>(database, MessageArchive::Options{
+      .directory = data_path / "archive",
+      .hot_months = hot_months,
+      .interval = std::chrono::minutes(std::max(1u, archive_interval_min)),
+      // As many queries as the main database can run at once
+      .partition_readers = database->readerCount()
+    });
+    std::shared_ptr<MessageStore> messageStore = std::make_shared<SqliteMessageStore>(database, writeBatcher, messageArchive);
+    auto blobStore = std::make_shared<BlobStore>(data_path / "blobs");
+    auto uploadService = std::make_shared<UploadService>(blobStore, UploadService::Options{
+      .max_size = std::min(upload_max_mb, 4095u) * 1024u * 1024u,
+      .referenced = [messageStore] (std::string_view hash) { return messageStore->referencesBlob(hash); }
+    });
+    // Both indexes read whole tables through their own reader connections
+    auto userIndexLoad = std::async(std::launch::async, [database] {
+      return std::make_shared<UserIndex>(database);
+    });
+    auto chatMembership = std::make_shared<ChatMembership>(database);
+    auto userIndex = userIndexLoad.get();
+    auto sessionCache = std::make_shared<SessionCache>(SessionCache::Options{
+      .capacity = session_cache_size,
+      .ttl = std::chrono::seconds(session_cache_ttl_s),
+      .flush_interval = std::chrono::seconds(std::max(1u, session_flush_interval_s))
+    });
+
+    auto chatTailCache = std::make_shared<ChatTailCache>(ChatTailCache::Options{
+      .messages_per_chat = std::max<std::size_t>(1, tail_cache_messages),
+      .memory_budget = tail_cache_mb * 1024 * 1024
+    });
+
+    auto authCrypto = std::make_shared<AuthCrypto>(AuthCrypto::Options{
+      .threads = auth_threads,
+      .cost = kdf_cost
+    });
 
     auto firstInjector = [&] () { return di::make_injector(
       di::bind<>().to(*rpc),
-      di::bind<Database>().in(di::singleton).to<Database>(
-        (data_path / "npchat.sqlite3").generic_string()
-      )
+      di::bind<Database>().to(database),
+      di::bind<MessageStore>().to(messageStore),
+      di::bind<MessageArchive>().to(messageArchive),
+      di::bind<BlobStore>().to(blobStore),
+      di::bind<UploadService>().to(uploadService),
+      di::bind<ChatMembership>().to(chatMembership),
+      di::bind<UserIndex>().to(userIndex),
+      di::bind<SessionCache>().to(sessionCache),
+      di::bind<ChatTailCache>().to(chatTailCache),
+      di::bind<AuthCrypto>().to(authCrypto)
     );};
 
     auto injector = firstInjector();
@@ -104,8 +221,67 @@ int main(int argc, char *argv[]) {
     auto contactService = injector.create<std::shared_ptr<ContactService>>();
     auto messageService = injector.create<std::shared_ptr<MessageService>>();
     auto chatService = injector.create<std::shared_ptr<ChatService>>();
-    auto chatObservers = std::make_shared<ChatObservers>();
-    auto webrtcService = std::make_shared<WebRTCService>();
+
+    if (warm_up) {
+      auto started = std::chrono::steady_clock::now();
+      auto sessions = std::async(std::launch::async, [&] {
+        return authService->warmSessionCache(session_cache_size);
+      });
+      auto chats = chatService->warmTailCache(warm_up_chats, database->readerCount());
+      auto session_count = sessions.get();
+      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+      spdlog::info("Warm-up: {} sessions, {} chat tails in {} ms", session_count, chats, ms);
+    }
+    // Single node only: there is no bus between nodes yet, so every listener is hosted by this process
+    auto eventBus = std::make_shared<LocalEventBus>();
+    auto presence = std::make_shared<LocalPresenceDirectory>();
+    auto chatObservers = std::make_shared<ChatObservers>(chatMembership, eventBus, presence, ChatObservers::Options{
+      .shards = observer_shards,
+      .queue_limit = listener_queue_limit,
+      .drain_threads = listener_threads
+    });
+    auto presenceService = std::make_shared<PresenceService>(chatMembership, presence, PresenceService::Options{
+      .batch_window = std::chrono::milliseconds(std::max(1u, presence_window_ms))
+    }, PresenceService::Events{
+      .presence_batch = [chatObservers] (std::vector<npchat::PresenceUpdate> updates) {
+        chatObservers->notify_presence_batch(std::move(updates));
+      }
+    });
+    chatObservers->set_attach_handler([presenceService] (std::uint32_t userId, bool attached) {
+      if (attached) {
+        presenceService->userAttached(userId);
+      } else {
+        presenceService->userDetached(userId);
+      }
+    });
+    auto webrtcService = std::make_shared<WebRTCService>(WebRTCService::Options{}, WebRTCService::Events{
+      .ice_candidates = [chatObservers] (const std::string& callId, npchat::UserId targetUserId, std::vector<std::string> candidates) {
+        chatObservers->notify_ice_candidates(callId, std::move(candidates), targetUserId);
+      },
+      .call_expired = [chatObservers] (const CallInfo& call) {
+        chatObservers->notify_call_ended(call.callId, "timeout", call.chatId);
+      }
+    });
+
+    auto mediaPipeline = std::make_shared<MediaPipeline>(database, messageStore, blobStore, chatMembership, MediaPipeline::Options{
+      .threads = media_threads,
+      .queue_limit = std::max<std::size_t>(1, media_queue_limit),
+      .ffmpeg = ffmpeg,
+      .max_edge = std::clamp(preview_size, 16u, 2048u)
+    }, MediaPipeline::Events{
+      .preview_ready = [chatObservers] (npchat::ChatId chatId, npchat::MessageId messageId, npchat::AttachmentId attachmentId) {
+        chatObservers->notify_attachment_preview_ready(chatId, messageId, attachmentId);
+      }
+    });
+
+    auto payloadCodec = std::make_shared<PayloadCodec>(PayloadCodec::Options{
+      .threshold = compress_threshold,
+      .level = zstd_level,
+      .dictionary = zstd_dictionary
+    });
+    if (!PayloadCodec::available()) {
+      spdlog::info("Built without zstd: Encoded* replies are sent uncompressed");
+    }
 
     auto injector2 = di::make_injector(
       firstInjector(),
@@ -114,6 +290,9 @@ int main(int argc, char *argv[]) {
       di::bind<>().to(messageService),
       di::bind<>().to(chatService),
       di::bind<>().to(chatObservers),
+      di::bind<>().to(presenceService),
+      di::bind<>().to(payloadCodec),
+      di::bind<>().to(mediaPipeline),
       di::bind<>().to(webrtcService)
     );
 
@@ -123,7 +302,15 @@ int main(int argc, char *argv[]) {
       .with_lifespan(nprpc::PoaPolicy::Lifespan::Persistent)
       .build();
 
-    auto authorizator = injector2.create<std::shared_ptr<AuthorizatorImpl>>();
+    auto authorizator = std::make_shared<AuthorizatorImpl>(*rpc, injector2.create<ServiceContext>(),
+      AuthorizatorImpl::Options{.poa_size = session_poa_size});
+
+    if (metrics_port != 0) {
+      std::make_shared<MetricsServer>(thread_pool::get_instance().ctx(), MetricsServer::Options{
+        .address = metrics_address,
+        .port = metrics_port
+      })->start();
+    }
 
     // Capture SIGINT and SIGTERM to perform a clean shutdown
     boost::asio::signal_set signals(thread_pool::get_instance().executor(), SIGINT, SIGTERM);
@@ -135,10 +322,19 @@ int main(int argc, char *argv[]) {
     const auto flags = use_ssl ? nprpc::ObjectActivationFlags::ALLOW_SSL_WEBSOCKET
       : nprpc::ObjectActivationFlags::ALLOW_WEBSOCKET;
 
+    spdlog::info("Started in {} ms", std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - startup).count());
+
     host_json.secured = use_ssl;
     ACTIVATE_HOST_OBJECT(host_json, poa, authorizator, flags);
     SAVE_HOST_JSON_TO_FILE(host_json, http_dir);
 
+    // Browsers find the authorizator through host.json; C++ clients look it up by name
+    if (!nameserver.empty()) {
+      rpc->get_nameserver(nameserver)->Bind(host_json.objects.authorizator, "npchat");
+      spdlog::info("Authorizator registered with the nameserver at {}", nameserver);
+    }
+
     thread_pool::get_instance().ctx().run();
     thread_pool::get_instance().wait();
 
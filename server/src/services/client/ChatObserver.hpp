@@ -1,223 +1,219 @@
 #pragma once
 
 #include "Observer.hpp"
+#include "EventBus.hpp"
+#include "services/db/ChatMembership.hpp"
 #include "npchat_stub/npchat.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
 #include <unordered_map>
-#include <unordered_set>
+#include <vector>
+
+// Chat notifications for the listeners of this node.
+//
+// notify_* publish an event on the bus to the nodes that, according to the
+// presence directory, host one of its recipients, and deliver the events the
+// bus hands back to the listeners this node hosts. Only the local bus and
+// directory exist, which route everything back into this process; see EventBus.hpp.
+class ChatObservers : public ShardedObserversT<npchat::ChatListener> {
+public:
+  // Told when a user's first listener on this node arrives (true) and their last one goes away (false)
+  using AttachHandler = std::function<void(std::uint32_t userId, bool attached)>;
 
-class ChatObservers : public ObserversT<npchat::ChatListener> {
 private:
-  // Map user ID to their chat listeners
-  std::unordered_map<std::uint32_t, std::vector<npchat::ChatListener*>> user_listeners_;
-
-  // Map chat ID to participating user IDs
-  std::unordered_map<npchat::ChatId, std::unordered_set<std::uint32_t>> chat_participants_;
-
-  void on_message_received_impl(npchat::MessageId messageId, npchat::ChatMessage message, npchat::ChatId chatId, std::uint32_t senderId) {
-    // Find all participants of this chat
-    auto chat_it = chat_participants_.find(chatId);
-    if (chat_it == chat_participants_.end()) {
+  // User ids start at 1
+  static constexpr std::uint32_t no_user = 0;
+
+  // Only the newest contact list still queued for a listener is sent
+  static constexpr Coalesce contact_list_snapshot = 1;
+
+  // Chat membership is read from the shared index, which ChatService keeps up to date
+  std::shared_ptr<ChatMembership> membership_;
+  std::shared_ptr<EventBus> bus_;
+  std::shared_ptr<PresenceDirectory> presence_;
+  AttachHandler on_attach_;
+
+  // Broadcast a listener call to all participants of a chat except one user
+  template <typename Method, typename... Args>
+  void broadcast_to_chat(npchat::ChatId chatId, std::uint32_t except, Method method, Args&&... args) {
+    // Snapshot, so membership changes during the broadcast don't affect it
+    auto participants = membership_->participants(chatId);
+    if (participants->empty()) {
       return; // Chat not found
     }
-
-    // Notify all participants except the sender
-    for (auto userId : chat_it->second) {
-      if (userId == senderId) continue; // Don't notify sender
-
-      auto user_it = user_listeners_.find(userId);
-      if (user_it != user_listeners_.end()) {
-        for (auto* listener : user_it->second) {
-          try {
-            listener->OnMessageReceived({}, messageId, message);
-          } catch (nprpc::Exception&) {
-            // Remove disconnected listener - will be handled by cleanup
-          }
-        }
-      }
-    }
-  }
-
-  void on_message_delivered_impl(npchat::ChatId chatId, npchat::MessageId messageId, std::uint32_t senderId) {
-    // Notify only the sender about delivery confirmation
-    auto user_it = user_listeners_.find(senderId);
-    if (user_it != user_listeners_.end()) {
-      for (auto* listener : user_it->second) {
-        try {
-          listener->OnMessageDelivered({}, chatId, messageId);
-        } catch (nprpc::Exception&) {
-          // Remove disconnected listener - will be handled by cleanup
-        }
-      }
-    }
+    broadcast(*participants, except, method, std::forward<Args>(args)...);
   }
 
-  void on_contact_list_updated_impl(std::uint32_t userId, npchat::ContactList contacts) {
-    auto user_it = user_listeners_.find(userId);
-    if (user_it != user_listeners_.end()) {
-      for (auto* listener : user_it->second) {
-        try {
-          listener->OnContactListUpdated({}, contacts);
-        } catch (nprpc::Exception&) {
-          // Remove disconnected listener - will be handled by cleanup
-        }
-      }
-    }
+  void publish_to_chat(npchat::ChatId chatId, ChatEvent event) {
+    auto participants = membership_->participants(chatId);
+    if (participants->empty()) return;
+    bus_->publish(presence_->nodesOf(*participants), std::move(event));
   }
 
-  void on_call_initiated_impl(std::string_view callId, npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId calleeId, std::string_view offer) {
-    // Find all participants of this chat
-    auto chat_it = chat_participants_.find(chatId);
-    if (chat_it == chat_participants_.end()) {
-      return; // Chat not found
+  // To the nodes hosting a participant of any of the chats
+  void publish_to_chats(std::span<const npchat::ChatId> chatIds, ChatEvent event) {
+    std::vector<std::uint32_t> users;
+    for (auto chatId : chatIds) {
+      auto participants = membership_->participants(chatId);
+      users.insert(users.end(), participants->begin(), participants->end());
     }
-
-    // Notify all participants except the caller
-    for (auto userId : chat_it->second) {
-      if (userId == callerId) continue; // Don't notify caller
-
-      auto user_it = user_listeners_.find(userId);
-      if (user_it != user_listeners_.end()) {
-        for (auto* listener : user_it->second) {
-          try {
-            listener->OnCallInitiated({}, std::string(callId), chatId, callerId, std::string(offer));
-          } catch (nprpc::Exception&) {
-            // Remove disconnected listener - will be handled by cleanup
-          }
-        }
-      }
+    if (users.empty()) return;
+    bus_->publish(presence_->nodesOf(users), std::move(event));
+  }
+
+  void publish_to_user(std::uint32_t userId, ChatEvent event) {
+    bus_->publish(presence_->nodesOf({&userId, 1}), std::move(event));
+  }
+
+  // Delivers an event from the bus to the listeners hosted here
+  void deliver(const ChatEvent& event) {
+    using namespace chat_events;
+
+    if (auto e = std::get_if<MessageReceived>(&event)) {
+      broadcast_to_chat(e->message.chatId, e->senderId, &npchat::ChatListener::OnMessageReceived, e->messageId, e->message);
+    } else if (auto e = std::get_if<MessageDelivered>(&event)) {
+      notify_one(e->senderId, [chatId = e->chatId, messageId = e->messageId] (npchat::ChatListener& listener) {
+        listener.OnMessageDelivered({}, chatId, messageId);
+      });
+    } else if (auto e = std::get_if<ContactListUpdated>(&event)) {
+      notify_one(e->userId, [contacts = e->contacts] (npchat::ChatListener& listener) {
+        listener.OnContactListUpdated({}, contacts);
+      }, contact_list_snapshot);
+    } else if (auto e = std::get_if<CallInitiated>(&event)) {
+      broadcast_to_chat(e->chatId, e->callerId, &npchat::ChatListener::OnCallInitiated, e->callId, e->chatId, e->callerId, e->offer);
+    } else if (auto e = std::get_if<CallAnswered>(&event)) {
+      notify_one(e->callerId, [callId = e->callId, answer = e->answer] (npchat::ChatListener& listener) {
+        listener.OnCallAnswered({}, callId, answer);
+      });
+    } else if (auto e = std::get_if<IceCandidates>(&event)) {
+      notify_one(e->targetUserId, [callId = e->callId, candidates = e->candidates] (npchat::ChatListener& listener) {
+        listener.OnIceCandidates({}, callId, candidates);
+      });
+    } else if (auto e = std::get_if<CallEnded>(&event)) {
+      broadcast_to_chat(e->chatId, no_user, &npchat::ChatListener::OnCallEnded, e->callId, e->reason);
+    } else if (auto e = std::get_if<PresenceBatch>(&event)) {
+      deliver_presence(e->updates);
+    } else if (auto e = std::get_if<AttachmentPreviewReady>(&event)) {
+      broadcast_to_chat(e->chatId, no_user, &npchat::ChatListener::OnAttachmentPreviewReady,
+                        e->chatId, e->messageId, e->attachmentId);
     }
   }
 
-  void on_call_answered_impl(std::string_view callId, std::string_view answer, npchat::UserId callerId) {
-    // Notify only the caller about the answer
-    auto user_it = user_listeners_.find(callerId);
-    if (user_it != user_listeners_.end()) {
-      for (auto* listener : user_it->second) {
-        try {
-          listener->OnCallAnswered({}, std::string(callId), std::string(answer));
-        } catch (nprpc::Exception&) {
-          // Remove disconnected listener - will be handled by cleanup
-        }
+  // One OnPresenceBatch per recipient, with the changes of all the chats they share with whoever changed
+  void deliver_presence(const std::vector<npchat::PresenceUpdate>& updates) {
+    std::unordered_map<std::uint32_t, npchat::PresenceUpdateList> per_user;
+    for (const auto& update : updates) {
+      auto participants = membership_->participants(update.chatId);
+      for (auto userId : *participants) {
+        if (userId != update.userId) per_user[userId].push_back(update);
       }
     }
-  }
-
-  void on_ice_candidate_impl(std::string_view callId, std::string_view candidate, npchat::UserId targetUserId) {
-    // Notify the target user about the ICE candidate
-    auto user_it = user_listeners_.find(targetUserId);
-    if (user_it != user_listeners_.end()) {
-      for (auto* listener : user_it->second) {
-        try {
-          listener->OnIceCandidate({}, std::string(callId), std::string(candidate));
-        } catch (nprpc::Exception&) {
-          // Remove disconnected listener - will be handled by cleanup
-        }
-      }
+    for (auto& [userId, list] : per_user) {
+      notify_one(userId, [list = std::move(list)] (npchat::ChatListener& listener) {
+        listener.OnPresenceBatch({}, list);
+      });
     }
   }
 
-  void on_call_ended_impl(std::string_view callId, std::string_view reason, npchat::ChatId chatId) {
-    // Find all participants of this chat
-    auto chat_it = chat_participants_.find(chatId);
-    if (chat_it == chat_participants_.end()) {
-      return; // Chat not found
+  // Tells an evicted client that events were lost and it has to subscribe again
+  static Options with_eviction_notice(Options options) {
+    if (!options.evicted) {
+      options.evicted = [](npchat::ChatListener& listener) { listener.OnEventsDropped({}); };
     }
+    return options;
+  }
 
-    // Notify all participants
-    for (auto userId : chat_it->second) {
-      auto user_it = user_listeners_.find(userId);
-      if (user_it != user_listeners_.end()) {
-        for (auto* listener : user_it->second) {
-          try {
-            listener->OnCallEnded({}, std::string(callId), std::string(reason));
-          } catch (nprpc::Exception&) {
-            // Remove disconnected listener - will be handled by cleanup
-          }
-        }
-      }
-    }
+protected:
+  void on_first_listener(std::uint32_t userId) override {
+    presence_->attach(userId);
+    if (on_attach_) on_attach_(userId, true);
+  }
+  void on_last_listener(std::uint32_t userId) override {
+    presence_->detach(userId);
+    if (on_attach_) on_attach_(userId, false);
   }
 
 public:
-  ChatObservers() : ObserversT<npchat::ChatListener>() {}
+  ChatObservers(const std::shared_ptr<ChatMembership>& membership,
+                const std::shared_ptr<EventBus>& bus,
+                const std::shared_ptr<PresenceDirectory>& presence,
+                const Options& options = {})
+    : ShardedObserversT<npchat::ChatListener>(with_eviction_notice(options))
+    , membership_(membership)
+    , bus_(bus)
+    , presence_(presence)
+  {
+    bus_->subscribe([this] (const ChatEvent& event) { deliver(event); });
+  }
+
+  // Set once, before the first subscription
+  void set_attach_handler(AttachHandler handler) { on_attach_ = std::move(handler); }
 
   // Subscribe a user's listener to chat events
   void subscribe_user(std::uint32_t userId, npchat::ChatListener* listener) {
-    nplib::async<false>(executor(), [this, userId, listener] {
-      user_listeners_[userId].push_back(listener);
-      add_impl(listener); // Add to base observer list
-    });
+    subscribe(userId, listener);
   }
 
   // Unsubscribe a user's listener
   void unsubscribe_user(std::uint32_t userId, npchat::ChatListener* listener) {
-    nplib::async<false>(executor(), [this, userId, listener] {
-      auto user_it = user_listeners_.find(userId);
-      if (user_it != user_listeners_.end()) {
-        auto& listeners = user_it->second;
-        listeners.erase(std::remove(listeners.begin(), listeners.end(), listener), listeners.end());
-        if (listeners.empty()) {
-          user_listeners_.erase(user_it);
-        }
-      }
-    });
+    unsubscribe(userId, listener);
   }
 
-  // Add chat participants mapping
-  void add_chat_participants(npchat::ChatId chatId, const std::vector<std::uint32_t>& participants) {
-    nplib::async<false>(executor(), [this, chatId, participants] {
-      auto& chat_users = chat_participants_[chatId];
-      for (auto userId : participants) {
-        chat_users.insert(userId);
-      }
-    });
-  }
-
-  // Remove user from chat
-  void remove_chat_participant(npchat::ChatId chatId, std::uint32_t userId) {
-    nplib::async<false>(executor(), [this, chatId, userId] {
-      auto chat_it = chat_participants_.find(chatId);
-      if (chat_it != chat_participants_.end()) {
-        chat_it->second.erase(userId);
-        if (chat_it->second.empty()) {
-          chat_participants_.erase(chat_it);
-        }
-      }
-    });
-  }
-
-  // Broadcast new message to chat participants
+  // Broadcast new message to chat participants (except the sender)
   void notify_message_received(npchat::MessageId messageId, const npchat::ChatMessage& message, std::uint32_t senderId) {
-    nplib::async<false>(executor(), &ChatObservers::on_message_received_impl, this, messageId, message, message.chatId, senderId);
+    auto pushed = message;
+    // Attachment content is fetched with GetAttachment; never push it to every participant
+    if (pushed.content.attachment) {
+      pushed.content.attachment->data.clear();
+    }
+    auto chatId = pushed.chatId;
+    publish_to_chat(chatId, chat_events::MessageReceived{messageId, std::move(pushed), senderId});
   }
 
   // Notify sender about message delivery
   void notify_message_delivered(npchat::ChatId chatId, npchat::MessageId messageId, std::uint32_t senderId) {
-    nplib::async<false>(executor(), &ChatObservers::on_message_delivered_impl, this, chatId, messageId, senderId);
+    publish_to_user(senderId, chat_events::MessageDelivered{chatId, messageId, senderId});
   }
 
   // Notify user about contact list changes
   void notify_contact_list_updated(std::uint32_t userId, const npchat::ContactList& contacts) {
-    nplib::async<false>(executor(), &ChatObservers::on_contact_list_updated_impl, this, userId, contacts);
+    publish_to_user(userId, chat_events::ContactListUpdated{userId, contacts});
   }
 
-  // Notify chat participants about call initiation
-  void notify_call_initiated(const std::string& callId, npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId calleeId, const std::string& offer) {
-    nplib::async<false>(executor(), &ChatObservers::on_call_initiated_impl, this, callId, chatId, callerId, calleeId, offer);
+  // Notify chat participants (except the caller) about call initiation
+  void notify_call_initiated(const std::string& callId, npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId /*calleeId*/, const std::string& offer) {
+    publish_to_chat(chatId, chat_events::CallInitiated{callId, chatId, callerId, offer});
   }
 
   // Notify caller about call answer
   void notify_call_answered(std::string_view callId, std::string_view answer, npchat::UserId callerId) {
-    nplib::async<false>(executor(), &ChatObservers::on_call_answered_impl, this, callId, answer, callerId);
+    publish_to_user(callerId, chat_events::CallAnswered{std::string(callId), std::string(answer), callerId});
+  }
+
+  // Notify user about a batch of ICE candidates
+  void notify_ice_candidates(std::string_view callId, std::vector<std::string> candidates, npchat::UserId targetUserId) {
+    publish_to_user(targetUserId, chat_events::IceCandidates{std::string(callId), std::move(candidates), targetUserId});
+  }
+
+  // Push presence changes, already coalesced, to the other participants of their chats
+  void notify_presence_batch(std::vector<npchat::PresenceUpdate> updates) {
+    std::vector<npchat::ChatId> chatIds;
+    chatIds.reserve(updates.size());
+    for (const auto& update : updates) chatIds.push_back(update.chatId);
+    std::sort(chatIds.begin(), chatIds.end());
+    chatIds.erase(std::unique(chatIds.begin(), chatIds.end()), chatIds.end());
+    publish_to_chats(chatIds, chat_events::PresenceBatch{std::move(updates)});
   }
 
-  // Notify user about ICE candidate
-  void notify_ice_candidate(std::string_view callId, std::string_view candidate, npchat::UserId targetUserId) {
-    nplib::async<false>(executor(), &ChatObservers::on_ice_candidate_impl, this, callId, candidate, targetUserId);
+  // Notify chat participants that the preview of an attachment was made
+  void notify_attachment_preview_ready(npchat::ChatId chatId, npchat::MessageId messageId, npchat::AttachmentId attachmentId) {
+    publish_to_chat(chatId, chat_events::AttachmentPreviewReady{chatId, messageId, attachmentId});
   }
 
   // Notify chat participants about call ending
   void notify_call_ended(std::string_view callId, std::string_view reason, npchat::ChatId chatId) {
-    nplib::async<false>(executor(), &ChatObservers::on_call_ended_impl, this, callId, reason, chatId);
+    publish_to_chat(chatId, chat_events::CallEnded{std::string(callId), std::string(reason), chatId});
   }
 };
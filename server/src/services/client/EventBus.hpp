@@ -0,0 +1,158 @@
+#pragma once
+
+#include "npchat_stub/npchat.hpp"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// The seam for running npchat on several nodes: chat events, a directory of
+// which node hosts which users, and a bus that carries events between nodes.
+//
+// Only the single-node implementations exist so far. LocalPresenceDirectory and
+// LocalEventBus route everything back into this process; a multi-node
+// deployment still needs a bus between nodes and a directory they share.
+//
+// Chat-scoped events carry the chat id, not its participants: each receiving
+// node resolves the participants itself and delivers to those it hosts.
+namespace chat_events {
+struct MessageReceived {
+  npchat::MessageId messageId;
+  npchat::ChatMessage message; // Attachment data already stripped
+  std::uint32_t senderId;
+};
+
+struct MessageDelivered {
+  npchat::ChatId chatId;
+  npchat::MessageId messageId;
+  std::uint32_t senderId;
+};
+
+struct ContactListUpdated {
+  std::uint32_t userId;
+  npchat::ContactList contacts;
+};
+
+struct CallInitiated {
+  std::string callId;
+  npchat::ChatId chatId;
+  npchat::UserId callerId;
+  std::string offer;
+};
+
+struct CallAnswered {
+  std::string callId;
+  std::string answer;
+  npchat::UserId callerId;
+};
+
+struct IceCandidates {
+  std::string callId;
+  std::vector<std::string> candidates;
+  npchat::UserId targetUserId;
+};
+
+struct CallEnded {
+  std::string callId;
+  std::string reason;
+  npchat::ChatId chatId;
+};
+
+// Presence changes in any number of chats; each goes to the other participants of its chat
+struct PresenceBatch {
+  std::vector<npchat::PresenceUpdate> updates;
+};
+
+struct AttachmentPreviewReady {
+  npchat::ChatId chatId;
+  npchat::MessageId messageId;
+  npchat::AttachmentId attachmentId;
+};
+} // namespace chat_events
+
+using ChatEvent = std::variant<
+  chat_events::MessageReceived,
+  chat_events::MessageDelivered,
+  chat_events::ContactListUpdated,
+  chat_events::CallInitiated,
+  chat_events::CallAnswered,
+  chat_events::IceCandidates,
+  chat_events::CallEnded,
+  chat_events::PresenceBatch,
+  chat_events::AttachmentPreviewReady>;
+
+using NodeId = std::string;
+
+// Which nodes host listeners of which users.
+// attach/detach are called as a user's first listener on this node arrives
+// and its last one goes away.
+class PresenceDirectory {
+public:
+  virtual ~PresenceDirectory() = default;
+
+  virtual void attach(std::uint32_t userId) = 0;
+  virtual void detach(std::uint32_t userId) = 0;
+
+  // Nodes hosting at least one of the users, each listed once
+  virtual std::vector<NodeId> nodesOf(std::span<const std::uint32_t> userIds) = 0;
+};
+
+// Carries events to the nodes that host their recipients
+class EventBus {
+public:
+  using Handler = std::function<void(const ChatEvent&)>;
+
+  virtual ~EventBus() = default;
+
+  // Handler for events addressed to this node; set once, before the first publish
+  virtual void subscribe(Handler handler) = 0;
+
+  virtual void publish(std::span<const NodeId> nodes, ChatEvent event) = 0;
+};
+
+// Single-node deployment: every listener is in this process, so the only
+// answer is this node, or none when no recipient is connected
+class LocalPresenceDirectory final : public PresenceDirectory {
+  const NodeId node_;
+  std::mutex mutex_;
+  std::unordered_map<std::uint32_t, std::uint32_t> hosted_; // user id -> shards hosting it
+
+public:
+  explicit LocalPresenceDirectory(NodeId node = "local") : node_(std::move(node)) {}
+
+  void attach(std::uint32_t userId) override {
+    std::lock_guard lock(mutex_);
+    ++hosted_[userId];
+  }
+
+  void detach(std::uint32_t userId) override {
+    std::lock_guard lock(mutex_);
+    if (auto it = hosted_.find(userId); it != hosted_.end() && --it->second == 0) {
+      hosted_.erase(it);
+    }
+  }
+
+  std::vector<NodeId> nodesOf(std::span<const std::uint32_t> userIds) override {
+    std::lock_guard lock(mutex_);
+    for (auto userId : userIds) {
+      if (hosted_.contains(userId)) return {node_};
+    }
+    return {};
+  }
+};
+
+// Hands events straight back to this node's handler
+class LocalEventBus final : public EventBus {
+  Handler handler_;
+
+public:
+  void subscribe(Handler handler) override { handler_ = std::move(handler); }
+
+  void publish(std::span<const NodeId> nodes, ChatEvent event) override {
+    if (!nodes.empty() && handler_) handler_(event);
+  }
+};
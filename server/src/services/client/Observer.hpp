@@ -2,6 +2,23 @@
 
 #include <nprpc/nprpc.hpp>
 #include <nplib/utils/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include "services/metrics/Metrics.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 template <typename T>
 requires std::is_base_of_v<nprpc::Object, T>
@@ -58,3 +75,324 @@ public:
 
   ObserversT() : strand_{ thread_pool::get_instance().make_strand() } {}
 };
+
+// Observers keyed by user id and spread over several strands.
+//
+// Every key belongs to one shard, and each shard owns its listeners and runs
+// on its own strand. Notifications for one user stay ordered, and broadcasts
+// to large chats are spread across the thread pool.
+//
+// Shards never call a listener themselves: each listener has a bounded queue
+// of outbound calls, drained by at most one task at a time. Listener calls
+// block until the client replies or times out, so drains run on a pool of
+// their own (drain_threads) and slow clients can't hold up the RPC threads.
+// A stalled client only delays its own events. Its queue fills up instead, and
+// once it holds queue_limit calls the listener is evicted: the queued calls are
+// discarded, Options::evicted is sent as its last call so the client knows to
+// subscribe again and resynchronize, and nothing more is queued for it. Calls
+// tagged with the same Coalesce value replace each other while queued, so
+// snapshots such as a contact list are only sent in their newest version.
+template <typename T>
+requires std::is_base_of_v<nprpc::Object, T>
+class ShardedObserversT {
+public:
+  struct Options {
+    std::size_t shards = 0;          // 0 = one per hardware thread
+    std::size_t queue_limit = 256;   // Calls queued for one listener before it is evicted
+    std::size_t drain_threads = 0;   // Threads sending listener calls; 0 = one per hardware thread
+    std::function<void(T&)> evicted; // Last call made to an evicted listener
+  };
+
+  using Coalesce = std::uint32_t;
+  static constexpr Coalesce no_coalesce = 0;
+
+protected:
+  using Call = std::shared_ptr<const std::function<void(T&)>>;
+
+  struct Shard;
+
+  // A listener and the calls queued for it
+  struct Outbox {
+    Shard& shard;
+    const std::uint32_t key;
+    const std::unique_ptr<T> listener;
+
+    std::mutex mutex;
+    std::deque<std::pair<Coalesce, Call>> pending;
+    bool draining = false;  // A drain task is posted or running
+    bool evicted = false;   // Only the eviction notice is left to send; nothing more is queued
+    bool closed = false;    // Evicted, dropped or unsubscribed; nothing more is sent
+
+    Outbox(Shard& shard, std::uint32_t key, T* listener)
+      : shard(shard)
+      , key(key)
+      , listener(listener) {}
+  };
+
+  struct Shard {
+    ShardedObserversT& owner;
+    boost::asio::io_context::strand strand;
+    std::unordered_map<std::uint32_t, std::vector<std::shared_ptr<Outbox>>> listeners;
+
+    explicit Shard(ShardedObserversT& owner)
+      : owner(owner)
+      , strand{ thread_pool::get_instance().make_strand() } {}
+
+    // Queues the call for every listener of `key`; must run on the strand.
+    // Closed listeners, and those whose queue is full, are dropped.
+    void deliver(std::uint32_t key, const Call& call, Coalesce tag) {
+      auto it = listeners.find(key);
+      if (it == listeners.end()) return;
+
+      auto& list = it->second;
+      std::erase_if(list, [&] (const std::shared_ptr<Outbox>& outbox) { return !owner.enqueue(outbox, call, tag); });
+      if (list.empty()) {
+        listeners.erase(it);
+        owner.on_last_listener(key);
+      }
+    }
+
+    // Forgets a listener closed by its drain task; must run on the strand
+    void remove(const std::shared_ptr<Outbox>& outbox) {
+      auto it = listeners.find(outbox->key);
+      if (it == listeners.end() || std::erase(it->second, outbox) == 0) return;
+      if (it->second.empty()) {
+        listeners.erase(it);
+        owner.on_last_listener(outbox->key);
+      }
+    }
+  };
+
+private:
+  // Calls sent by one drain task before it yields its thread to other listeners
+  static constexpr std::size_t drain_batch = 32;
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  const std::size_t queue_limit_;
+  const Call evicted_notice_;    // Null if Options::evicted is empty
+  metrics::Gauge& queued_;       // Notification tasks posted to a strand that haven't run yet
+  metrics::Gauge& pending_;      // Calls waiting in listener queues
+  metrics::Counter& calls_;      // Listener calls made
+  metrics::Counter& coalesced_;  // Queued calls replaced by a newer one
+  metrics::Counter& dropped_;    // Listeners dropped because their session was closed
+  metrics::Counter& evicted_;    // Listeners evicted because their queue was full
+  metrics::Histogram& fanout_;   // Recipients of one notify_many
+
+  // Runs the drains; declared last, so it is joined before the rest goes away
+  boost::asio::thread_pool drain_pool_;
+
+  // Empties the queue; the caller holds the outbox mutex
+  void close_locked(Outbox& outbox) {
+    outbox.closed = true;
+    pending_.sub(static_cast<std::int64_t>(outbox.pending.size()));
+    outbox.pending.clear();
+  }
+
+  // Returns false if the listener is closed, or was just evicted because its queue is full
+  bool enqueue(const std::shared_ptr<Outbox>& outbox, const Call& call, Coalesce tag) {
+    {
+      std::lock_guard lock(outbox->mutex);
+      if (outbox->closed || outbox->evicted) return false;
+
+      if (tag != no_coalesce) {
+        auto queued = std::find_if(outbox->pending.begin(), outbox->pending.end(),
+          [tag] (const auto& entry) { return entry.first == tag; });
+        if (queued != outbox->pending.end()) {
+          queued->second = call;
+          coalesced_.inc();
+          return true;
+        }
+      }
+
+      if (outbox->pending.size() >= queue_limit_) {
+        evicted_.inc();
+        if (!evicted_notice_) {
+          close_locked(*outbox);
+          return false;
+        }
+        // The notice replaces everything queued; the drain closes the outbox after sending it
+        pending_.sub(static_cast<std::int64_t>(outbox->pending.size()));
+        outbox->pending.clear();
+        outbox->pending.emplace_back(no_coalesce, evicted_notice_);
+        pending_.add();
+        outbox->evicted = true;
+        if (!outbox->draining) {
+          outbox->draining = true;
+          post_drain(outbox);
+        }
+        return false;
+      }
+
+      outbox->pending.emplace_back(tag, call);
+      pending_.add();
+      if (outbox->draining) return true;
+      outbox->draining = true;
+    }
+    post_drain(outbox);
+    return true;
+  }
+
+  void post_drain(const std::shared_ptr<Outbox>& outbox) {
+    boost::asio::post(drain_pool_, [this, outbox] { drain(outbox); });
+  }
+
+  // Sends queued calls in order; only one drain per outbox runs at a time
+  void drain(const std::shared_ptr<Outbox>& outbox) {
+    for (std::size_t sent = 0;; ++sent) {
+      Call call;
+      {
+        std::lock_guard lock(outbox->mutex);
+        if (outbox->closed || outbox->pending.empty()) {
+          // An evicted listener is done once its notice went out
+          if (outbox->evicted) outbox->closed = true;
+          outbox->draining = false;
+          return;
+        }
+        if (sent == drain_batch) break;
+        call = std::move(outbox->pending.front().second);
+        outbox->pending.pop_front();
+        pending_.sub();
+      }
+
+      try {
+        (*call)(*outbox->listener);
+        calls_.inc();
+      } catch (nprpc::Exception&) {
+        // session was closed
+        {
+          std::lock_guard lock(outbox->mutex);
+          close_locked(*outbox);
+          outbox->draining = false;
+        }
+        dropped_.inc();
+        auto& shard = outbox->shard;
+        nplib::async<false>(shard.strand, [&shard, outbox] { shard.remove(outbox); });
+        return;
+      }
+    }
+    post_drain(outbox);
+  }
+
+protected:
+  Shard& shard_for(std::uint32_t key) noexcept { return *shards_[key % shards_.size()]; }
+
+  // Called on the key's strand when its first listener arrives and when its last one is gone
+  virtual void on_first_listener(std::uint32_t /*key*/) {}
+  virtual void on_last_listener(std::uint32_t /*key*/) {}
+
+  // Queues fn(listener) for every listener of `key`
+  template <typename F>
+  void notify_one(std::uint32_t key, F fn, Coalesce tag = no_coalesce) {
+    auto& shard = shard_for(key);
+    Call call = std::make_shared<const std::function<void(T&)>>(std::move(fn));
+    queued_.add();
+    nplib::async<false>(shard.strand, [&shard, key, call = std::move(call), tag] {
+      shard.owner.queued_.sub();
+      shard.deliver(key, call, tag);
+    });
+  }
+
+  // Queues fn(listener) for every listener of every key except `except`,
+  // with one task per shard instead of one per key
+  template <typename F>
+  void notify_many(std::span<const std::uint32_t> keys, std::uint32_t except, F fn) {
+    std::vector<std::vector<std::uint32_t>> buckets(shards_.size());
+    std::uint64_t recipients = 0;
+    for (auto key : keys) {
+      if (key != except) {
+        buckets[key % shards_.size()].push_back(key);
+        ++recipients;
+      }
+    }
+    fanout_.observe(recipients);
+
+    Call call = std::make_shared<const std::function<void(T&)>>(std::move(fn));
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+      if (buckets[i].empty()) continue;
+      auto& shard = *shards_[i];
+      queued_.add();
+      nplib::async<false>(shard.strand, [&shard, keys = std::move(buckets[i]), call] {
+        shard.owner.queued_.sub();
+        for (auto key : keys) shard.deliver(key, call, no_coalesce);
+      });
+    }
+  }
+
+  // Calls method(listener, timeout, args...) on every listener of every key except `except`.
+  // The arguments are copied into one tuple that every shard task and queued call
+  // points to; each call is encoded separately, by the stub of its own session.
+  template <typename Method, typename... Args>
+  void broadcast(std::span<const std::uint32_t> keys, std::uint32_t except, Method method, Args&&... args) {
+    auto payload = std::make_shared<const std::tuple<std::decay_t<Args>...>>(std::forward<Args>(args)...);
+    notify_many(keys, except, [method, payload] (T& listener) {
+      std::apply([&] (const auto&... a) { std::invoke(method, listener, std::nullopt, a...); }, *payload);
+    });
+  }
+
+public:
+  explicit ShardedObserversT(const Options& options = {})
+    : queue_limit_(std::max<std::size_t>(1, options.queue_limit))
+    , evicted_notice_(options.evicted ? std::make_shared<const std::function<void(T&)>>(options.evicted) : nullptr)
+    , queued_(metrics::Registry::instance().gauge(
+        "npchat_observer_queue_depth", "Notification tasks waiting for their strand"))
+    , pending_(metrics::Registry::instance().gauge(
+        "npchat_listener_queue_depth", "Calls waiting in listener queues"))
+    , calls_(metrics::Registry::instance().counter(
+        "npchat_observer_calls_total", "Listener callbacks made"))
+    , coalesced_(metrics::Registry::instance().counter(
+        "npchat_observer_coalesced_total", "Queued listener calls superseded by a newer one"))
+    , dropped_(metrics::Registry::instance().counter(
+        "npchat_observer_dropped_total", "Listeners dropped because their session was closed"))
+    , evicted_(metrics::Registry::instance().counter(
+        "npchat_observer_evicted_total", "Listeners evicted because their queue was full"))
+    , fanout_(metrics::Registry::instance().histogram(
+        "npchat_observer_fanout_recipients", "Users one chat notification was sent to", metrics::count_buckets()))
+    , drain_pool_(options.drain_threads ? options.drain_threads : std::max(1u, std::thread::hardware_concurrency()))
+  {
+    auto shard_count = options.shards;
+    if (shard_count == 0) {
+      shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    shards_.reserve(shard_count);
+    for (std::size_t i = 0; i < shard_count; ++i) {
+      shards_.push_back(std::make_unique<Shard>(*this));
+    }
+  }
+
+  virtual ~ShardedObserversT() {
+    // Calls still queued are dropped; the ones in flight finish or time out first
+    drain_pool_.stop();
+    drain_pool_.join();
+  }
+
+  std::size_t shard_count() const noexcept { return shards_.size(); }
+
+  // Takes ownership of the listener
+  void subscribe(std::uint32_t key, T* observer) {
+    auto& shard = shard_for(key);
+    nplib::async<false>(shard.strand, [&shard, key, observer] {
+      auto& list = shard.listeners[key];
+      list.push_back(std::make_shared<Outbox>(shard, key, observer));
+      if (list.size() == 1) shard.owner.on_first_listener(key);
+    });
+  }
+
+  void unsubscribe(std::uint32_t key, T* observer) {
+    auto& shard = shard_for(key);
+    nplib::async<false>(shard.strand, [&shard, key, observer] {
+      auto it = shard.listeners.find(key);
+      if (it == shard.listeners.end()) return;
+      auto& list = it->second;
+      std::erase_if(list, [&shard, observer] (const std::shared_ptr<Outbox>& outbox) {
+        if (outbox->listener.get() != observer) return false;
+        std::lock_guard lock(outbox->mutex);
+        shard.owner.close_locked(*outbox);
+        return true;
+      });
+      if (list.empty()) {
+        shard.listeners.erase(it);
+        shard.owner.on_last_listener(key);
+      }
+    });
+  }
+};
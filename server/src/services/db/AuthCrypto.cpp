@@ -0,0 +1,175 @@
+#include "AuthCrypto.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <spdlog/spdlog.h>
+
+namespace {
+constexpr std::string_view scrypt_prefix = "$scrypt$";
+constexpr std::size_t legacy_digest_bytes = 32; // SHA-256
+constexpr unsigned min_cost = 10;
+constexpr unsigned max_cost = 22;
+
+std::size_t default_threads() {
+  return std::max(1u, std::thread::hardware_concurrency() / 2);
+}
+
+int hex_value(char c) noexcept {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool from_hex(std::string_view hex, std::vector<unsigned char>& out) {
+  if (hex.size() % 2 != 0) return false;
+  out.resize(hex.size() / 2);
+  for (std::size_t i = 0; i < out.size(); ++i) {
+    int hi = hex_value(hex[2 * i]);
+    int lo = hex_value(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0) return false;
+    out[i] = static_cast<unsigned char>((hi << 4) | lo);
+  }
+  return true;
+}
+
+// Reads "<name>=<number>" followed by `end`, advancing s past it
+bool parse_param(std::string_view& s, std::string_view name, char end, unsigned& value) {
+  if (!s.starts_with(name) || s.size() <= name.size() || s[name.size()] != '=') return false;
+  s.remove_prefix(name.size() + 1);
+  auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+  if (ec != std::errc{} || ptr == s.data() + s.size() || *ptr != end) return false;
+  s.remove_prefix(ptr - s.data() + 1);
+  return true;
+}
+
+struct EncodedHash {
+  unsigned cost, r, p;
+  std::vector<unsigned char> salt, key;
+};
+
+std::optional<EncodedHash> decode(std::string_view s) {
+  if (!s.starts_with(scrypt_prefix)) return std::nullopt;
+  s.remove_prefix(scrypt_prefix.size());
+
+  EncodedHash h;
+  if (!parse_param(s, "ln", ',', h.cost) || !parse_param(s, "r", ',', h.r) || !parse_param(s, "p", '$', h.p)) {
+    return std::nullopt;
+  }
+
+  auto sep = s.find('$');
+  if (sep == std::string_view::npos) return std::nullopt;
+  if (!from_hex(s.substr(0, sep), h.salt) || !from_hex(s.substr(sep + 1), h.key) || h.key.empty()) {
+    return std::nullopt;
+  }
+  return h;
+}
+} // namespace
+
+AuthCrypto::AuthCrypto(Options options)
+  : options_(options)
+  , pool_(options.threads ? options.threads : default_threads())
+{
+  if (options_.cost < min_cost || options_.cost > max_cost) {
+    throw std::runtime_error("KDF cost must be between " + std::to_string(min_cost) +
+                             " and " + std::to_string(max_cost));
+  }
+
+  // Of a random password nobody knows
+  dummy_hash_ = hash(sessionId());
+
+  spdlog::info("Auth crypto: {} threads, scrypt N=2^{} r={} p={}",
+               options_.threads ? options_.threads : default_threads(),
+               options_.cost, scrypt_r, scrypt_p);
+}
+
+AuthCrypto::~AuthCrypto() {
+  pool_.join();
+}
+
+void AuthCrypto::toHex(std::span<const unsigned char> bytes, char* out) noexcept {
+  static constexpr char digits[] = "0123456789abcdef";
+  for (auto b : bytes) {
+    *out++ = digits[b >> 4];
+    *out++ = digits[b & 0x0f];
+  }
+}
+
+std::string AuthCrypto::toHex(std::span<const unsigned char> bytes) {
+  std::string result(bytes.size() * 2, '\0');
+  toHex(bytes, result.data());
+  return result;
+}
+
+std::string AuthCrypto::sessionId() {
+  unsigned char random_bytes[session_id_bytes];
+
+  if (RAND_bytes(random_bytes, session_id_bytes) != 1) {
+    spdlog::error("Failed to generate secure random bytes for session ID");
+    throw std::runtime_error("Failed to generate secure session ID");
+  }
+
+  return toHex(random_bytes);
+}
+
+std::string AuthCrypto::scrypt(std::string_view password, std::span<const unsigned char> salt,
+                               unsigned cost, unsigned r, unsigned p)
+{
+  // Working memory as OpenSSL accounts it: 128 * r * (N + 2 + p) bytes
+  const std::uint64_t n = std::uint64_t(1) << cost;
+  const std::uint64_t maxmem = 128 * std::uint64_t(r) * (n + 2 + p);
+
+  unsigned char key[key_bytes];
+  if (EVP_PBE_scrypt(password.data(), password.size(), salt.data(), salt.size(),
+                     n, r, p, maxmem, key, sizeof(key)) != 1) {
+    throw std::runtime_error("scrypt failed");
+  }
+  return std::string(reinterpret_cast<const char*>(key), sizeof(key));
+}
+
+std::string AuthCrypto::hash(std::string_view password) const {
+  unsigned char salt[salt_bytes];
+  if (RAND_bytes(salt, sizeof(salt)) != 1) {
+    throw std::runtime_error("Failed to generate password salt");
+  }
+
+  auto key = scrypt(password, salt, options_.cost, scrypt_r, scrypt_p);
+
+  return std::string(scrypt_prefix) +
+    "ln=" + std::to_string(options_.cost) +
+    ",r=" + std::to_string(scrypt_r) +
+    ",p=" + std::to_string(scrypt_p) +
+    "$" + toHex(salt) +
+    "$" + toHex({reinterpret_cast<const unsigned char*>(key.data()), key.size()});
+}
+
+AuthCrypto::Verification AuthCrypto::verify(std::string_view password, std::string_view stored) const {
+  if (stored.size() == legacy_digest_bytes && !stored.starts_with(scrypt_prefix)) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    if (EVP_Digest(password.data(), password.size(), digest, &digest_len, EVP_sha256(), nullptr) != 1) {
+      throw std::runtime_error("SHA-256 failed");
+    }
+    bool ok = digest_len == stored.size() && CRYPTO_memcmp(digest, stored.data(), digest_len) == 0;
+    return {ok, ok};
+  }
+
+  auto encoded = decode(stored);
+  // Stored parameters are trusted only within the range we would produce ourselves
+  if (!encoded || encoded->cost < min_cost || encoded->cost > max_cost ||
+      encoded->r != scrypt_r || encoded->p != scrypt_p || encoded->key.size() != key_bytes) {
+    spdlog::warn("Unrecognized password hash format");
+    return {};
+  }
+
+  auto key = scrypt(password, encoded->salt, encoded->cost, encoded->r, encoded->p);
+  bool ok = CRYPTO_memcmp(key.data(), encoded->key.data(), key_bytes) == 0;
+  return {ok, ok && encoded->cost < options_.cost};
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+// Password hashing and session token generation, run on a dedicated pool so a
+// burst of logins occupies these threads instead of the RPC I/O threads.
+//
+// Passwords are hashed with scrypt and stored as
+//   $scrypt$ln=<log2 N>,r=<r>,p=<p>$<salt hex>$<key hex>
+// so the cost can be raised later without breaking existing hashes. Hashes
+// created before that (a bare SHA-256 digest) are still accepted and reported
+// as needing a rehash.
+class AuthCrypto {
+public:
+  struct Options {
+    std::size_t threads = 0; // 0 = half the hardware threads
+    unsigned cost = 15;      // scrypt N = 2^cost
+  };
+
+  struct Verification {
+    bool ok = false;
+    // Set when the stored hash is a legacy digest or was made with a lower cost
+    bool needs_rehash = false;
+  };
+
+private:
+  static constexpr unsigned scrypt_r = 8;
+  static constexpr unsigned scrypt_p = 1;
+  static constexpr std::size_t salt_bytes = 16;
+  static constexpr std::size_t key_bytes = 32;
+  static constexpr std::size_t session_id_bytes = 32;
+
+  const Options options_;
+  std::string dummy_hash_;
+  boost::asio::thread_pool pool_;
+
+  static std::string scrypt(std::string_view password, std::span<const unsigned char> salt,
+                            unsigned cost, unsigned r, unsigned p);
+
+public:
+  explicit AuthCrypto(Options options);
+  ~AuthCrypto();
+
+  const Options& options() const noexcept { return options_; }
+
+  // Runs fn on the crypto pool
+  template <typename F>
+  auto run(F&& fn) -> std::future<std::invoke_result_t<std::decay_t<F>&>> {
+    using R = std::invoke_result_t<std::decay_t<F>&>;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+    auto result = task->get_future();
+    boost::asio::post(pool_, [task] { (*task)(); });
+    return result;
+  }
+
+  // The following run on the calling thread; use run() to move them off it
+
+  // Encoded scrypt hash of the password with a fresh salt and the configured cost
+  std::string hash(std::string_view password) const;
+
+  Verification verify(std::string_view password, std::string_view stored) const;
+
+  // Hash at the configured cost that no password matches. Verifying against it takes
+  // as long as checking a real password, for logins that match no user.
+  std::string_view dummyHash() const noexcept { return dummy_hash_; }
+
+  // 32 random bytes, hex encoded
+  static std::string sessionId();
+
+  // Lowercase hex; out must have room for 2 * bytes.size() characters
+  static void toHex(std::span<const unsigned char> bytes, char* out) noexcept;
+  static std::string toHex(std::span<const unsigned char> bytes);
+};
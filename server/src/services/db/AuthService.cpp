@@ -1,32 +1,23 @@
 #include "AuthService.hpp"
-#include <sstream>
-#include <iomanip>
+#include <algorithm>
 #include <random>
 
-std::string AuthService::generateSessionId() {
-  constexpr size_t session_id_bytes = 32;
-  unsigned char random_bytes[session_id_bytes];
-
-  if (RAND_bytes(random_bytes, session_id_bytes) != 1) {
-    spdlog::error("Failed to generate secure random bytes for session ID");
-    throw std::runtime_error("Failed to generate secure session ID");
-  }
-
-  std::stringstream ss;
-  for (size_t i = 0; i < session_id_bytes; ++i) {
-    ss << std::hex << std::setfill('0') << std::setw(2) << static_cast<int>(random_bytes[i]);
-  }
-
-  return ss.str();
-}
-
-std::string AuthService::hashPassword(std::string_view password) {
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256_CTX sha256;
-  SHA256_Init(&sha256);
-  SHA256_Update(&sha256, password.data(), password.size());
-  SHA256_Final(hash, &sha256);
-  return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+namespace {
+// Read-only queries, prepared on every reader connection on first use
+constexpr std::string_view get_user_by_session_sql =
+  "SELECT u.id, u.username, s.expires_at FROM users u "
+  "JOIN user_sessions s ON u.id = s.user_id "
+  "WHERE s.session_token = ? AND s.expires_at > ? AND u.is_active = 1";
+
+// The sessions with the most recent activity, for warming the session cache
+constexpr std::string_view get_recent_sessions_sql =
+  "SELECT s.session_token, u.id, u.username, s.expires_at FROM user_sessions s "
+  "JOIN users u ON u.id = s.user_id "
+  "WHERE s.expires_at > ? AND u.is_active = 1 "
+  "ORDER BY s.last_activity DESC LIMIT ?";
+
+constexpr std::string_view get_user_by_login_sql =
+  "SELECT id, username, password_hash FROM users WHERE (username = ? OR email = ?) AND is_active = 1";
 }
 
 std::uint32_t AuthService::generateVerificationCode() {
@@ -41,19 +32,24 @@ std::uint64_t AuthService::currentTimestamp() {
     std::chrono::system_clock::now().time_since_epoch()).count();
 }
 
-AuthService::AuthService(const std::shared_ptr<Database>& database) : db_(database) {
+AuthService::AuthService(const std::shared_ptr<Database>& database,
+                         const std::shared_ptr<SessionCache>& sessions,
+                         const std::shared_ptr<AuthCrypto>& crypto,
+                         const std::shared_ptr<UserIndex>& users)
+  : db_(database)
+  , sessions_(sessions)
+  , crypto_(crypto)
+  , users_(users)
+  , lock_wait_(metrics::lock_wait("AuthService"))
+{
   spdlog::info("Initializing AuthService");
+
   // Prepare all statements
   insert_user_stmt_ = db_->prepareStatement(
     "INSERT INTO users (username, email, password_hash, created_at, is_active) VALUES (?, ?, ?, ?, 1)");
 
-  get_user_by_login_stmt_ = db_->prepareStatement(
-    "SELECT id, username, email, password_hash FROM users WHERE (username = ? OR email = ?) AND is_active = 1");
-
-  get_user_by_session_stmt_ = db_->prepareStatement(
-    "SELECT u.id, u.username, u.email FROM users u "
-    "JOIN user_sessions s ON u.id = s.user_id "
-    "WHERE s.session_token = ? AND s.expires_at > ? AND u.is_active = 1");
+  update_password_stmt_ = db_->prepareStatement(
+    "UPDATE users SET password_hash = ? WHERE id = ?");
 
   get_user_by_id_stmt_ = db_->prepareStatement(
     "SELECT id, username, email FROM users WHERE id = ? AND is_active = 1");
@@ -61,20 +57,13 @@ AuthService::AuthService(const std::shared_ptr<Database>& database) : db_(databa
   insert_session_stmt_ = db_->prepareStatement(
     "INSERT INTO user_sessions (user_id, session_token, created_at, expires_at, last_activity) VALUES (?, ?, ?, ?, ?)");
 
-  update_session_stmt_ = db_->prepareStatement(
-    "UPDATE user_sessions SET last_activity = ? WHERE session_token = ?");
-
   delete_session_stmt_ = db_->prepareStatement(
     "DELETE FROM user_sessions WHERE session_token = ?");
 
   check_username_stmt_ = db_->prepareStatement(
-    "SELECT COUNT(*) FROM users WHERE LOWER(username) = LOWER(?) "
-    "UNION ALL "
     "SELECT COUNT(*) FROM pending_registrations WHERE LOWER(username) = LOWER(?)");
 
   check_email_stmt_ = db_->prepareStatement(
-    "SELECT COUNT(*) FROM users WHERE LOWER(email) = LOWER(?) "
-    "UNION ALL "
     "SELECT COUNT(*) FROM pending_registrations WHERE LOWER(email) = LOWER(?)");
 
   insert_pending_stmt_ = db_->prepareStatement(
@@ -90,12 +79,69 @@ AuthService::AuthService(const std::shared_ptr<Database>& database) : db_(databa
 
   cleanup_expired_stmt_ = db_->prepareStatement(
     "DELETE FROM pending_registrations WHERE expires_at <= ?");
+
+  // Expired rows are never read again; dropping them at startup keeps the tables small
+  {
+    auto stmt = db_->prepareStatement("DELETE FROM user_sessions WHERE expires_at <= ?");
+    sqlite3_bind_int64(stmt, 1, currentTimestamp());
+    auto rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+      throw std::runtime_error(std::string("Failed to delete expired sessions: ") + sqlite3_errmsg(db_->getConnection()));
+    }
+  }
+  sqlite3_bind_int64(cleanup_expired_stmt_, 1, currentTimestamp());
+  auto rc = sqlite3_step(cleanup_expired_stmt_);
+  sqlite3_reset(cleanup_expired_stmt_);
+  if (rc != SQLITE_DONE) {
+    throw std::runtime_error(std::string("Failed to delete expired registrations: ") + sqlite3_errmsg(db_->getConnection()));
+  }
+
+  // Its own connection, so a flush never runs inside a transaction of the shared writer
+  activity_writer_ = db_->openConnection(false);
+  update_session_stmt_ = activity_writer_->prepareStatement(
+    "UPDATE user_sessions SET last_activity = MAX(last_activity, ?) WHERE session_token = ?");
+
+  activity_flusher_ = std::thread(&AuthService::runActivityFlusher, this);
+}
+
+std::size_t AuthService::warmSessionCache(std::size_t limit) {
+  std::vector<std::pair<std::string, SessionCache::Session>> recent;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_recent_sessions_sql);
+
+    sqlite3_bind_int64(stmt, 1, currentTimestamp());
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(std::min(limit, sessions_->options().capacity)));
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      recent.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)), SessionCache::Session{
+        .user_id = static_cast<std::uint32_t>(sqlite3_column_int(stmt, 1)),
+        .username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)),
+        .expires_at = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 3))
+      });
+    }
+    sqlite3_reset(stmt);
+  }
+
+  // Oldest first, so the most recently active end up at the front of the LRU lists
+  for (auto it = recent.rbegin(); it != recent.rend(); ++it) {
+    sessions_->insert(it->first, std::move(it->second));
+  }
+  return recent.size();
 }
 
 AuthService::~AuthService() {
+  {
+    std::lock_guard lock(flusher_mutex_);
+    stop_flusher_ = true;
+  }
+  flusher_cv_.notify_one();
+  // The flusher writes what is still pending before exiting
+  activity_flusher_.join();
+
   sqlite3_finalize(insert_user_stmt_);
-  sqlite3_finalize(get_user_by_login_stmt_);
-  sqlite3_finalize(get_user_by_session_stmt_);
+  sqlite3_finalize(update_password_stmt_);
   sqlite3_finalize(get_user_by_id_stmt_);
   sqlite3_finalize(insert_session_stmt_);
   sqlite3_finalize(update_session_stmt_);
@@ -109,118 +155,184 @@ AuthService::~AuthService() {
 }
 
 npchat::UserData AuthService::logIn(std::string_view login, std::string_view password) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  sqlite3_bind_text(get_user_by_login_stmt_, 1, login.data(), login.size(), SQLITE_STATIC);
-  sqlite3_bind_text(get_user_by_login_stmt_, 2, login.data(), login.size(), SQLITE_STATIC);
-
-  if (sqlite3_step(get_user_by_login_stmt_) == SQLITE_ROW) {
-    std::uint32_t user_id = sqlite3_column_int(get_user_by_login_stmt_, 0);
-    std::string username = reinterpret_cast<const char*>(sqlite3_column_text(get_user_by_login_stmt_, 1));
-    std::string stored_hash = std::string(
-      reinterpret_cast<const char*>(sqlite3_column_blob(get_user_by_login_stmt_, 3)),
-      sqlite3_column_bytes(get_user_by_login_stmt_, 3));
-
-    sqlite3_reset(get_user_by_login_stmt_);
-
-    if (stored_hash == hashPassword(password)) {
-      // Generate new session
-      std::string session_id = generateSessionId();
-      std::uint64_t current_time = currentTimestamp();
-      std::uint64_t expires = current_time + (30 * 24 * 60 * 60); // 30 days
-
-      sqlite3_bind_int(insert_session_stmt_, 1, user_id);
-      sqlite3_bind_text(insert_session_stmt_, 2, session_id.c_str(), -1, SQLITE_STATIC);
-      sqlite3_bind_int64(insert_session_stmt_, 3, current_time);
-      sqlite3_bind_int64(insert_session_stmt_, 4, expires);
-      sqlite3_bind_int64(insert_session_stmt_, 5, current_time);
-      sqlite3_step(insert_session_stmt_);
-      sqlite3_reset(insert_session_stmt_);
-
-      active_sessions_[session_id] = user_id;
-
-      npchat::UserData user_data;
-      user_data.userId = user_id;
-      user_data.name = username;
-      user_data.sessionId = session_id;
-      // user_data.registeredUser will be set by the caller
-      return user_data;
+  std::uint32_t user_id = 0;
+  std::string username, stored_hash;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_user_by_login_sql);
+
+    sqlite3_bind_text(stmt, 1, login.data(), login.size(), SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, login.data(), login.size(), SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      user_id = sqlite3_column_int(stmt, 0);
+      username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+      stored_hash = std::string(
+        reinterpret_cast<const char*>(sqlite3_column_blob(stmt, 2)),
+        sqlite3_column_bytes(stmt, 2));
     }
+    sqlite3_reset(stmt);
   }
 
-  sqlite3_reset(get_user_by_login_stmt_);
-  throw npchat::AuthorizationFailed{npchat::AuthorizationError::InvalidCredentials};
-}
+  // Unknown logins are verified against a dummy hash, so they take as long as a
+  // wrong password and the response time doesn't tell which accounts exist
+  const bool found = user_id != 0;
+  if (!found) stored_hash = crypto_->dummyHash();
+
+  struct Proof {
+    std::string session_id;
+    std::string new_hash; // Replaces stored_hash when it is outdated
+  };
+
+  // The arguments outlive the job, since we wait for it here
+  auto proof = crypto_->run([&] () -> std::optional<Proof> {
+    auto verification = crypto_->verify(password, stored_hash);
+    if (!verification.ok) return std::nullopt;
+    return Proof{
+      AuthCrypto::sessionId(),
+      verification.needs_rehash ? crypto_->hash(password) : std::string{}
+    };
+  }).get();
+
+  if (!found || !proof) {
+    throw npchat::AuthorizationFailed{npchat::AuthorizationError::InvalidCredentials};
+  }
 
-npchat::UserData AuthService::logInWithSessionId(std::string_view session_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  // Check cache first
-  std::string session_str(session_id); // Need string for map lookup
-  auto it = active_sessions_.find(session_str);
-  if (it != active_sessions_.end()) {
-    sqlite3_bind_text(get_user_by_session_stmt_, 1, session_id.data(), session_id.size(), SQLITE_STATIC);
-    sqlite3_bind_int64(get_user_by_session_stmt_, 2, currentTimestamp());
-
-    if (sqlite3_step(get_user_by_session_stmt_) == SQLITE_ROW) {
-      uint32_t user_id = sqlite3_column_int(get_user_by_session_stmt_, 0);
-      std::string username = reinterpret_cast<const char*>(sqlite3_column_text(get_user_by_session_stmt_, 1));
-      sqlite3_reset(get_user_by_session_stmt_);
-
-      npchat::UserData user_data;
-      user_data.userId = user_id;
-      user_data.name = username;
-      user_data.sessionId = session_str;
-      return user_data;
+  std::uint64_t current_time = currentTimestamp();
+  std::uint64_t expires = current_time + (30 * 24 * 60 * 60); // 30 days
+  {
+    metrics::TimedLock lock(mutex_, lock_wait_);
+
+    if (!proof->new_hash.empty()) {
+      sqlite3_bind_blob(update_password_stmt_, 1, proof->new_hash.data(), proof->new_hash.size(), SQLITE_STATIC);
+      sqlite3_bind_int(update_password_stmt_, 2, user_id);
+      sqlite3_step(update_password_stmt_);
+      sqlite3_reset(update_password_stmt_);
+      spdlog::info("Upgraded password hash of user {}", user_id);
     }
-    sqlite3_reset(get_user_by_session_stmt_);
 
-    // Remove from cache if DB lookup failed
-    active_sessions_.erase(it);
+    sqlite3_bind_int(insert_session_stmt_, 1, user_id);
+    sqlite3_bind_text(insert_session_stmt_, 2, proof->session_id.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(insert_session_stmt_, 3, current_time);
+    sqlite3_bind_int64(insert_session_stmt_, 4, expires);
+    sqlite3_bind_int64(insert_session_stmt_, 5, current_time);
+    sqlite3_step(insert_session_stmt_);
+    sqlite3_reset(insert_session_stmt_);
   }
 
-  throw npchat::AuthorizationFailed{npchat::AuthorizationError::AccessDenied};
+  sessions_->insert(proof->session_id, {user_id, username, expires});
+
+  npchat::UserData user_data;
+  user_data.userId = user_id;
+  user_data.name = std::move(username);
+  user_data.sessionId = std::move(proof->session_id);
+  // user_data.registeredUser will be set by the caller
+  return user_data;
 }
 
-std::uint32_t AuthService::getUserIdFromSession(std::string_view session_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+void AuthService::runActivityFlusher() {
+  std::unique_lock lock(flusher_mutex_);
+  for (;;) {
+    flusher_cv_.wait_for(lock, sessions_->options().flush_interval, [this] { return stop_flusher_; });
+    bool stop = stop_flusher_;
 
-  std::string session_str(session_id);
+    lock.unlock();
+    flushActivity();
+    lock.lock();
 
-  // Check cache first
-  if (auto it = active_sessions_.find(session_str); it != active_sessions_.end()) {
-    return it->second;
+    if (stop) break;
   }
+}
 
-  sqlite3_bind_text(get_user_by_session_stmt_, 1, session_id.data(), session_id.size(), SQLITE_STATIC);
+void AuthService::flushActivity() {
+  auto activity = sessions_->takeActivity();
+  if (activity.empty()) return;
 
-  if (sqlite3_step(get_user_by_session_stmt_) == SQLITE_ROW) {
-    std::uint32_t user_id = sqlite3_column_int(get_user_by_session_stmt_, 0);
-    sqlite3_reset(get_user_by_session_stmt_);
-    return user_id;
+  // Only the flusher thread uses activity_writer_, so no lock is needed
+  auto db = activity_writer_->handle();
+
+  // One transaction and one UPDATE per active session, however often it was used
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("Failed to begin session activity flush: {}", sqlite3_errmsg(db));
+    return;
   }
 
-  sqlite3_reset(get_user_by_session_stmt_);
-  throw npchat::AuthorizationFailed{npchat::AuthorizationError::AccessDenied};
+  for (const auto& [session_id, last_activity] : activity) {
+    sqlite3_bind_int64(update_session_stmt_, 1, last_activity);
+    sqlite3_bind_text(update_session_stmt_, 2, session_id.data(), session_id.size(), SQLITE_STATIC);
+    auto rc = sqlite3_step(update_session_stmt_);
+    sqlite3_reset(update_session_stmt_);
+    if (rc != SQLITE_DONE) {
+      spdlog::error("Failed to flush session activity: {}", sqlite3_errmsg(db));
+      sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+      return;
+    }
+  }
+
+  if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("Failed to commit activity of {} sessions: {}", activity.size(), sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    return;
+  }
+  spdlog::debug("Flushed activity of {} sessions", activity.size());
 }
 
-std::uint32_t AuthService::getUserIdFromLogin(std::string_view login) {
-  std::lock_guard<std::mutex> lock(mutex_);
+std::optional<SessionCache::Session> AuthService::findSession(std::string_view session_id) {
+  auto now = currentTimestamp();
 
-  sqlite3_bind_text(get_user_by_login_stmt_, 1, login.data(), login.size(), SQLITE_STATIC);
-  sqlite3_bind_text(get_user_by_login_stmt_, 2, login.data(), login.size(), SQLITE_STATIC);
+  if (auto session = sessions_->find(session_id, now)) {
+    return session;
+  }
 
-  if (sqlite3_step(get_user_by_login_stmt_) == SQLITE_ROW) {
-    std::uint32_t user_id = sqlite3_column_int(get_user_by_login_stmt_, 0);
-    sqlite3_reset(get_user_by_login_stmt_);
-    return user_id;
+  // Cache miss: a reader connection, so reconnecting clients don't queue on mutex_
+  std::optional<SessionCache::Session> session;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_user_by_session_sql);
+
+    sqlite3_bind_text(stmt, 1, session_id.data(), session_id.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, now);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      session = SessionCache::Session{
+        static_cast<std::uint32_t>(sqlite3_column_int(stmt, 0)),
+        reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+        static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 2))
+      };
+    }
+    sqlite3_reset(stmt);
   }
 
-  sqlite3_reset(get_user_by_login_stmt_);
-  throw npchat::AuthorizationFailed{npchat::AuthorizationError::InvalidCredentials};
+  if (session) {
+    sessions_->insert(session_id, *session);
+    sessions_->touch(session_id, now);
+  }
+  return session;
+}
+
+npchat::UserData AuthService::logInWithSessionId(std::string_view session_id) {
+  auto session = findSession(session_id);
+  if (!session) {
+    throw npchat::AuthorizationFailed{npchat::AuthorizationError::AccessDenied};
+  }
+
+  npchat::UserData user_data;
+  user_data.userId = session->user_id;
+  user_data.name = std::move(session->username);
+  user_data.sessionId = std::string(session_id);
+  return user_data;
+}
+
+std::uint32_t AuthService::getUserIdFromSession(std::string_view session_id) {
+  auto session = findSession(session_id);
+  if (!session) {
+    throw npchat::AuthorizationFailed{npchat::AuthorizationError::AccessDenied};
+  }
+  return session->user_id;
 }
 
 std::optional<npchat::Contact> AuthService::getUserById(std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_int(get_user_by_id_stmt_, 1, user_id);
 
@@ -238,59 +350,57 @@ std::optional<npchat::Contact> AuthService::getUserById(std::uint32_t user_id) {
 }
 
 bool AuthService::logOut(std::string_view session_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
+
+  sessions_->erase(session_id);
 
   sqlite3_bind_text(delete_session_stmt_, 1, session_id.data(), session_id.size(), SQLITE_STATIC);
   bool success = sqlite3_step(delete_session_stmt_) == SQLITE_DONE;
   sqlite3_reset(delete_session_stmt_);
-
-  std::string session_str(session_id); // Convert for map operations
-  active_sessions_.erase(session_str);
   return success;
 }
 
 bool AuthService::checkUsernameInternal(std::string_view username) {
+  if (users_->hasUsername(username)) return false;
+
   sqlite3_bind_text(check_username_stmt_, 1, username.data(), username.size(), SQLITE_STATIC);
-  sqlite3_bind_text(check_username_stmt_, 2, username.data(), username.size(), SQLITE_STATIC);
 
   bool available = true;
-  while (sqlite3_step(check_username_stmt_) == SQLITE_ROW) {
-    if (sqlite3_column_int(check_username_stmt_, 0) > 0) {
-      available = false;
-      break;
-    }
+  if (sqlite3_step(check_username_stmt_) == SQLITE_ROW) {
+    available = sqlite3_column_int(check_username_stmt_, 0) == 0;
   }
   sqlite3_reset(check_username_stmt_);
   return available;
 }
 
 bool AuthService::checkEmailInternal(std::string_view email) {
+  if (users_->hasEmail(email)) return false;
+
   sqlite3_bind_text(check_email_stmt_, 1, email.data(), email.size(), SQLITE_STATIC);
-  sqlite3_bind_text(check_email_stmt_, 2, email.data(), email.size(), SQLITE_STATIC);
 
   bool available = true;
-  while (sqlite3_step(check_email_stmt_) == SQLITE_ROW) {
-    if (sqlite3_column_int(check_email_stmt_, 0) > 0) {
-      available = false;
-      break;
-    }
+  if (sqlite3_step(check_email_stmt_) == SQLITE_ROW) {
+    available = sqlite3_column_int(check_email_stmt_, 0) == 0;
   }
   sqlite3_reset(check_email_stmt_);
   return available;
 }
 
 bool AuthService::checkUsername(std::string_view username) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
   return checkUsernameInternal(username);
 }
 
 bool AuthService::checkEmail(std::string_view email) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
   return checkEmailInternal(email);
 }
 
 void AuthService::registerStepOne(std::string_view username, std::string_view email, std::string_view password) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  // Hashed before taking mutex_, so a slow KDF doesn't hold up other requests
+  auto password_hash = crypto_->run([&] { return crypto_->hash(password); }).get();
+
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   if (!checkUsernameInternal(username)) {
     throw npchat::RegistrationFailed{npchat::RegistrationError::UsernameAlreadyTaken};
@@ -311,7 +421,6 @@ void AuthService::registerStepOne(std::string_view username, std::string_view em
 
   sqlite3_bind_text(insert_pending_stmt_, 1, username.data(), username.size(), SQLITE_STATIC);
   sqlite3_bind_text(insert_pending_stmt_, 2, email.data(), email.size(), SQLITE_STATIC);
-  auto password_hash = hashPassword(password);
   sqlite3_bind_blob(insert_pending_stmt_, 3, password_hash.c_str(), password_hash.length(), SQLITE_STATIC);
   sqlite3_bind_int(insert_pending_stmt_, 4, verification_code);
   sqlite3_bind_int64(insert_pending_stmt_, 5, current_time);
@@ -328,7 +437,7 @@ void AuthService::registerStepOne(std::string_view username, std::string_view em
 }
 
 void AuthService::registerStepTwo(std::string_view username, std::uint32_t code) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_text(get_pending_stmt_, 1, username.data(), username.size(), SQLITE_STATIC);
   sqlite3_bind_int(get_pending_stmt_, 2, code);
@@ -350,6 +459,7 @@ void AuthService::registerStepTwo(std::string_view username, std::uint32_t code)
 
     if (sqlite3_step(insert_user_stmt_) == SQLITE_DONE) {
       sqlite3_reset(insert_user_stmt_);
+      users_->add(static_cast<std::uint32_t>(sqlite3_last_insert_rowid(db_->getConnection())), username, email);
 
       // Clean up pending registration
       sqlite3_bind_text(delete_pending_stmt_, 1, username.data(), username.size(), SQLITE_STATIC);
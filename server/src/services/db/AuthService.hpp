@@ -1,17 +1,20 @@
 #pragma once
 
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <string_view>
 #include <unordered_map>
 #include <optional>
 #include <sqlite3.h>
-#include <openssl/sha.h>
-#include <boost/uuid/random_generator.hpp>
-#include <openssl/rand.h>
 #include <spdlog/spdlog.h>
+#include "AuthCrypto.hpp"
 #include "Database.hpp"
+#include "services/metrics/Metrics.hpp"
+#include "SessionCache.hpp"
+#include "UserIndex.hpp"
 #include "npchat_stub/npchat.hpp"
 
 class AuthService {
@@ -38,12 +41,15 @@ public:
 
 private:
   std::shared_ptr<Database> db_;
+  std::shared_ptr<SessionCache> sessions_;
+  std::shared_ptr<AuthCrypto> crypto_;
+  std::shared_ptr<UserIndex> users_;
   mutable std::mutex mutex_;
+  metrics::Histogram& lock_wait_; // Time spent waiting for mutex_
 
   // Prepared statements
   sqlite3_stmt* insert_user_stmt_;
-  sqlite3_stmt* get_user_by_login_stmt_;
-  sqlite3_stmt* get_user_by_session_stmt_;
+  sqlite3_stmt* update_password_stmt_;
   sqlite3_stmt* get_user_by_id_stmt_;
   sqlite3_stmt* insert_session_stmt_;
   sqlite3_stmt* update_session_stmt_;
@@ -55,24 +61,38 @@ private:
   sqlite3_stmt* delete_pending_stmt_;
   sqlite3_stmt* cleanup_expired_stmt_;
 
-  // In-memory cache for sessions
-  std::unordered_map<std::string, std::uint32_t> active_sessions_;
+  // Writes the last_activity recorded by sessions_ back every flush_interval,
+  // on a connection of its own with update_session_stmt_ prepared on it
+  std::unique_ptr<Database::Connection> activity_writer_;
+  std::thread activity_flusher_;
+  std::mutex flusher_mutex_;
+  std::condition_variable flusher_cv_;
+  bool stop_flusher_ = false;
+
+  void runActivityFlusher();
+  void flushActivity();
+
+  // Cache first, then the database; records the session's activity
+  std::optional<SessionCache::Session> findSession(std::string_view session_id);
 
-  static std::string generateSessionId();
-  static std::string hashPassword(std::string_view password);
   static std::uint32_t generateVerificationCode();
   static std::uint64_t currentTimestamp();
 
 public:
-  explicit AuthService(const std::shared_ptr<Database>& database);
+  AuthService(const std::shared_ptr<Database>& database,
+              const std::shared_ptr<SessionCache>& sessions,
+              const std::shared_ptr<AuthCrypto>& crypto,
+              const std::shared_ptr<UserIndex>& users);
   ~AuthService();
 
   // Authentication methods
+  // Password verification runs on the crypto pool; the caller waits for it without holding any lock
   npchat::UserData logIn(std::string_view login, std::string_view password);
   npchat::UserData logInWithSessionId(std::string_view session_id);
   std::uint32_t getUserIdFromSession(std::string_view session_id);
-  std::uint32_t getUserIdFromLogin(std::string_view login);
   bool logOut(std::string_view session_id);
+  // Caches the up to `limit` most recently active sessions, before clients reconnect; returns how many
+  std::size_t warmSessionCache(std::size_t limit);
 
   // User information methods
   std::optional<npchat::Contact> getUserById(std::uint32_t user_id);
@@ -84,7 +104,8 @@ public:
   void registerStepTwo(std::string_view username, std::uint32_t code);
 
 private:
-  // Internal helpers that don't acquire mutex (called when mutex is already held)
+  // Internal helpers that don't acquire mutex (called when mutex is already held).
+  // Registered accounts are looked up in users_, pending registrations in the database.
   bool checkUsernameInternal(std::string_view username);
   bool checkEmailInternal(std::string_view email);
 };
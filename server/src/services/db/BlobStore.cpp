@@ -0,0 +1,251 @@
+#include "BlobStore.hpp"
+
+#include <spdlog/spdlog.h>
+#include <openssl/evp.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+constexpr std::size_t hash_length = 64; // hex SHA-256
+
+// Makes the names of temporary files unique within the process
+std::atomic<std::uint64_t> tmp_counter{0};
+
+std::string to_hex(const unsigned char* digest, unsigned int digest_len) {
+  static constexpr char hex[] = "0123456789abcdef";
+  std::string result(digest_len * 2, '\0');
+  for (unsigned int i = 0; i < digest_len; ++i) {
+    result[2 * i] = hex[digest[i] >> 4];
+    result[2 * i + 1] = hex[digest[i] & 0x0F];
+  }
+  return result;
+}
+
+void write_all(int fd, const std::uint8_t* data, std::size_t size) {
+  while (size > 0) {
+    auto n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error("Failed to write blob");
+    }
+    data += n;
+    size -= static_cast<std::size_t>(n);
+  }
+}
+}
+
+BlobStore::Blob::~Blob() {
+  if (addr_) ::munmap(addr_, size_);
+}
+
+BlobStore::BlobStore(const std::filesystem::path& root)
+  : root_(root)
+  , tmp_dir_(root / "tmp")
+{
+  std::filesystem::create_directories(tmp_dir_);
+  // Leftovers of writes interrupted by a crash or restart
+  for (const auto& entry : std::filesystem::directory_iterator(tmp_dir_)) {
+    std::error_code ec;
+    std::filesystem::remove(entry.path(), ec);
+  }
+  spdlog::info("Blob store: {}", root_.generic_string());
+}
+
+std::string BlobStore::hashOf(std::span<const std::uint8_t> data) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len = 0;
+  if (EVP_Digest(data.data(), data.size(), digest, &digest_len, EVP_sha256(), nullptr) != 1) {
+    throw std::runtime_error("Failed to hash blob");
+  }
+  return to_hex(digest, digest_len);
+}
+
+bool BlobStore::isValidHash(std::string_view hash) noexcept {
+  if (hash.size() != hash_length) return false;
+  for (char c : hash) {
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+  }
+  return true;
+}
+
+std::filesystem::path BlobStore::pathFor(std::string_view hash) const {
+  // The hash ends up in a path, so never trust it blindly
+  if (!isValidHash(hash)) {
+    throw std::runtime_error("Invalid blob hash");
+  }
+  return root_ / hash.substr(0, 2) / hash;
+}
+
+std::string BlobStore::put(std::span<const std::uint8_t> data) {
+  auto hash = hashOf(data);
+  auto path = pathFor(hash);
+  if (std::filesystem::exists(path)) {
+    return hash; // already stored
+  }
+
+  auto tmp_path = tmp_dir_ / (hash + '.' + std::to_string(tmp_counter.fetch_add(1)));
+
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    spdlog::error("[BlobStore] Failed to create {}: {}", tmp_path.generic_string(), std::strerror(errno));
+    throw std::runtime_error("Failed to store blob");
+  }
+
+  try {
+    write_all(fd, data.data(), data.size());
+    // The database row referencing this blob must never outlive the content itself
+    if (::fsync(fd) != 0) {
+      throw std::runtime_error("Failed to sync blob");
+    }
+  } catch (...) {
+    ::close(fd);
+    std::filesystem::remove(tmp_path);
+    throw;
+  }
+  ::close(fd);
+
+  try {
+    std::filesystem::create_directories(path.parent_path());
+    // rename() is atomic, so a concurrent put() of the same content just replaces an identical file
+    std::filesystem::rename(tmp_path, path);
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(tmp_path, ec);
+    throw;
+  }
+  return hash;
+}
+
+bool BlobStore::contains(std::string_view hash) const {
+  return isValidHash(hash) && std::filesystem::exists(pathFor(hash));
+}
+
+bool BlobStore::removeUnreferenced(std::string_view hash, const std::function<bool(std::string_view)>& referenced) {
+  auto path = pathFor(hash);
+
+  std::unique_lock lock(holds_mutex_);
+  if (referenced(hash)) return false;
+
+  std::error_code ec;
+  bool removed = std::filesystem::remove(path, ec);
+  if (ec) {
+    spdlog::error("[BlobStore] Failed to remove {}: {}", path.generic_string(), ec.message());
+  }
+  return removed;
+}
+
+std::shared_ptr<const BlobStore::Blob> BlobStore::open(std::string_view hash) const {
+  auto path = pathFor(hash);
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) return nullptr;
+    spdlog::error("[BlobStore] Failed to open {}: {}", path.generic_string(), std::strerror(errno));
+    throw std::runtime_error("Failed to open blob");
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Failed to open blob");
+  }
+
+  auto size = static_cast<std::size_t>(st.st_size);
+  void* addr = nullptr;
+  if (size > 0) {
+    addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Failed to map blob");
+    }
+  }
+  // The mapping stays valid after the descriptor is closed
+  ::close(fd);
+
+  return std::make_shared<const Blob>(addr, size);
+}
+
+BlobStore::Writer::Writer(const BlobStore& store)
+  : store_(store)
+  , tmp_path_(store.tmp_dir_ / ("upload." + std::to_string(tmp_counter.fetch_add(1))))
+  , fd_(::open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644))
+  , md_(nullptr)
+{
+  if (fd_ < 0) {
+    spdlog::error("[BlobStore] Failed to create {}: {}", tmp_path_.generic_string(), std::strerror(errno));
+    throw std::runtime_error("Failed to store blob");
+  }
+
+  md_ = EVP_MD_CTX_new();
+  if (!md_ || EVP_DigestInit_ex(md_, EVP_sha256(), nullptr) != 1) {
+    EVP_MD_CTX_free(md_);
+    ::close(fd_);
+    std::filesystem::remove(tmp_path_);
+    throw std::runtime_error("Failed to hash blob");
+  }
+}
+
+BlobStore::Writer::~Writer() {
+  EVP_MD_CTX_free(md_);
+  if (fd_ >= 0) {
+    ::close(fd_);
+    std::error_code ec;
+    std::filesystem::remove(tmp_path_, ec);
+  }
+}
+
+void BlobStore::Writer::write(std::span<const std::uint8_t> data) {
+  if (fd_ < 0) {
+    throw std::runtime_error("Blob is already committed");
+  }
+  if (EVP_DigestUpdate(md_, data.data(), data.size()) != 1) {
+    throw std::runtime_error("Failed to hash blob");
+  }
+  write_all(fd_, data.data(), data.size());
+  size_ += data.size();
+}
+
+std::string BlobStore::Writer::commit() {
+  if (fd_ < 0) {
+    throw std::runtime_error("Blob is already committed");
+  }
+
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len = 0;
+  if (EVP_DigestFinal_ex(md_, digest, &digest_len) != 1) {
+    throw std::runtime_error("Failed to hash blob");
+  }
+  auto hash = to_hex(digest, digest_len);
+
+  // Same as put(): the content is durable before anything can reference it
+  if (::fsync(fd_) != 0) {
+    throw std::runtime_error("Failed to sync blob");
+  }
+  ::close(fd_);
+  fd_ = -1;
+
+  // The destructor no longer cleans up once fd_ is closed
+  auto path = store_.pathFor(hash);
+  try {
+    if (std::filesystem::exists(path)) {
+      std::filesystem::remove(tmp_path_); // already stored
+    } else {
+      std::filesystem::create_directories(path.parent_path());
+      std::filesystem::rename(tmp_path_, path);
+      created_ = true;
+    }
+  } catch (...) {
+    std::error_code ec;
+    std::filesystem::remove(tmp_path_, ec);
+    throw;
+  }
+  return hash;
+}
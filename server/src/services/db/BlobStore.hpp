@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+// Content-addressed attachment storage on the local filesystem.
+//
+// Blobs are keyed by the hex SHA-256 of their content and live under
+// <root>/<first two hex digits>/<hash>, so identical uploads are stored once.
+// Reads are served from read-only memory mappings, which lets chunked
+// downloads slice the file without copying it into the heap first.
+//
+// Content no row refers to can be removed again, but only while no one holds
+// the store: whoever stores content and then the row that refers to it keeps
+// a hold() across both, so a blob is never removed between the two.
+class BlobStore {
+public:
+  // Read-only memory mapping of one stored blob
+  class Blob {
+    void* addr_;
+    std::size_t size_;
+
+  public:
+    Blob(void* addr, std::size_t size) noexcept
+      : addr_(addr)
+      , size_(size)
+    {
+    }
+    ~Blob();
+
+    Blob(const Blob&) = delete;
+    Blob& operator=(const Blob&) = delete;
+
+    std::size_t size() const noexcept { return size_; }
+    std::span<const std::uint8_t> bytes() const noexcept {
+      return {static_cast<const std::uint8_t*>(addr_), size_};
+    }
+  };
+
+  // Content written in pieces to a temporary file, stored under its hash by commit().
+  // Only the hash state is kept in memory, however large the content gets.
+  class Writer {
+    const BlobStore& store_;
+    std::filesystem::path tmp_path_;
+    int fd_;
+    EVP_MD_CTX* md_;
+    std::uint64_t size_ = 0;
+    bool created_ = false;
+
+  public:
+    explicit Writer(const BlobStore& store);
+    // Removes the temporary file unless the content was committed
+    ~Writer();
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void write(std::span<const std::uint8_t> data);
+    std::uint64_t size() const noexcept { return size_; }
+    // Syncs the content and moves it into the store; returns its hash
+    std::string commit();
+    // True if commit() stored new content rather than finding it already there
+    bool created() const noexcept { return created_; }
+  };
+
+  using Hold = std::shared_lock<std::shared_mutex>;
+
+private:
+  std::filesystem::path root_;
+  std::filesystem::path tmp_dir_;
+  mutable std::shared_mutex holds_mutex_;
+
+public:
+  explicit BlobStore(const std::filesystem::path& root);
+
+  // Hex SHA-256 of the content, which is also its key in the store
+  static std::string hashOf(std::span<const std::uint8_t> data);
+
+  static bool isValidHash(std::string_view hash) noexcept;
+
+  // Stores the content if it isn't there yet and returns its hash
+  std::string put(std::span<const std::uint8_t> data);
+
+  // Starts storing content that arrives in pieces
+  std::unique_ptr<Writer> writer() const { return std::make_unique<Writer>(*this); }
+
+  bool contains(std::string_view hash) const;
+
+  // Keeps removeUnreferenced() from running until it is released. Not reentrant:
+  // a thread holding one must not take another or call removeUnreferenced().
+  Hold hold() const { return Hold(holds_mutex_); }
+
+  // Removes the blob unless referenced(hash) says something refers to it, which is
+  // asked while no one holds the store; returns true if it was removed
+  bool removeUnreferenced(std::string_view hash, const std::function<bool(std::string_view)>& referenced);
+
+  // Where a blob is stored, for tools that read the file themselves; throws on an invalid hash
+  std::filesystem::path pathFor(std::string_view hash) const;
+
+  // Maps a stored blob into memory; returns nullptr if it doesn't exist
+  std::shared_ptr<const Blob> open(std::string_view hash) const;
+
+  const std::filesystem::path& root() const noexcept { return root_; }
+  const std::filesystem::path& tmpDir() const noexcept { return tmp_dir_; }
+};
@@ -0,0 +1,141 @@
+#include "ChatMembership.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+namespace {
+const auto empty_participants = std::make_shared<const ChatMembership::Participants>();
+const auto empty_chats = std::make_shared<const ChatMembership::Chats>();
+}
+
+template <typename Map, typename Value>
+void ChatMembership::insert_into(Map& map, typename Map::key_type key, Value value) {
+  auto& current = map[key];
+  using List = typename Map::mapped_type::element_type;
+
+  if (current && std::binary_search(current->begin(), current->end(), value)) return;
+
+  auto updated = current ? std::make_shared<std::remove_const_t<List>>(*current)
+                         : std::make_shared<std::remove_const_t<List>>();
+  updated->insert(std::upper_bound(updated->begin(), updated->end(), value), value);
+  current = std::move(updated);
+}
+
+template <typename Map, typename Value>
+void ChatMembership::erase_from(Map& map, typename Map::key_type key, Value value) {
+  auto it = map.find(key);
+  if (it == map.end()) return;
+  using List = typename Map::mapped_type::element_type;
+
+  auto pos = std::lower_bound(it->second->begin(), it->second->end(), value);
+  if (pos == it->second->end() || *pos != value) return;
+
+  if (it->second->size() == 1) {
+    map.erase(it);
+    return;
+  }
+
+  auto updated = std::make_shared<std::remove_const_t<List>>(*it->second);
+  updated->erase(updated->begin() + (pos - it->second->begin()));
+  it->second = std::move(updated);
+}
+
+ChatMembership::ChatMembership(const std::shared_ptr<Database>& database) {
+  auto start = std::chrono::steady_clock::now();
+
+  std::unordered_map<npchat::ChatId, Participants> participants;
+  std::unordered_map<std::uint32_t, Chats> chats;
+  std::size_t rows = 0;
+
+  {
+    auto reader = database->reader();
+    auto stmt = reader->prepareStatement("SELECT chat_id, user_id FROM chat_participants");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      npchat::ChatId chat_id = sqlite3_column_int(stmt, 0);
+      std::uint32_t user_id = sqlite3_column_int(stmt, 1);
+      participants[chat_id].push_back(user_id);
+      chats[user_id].push_back(chat_id);
+      ++rows;
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  participants_.reserve(participants.size());
+  for (auto& [chat_id, list] : participants) {
+    std::sort(list.begin(), list.end());
+    participants_.emplace(chat_id, std::make_shared<const Participants>(std::move(list)));
+  }
+
+  chats_.reserve(chats.size());
+  for (auto& [user_id, list] : chats) {
+    std::sort(list.begin(), list.end());
+    chats_.emplace(user_id, std::make_shared<const Chats>(std::move(list)));
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  spdlog::info("Chat membership loaded: {} chats, {} users, {} memberships in {} ms",
+               participants_.size(), chats_.size(), rows, elapsed.count());
+}
+
+bool ChatMembership::isParticipant(npchat::ChatId chat_id, std::uint32_t user_id) const {
+  std::shared_lock lock(mutex_);
+  auto it = participants_.find(chat_id);
+  return it != participants_.end() && std::binary_search(it->second->begin(), it->second->end(), user_id);
+}
+
+std::shared_ptr<const ChatMembership::Participants> ChatMembership::participants(npchat::ChatId chat_id) const {
+  std::shared_lock lock(mutex_);
+  auto it = participants_.find(chat_id);
+  return it != participants_.end() ? it->second : empty_participants;
+}
+
+std::shared_ptr<const ChatMembership::Chats> ChatMembership::chatsOf(std::uint32_t user_id) const {
+  std::shared_lock lock(mutex_);
+  auto it = chats_.find(user_id);
+  return it != chats_.end() ? it->second : empty_chats;
+}
+
+std::size_t ChatMembership::chatCount() const {
+  std::shared_lock lock(mutex_);
+  return participants_.size();
+}
+
+void ChatMembership::add(npchat::ChatId chat_id, std::span<const std::uint32_t> user_ids) {
+  std::unique_lock lock(mutex_);
+
+  // The chat's list is copied once for all of them; each user's list once for its own
+  auto it = participants_.find(chat_id);
+  auto updated = it != participants_.end() ? std::make_shared<Participants>(*it->second)
+                                           : std::make_shared<Participants>();
+  auto existing = static_cast<std::ptrdiff_t>(updated->size());
+  for (auto user_id : user_ids) {
+    if (!std::binary_search(updated->begin(), updated->begin() + existing, user_id)) updated->push_back(user_id);
+  }
+  std::sort(updated->begin() + existing, updated->end());
+  updated->erase(std::unique(updated->begin() + existing, updated->end()), updated->end());
+  if (static_cast<std::ptrdiff_t>(updated->size()) == existing) return;
+
+  for (auto user = updated->begin() + existing; user != updated->end(); ++user) {
+    insert_into(chats_, *user, chat_id);
+  }
+  std::inplace_merge(updated->begin(), updated->begin() + existing, updated->end());
+  participants_[chat_id] = std::move(updated);
+}
+
+void ChatMembership::remove(npchat::ChatId chat_id, std::uint32_t user_id) {
+  std::unique_lock lock(mutex_);
+  erase_from(participants_, chat_id, user_id);
+  erase_from(chats_, user_id, chat_id);
+}
+
+void ChatMembership::removeChat(npchat::ChatId chat_id) {
+  std::unique_lock lock(mutex_);
+  auto it = participants_.find(chat_id);
+  if (it == participants_.end()) return;
+
+  for (auto user_id : *it->second) {
+    erase_from(chats_, user_id, chat_id);
+  }
+  participants_.erase(it);
+}
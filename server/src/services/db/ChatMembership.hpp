@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include "Database.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Authoritative in-memory index of chat membership.
+//
+// Loaded from chat_participants at startup and kept up to date by ChatService,
+// which writes through it after every membership change it commits. Both
+// directions are indexed: chat -> participants and user -> chats. Each list is
+// a sorted, immutable snapshot that is replaced on change, so lookups are a
+// shared lock plus a binary search, and callers may keep a snapshot around
+// without holding any lock.
+class ChatMembership {
+public:
+  using Participants = std::vector<std::uint32_t>; // sorted user ids
+  using Chats = std::vector<npchat::ChatId>;       // sorted chat ids
+
+private:
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<npchat::ChatId, std::shared_ptr<const Participants>> participants_;
+  std::unordered_map<std::uint32_t, std::shared_ptr<const Chats>> chats_;
+
+  template <typename Map, typename Value>
+  static void insert_into(Map& map, typename Map::key_type key, Value value);
+  template <typename Map, typename Value>
+  static void erase_from(Map& map, typename Map::key_type key, Value value);
+
+public:
+  explicit ChatMembership(const std::shared_ptr<Database>& database);
+
+  bool isParticipant(npchat::ChatId chat_id, std::uint32_t user_id) const;
+
+  // Snapshot of a chat's participants; empty if the chat doesn't exist
+  std::shared_ptr<const Participants> participants(npchat::ChatId chat_id) const;
+
+  // Snapshot of the chats a user participates in
+  std::shared_ptr<const Chats> chatsOf(std::uint32_t user_id) const;
+
+  std::size_t chatCount() const;
+
+  // Write-through updates, called after the change is committed
+  void add(npchat::ChatId chat_id, std::span<const std::uint32_t> user_ids);
+  void remove(npchat::ChatId chat_id, std::uint32_t user_id);
+  void removeChat(npchat::ChatId chat_id);
+};
@@ -1,33 +1,54 @@
 #include "ChatService.hpp"
 
-ChatService::ChatService(const std::shared_ptr<Database>& database)
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace {
+// Read-only queries, prepared on every reader connection on first use
+constexpr std::string_view get_message_by_id_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       u.username, a.type, a.name, a.size "
+  "FROM messages m "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE m.id = ?";
+
+// A range scan of idx_chat_participants_recent, already in display order
+constexpr std::string_view get_user_chats_details_sql =
+  "SELECT s.chat_id, s.created_by, s.created_at, s.participant_count, s.last_message_time, "
+  "       (s.created_by = ?1) as can_delete, cp.unread_count "
+  "FROM chat_participants cp "
+  "JOIN chat_summary s ON s.chat_id = cp.chat_id "
+  "WHERE cp.user_id = ?1 "
+  "ORDER BY cp.last_message_time DESC";
+
+constexpr std::string_view get_chat_creator_sql =
+  "SELECT created_by FROM chats WHERE id = ?";
+
+// Message ids grow with time, so the newest last message is the most recent activity
+constexpr std::string_view get_recent_chats_sql =
+  "SELECT chat_id FROM chat_summary WHERE last_message_id IS NOT NULL ORDER BY last_message_id DESC LIMIT ?";
+
+} // namespace
+
+ChatService::ChatService(const std::shared_ptr<Database>& database,
+                         const std::shared_ptr<MessageStore>& store,
+                         const std::shared_ptr<MessageArchive>& archive,
+                         const std::shared_ptr<BlobStore>& blobs,
+                         const std::shared_ptr<ChatMembership>& membership,
+                         const std::shared_ptr<ChatTailCache>& tail,
+                         const std::shared_ptr<UploadService>& uploads)
   : db_(database)
+  , store_(store)
+  , archive_(archive)
+  , blobs_(blobs)
+  , membership_(membership)
+  , tail_(tail)
+  , uploads_(uploads)
+  , lock_wait_(metrics::lock_wait("ChatService"))
 {
-  insert_message_stmt_ = db_->prepareStatement(
-    "INSERT INTO messages (chat_id, sender_id, content, timestamp, attachment_id) "
-    "VALUES (?, ?, ?, strftime('%s', 'now'), ?)");
-
-  get_messages_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "WHERE m.chat_id = ? ORDER BY m.timestamp ASC LIMIT ? OFFSET ?");
-
-  get_message_by_id_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       u.username, a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "WHERE m.id = ?");
-
-  mark_delivered_stmt_ = db_->prepareStatement(
-    "INSERT OR IGNORE INTO message_delivery (message_id, user_id, delivered_at) VALUES (?, ?, ?)");
-
-  get_chat_participants_stmt_ = db_->prepareStatement(
-    "SELECT user_id FROM chat_participants WHERE chat_id = ?");
+  moveInlineAttachments();
 
   create_chat_stmt_ = db_->prepareStatement(
     "INSERT INTO chats (created_by, created_at) VALUES (?, ?)");
@@ -35,36 +56,6 @@ ChatService::ChatService(const std::shared_ptr<Database>& database)
   add_participant_stmt_ = db_->prepareStatement(
     "INSERT INTO chat_participants (chat_id, user_id, joined_at) VALUES (?, ?, ?)");
 
-  get_user_chats_stmt_ = db_->prepareStatement(
-    "SELECT DISTINCT c.id, c.created_by, c.created_at "
-    "FROM chats c "
-    "JOIN chat_participants cp ON c.id = cp.chat_id "
-    "WHERE cp.user_id = ?");
-
-  insert_attachment_stmt_ = db_->prepareStatement(
-    "INSERT INTO attachments (type, name, data) VALUES (?, ?, ?)");
-
-  get_attachment_stmt_ = db_->prepareStatement(
-    "SELECT type, name, data FROM attachments WHERE id = ?");
-
-  find_existing_chat_stmt_ = db_->prepareStatement(
-    "SELECT c.id FROM chats c "
-    "JOIN chat_participants cp1 ON c.id = cp1.chat_id "
-    "JOIN chat_participants cp2 ON c.id = cp2.chat_id "
-    "WHERE cp1.user_id = ? AND cp2.user_id = ? AND cp1.user_id != cp2.user_id "
-    "AND (SELECT COUNT(*) FROM chat_participants cp WHERE cp.chat_id = c.id) = 2 "
-    "LIMIT 1");
-
-  get_user_chats_details_stmt_ = db_->prepareStatement(
-    "SELECT DISTINCT c.id, c.created_by, c.created_at, "
-  "       (SELECT COUNT(*) FROM chat_participants cp WHERE cp.chat_id = c.id) as participant_count, "
-  "       (SELECT MAX(m.timestamp) FROM messages m WHERE m.chat_id = c.id) as last_message_time, "
-  "       (c.created_by = ?) as can_delete "
-    "FROM chats c "
-    "JOIN chat_participants cp ON c.id = cp.chat_id "
-    "WHERE cp.user_id = ? "
-    "ORDER BY last_message_time DESC NULLS LAST");
-
   remove_participant_stmt_ = db_->prepareStatement(
     "DELETE FROM chat_participants WHERE chat_id = ? AND user_id = ?");
 
@@ -76,25 +67,75 @@ ChatService::ChatService(const std::shared_ptr<Database>& database)
 }
 
 ChatService::~ChatService() {
-  sqlite3_finalize(insert_message_stmt_);
-  sqlite3_finalize(get_messages_stmt_);
-  sqlite3_finalize(get_message_by_id_stmt_);
-  sqlite3_finalize(mark_delivered_stmt_);
-  sqlite3_finalize(get_chat_participants_stmt_);
   sqlite3_finalize(create_chat_stmt_);
   sqlite3_finalize(add_participant_stmt_);
-  sqlite3_finalize(get_user_chats_stmt_);
-  sqlite3_finalize(insert_attachment_stmt_);
-  sqlite3_finalize(get_attachment_stmt_);
-  sqlite3_finalize(find_existing_chat_stmt_);
-  sqlite3_finalize(get_user_chats_details_stmt_);
   sqlite3_finalize(remove_participant_stmt_);
   sqlite3_finalize(delete_chat_stmt_);
   sqlite3_finalize(delete_chat_messages_stmt_);
 }
 
+void ChatService::moveInlineAttachments() {
+  std::vector<std::uint32_t> legacy_ids;
+  {
+    auto stmt = db_->prepareStatement("SELECT id FROM inline_attachments");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      legacy_ids.push_back(sqlite3_column_int(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  if (legacy_ids.empty()) return;
+
+  spdlog::info("[ChatService] Moving {} inline attachments to the blob store", legacy_ids.size());
+
+  auto select_stmt = db_->prepareStatement("SELECT data FROM attachments WHERE id = ?");
+  auto update_stmt = db_->prepareStatement(
+    "UPDATE attachments SET hash = ?, size = ?, data = x'' WHERE id = ?");
+  auto done_stmt = db_->prepareStatement("DELETE FROM inline_attachments WHERE id = ?");
+
+  // One row at a time, so the content of only one attachment is in memory
+  for (auto id : legacy_ids) {
+    // The attachment is gone, or moved and taken off the list
+    auto done = [&] {
+      sqlite3_bind_int(done_stmt, 1, id);
+      if (sqlite3_step(done_stmt) != SQLITE_DONE) {
+        spdlog::error("[ChatService] Failed to record moved attachment {}: {}", id, sqlite3_errmsg(db_->getConnection()));
+      }
+      sqlite3_reset(done_stmt);
+    };
+
+    sqlite3_bind_int(select_stmt, 1, id);
+    if (sqlite3_step(select_stmt) != SQLITE_ROW) {
+      sqlite3_reset(select_stmt);
+      done();
+      continue;
+    }
+
+    auto data = static_cast<const std::uint8_t*>(sqlite3_column_blob(select_stmt, 0));
+    auto size = static_cast<std::size_t>(sqlite3_column_bytes(select_stmt, 0));
+    auto hash = blobs_->put({data, size});
+    sqlite3_reset(select_stmt);
+
+    sqlite3_bind_text(update_stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(update_stmt, 2, static_cast<sqlite3_int64>(size));
+    sqlite3_bind_int(update_stmt, 3, id);
+    if (sqlite3_step(update_stmt) == SQLITE_DONE) {
+      sqlite3_reset(update_stmt);
+      done();
+    } else {
+      // Stays on the list for the next start
+      spdlog::error("[ChatService] Failed to move attachment {}: {}", id, sqlite3_errmsg(db_->getConnection()));
+      sqlite3_reset(update_stmt);
+    }
+  }
+
+  sqlite3_finalize(select_stmt);
+  sqlite3_finalize(update_stmt);
+  sqlite3_finalize(done_stmt);
+}
+
 std::uint32_t ChatService::createChat(std::uint32_t creator_id, const std::vector<std::uint32_t>& participant_ids) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
     std::chrono::system_clock::now().time_since_epoch()).count();
@@ -111,266 +152,376 @@ std::uint32_t ChatService::createChat(std::uint32_t creator_id, const std::vecto
   std::uint32_t chat_id = static_cast<std::uint32_t>(sqlite3_last_insert_rowid(db_->getConnection()));
   sqlite3_reset(create_chat_stmt_);
 
-  // Add creator as participant
-  sqlite3_bind_int(add_participant_stmt_, 1, chat_id);
-  sqlite3_bind_int(add_participant_stmt_, 2, creator_id);
-  sqlite3_bind_int64(add_participant_stmt_, 3, timestamp);
-  sqlite3_step(add_participant_stmt_);
-  sqlite3_reset(add_participant_stmt_);
-
-  // Add other participants
-  for (std::uint32_t participant_id : participant_ids) {
-    if (participant_id != creator_id) {
-      sqlite3_bind_int(add_participant_stmt_, 1, chat_id);
-      sqlite3_bind_int(add_participant_stmt_, 2, participant_id);
-      sqlite3_bind_int64(add_participant_stmt_, 3, timestamp);
-      sqlite3_step(add_participant_stmt_);
-      sqlite3_reset(add_participant_stmt_);
-    }
+  auto add_participant = [&](std::uint32_t user_id) {
+    sqlite3_bind_int(add_participant_stmt_, 1, chat_id);
+    sqlite3_bind_int(add_participant_stmt_, 2, user_id);
+    sqlite3_bind_int64(add_participant_stmt_, 3, timestamp);
+    bool added = sqlite3_step(add_participant_stmt_) == SQLITE_DONE;
+    sqlite3_reset(add_participant_stmt_);
+    return added;
+  };
+
+  // A chat its creator isn't in is removed again
+  if (!add_participant(creator_id)) {
+    spdlog::error("[ChatService] Failed to add the creator of chat {}: {}", chat_id, sqlite3_errmsg(db_->getConnection()));
+    sqlite3_bind_int(delete_chat_stmt_, 1, chat_id);
+    sqlite3_step(delete_chat_stmt_);
+    sqlite3_reset(delete_chat_stmt_);
+    throw std::runtime_error("Failed to create chat");
   }
 
-  // Update cache
-  std::vector<std::uint32_t> participants;
-  participants.push_back(creator_id);
-  for (auto id : participant_ids) {
-    if (id != creator_id) {
-      participants.push_back(id);
+  // The membership index only gets the rows that were stored; an unknown or repeated id is skipped
+  std::vector<std::uint32_t> participants{creator_id};
+  for (std::uint32_t participant_id : participant_ids) {
+    if (participant_id == creator_id) continue;
+    if (add_participant(participant_id)) {
+      participants.push_back(participant_id);
+    } else {
+      spdlog::warn("[ChatService] User {} not added to chat {}: {}", participant_id, chat_id,
+                   sqlite3_errmsg(db_->getConnection()));
     }
   }
-  chat_participants_cache_[chat_id] = std::move(participants);
+  membership_->add(chat_id, participants);
 
   return chat_id;
 }
 
-npchat::MessageId ChatService::sendMessage(std::uint32_t sender_id, npchat::ChatId chat_id, const npchat::ChatMessageContent& content) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
-
+npchat::ChatMessage ChatService::sendMessage(std::uint32_t sender_id, npchat::ChatId chat_id, const npchat::ChatMessageContent& content) {
   // Verify sender is participant
-  auto participants = getChatParticipants(chat_id);
-  if (std::find(participants.begin(), participants.end(), sender_id) == participants.end()) {
+  if (!membership_->isParticipant(chat_id, sender_id)) {
     throw std::runtime_error("User is not a participant in this chat");
   }
 
-  std::uint32_t attachment_id = 0;
-
-  // Handle attachment if present
+  npchat::ChatMessage message {
+    .senderId = sender_id,
+    .chatId = chat_id,
+    .timestamp = static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count()),
+    .content = {.text = content.text}
+  };
+
+  MessageStore::NewMessage row {
+    .sender_id = sender_id,
+    .chat_id = chat_id,
+    .text = content.text,
+    .timestamp = message.timestamp
+  };
+
+  // The content goes to the blob store before the rows are queued, and the hold keeps
+  // UploadService from removing it until the row refers to it. Uploaded content whose
+  // message fails to insert is discarded again.
+  BlobStore::Hold hold;
+  std::optional<UploadService::Committed> upload;
+  std::string attachment_hash;
   if (content.attachment.has_value()) {
     const auto& attachment = content.attachment.value();
-
-    sqlite3_bind_int(insert_attachment_stmt_, 1, static_cast<int>(attachment.type));
-    sqlite3_bind_text(insert_attachment_stmt_, 2, attachment.name.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_blob(insert_attachment_stmt_, 3, attachment.data.data(), attachment.data.size(), SQLITE_STATIC);
-
-    if (sqlite3_step(insert_attachment_stmt_) == SQLITE_DONE) {
-      attachment_id = static_cast<std::uint32_t>(sqlite3_last_insert_rowid(db_->getConnection()));
+    if (attachment.upload != 0) {
+      // Already in the blob store, written chunk by chunk
+      if (!attachment.data.empty()) {
+        throw std::runtime_error("Attachment has both inline data and an upload");
+      }
+      hold = blobs_->hold();
+      upload = uploads_->take(sender_id, attachment.upload);
+      if (!upload) {
+        throw std::runtime_error("Attachment upload is missing or not committed");
+      }
+      attachment_hash = upload->hash;
+      row.attachment_size = upload->size;
+    } else {
+      // Larger content has to be uploaded in chunks, so one request can't pin a huge buffer
+      if (attachment.data.size() > UploadService::max_chunk) {
+        throw std::runtime_error("Attachment is too large to send inline");
+      }
+      hold = blobs_->hold();
+      attachment_hash = blobs_->put(attachment.data);
+      row.attachment_size = attachment.data.size();
     }
-    sqlite3_reset(insert_attachment_stmt_);
-  }
 
-  // Insert message
-  sqlite3_bind_int(insert_message_stmt_, 1, chat_id);
-  sqlite3_bind_int(insert_message_stmt_, 2, sender_id);
-  sqlite3_bind_text(insert_message_stmt_, 3, content.text.c_str(), -1, SQLITE_STATIC);
-  if (attachment_id > 0) {
-    sqlite3_bind_int(insert_message_stmt_, 5, attachment_id);
-  } else {
-    sqlite3_bind_null(insert_message_stmt_, 5);
+    row.has_attachment = true;
+    row.attachment_type = attachment.type;
+    row.attachment_name = attachment.name;
+    row.attachment_hash = attachment_hash;
   }
 
-  if (sqlite3_step(insert_message_stmt_) != SQLITE_DONE) {
-    sqlite3_reset(insert_message_stmt_);
-    throw std::runtime_error("Failed to send message");
+  // The attachment and message rows are committed together with other sessions' inserts.
+  // Don't hold mutex_ while waiting for the group commit.
+  MessageStore::InsertedMessage inserted;
+  try {
+    inserted = store_->insertMessage(row).get();
+  } catch (...) {
+    if (hold) hold.unlock();
+    if (upload) uploads_->discard(*upload);
+    throw;
   }
+  if (hold) hold.unlock();
 
-  npchat::MessageId message_id = static_cast<npchat::MessageId>(sqlite3_last_insert_rowid(db_->getConnection()));
-  sqlite3_reset(insert_message_stmt_);
+  message.messageId = inserted.message_id;
+  if (content.attachment.has_value()) {
+    message.content.attachment = npchat::ChatAttachment {
+      .type = content.attachment->type,
+      .name = content.attachment->name,
+      .id = inserted.attachment_id,
+      .size = static_cast<std::uint32_t>(row.attachment_size)
+    };
+  }
 
-  return message_id;
+  tail_->append(message);
+  return message;
 }
 
 std::vector<npchat::ChatMessage> ChatService::getMessages(npchat::ChatId chat_id, std::uint32_t limit, std::uint32_t offset) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
-
-  std::vector<npchat::ChatMessage> messages;
-
-  sqlite3_bind_int(get_messages_stmt_, 1, chat_id);
-  sqlite3_bind_int(get_messages_stmt_, 2, limit);
-  sqlite3_bind_int(get_messages_stmt_, 3, offset);
+  limit = std::clamp<std::uint32_t>(limit, 1, max_history_messages);
+  if (auto messages = tail_->findOldest(chat_id, limit, offset)) {
+    return std::move(*messages);
+  }
+  return store_->getMessages(chat_id, limit, offset);
+}
 
-  while (sqlite3_step(get_messages_stmt_) == SQLITE_ROW) {
-    npchat::ChatMessage msg;
-    msg.messageId = sqlite3_column_int(get_messages_stmt_, 0);
-    msg.chatId = sqlite3_column_int(get_messages_stmt_, 1);
-    msg.senderId = sqlite3_column_int(get_messages_stmt_, 2);
-    // Safely handle text content
-    const char* content_text = reinterpret_cast<const char*>(sqlite3_column_text(get_messages_stmt_, 3));
-    msg.content.text = content_text ? content_text : "";
-    msg.timestamp = sqlite3_column_int64(get_messages_stmt_, 4);
+std::vector<npchat::ChatMessage> ChatService::getMessagesBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                                std::uint32_t limit) {
+  limit = std::clamp<std::uint32_t>(limit, 1, max_history_messages);
+  if (auto messages = tail_->findBefore(chat_id, before_message_id, limit)) {
+    return std::move(*messages);
+  }
 
-    // Handle attachment if present
-    if (sqlite3_column_type(get_messages_stmt_, 5) != SQLITE_NULL) {
-      npchat::ChatAttachment attachment;
-      attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(get_messages_stmt_, 6));
-
-      // Safely handle attachment name
-      const char* attachment_name = reinterpret_cast<const char*>(sqlite3_column_text(get_messages_stmt_, 7));
-      attachment.name = attachment_name ? attachment_name : "";
-
-      // Safely handle blob data
-      const void* blob_data = sqlite3_column_blob(get_messages_stmt_, 8);
-      int blob_size = sqlite3_column_bytes(get_messages_stmt_, 8);
-      if (blob_data && blob_size > 0) {
-        attachment.data.assign(
-          static_cast<const std::uint8_t*>(blob_data),
-          static_cast<const std::uint8_t*>(blob_data) + blob_size
-        );
-      }
+  // Opening a chat (re)loads its tail; pages further back go to the store
+  const auto tail_size = tail_->options().messages_per_chat;
+  if (before_message_id != 0 || limit > tail_size) {
+    return store_->getMessagesBefore(chat_id, before_message_id, limit);
+  }
 
-      msg.content.attachment = attachment;
-    }
+  auto ticket = tail_->beginLoad(chat_id);
+  auto messages = store_->getMessagesBefore(chat_id, 0, static_cast<std::uint32_t>(tail_size));
+  tail_->completeLoad(chat_id, ticket, messages);
 
-    messages.push_back(std::move(msg));
+  if (messages.size() > limit) {
+    messages.erase(messages.begin(), messages.end() - limit);
   }
-
-  sqlite3_reset(get_messages_stmt_);
   return messages;
 }
 
 std::optional<npchat::ChatMessage> ChatService::getMessageById(npchat::MessageId message_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_message_by_id_sql);
 
-  sqlite3_bind_int(get_message_by_id_stmt_, 1, message_id);
+  sqlite3_bind_int(stmt, 1, message_id);
 
-  if (sqlite3_step(get_message_by_id_stmt_) == SQLITE_ROW) {
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::ChatMessage msg;
-    msg.messageId = sqlite3_column_int(get_message_by_id_stmt_, 0);
-    msg.chatId = sqlite3_column_int(get_message_by_id_stmt_, 1);
-    msg.content.text = reinterpret_cast<const char*>(sqlite3_column_text(get_message_by_id_stmt_, 3));
-    msg.timestamp = sqlite3_column_int64(get_message_by_id_stmt_, 4);
+    msg.messageId = sqlite3_column_int(stmt, 0);
+    msg.chatId = sqlite3_column_int(stmt, 1);
+    msg.senderId = sqlite3_column_int(stmt, 2);
+    msg.content.text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+    msg.timestamp = sqlite3_column_int64(stmt, 4);
 
     // Handle attachment if present
-    if (sqlite3_column_type(get_message_by_id_stmt_, 6) != SQLITE_NULL) {
+    if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
       npchat::ChatAttachment attachment;
-      attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(get_message_by_id_stmt_, 7));
-      attachment.name = reinterpret_cast<const char*>(sqlite3_column_text(get_message_by_id_stmt_, 8));
-
-      const void* blob_data = sqlite3_column_blob(get_message_by_id_stmt_, 9);
-      int blob_size = sqlite3_column_bytes(get_message_by_id_stmt_, 9);
-      attachment.data.assign(
-        static_cast<const std::uint8_t*>(blob_data),
-        static_cast<const std::uint8_t*>(blob_data) + blob_size
-      );
+      attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(stmt, 7));
+      attachment.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 8));
+      attachment.id = sqlite3_column_int(stmt, 5);
+      attachment.size = static_cast<std::uint32_t>(sqlite3_column_int64(stmt, 9));
 
       msg.content.attachment = attachment;
     }
 
-    sqlite3_reset(get_message_by_id_stmt_);
+    sqlite3_reset(stmt);
     return msg;
   }
 
-  sqlite3_reset(get_message_by_id_stmt_);
+  sqlite3_reset(stmt);
   return std::nullopt;
 }
 
-void ChatService::markMessageDelivered(npchat::MessageId message_id, std::uint32_t user_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+npchat::bytestream ChatService::readAttachment(std::uint32_t user_id, npchat::AttachmentId attachment_id,
+                                              std::uint32_t offset, std::uint32_t length) {
+  // Only attachments of messages in chats the user participates in
+  auto ref = store_->findAttachment(attachment_id);
+  if (!ref || ref->hash.empty() || !membership_->isParticipant(ref->chat_id, user_id)) {
+    throw std::runtime_error("Attachment not found");
+  }
 
-  std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
-    std::chrono::system_clock::now().time_since_epoch()).count();
+  const auto& hash = ref->hash;
+  auto blob = blobs_->open(hash);
+  if (!blob) {
+    spdlog::error("[ChatService] Content of attachment {} is missing from the blob store", attachment_id);
+    throw std::runtime_error("Attachment not found");
+  }
 
-  sqlite3_bind_int(mark_delivered_stmt_, 1, message_id);
-  sqlite3_bind_int(mark_delivered_stmt_, 2, user_id);
-  sqlite3_bind_int64(mark_delivered_stmt_, 3, timestamp);
+  auto bytes = blob->bytes();
+  if (offset >= bytes.size()) {
+    return {};
+  }
 
-  sqlite3_step(mark_delivered_stmt_);
-  sqlite3_reset(mark_delivered_stmt_);
+  auto chunk = bytes.subspan(offset, std::min<std::size_t>({length, max_attachment_chunk, bytes.size() - offset}));
+  return npchat::bytestream(chunk.begin(), chunk.end());
 }
 
-std::vector<std::uint32_t> ChatService::getChatParticipants(npchat::ChatId chat_id) {
-  // Check cache first
-  auto it = chat_participants_cache_.find(chat_id);
-  if (it != chat_participants_cache_.end()) {
-    return it->second;
-  }
+void ChatService::markMessageDelivered(npchat::MessageId message_id, std::uint32_t user_id) {
+  store_->ackDelivery(message_id, user_id);
+}
 
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+std::vector<std::uint32_t> ChatService::getChatParticipants(npchat::ChatId chat_id) {
+  return *membership_->participants(chat_id);
+}
 
-  std::vector<std::uint32_t> participants;
+bool ChatService::isParticipant(npchat::ChatId chat_id, std::uint32_t user_id) const {
+  return membership_->isParticipant(chat_id, user_id);
+}
 
-  sqlite3_bind_int(get_chat_participants_stmt_, 1, chat_id);
+void ChatService::addParticipant(std::uint32_t requesting_user_id, npchat::ChatId chat_id, std::uint32_t participant_id) {
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
-  while (sqlite3_step(get_chat_participants_stmt_) == SQLITE_ROW) {
-    participants.push_back(sqlite3_column_int(get_chat_participants_stmt_, 0));
+  if (!membership_->isParticipant(chat_id, requesting_user_id)) {
+    throw std::runtime_error("User is not a participant in this chat");
+  }
+  if (getChatCreator(chat_id) != requesting_user_id) {
+    throw std::runtime_error("Only chat creator can add participants");
+  }
+  if (membership_->isParticipant(chat_id, participant_id)) {
+    throw std::runtime_error("User is already a participant in this chat");
   }
 
-  sqlite3_reset(get_chat_participants_stmt_);
-
-  // Update cache
-  chat_participants_cache_[chat_id] = participants;
-
-  return participants;
-}
-
-std::vector<npchat::ChatId> ChatService::getUserChats(std::uint32_t user_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
 
-  std::vector<npchat::ChatId> chats;
+  sqlite3_bind_int(add_participant_stmt_, 1, chat_id);
+  sqlite3_bind_int(add_participant_stmt_, 2, participant_id);
+  sqlite3_bind_int64(add_participant_stmt_, 3, timestamp);
 
-  sqlite3_bind_int(get_user_chats_stmt_, 1, user_id);
+  // Fails on the users foreign key if the user doesn't exist
+  bool success = sqlite3_step(add_participant_stmt_) == SQLITE_DONE;
+  sqlite3_reset(add_participant_stmt_);
 
-  while (sqlite3_step(get_user_chats_stmt_) == SQLITE_ROW) {
-    chats.push_back(sqlite3_column_int(get_user_chats_stmt_, 0));
+  if (!success) {
+    spdlog::warn("[ChatService] Failed to add participant {} to chat {}: {}",
+                 participant_id, chat_id, sqlite3_errmsg(db_->getConnection()));
+    throw std::runtime_error("User not found");
   }
 
-  sqlite3_reset(get_user_chats_stmt_);
-  return chats;
+  std::uint32_t added[] = {participant_id};
+  membership_->add(chat_id, added);
+}
+
+std::vector<npchat::ChatId> ChatService::getUserChats(std::uint32_t user_id) {
+  return *membership_->chatsOf(user_id);
 }
 
 npchat::ChatList ChatService::getUserChatsWithDetails(std::uint32_t user_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_user_chats_details_sql);
 
   npchat::ChatList chats;
 
-  // Bind user_id for the can_delete computed column (c.created_by = ?) and for the WHERE clause
-  sqlite3_bind_int(get_user_chats_details_stmt_, 1, user_id);
-  sqlite3_bind_int(get_user_chats_details_stmt_, 2, user_id);
-  while (sqlite3_step(get_user_chats_details_stmt_) == SQLITE_ROW) {
+  sqlite3_bind_int(stmt, 1, user_id);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::Chat chat;
-    chat.id = sqlite3_column_int(get_user_chats_details_stmt_, 0);
-    chat.createdBy = sqlite3_column_int(get_user_chats_details_stmt_, 1);
-    chat.createdAt = sqlite3_column_int(get_user_chats_details_stmt_, 2);
-    chat.participantCount = sqlite3_column_int(get_user_chats_details_stmt_, 3);
+    chat.id = sqlite3_column_int(stmt, 0);
+    chat.createdBy = sqlite3_column_int(stmt, 1);
+    chat.createdAt = sqlite3_column_int(stmt, 2);
+    chat.participantCount = sqlite3_column_int(stmt, 3);
 
     // Handle optional last message time
-    if (sqlite3_column_type(get_user_chats_details_stmt_, 4) != SQLITE_NULL) {
-      chat.lastMessageTime = sqlite3_column_int(get_user_chats_details_stmt_, 4);
+    if (sqlite3_column_type(stmt, 4) != SQLITE_NULL) {
+      chat.lastMessageTime = sqlite3_column_int(stmt, 4);
     }
 
     // can_delete computed column (1 or 0) - IDL requires this field, set explicitly
-    chat.canDelete = (sqlite3_column_int(get_user_chats_details_stmt_, 5) != 0);
+    chat.canDelete = (sqlite3_column_int(stmt, 5) != 0);
+    chat.unreadCount = sqlite3_column_int(stmt, 6);
 
     chats.push_back(std::move(chat));
   }
 
-  sqlite3_reset(get_user_chats_details_stmt_);
+  sqlite3_reset(stmt);
   return chats;
 }
 
-// Find existing chat between two users, or create a new one
-npchat::ChatId ChatService::findOrCreateChatBetween(std::uint32_t user1_id, std::uint32_t user2_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+std::vector<npchat::ChatPreview> ChatService::getUserChatsWithPreview(std::uint32_t user_id, std::uint32_t limit_per_chat) {
+  limit_per_chat = std::min(limit_per_chat, max_preview_messages);
+
+  std::vector<npchat::ChatPreview> previews;
+  auto chats = getUserChatsWithDetails(user_id);
+  previews.reserve(chats.size());
 
-  // First, try to find existing chat between these two users
-  sqlite3_bind_int(find_existing_chat_stmt_, 1, user1_id);
-  sqlite3_bind_int(find_existing_chat_stmt_, 2, user2_id);
+  std::vector<npchat::ChatId> misses;
+  for (auto& chat : chats) {
+    auto& preview = previews.emplace_back();
+    preview.chat = std::move(chat);
+    if (limit_per_chat == 0) continue;
 
-  if (sqlite3_step(find_existing_chat_stmt_) == SQLITE_ROW) {
-    npchat::ChatId existing_chat_id = sqlite3_column_int(find_existing_chat_stmt_, 0);
-    sqlite3_reset(find_existing_chat_stmt_);
-    return existing_chat_id;
+    if (auto messages = tail_->findBefore(preview.chat.id, 0, limit_per_chat)) {
+      preview.messages = std::move(*messages);
+    } else {
+      misses.push_back(preview.chat.id);
+    }
+  }
+  if (misses.empty()) return previews;
+
+  // The rows come by chat id; previews are in chat list order
+  auto messages = store_->getLatestMessages(misses, limit_per_chat);
+  std::unordered_map<npchat::ChatId, npchat::ChatPreview*> by_id;
+  by_id.reserve(misses.size());
+  for (auto& preview : previews) by_id.emplace(preview.chat.id, &preview);
+  for (auto& message : messages) {
+    if (auto it = by_id.find(message.chatId); it != by_id.end()) {
+      it->second->messages.push_back(std::move(message));
+    }
+  }
+  return previews;
+}
+
+std::size_t ChatService::warmTailCache(std::size_t chat_count, std::size_t threads) {
+  std::vector<npchat::ChatId> chats;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_recent_chats_sql);
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(chat_count));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      chats.push_back(sqlite3_column_int(stmt, 0));
+    }
+    sqlite3_reset(stmt);
   }
 
-  sqlite3_reset(find_existing_chat_stmt_);
+  // Each newest page fills the chat's tail, as opening the chat would
+  const auto limit = static_cast<std::uint32_t>(tail_->options().messages_per_chat);
+  std::atomic<std::size_t> next{0};
+  auto load = [&] {
+    for (auto i = next++; i < chats.size(); i = next++) {
+      getMessagesBefore(chats[i], 0, limit);
+    }
+  };
+
+  std::vector<std::jthread> workers;
+  threads = std::clamp<std::size_t>(threads, 1, std::max<std::size_t>(1, db_->readerCount()));
+  for (std::size_t i = 1; i < threads; ++i) workers.emplace_back(load);
+  load();
+  workers.clear();
+
+  return chats.size();
+}
+
+// Find existing chat between two users, or create a new one
+npchat::ChatId ChatService::findOrCreateChatBetween(std::uint32_t user1_id, std::uint32_t user2_id) {
+  metrics::TimedLock lock(mutex_, lock_wait_);
+
+  // First, try to find an existing private chat between these two users
+  if (user1_id != user2_id) {
+    auto chats1 = membership_->chatsOf(user1_id);
+    auto chats2 = membership_->chatsOf(user2_id);
+    // Both lists are sorted, so walk them together
+    auto it1 = chats1->begin(), it2 = chats2->begin();
+    while (it1 != chats1->end() && it2 != chats2->end()) {
+      if (*it1 < *it2) {
+        ++it1;
+      } else if (*it2 < *it1) {
+        ++it2;
+      } else {
+        if (membership_->participants(*it1)->size() == 2) return *it1;
+        ++it1, ++it2;
+      }
+    }
+  }
 
   // No existing chat found, create a new one
   std::vector<std::uint32_t> participants = {user2_id};
@@ -379,30 +530,14 @@ npchat::ChatId ChatService::findOrCreateChatBetween(std::uint32_t user1_id, std:
 
 // Remove a participant from a chat
 bool ChatService::removeParticipant(std::uint32_t requesting_user_id, npchat::ChatId chat_id, std::uint32_t participant_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
-
-  // Get chat info to check creator
-  sqlite3_bind_int(get_user_chats_details_stmt_, 1, requesting_user_id);
-
-  bool is_chat_creator = false;
-  bool is_participant = false;
-  std::uint32_t chat_creator_id = 0;
-
-  while (sqlite3_step(get_user_chats_details_stmt_) == SQLITE_ROW) {
-    std::uint32_t current_chat_id = sqlite3_column_int(get_user_chats_details_stmt_, 0);
-    if (current_chat_id == chat_id) {
-      chat_creator_id = sqlite3_column_int(get_user_chats_details_stmt_, 1);
-      is_chat_creator = (chat_creator_id == requesting_user_id);
-      is_participant = true;
-      break;
-    }
-  }
-  sqlite3_reset(get_user_chats_details_stmt_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
-  if (!is_participant) {
+  if (!membership_->isParticipant(chat_id, requesting_user_id)) {
     throw std::runtime_error("User is not a participant in this chat");
   }
 
+  bool is_chat_creator = getChatCreator(chat_id) == requesting_user_id;
+
   // Authorization check:
   // - Chat creator can remove anyone
   // - Any participant can remove themselves
@@ -418,16 +553,11 @@ bool ChatService::removeParticipant(std::uint32_t requesting_user_id, npchat::Ch
   sqlite3_reset(remove_participant_stmt_);
 
   if (success) {
-    // Update cache
-    auto it = chat_participants_cache_.find(chat_id);
-    if (it != chat_participants_cache_.end()) {
-      auto& participants = it->second;
-      participants.erase(std::remove(participants.begin(), participants.end(), participant_id), participants.end());
-
-      // If no participants left, delete the entire chat
-      if (participants.empty())
-        deleteChat(chat_id);
-    }
+    membership_->remove(chat_id, participant_id);
+
+    // If no participants left, delete the entire chat
+    if (membership_->participants(chat_id)->empty())
+      deleteChat(chat_id);
   }
 
   return success;
@@ -435,7 +565,7 @@ bool ChatService::removeParticipant(std::uint32_t requesting_user_id, npchat::Ch
 
 // Delete an entire chat (used when last participant leaves)
 bool ChatService::deleteChat(npchat::ChatId chat_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   // Delete all messages first (foreign key constraint)
   sqlite3_bind_int(delete_chat_messages_stmt_, 1, chat_id);
@@ -447,9 +577,11 @@ bool ChatService::deleteChat(npchat::ChatId chat_id) {
   bool success = (sqlite3_step(delete_chat_stmt_) == SQLITE_DONE);
   sqlite3_reset(delete_chat_stmt_);
 
+  tail_->invalidate(chat_id);
+
   if (success) {
-    // Remove from cache
-    chat_participants_cache_.erase(chat_id);
+    membership_->removeChat(chat_id);
+    archive_->deleteChat(chat_id);
   } else {
     spdlog::warn("[ChatService] Failed to execute DELETE: {}", sqlite3_errmsg(db_->getConnection()));
   }
@@ -459,28 +591,17 @@ bool ChatService::deleteChat(npchat::ChatId chat_id) {
 
 // Get chat creator ID
 std::uint32_t ChatService::getChatCreator(npchat::ChatId chat_id) {
-  std::lock_guard<std::recursive_mutex> lock(mutex_);
-
-  // We can reuse the get_user_chats_details_stmt but we need a specific query
-  // For now, let's use a simple approach by getting participants and checking the creator field
-  auto participants = getChatParticipants(chat_id);
-  if (participants.empty()) {
-    throw std::runtime_error("Chat not found or has no participants");
-  }
-
-  // Use the details query to get creator info
-  sqlite3_stmt* get_chat_creator_stmt = db_->prepareStatement(
-    "SELECT created_by FROM chats WHERE id = ?");
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_chat_creator_sql);
 
-  sqlite3_bind_int(get_chat_creator_stmt, 1, chat_id);
+  sqlite3_bind_int(stmt, 1, chat_id);
 
   std::uint32_t creator_id = 0;
-  if (sqlite3_step(get_chat_creator_stmt) == SQLITE_ROW) {
-    creator_id = sqlite3_column_int(get_chat_creator_stmt, 0);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    creator_id = sqlite3_column_int(stmt, 0);
   }
 
-  sqlite3_reset(get_chat_creator_stmt);
-  sqlite3_finalize(get_chat_creator_stmt);
+  sqlite3_reset(stmt);
 
   if (creator_id == 0) {
     throw std::runtime_error("Chat not found");
@@ -6,53 +6,89 @@
 #include <mutex>
 #include <sqlite3.h>
 #include <spdlog/spdlog.h>
+#include "BlobStore.hpp"
+#include "ChatMembership.hpp"
+#include "ChatTailCache.hpp"
 #include "Database.hpp"
+#include "MessageArchive.hpp"
+#include "services/metrics/Metrics.hpp"
+#include "MessageStore.hpp"
+#include "UploadService.hpp"
 #include "npchat_stub/npchat.hpp"
 
 class ChatService {
 private:
   std::shared_ptr<Database> db_;
+  std::shared_ptr<MessageStore> store_;
+  std::shared_ptr<MessageArchive> archive_;
+  std::shared_ptr<BlobStore> blobs_;
+  std::shared_ptr<ChatMembership> membership_;
+  std::shared_ptr<ChatTailCache> tail_;
+  std::shared_ptr<UploadService> uploads_;
   mutable std::recursive_mutex mutex_;
+  metrics::Histogram& lock_wait_; // Time spent waiting for mutex_
 
   // Prepared statements
-  sqlite3_stmt* insert_message_stmt_;
-  sqlite3_stmt* get_messages_stmt_;
-  sqlite3_stmt* get_message_by_id_stmt_;
-  sqlite3_stmt* mark_delivered_stmt_;
-  sqlite3_stmt* get_chat_participants_stmt_;
   sqlite3_stmt* create_chat_stmt_;
   sqlite3_stmt* add_participant_stmt_;
-  sqlite3_stmt* get_user_chats_stmt_;
-  sqlite3_stmt* insert_attachment_stmt_;
-  sqlite3_stmt* get_attachment_stmt_;
-  sqlite3_stmt* find_existing_chat_stmt_;
-  sqlite3_stmt* get_user_chats_details_stmt_;
   sqlite3_stmt* remove_participant_stmt_;
   sqlite3_stmt* delete_chat_stmt_;
   sqlite3_stmt* delete_chat_messages_stmt_;
 
-  std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> chat_participants_cache_;
+  // Moves the attachments listed in inline_attachments, written by older versions, out of SQLite
+  void moveInlineAttachments();
 
 public:
-  explicit ChatService(const std::shared_ptr<Database>& database);
+  // Upper bound on the length of one readAttachment() chunk
+  static constexpr std::uint32_t max_attachment_chunk = 1024 * 1024;
+  // Upper bound on the messages per chat of getUserChatsWithPreview()
+  static constexpr std::uint32_t max_preview_messages = 50;
+  // Upper bound on the messages of one getMessages() or getMessagesBefore() page
+  static constexpr std::uint32_t max_history_messages = 200;
+
+  ChatService(const std::shared_ptr<Database>& database,
+              const std::shared_ptr<MessageStore>& store,
+              const std::shared_ptr<MessageArchive>& archive,
+              const std::shared_ptr<BlobStore>& blobs,
+              const std::shared_ptr<ChatMembership>& membership,
+              const std::shared_ptr<ChatTailCache>& tail,
+              const std::shared_ptr<UploadService>& uploads);
   ~ChatService();
 
   // Create a new chat with participants
   std::uint32_t createChat(std::uint32_t creator_id, const std::vector<std::uint32_t>& participant_ids);
-  // Send a message in a chat
-  npchat::MessageId sendMessage(std::uint32_t sender_id, npchat::ChatId chat_id, const npchat::ChatMessageContent& content);
-  // Retrieve messages in a chat with pagination
+  // Send a message in a chat; returns the stored message, with the attachment referenced by id.
+  // The attachment content is either inline or a committed upload of the sender's.
+  npchat::ChatMessage sendMessage(std::uint32_t sender_id, npchat::ChatId chat_id, const npchat::ChatMessageContent& content);
+  // Retrieve messages in a chat with pagination; served from the tail cache for chats it holds whole
   std::vector<npchat::ChatMessage> getMessages(npchat::ChatId chat_id, std::uint32_t limit = 50, std::uint32_t offset = 0);
+  // Retrieve up to `limit` messages older than `before_message_id` (0 = newest), oldest first.
+  // Pages within the chat's cached tail don't touch the store.
+  std::vector<npchat::ChatMessage> getMessagesBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                     std::uint32_t limit = 50);
   // Get a message by its ID
   std::optional<npchat::ChatMessage> getMessageById(npchat::MessageId message_id);
-  // Mark a message as delivered to a user
+  // Read up to `length` bytes of an attachment visible to the user
+  npchat::bytestream readAttachment(std::uint32_t user_id, npchat::AttachmentId attachment_id,
+                                    std::uint32_t offset, std::uint32_t length);
+  // Mark a message as delivered to a user, removing it from their delivery queue
   void markMessageDelivered(npchat::MessageId message_id, std::uint32_t user_id);
-  // Get list of participant user IDs in a chat
+  // Get list of participant user IDs in a chat (sorted)
   std::vector<std::uint32_t> getChatParticipants(npchat::ChatId chat_id);
+  // Check membership without touching the database
+  bool isParticipant(npchat::ChatId chat_id, std::uint32_t user_id) const;
+  // Add a participant to an existing chat (chat creator only)
+  void addParticipant(std::uint32_t requesting_user_id, npchat::ChatId chat_id, std::uint32_t participant_id);
   // Get list of chat IDs a user is part of
   std::vector<npchat::ChatId> getUserChats(std::uint32_t user_id);
   // Get detailed chat info for a user
   npchat::ChatList getUserChatsWithDetails(std::uint32_t user_id);
+  // The chat list with the newest `limit_per_chat` messages of each chat, oldest first.
+  // Tails in the cache are copied, the other chats are read with one store query.
+  std::vector<npchat::ChatPreview> getUserChatsWithPreview(std::uint32_t user_id, std::uint32_t limit_per_chat);
+  // Loads the tails of the `chat_count` most recently active chats on up to `threads` threads,
+  // before clients connect; returns the number of chats
+  std::size_t warmTailCache(std::size_t chat_count, std::size_t threads);
   // Find existing chat between two users, or create a new one
   npchat::ChatId findOrCreateChatBetween(std::uint32_t user1_id, std::uint32_t user2_id);
   // Remove a participant from a chat
@@ -0,0 +1,160 @@
+#include "ChatTailCache.hpp"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+namespace {
+bool by_id(const npchat::ChatMessage& message, npchat::MessageId message_id) {
+  return message.messageId < message_id;
+}
+} // namespace
+
+ChatTailCache::ChatTailCache(Options options)
+  : options_(options)
+  , shard_budget_(options.memory_budget / std::max<std::size_t>(1, options.shard_count))
+{
+  auto shard_count = std::max<std::size_t>(1, options_.shard_count);
+  shards_.reserve(shard_count);
+  for (std::size_t i = 0; i < shard_count; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+
+  spdlog::info("Chat tail cache: {} shards of {} KiB, {} messages per chat",
+               shard_count, shard_budget_ / 1024, options_.messages_per_chat);
+}
+
+std::size_t ChatTailCache::size_of(const npchat::ChatMessage& message) noexcept {
+  std::size_t size = sizeof(npchat::ChatMessage) + message.content.text.size();
+  if (message.content.attachment) size += message.content.attachment->name.size();
+  return size;
+}
+
+void ChatTailCache::erase(Shard& shard, std::list<Entry>::iterator entry) {
+  shard.bytes -= entry->bytes;
+  shard.index.erase(entry->chat_id);
+  shard.lru.erase(entry);
+}
+
+void ChatTailCache::evict(Shard& shard) {
+  // The most recently used tail stays even if it alone is over budget
+  while (shard.bytes > shard_budget_ && shard.lru.size() > 1) {
+    erase(shard, std::prev(shard.lru.end()));
+  }
+}
+
+std::optional<std::vector<npchat::ChatMessage>> ChatTailCache::findBefore(npchat::ChatId chat_id,
+                                                                           npchat::MessageId before_message_id,
+                                                                           std::uint32_t limit) {
+  auto& shard = shard_for(chat_id);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.index.find(chat_id);
+  if (it == shard.index.end() || it->second->loading) return std::nullopt;
+
+  auto& entry = *it->second;
+  auto end = before_message_id
+    ? std::lower_bound(entry.messages.begin(), entry.messages.end(), before_message_id, by_id)
+    : entry.messages.end();
+  auto available = static_cast<std::size_t>(end - entry.messages.begin());
+
+  // Older messages than the tail has are in the store
+  if (available < limit && !entry.complete) return std::nullopt;
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return std::vector<npchat::ChatMessage>(end - std::min<std::size_t>(available, limit), end);
+}
+
+std::optional<std::vector<npchat::ChatMessage>> ChatTailCache::findOldest(npchat::ChatId chat_id, std::uint32_t limit,
+                                                                           std::uint32_t offset) {
+  auto& shard = shard_for(chat_id);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.index.find(chat_id);
+  if (it == shard.index.end() || it->second->loading || !it->second->complete) return std::nullopt;
+
+  auto& messages = it->second->messages;
+  auto begin = messages.begin() + std::min<std::size_t>(offset, messages.size());
+  auto end = begin + std::min<std::size_t>(limit, messages.end() - begin);
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return std::vector<npchat::ChatMessage>(begin, end);
+}
+
+ChatTailCache::Ticket ChatTailCache::beginLoad(npchat::ChatId chat_id) {
+  auto& shard = shard_for(chat_id);
+  std::lock_guard lock(shard.mutex);
+
+  auto ticket = shard.next_ticket++;
+  if (auto it = shard.index.find(chat_id); it != shard.index.end()) {
+    // Already cached, or another load is in flight; this one takes over
+    shard.bytes -= it->second->bytes;
+    it->second->messages.clear();
+    it->second->bytes = 0;
+    it->second->loading = ticket;
+    return ticket;
+  }
+
+  shard.lru.push_front(Entry{.chat_id = chat_id, .loading = ticket});
+  shard.index.emplace(chat_id, shard.lru.begin());
+  return ticket;
+}
+
+void ChatTailCache::completeLoad(npchat::ChatId chat_id, Ticket ticket, const std::vector<npchat::ChatMessage>& messages) {
+  auto& shard = shard_for(chat_id);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.index.find(chat_id);
+  if (it == shard.index.end() || it->second->loading != ticket) return;
+
+  auto& entry = *it->second;
+  auto first = messages.size() > options_.messages_per_chat ? messages.end() - options_.messages_per_chat : messages.begin();
+  entry.messages.assign(first, messages.end());
+  entry.complete = messages.size() < options_.messages_per_chat;
+  entry.loading = 0;
+  for (const auto& message : entry.messages) entry.bytes += size_of(message);
+
+  shard.bytes += entry.bytes;
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  evict(shard);
+}
+
+void ChatTailCache::append(const npchat::ChatMessage& message) {
+  auto& shard = shard_for(message.chatId);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.index.find(message.chatId);
+  if (it == shard.index.end()) return;
+
+  auto& entry = *it->second;
+  if (entry.loading) {
+    // The load may have read the chat before this message was committed
+    erase(shard, it->second);
+    return;
+  }
+
+  // Concurrent senders can get here out of id order
+  auto pos = std::lower_bound(entry.messages.begin(), entry.messages.end(), message.messageId, by_id);
+  if (pos != entry.messages.end() && pos->messageId == message.messageId) return;
+  entry.messages.insert(pos, message);
+  entry.bytes += size_of(message);
+  shard.bytes += size_of(message);
+
+  while (entry.messages.size() > options_.messages_per_chat) {
+    auto size = size_of(entry.messages.front());
+    entry.bytes -= size;
+    shard.bytes -= size;
+    entry.messages.pop_front();
+    entry.complete = false;
+  }
+
+  evict(shard);
+}
+
+void ChatTailCache::invalidate(npchat::ChatId chat_id) {
+  auto& shard = shard_for(chat_id);
+  std::lock_guard lock(shard.mutex);
+
+  if (auto it = shard.index.find(chat_id); it != shard.index.end()) {
+    erase(shard, it->second);
+  }
+}
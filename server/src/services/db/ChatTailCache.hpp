@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "npchat_stub/npchat.hpp"
+
+// The newest messages of recently opened chats, in front of the MessageStore.
+//
+// Opening a chat asks for its newest page; with the tail cached that page, and
+// the ones after it while they are still within the tail, are copied out of
+// memory instead of queried. A tail is loaded on the first miss, extended by
+// every message sent to the chat and dropped when one of its messages is
+// edited or deleted.
+//
+// Chats are spread over shards, each with its own lock, LRU list and share of
+// the memory budget. A load that races with a write to its chat isn't cached.
+class ChatTailCache {
+public:
+  struct Options {
+    std::size_t messages_per_chat = 100;
+    std::size_t memory_budget = 64 * 1024 * 1024; // Bytes, over all chats
+    std::size_t shard_count = 16;
+  };
+
+  // Identifies a load started with beginLoad()
+  using Ticket = std::uint64_t;
+
+private:
+  struct Entry {
+    npchat::ChatId chat_id;
+    std::deque<npchat::ChatMessage> messages; // Oldest first
+    bool complete = false; // The tail is the chat's whole history
+    Ticket loading = 0;    // Non-zero until the loaded messages are in
+    std::size_t bytes = 0;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<npchat::ChatId, std::list<Entry>::iterator> index;
+    std::size_t bytes = 0;
+    Ticket next_ticket = 1;
+  };
+
+  const Options options_;
+  const std::size_t shard_budget_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  Shard& shard_for(npchat::ChatId chat_id) noexcept {
+    return *shards_[chat_id % shards_.size()];
+  }
+
+  static std::size_t size_of(const npchat::ChatMessage& message) noexcept;
+
+  // Must be called with the shard locked
+  static void erase(Shard& shard, std::list<Entry>::iterator entry);
+  void evict(Shard& shard);
+
+public:
+  explicit ChatTailCache(Options options);
+
+  const Options& options() const noexcept { return options_; }
+
+  // Up to `limit` messages older than `before_message_id` (0 = newest), oldest first,
+  // if the cached tail has all of them
+  std::optional<std::vector<npchat::ChatMessage>> findBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                             std::uint32_t limit);
+  // `limit` messages after the first `offset`, oldest first; only for chats cached whole
+  std::optional<std::vector<npchat::ChatMessage>> findOldest(npchat::ChatId chat_id, std::uint32_t limit, std::uint32_t offset);
+
+  // Loading the tail of a chat: any write to the chat between the two calls
+  // discards the load, so a tail read before the write is never cached
+  Ticket beginLoad(npchat::ChatId chat_id);
+  // `messages`: the chat's newest messages_per_chat messages, oldest first
+  void completeLoad(npchat::ChatId chat_id, Ticket ticket, const std::vector<npchat::ChatMessage>& messages);
+
+  // A message was committed to the chat
+  void append(const npchat::ChatMessage& message);
+  // Messages of the chat were changed or removed
+  void invalidate(npchat::ChatId chat_id);
+};
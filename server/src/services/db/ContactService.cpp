@@ -1,28 +1,48 @@
 #include "ContactService.hpp"
 
-ContactService::ContactService(const std::shared_ptr<Database>& database) : db_(database) {
+namespace {
+// Read-only queries, prepared on every reader connection on first use
+constexpr std::string_view get_contacts_sql =
+  "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
+  "FROM contacts c "
+  "JOIN users u ON c.contact_id = u.id "
+  "WHERE c.owner_id = ? AND c.blocked = 0 "
+  "ORDER BY u.username ASC";
+
+constexpr std::string_view get_contact_by_id_sql =
+  "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
+  "FROM contacts c "
+  "JOIN users u ON c.contact_id = u.id "
+  "WHERE c.owner_id = ? AND c.contact_id = ?";
+
+constexpr std::string_view get_contact_by_username_sql =
+  "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
+  "FROM contacts c "
+  "JOIN users u ON c.contact_id = u.id "
+  "WHERE c.owner_id = ? AND u.username = ?";
+
+constexpr std::string_view get_blocked_contacts_sql =
+  "SELECT c.contact_id, u.username, u.email, c.added_at "
+  "FROM contacts c "
+  "JOIN users u ON c.contact_id = u.id "
+  "WHERE c.owner_id = ? AND c.blocked = 1 "
+  "ORDER BY u.username ASC";
+
+constexpr std::string_view is_blocked_sql =
+  "SELECT blocked FROM contacts WHERE owner_id = ? AND contact_id = ?";
+
+constexpr std::string_view get_user_by_username_sql =
+  "SELECT id, username, email FROM users WHERE username = ?";
+} // namespace
+
+ContactService::ContactService(const std::shared_ptr<Database>& database, const std::shared_ptr<UserIndex>& users)
+  : db_(database)
+  , users_(users)
+  , lock_wait_(metrics::lock_wait("ContactService"))
+{
   add_contact_stmt_ = db_->prepareStatement(
     "INSERT INTO contacts (owner_id, contact_id, added_at) VALUES (?, ?, ?)");
 
-  get_contacts_stmt_ = db_->prepareStatement(
-    "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
-    "FROM contacts c "
-    "JOIN users u ON c.contact_id = u.id "
-    "WHERE c.owner_id = ? AND c.blocked = 0 "
-    "ORDER BY u.username ASC");
-
-  get_contact_by_id_stmt_ = db_->prepareStatement(
-    "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
-    "FROM contacts c "
-    "JOIN users u ON c.contact_id = u.id "
-    "WHERE c.owner_id = ? AND c.contact_id = ?");
-
-  get_contact_by_username_stmt_ = db_->prepareStatement(
-    "SELECT c.contact_id, u.username, u.email, c.added_at, c.blocked "
-    "FROM contacts c "
-    "JOIN users u ON c.contact_id = u.id "
-    "WHERE c.owner_id = ? AND u.username = ?");
-
   remove_contact_stmt_ = db_->prepareStatement(
     "DELETE FROM contacts WHERE owner_id = ? AND contact_id = ?");
 
@@ -34,35 +54,14 @@ ContactService::ContactService(const std::shared_ptr<Database>& database) : db_(
 
   unblock_contact_stmt_ = db_->prepareStatement(
     "UPDATE contacts SET blocked = 0 WHERE owner_id = ? AND contact_id = ?");
-
-  get_blocked_contacts_stmt_ = db_->prepareStatement(
-    "SELECT c.contact_id, u.username, u.email, c.added_at "
-    "FROM contacts c "
-    "JOIN users u ON c.contact_id = u.id "
-    "WHERE c.owner_id = ? AND c.blocked = 1 "
-    "ORDER BY u.username ASC");
-
-  is_blocked_stmt_ = db_->prepareStatement(
-    "SELECT blocked FROM contacts WHERE owner_id = ? AND contact_id = ?");
-
-  search_users_stmt_ = db_->prepareStatement(
-    "SELECT id, username, email FROM users "
-    "WHERE (username LIKE ? OR email LIKE ?) AND id != ? "
-    "ORDER BY username ASC LIMIT ?");
 }
 
 ContactService::~ContactService() {
   sqlite3_finalize(add_contact_stmt_);
-  sqlite3_finalize(get_contacts_stmt_);
-  sqlite3_finalize(get_contact_by_id_stmt_);
-  sqlite3_finalize(get_contact_by_username_stmt_);
   sqlite3_finalize(remove_contact_stmt_);
   sqlite3_finalize(check_contact_exists_stmt_);
   sqlite3_finalize(block_contact_stmt_);
   sqlite3_finalize(unblock_contact_stmt_);
-  sqlite3_finalize(get_blocked_contacts_stmt_);
-  sqlite3_finalize(is_blocked_stmt_);
-  sqlite3_finalize(search_users_stmt_);
 }
 
 bool ContactService::addContact(std::uint32_t owner_id, std::uint32_t contact_id) {
@@ -70,7 +69,7 @@ bool ContactService::addContact(std::uint32_t owner_id, std::uint32_t contact_id
     return false; // Cannot add self as contact
   }
 
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   // Check if contact already exists
   sqlite3_bind_int(check_contact_exists_stmt_, 1, owner_id);
@@ -108,67 +107,70 @@ bool ContactService::addContactByUsername(std::uint32_t owner_id, const std::str
 }
 
 std::vector<npchat::Contact> ContactService::getContacts(std::uint32_t owner_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_contacts_sql);
 
   std::vector<npchat::Contact> contacts;
 
-  sqlite3_bind_int(get_contacts_stmt_, 1, owner_id);
+  sqlite3_bind_int(stmt, 1, owner_id);
 
-  while (sqlite3_step(get_contacts_stmt_) == SQLITE_ROW) {
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::Contact contact;
-    contact.id = sqlite3_column_int(get_contacts_stmt_, 0);
-    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(get_contacts_stmt_, 1));
-    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(get_contacts_stmt_, 2));
+    contact.id = sqlite3_column_int(stmt, 0);
+    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
 
     contacts.push_back(std::move(contact));
   }
 
-  sqlite3_reset(get_contacts_stmt_);
+  sqlite3_reset(stmt);
   return contacts;
 }
 
 std::optional<npchat::Contact> ContactService::getContact(std::uint32_t owner_id, std::uint32_t contact_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_contact_by_id_sql);
 
-  sqlite3_bind_int(get_contact_by_id_stmt_, 1, owner_id);
-  sqlite3_bind_int(get_contact_by_id_stmt_, 2, contact_id);
+  sqlite3_bind_int(stmt, 1, owner_id);
+  sqlite3_bind_int(stmt, 2, contact_id);
 
-  if (sqlite3_step(get_contact_by_id_stmt_) == SQLITE_ROW) {
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::Contact contact;
-    contact.id = sqlite3_column_int(get_contact_by_id_stmt_, 0);
-    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(get_contact_by_id_stmt_, 1));
-    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(get_contact_by_id_stmt_, 2));
+    contact.id = sqlite3_column_int(stmt, 0);
+    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
 
-    sqlite3_reset(get_contact_by_id_stmt_);
+    sqlite3_reset(stmt);
     return contact;
   }
 
-  sqlite3_reset(get_contact_by_id_stmt_);
+  sqlite3_reset(stmt);
   return std::nullopt;
 }
 
 std::optional<npchat::Contact> ContactService::getContactByUsername(std::uint32_t owner_id, const std::string& username) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_contact_by_username_sql);
 
-  sqlite3_bind_int(get_contact_by_username_stmt_, 1, owner_id);
-  sqlite3_bind_text(get_contact_by_username_stmt_, 2, username.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 1, owner_id);
+  sqlite3_bind_text(stmt, 2, username.c_str(), -1, SQLITE_STATIC);
 
-  if (sqlite3_step(get_contact_by_username_stmt_) == SQLITE_ROW) {
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::Contact contact;
-    contact.id = sqlite3_column_int(get_contact_by_username_stmt_, 0);
-    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(get_contact_by_username_stmt_, 1));
-    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(get_contact_by_username_stmt_, 2));
+    contact.id = sqlite3_column_int(stmt, 0);
+    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
 
-    sqlite3_reset(get_contact_by_username_stmt_);
+    sqlite3_reset(stmt);
     return contact;
   }
 
-  sqlite3_reset(get_contact_by_username_stmt_);
+  sqlite3_reset(stmt);
   return std::nullopt;
 }
 
 bool ContactService::removeContact(std::uint32_t owner_id, std::uint32_t contact_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_int(remove_contact_stmt_, 1, owner_id);
   sqlite3_bind_int(remove_contact_stmt_, 2, contact_id);
@@ -180,7 +182,7 @@ bool ContactService::removeContact(std::uint32_t owner_id, std::uint32_t contact
 }
 
 bool ContactService::blockContact(std::uint32_t owner_id, std::uint32_t contact_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_int(block_contact_stmt_, 1, owner_id);
   sqlite3_bind_int(block_contact_stmt_, 2, contact_id);
@@ -192,7 +194,7 @@ bool ContactService::blockContact(std::uint32_t owner_id, std::uint32_t contact_
 }
 
 bool ContactService::unblockContact(std::uint32_t owner_id, std::uint32_t contact_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_int(unblock_contact_stmt_, 1, owner_id);
   sqlite3_bind_int(unblock_contact_stmt_, 2, contact_id);
@@ -204,68 +206,56 @@ bool ContactService::unblockContact(std::uint32_t owner_id, std::uint32_t contac
 }
 
 std::vector<npchat::Contact> ContactService::getBlockedContacts(std::uint32_t owner_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_blocked_contacts_sql);
 
   std::vector<npchat::Contact> contacts;
 
-  sqlite3_bind_int(get_blocked_contacts_stmt_, 1, owner_id);
+  sqlite3_bind_int(stmt, 1, owner_id);
 
-  while (sqlite3_step(get_blocked_contacts_stmt_) == SQLITE_ROW) {
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
     npchat::Contact contact;
-    contact.id = sqlite3_column_int(get_blocked_contacts_stmt_, 0);
-    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(get_blocked_contacts_stmt_, 1));
-    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(get_blocked_contacts_stmt_, 2));
+    contact.id = sqlite3_column_int(stmt, 0);
+    contact.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+    // contact.email = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
 
     contacts.push_back(std::move(contact));
   }
 
-  sqlite3_reset(get_blocked_contacts_stmt_);
+  sqlite3_reset(stmt);
   return contacts;
 }
 
 bool ContactService::isBlocked(std::uint32_t owner_id, std::uint32_t contact_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(is_blocked_sql);
 
-  sqlite3_bind_int(is_blocked_stmt_, 1, owner_id);
-  sqlite3_bind_int(is_blocked_stmt_, 2, contact_id);
+  sqlite3_bind_int(stmt, 1, owner_id);
+  sqlite3_bind_int(stmt, 2, contact_id);
 
   bool blocked = false;
-  if (sqlite3_step(is_blocked_stmt_) == SQLITE_ROW) {
-    blocked = sqlite3_column_int(is_blocked_stmt_, 0) == 1;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    blocked = sqlite3_column_int(stmt, 0) == 1;
   }
 
-  sqlite3_reset(is_blocked_stmt_);
+  sqlite3_reset(stmt);
   return blocked;
 }
 
 std::vector<npchat::Contact> ContactService::searchUsers(std::uint32_t searcher_id, const std::string& query, std::uint32_t limit) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
   std::vector<npchat::Contact> users;
-
-  std::string search_pattern = "%" + query + "%";
-
-  sqlite3_bind_text(search_users_stmt_, 1, search_pattern.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(search_users_stmt_, 2, search_pattern.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(search_users_stmt_, 3, searcher_id);
-  sqlite3_bind_int(search_users_stmt_, 4, limit);
-
-  while (sqlite3_step(search_users_stmt_) == SQLITE_ROW) {
+  for (auto& entry : users_->search(query, searcher_id, limit)) {
     npchat::Contact user;
-    user.id = sqlite3_column_int(search_users_stmt_, 0);
-    user.username = reinterpret_cast<const char*>(sqlite3_column_text(search_users_stmt_, 1));
-    // user.email = reinterpret_cast<const char*>(sqlite3_column_text(search_users_stmt_, 2));
-
+    user.id = entry.id;
+    user.username = std::move(entry.username);
     users.push_back(std::move(user));
   }
-
-  sqlite3_reset(search_users_stmt_);
   return users;
 }
 
 std::optional<ContactService::User> ContactService::getUserByUsername(const std::string& username) {
-  sqlite3_stmt* stmt = db_->prepareStatement(
-    "SELECT id, username, email FROM users WHERE username = ?");
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_user_by_username_sql);
 
   sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
 
@@ -275,10 +265,10 @@ std::optional<ContactService::User> ContactService::getUserByUsername(const std:
     user.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
     user.email = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return user;
   }
 
-  sqlite3_finalize(stmt);
+  sqlite3_reset(stmt);
   return std::nullopt;
 }
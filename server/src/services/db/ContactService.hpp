@@ -7,28 +7,26 @@
 #include <sqlite3.h>
 #include <spdlog/spdlog.h>
 #include "Database.hpp"
+#include "UserIndex.hpp"
+#include "services/metrics/Metrics.hpp"
 #include "npchat_stub/npchat.hpp"
 
 class ContactService {
 private:
   std::shared_ptr<Database> db_;
+  std::shared_ptr<UserIndex> users_;
   mutable std::mutex mutex_;
+  metrics::Histogram& lock_wait_; // Time spent waiting for mutex_
 
   // Prepared statements
   sqlite3_stmt* add_contact_stmt_;
-  sqlite3_stmt* get_contacts_stmt_;
-  sqlite3_stmt* get_contact_by_id_stmt_;
-  sqlite3_stmt* get_contact_by_username_stmt_;
   sqlite3_stmt* remove_contact_stmt_;
   sqlite3_stmt* check_contact_exists_stmt_;
   sqlite3_stmt* block_contact_stmt_;
   sqlite3_stmt* unblock_contact_stmt_;
-  sqlite3_stmt* get_blocked_contacts_stmt_;
-  sqlite3_stmt* is_blocked_stmt_;
-  sqlite3_stmt* search_users_stmt_;
 
 public:
-  explicit ContactService(const std::shared_ptr<Database>& database);
+  ContactService(const std::shared_ptr<Database>& database, const std::shared_ptr<UserIndex>& users);
   ~ContactService();
 
   bool addContact(std::uint32_t owner_id, std::uint32_t contact_id);
@@ -42,6 +40,7 @@ public:
   bool unblockContact(std::uint32_t owner_id, std::uint32_t contact_id);
   std::vector<npchat::Contact> getBlockedContacts(std::uint32_t owner_id);
   bool isBlocked(std::uint32_t owner_id, std::uint32_t contact_id);
+  // Served from the user index without touching the database
   std::vector<npchat::Contact> searchUsers(std::uint32_t searcher_id, const std::string& query, std::uint32_t limit = 20);
 
 private:
@@ -0,0 +1,204 @@
+#include "Database.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <thread>
+
+#include "services/metrics/Metrics.hpp"
+
+namespace {
+constexpr int busy_timeout_ms = 5000;
+constexpr int writer_flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX;
+// A reader is only ever used by the thread that leased it, so it doesn't need SQLite's own mutex
+constexpr int reader_flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+
+// Statement run times as SQLite reports them, per connection role and statement kind.
+// SQLite measures them with the VFS clock, which on unix has millisecond resolution.
+struct StatementTimes {
+  enum Kind { select, insert, update, remove, other, kind_count };
+  metrics::Histogram* by_kind[kind_count];
+
+  explicit StatementTimes(std::string_view role) {
+    static constexpr std::string_view names[] = {"select", "insert", "update", "delete", "other"};
+    for (int kind = 0; kind < kind_count; ++kind) {
+      by_kind[kind] = &metrics::Registry::instance().latency(
+        "npchat_sqlite_statement_seconds", "Time SQLite spent running a statement, from first step to reset",
+        fmt::format("connection=\"{}\",kind=\"{}\"", role, names[kind]));
+    }
+  }
+
+  static Kind kind_of(const char* sql) noexcept {
+    if (!sql) return other;
+    while (std::isspace(static_cast<unsigned char>(*sql))) ++sql;
+    auto starts_with = [sql] (std::string_view word) {
+      for (std::size_t i = 0; i < word.size(); ++i) {
+        if (std::toupper(static_cast<unsigned char>(sql[i])) != word[i]) return false;
+      }
+      return true;
+    };
+    if (starts_with("SELECT") || starts_with("WITH")) return select;
+    if (starts_with("INSERT") || starts_with("REPLACE")) return insert;
+    if (starts_with("UPDATE")) return update;
+    if (starts_with("DELETE")) return remove;
+    return other;
+  }
+
+  static int on_trace(unsigned type, void* ctx, void* stmt, void* elapsed_ns) {
+    if (type == SQLITE_TRACE_PROFILE) {
+      auto times = static_cast<StatementTimes*>(ctx);
+      auto kind = kind_of(sqlite3_sql(static_cast<sqlite3_stmt*>(stmt)));
+      times->by_kind[kind]->observe(static_cast<std::uint64_t>(*static_cast<sqlite3_int64*>(elapsed_ns)));
+    }
+    return 0;
+  }
+};
+
+StatementTimes& statement_times(bool read_only) {
+  static StatementTimes reader("reader"), writer("writer");
+  return read_only ? reader : writer;
+}
+} // namespace
+
+Database::Connection::Connection(const std::string &path, int flags)
+  : db_(nullptr)
+{
+  if (sqlite3_open_v2(path.c_str(), &db_, flags, nullptr) != SQLITE_OK) {
+    spdlog::warn("[Database] Failed to open database: {}", db_ ? sqlite3_errmsg(db_) : "out of memory");
+    sqlite3_close(db_);
+    throw std::runtime_error("Database connection failed");
+  }
+  sqlite3_busy_timeout(db_, busy_timeout_ms);
+  sqlite3_trace_v2(db_, SQLITE_TRACE_PROFILE, &StatementTimes::on_trace,
+                   &statement_times((flags & SQLITE_OPEN_READONLY) != 0));
+}
+
+Database::Connection::~Connection() {
+  for (auto& [sql, stmt] : statements_) {
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(db_);
+}
+
+void Database::Connection::execute(const std::string &query) {
+  char *errMsg = nullptr;
+  if (sqlite3_exec(db_, query.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
+    spdlog::warn("[Database] Error executing query: {}", errMsg);
+    sqlite3_free(errMsg);
+  }
+}
+
+sqlite3_stmt* Database::Connection::prepareStatement(const std::string& sql) {
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db_));
+    throw std::runtime_error("Failed to prepare statement");
+  }
+  return stmt;
+}
+
+sqlite3_stmt* Database::Connection::statement(std::string_view sql) {
+  if (auto it = statements_.find(sql); it != statements_.end()) {
+    return it->second;
+  }
+
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v3(db_, sql.data(), static_cast<int>(sql.size()),
+                         SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK) {
+    spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db_));
+    throw std::runtime_error("Failed to prepare statement");
+  }
+
+  statements_.emplace(std::string(sql), stmt);
+  return stmt;
+}
+
+void Database::Connection::resetBusyStatements() noexcept {
+  for (auto stmt = sqlite3_next_stmt(db_, nullptr); stmt; stmt = sqlite3_next_stmt(db_, stmt)) {
+    if (sqlite3_stmt_busy(stmt)) sqlite3_reset(stmt);
+  }
+}
+
+Database::Database(const std::string &path, std::size_t reader_count)
+  : Database(path, reader_count, Options{})
+{
+}
+
+Database::Database(const std::string &path, std::size_t reader_count, const Options& options)
+  : dbPath_(path)
+  , options_(options)
+{
+  if (sqlite3_threadsafe() != 1) {
+    // https://www.sqlite.org/c3ref/c_config_covering_index_scan.html#sqliteconfigserialized
+    throw std::runtime_error("Threading mode isn't set to 'SQLITE_CONFIG_SERIALIZED'");
+  }
+
+  writer_ = std::make_unique<Connection>(dbPath_, writer_flags);
+  spdlog::info("Database is open: {}", path);
+
+  // WAL lets readers run concurrently with the writer; the mode is persistent in the file
+  writer_->execute("PRAGMA journal_mode = WAL;");
+  // Under WAL, NORMAL syncs at checkpoints instead of on every commit
+  writer_->execute("PRAGMA synchronous = NORMAL;");
+  writer_->execute("PRAGMA foreign_keys = ON;");
+  configure(*writer_);
+
+  if (reader_count == 0) {
+    reader_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  readers_.reserve(reader_count);
+  free_readers_.reserve(reader_count);
+  for (std::size_t i = 0; i < reader_count; ++i) {
+    readers_.push_back(openConnection(true));
+    free_readers_.push_back(readers_.back().get());
+  }
+
+  spdlog::info("Database reader pool size: {}", reader_count);
+}
+
+Database::~Database() = default;
+
+void Database::configure(Connection& conn) const {
+  // A negative cache_size is in KiB
+  conn.execute(fmt::format("PRAGMA cache_size = -{};", options_.cache_mb * 1024));
+  conn.execute(fmt::format("PRAGMA mmap_size = {};", options_.mmap_mb * 1024 * 1024));
+  conn.execute("PRAGMA temp_store = MEMORY;");
+}
+
+std::unique_ptr<Database::Connection> Database::openConnection(bool read_only) const {
+  auto conn = std::make_unique<Connection>(dbPath_, read_only ? reader_flags : writer_flags);
+  if (!read_only) {
+    conn->execute("PRAGMA synchronous = NORMAL;");
+    conn->execute("PRAGMA foreign_keys = ON;");
+  }
+  configure(*conn);
+  return conn;
+}
+
+Database::Reader Database::reader() {
+  static auto& wait = metrics::Registry::instance().latency(
+    "npchat_db_reader_wait_seconds", "Time spent waiting for a free reader connection");
+
+  std::unique_lock lock(readers_mutex_);
+  if (free_readers_.empty()) {
+    auto started = std::chrono::steady_clock::now();
+    readers_cv_.wait(lock, [this] { return !free_readers_.empty(); });
+    wait.observe(std::chrono::steady_clock::now() - started);
+  } else {
+    wait.observe(std::uint64_t{0});
+  }
+  auto conn = free_readers_.back();
+  free_readers_.pop_back();
+  return Reader(this, conn);
+}
+
+void Database::release(Connection *conn) noexcept {
+  // Don't hand out a connection with a statement still holding a read transaction open
+  conn->resetBusyStatements();
+  {
+    std::lock_guard lock(readers_mutex_);
+    free_readers_.push_back(conn);
+  }
+  readers_cv_.notify_one();
+}
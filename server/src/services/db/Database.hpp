@@ -3,55 +3,135 @@
 #include <spdlog/spdlog.h>
 
 #include <sqlite3.h>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
+#include <nplib/utils/unordered.hpp>
+
+// SQLite database running in WAL mode with one writer connection and a pool
+// of read-only connections.
+//
+// Services keep using getConnection()/prepareStatement()/execute() for writes,
+// which all go through the single serialized writer connection. Read-only queries
+// lease a reader connection with reader(); every reader has its own prepared
+// statement cache, so reads run in parallel with each other and with the writer.
+//
+// Commits are synchronous=NORMAL: under WAL that keeps the database consistent
+// and only a power loss, not a crash of the process, can undo the last ones.
 class Database {
-  sqlite3 *db_;
-  std::string dbPath_;
 public:
-  explicit Database(const std::string &path)
-    : db_(nullptr)
-    , dbPath_(path)
-  {
-    if (sqlite3_threadsafe() != 1) {
-      // https://www.sqlite.org/c3ref/c_config_covering_index_scan.html#sqliteconfigserialized
-      throw std::runtime_error("Threading mode isn't set to 'SQLITE_CONFIG_SERIALIZED'");
+  // Per-connection tuning, applied to the writer and to every reader
+  struct Options {
+    std::size_t cache_mb = 16;  // Page cache of each connection
+    std::size_t mmap_mb = 256;  // Reads map up to this much of the file instead of copying pages; 0 = off
+  };
+
+  class Connection {
+    sqlite3 *db_;
+    std::unordered_map<std::string, sqlite3_stmt*, nplib::utils::string_hash, std::equal_to<>> statements_;
+
+  public:
+    Connection(const std::string &path, int flags);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    sqlite3 *handle() noexcept { return db_; }
+
+    // Generic method for executing a query without a result
+    void execute(const std::string &query);
+
+    // Prepares a statement owned by the caller (must be finalized by the caller)
+    sqlite3_stmt* prepareStatement(const std::string& sql);
+
+    // Returns a statement owned by the connection, prepared on first use.
+    // The caller must sqlite3_reset() it when done, as with member statements.
+    sqlite3_stmt* statement(std::string_view sql);
+
+    // Resets every statement that was left in the middle of a step
+    void resetBusyStatements() noexcept;
+  };
+
+  // Lease on one reader connection, returned to the pool on destruction
+  class Reader {
+    Database *db_;
+    Connection *conn_;
+
+  public:
+    Reader(Database *db, Connection *conn) noexcept
+      : db_(db)
+      , conn_(conn)
+    {
     }
-    if (sqlite3_open(dbPath_.c_str(), &db_) != SQLITE_OK) {
-      spdlog::warn("[Database] Failed to open database: {}", sqlite3_errmsg(db_));
-      throw std::runtime_error("Database connection failed");
+
+    Reader(Reader&& other) noexcept
+      : db_(other.db_)
+      , conn_(other.conn_)
+    {
+      other.conn_ = nullptr;
     }
-    spdlog::info("Database is open: {}", path);
-    execute("PRAGMA foreign_keys = ON;");
-  }
 
-  ~Database() {
-    if (db_) {
-      sqlite3_close(db_);
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader& operator=(Reader&&) = delete;
+
+    ~Reader() {
+      if (conn_) db_->release(conn_);
     }
-  }
 
+    Connection* operator->() noexcept { return conn_; }
+    sqlite3_stmt* statement(std::string_view sql) { return conn_->statement(sql); }
+  };
+
+private:
+  std::string dbPath_;
+  Options options_;
+  std::unique_ptr<Connection> writer_;
+  std::vector<std::unique_ptr<Connection>> readers_;
+
+  std::mutex readers_mutex_;
+  std::condition_variable readers_cv_;
+  std::vector<Connection*> free_readers_;
+
+  void release(Connection *conn) noexcept;
+  void configure(Connection& conn) const;
+
+public:
+  // reader_count == 0 picks one reader per hardware thread (the size of the thread pool)
+  explicit Database(const std::string &path, std::size_t reader_count = 0);
+  Database(const std::string &path, std::size_t reader_count, const Options& options);
+  ~Database();
+
+  const std::string& path() const noexcept { return dbPath_; }
+
+  // Writer connection
   sqlite3 *getConnection() {
-    return db_;
+    return writer_->handle();
   }
 
-  // Generic method for executing a query without a result
+  // Generic method for executing a query without a result on the writer connection
   void execute(const std::string &query) {
-    char *errMsg = nullptr;
-    if (sqlite3_exec(db_, query.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
-      spdlog::warn("[Database] Error executing query: {}", errMsg);
-      sqlite3_free(errMsg);
-    }
+    writer_->execute(query);
   }
 
   sqlite3_stmt* prepareStatement(const std::string& sql) {
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        spdlog::error("Failed to prepare statement: {}", sqlite3_errmsg(db_));
-        throw std::runtime_error("Failed to prepare statement");
-    }
-    return stmt;
+    return writer_->prepareStatement(sql);
   }
 
+  // Opens a new connection to the same database, configured the same way as the pool ones
+  std::unique_ptr<Connection> openConnection(bool read_only) const;
+
+  // Leases a reader connection, blocking if all of them are in use
+  Reader reader();
+
+  std::size_t readerCount() const noexcept { return readers_.size(); }
 };
@@ -0,0 +1,302 @@
+#include "MediaPipeline.hpp"
+
+#include <spdlog/spdlog.h>
+#include <boost/asio/post.hpp>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+extern char** environ;
+
+namespace {
+constexpr std::string_view find_preview_sql =
+  "SELECT preview_hash FROM media_previews WHERE hash = ?";
+
+constexpr const char* insert_preview_sql =
+  "INSERT OR REPLACE INTO media_previews (hash, preview_hash, created_at) VALUES (?, ?, ?)";
+
+constexpr auto poll_interval = std::chrono::milliseconds(20);
+
+// Demuxers ffmpeg may pick for an attachment. Uploads are arbitrary bytes, and
+// formats like HLS, concat or image2 would read other files or URLs they name.
+// "mov" covers mp4, m4a, 3gp and the HEIF images, "matroska" covers webm.
+constexpr const char* input_formats =
+  "png_pipe,jpeg_pipe,webp_pipe,gif,bmp_pipe,tiff_pipe,mov,matroska,avi";
+
+// Makes the names of preview files unique within the process
+std::atomic<std::uint64_t> output_counter{0};
+
+metrics::Counter& previews(const char* result) {
+  return metrics::Registry::instance().counter("npchat_media_previews_total",
+    "Attachment preview jobs by outcome",
+    std::string("result=\"").append(result).append("\""));
+}
+
+// Full path of the executable, looked up in PATH unless it has a slash
+std::optional<std::filesystem::path> find_executable(const std::string& name) {
+  if (name.find('/') != std::string::npos) {
+    if (::access(name.c_str(), X_OK) == 0) return name;
+    return std::nullopt;
+  }
+  const char* path = std::getenv("PATH");
+  std::string_view dirs = path ? path : "/usr/local/bin:/usr/bin:/bin";
+  while (!dirs.empty()) {
+    auto end = dirs.find(':');
+    auto dir = dirs.substr(0, end);
+    if (!dir.empty()) {
+      auto candidate = std::filesystem::path(dir) / name;
+      if (::access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    if (end == std::string_view::npos) break;
+    dirs.remove_prefix(end + 1);
+  }
+  return std::nullopt;
+}
+
+// Runs the command with stdin and stdout on /dev/null; returns its exit status, or -1 if it was killed
+int run_process(const std::vector<std::string>& args, std::chrono::seconds timeout) {
+  std::vector<char*> argv;
+  for (const auto& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+  pid_t pid = 0;
+  int rc = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0) {
+    throw std::runtime_error(std::string("Failed to start ") + args[0] + ": " + std::strerror(rc));
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  int status = 0;
+  while (::waitpid(pid, &status, WNOHANG) == 0) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      ::kill(pid, SIGKILL);
+      ::waitpid(pid, &status, 0);
+      return -1;
+    }
+    std::this_thread::sleep_for(poll_interval);
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+} // namespace
+
+MediaPipeline::MediaPipeline(const std::shared_ptr<Database>& database,
+                             const std::shared_ptr<MessageStore>& store,
+                             const std::shared_ptr<BlobStore>& blobs,
+                             const std::shared_ptr<ChatMembership>& membership,
+                             Options options, Events events)
+  : options_(std::move(options))
+  , events_(std::move(events))
+  , db_(database)
+  , store_(store)
+  , blobs_(blobs)
+  , membership_(membership)
+  , queue_depth_(metrics::Registry::instance().gauge(
+      "npchat_media_queue_depth", "Attachment preview jobs waiting or running"))
+  , made_(previews("made"))
+  , failed_(previews("failed"))
+  , dropped_(previews("dropped"))
+  , duration_(metrics::Registry::instance().latency(
+      "npchat_media_preview_seconds", "Time to make one attachment preview"))
+  , pool_(std::max<std::size_t>(1, options_.threads))
+{
+  if (options_.threads == 0) {
+    spdlog::info("[MediaPipeline] Attachment previews are disabled");
+    return;
+  }
+
+  auto ffmpeg = find_executable(options_.ffmpeg);
+  if (!ffmpeg) {
+    spdlog::warn("[MediaPipeline] {} not found, attachments get no previews", options_.ffmpeg);
+    return;
+  }
+  ffmpeg_ = ffmpeg->string();
+
+  // Its own connection, so recording a preview never waits behind the services' writes
+  writer_ = db_->openConnection(false);
+  insert_preview_stmt_ = writer_->prepareStatement(insert_preview_sql);
+  enabled_ = true;
+
+  spdlog::info("[MediaPipeline] {} threads, previews up to {} px with {}", options_.threads, options_.max_edge, ffmpeg_);
+}
+
+MediaPipeline::~MediaPipeline() {
+  // Queued jobs are dropped; the ones running finish first
+  pool_.stop();
+  pool_.join();
+  sqlite3_finalize(insert_preview_stmt_);
+}
+
+void MediaPipeline::submit(npchat::ChatId chat_id, npchat::MessageId message_id, const npchat::ChatAttachment& attachment) {
+  if (!enabled_ || attachment.id == 0) return;
+  if (attachment.type != npchat::ChatAttachmentType::Picture &&
+      attachment.type != npchat::ChatAttachmentType::Video) {
+    return;
+  }
+
+  if (queued_.fetch_add(1) >= options_.queue_limit) {
+    queued_.fetch_sub(1);
+    dropped_.inc();
+    spdlog::warn("[MediaPipeline] Queue is full, attachment {} gets no preview", attachment.id);
+    return;
+  }
+  queue_depth_.add();
+
+  Job job{chat_id, message_id, attachment.id, attachment.type};
+  boost::asio::post(pool_, [this, job] {
+    try {
+      run(job);
+    } catch (const std::exception& e) {
+      failed_.inc();
+      spdlog::error("[MediaPipeline] Preview of attachment {} failed: {}", job.attachment_id, e.what());
+    }
+    queued_.fetch_sub(1);
+    queue_depth_.sub();
+  });
+}
+
+void MediaPipeline::run(const Job& job) {
+  metrics::Timer timer(duration_);
+
+  auto ref = store_->findAttachment(job.attachment_id);
+  if (!ref || ref->hash.empty()) return;
+
+  // The same content was sent before
+  std::string existing;
+  if (lookup(ref->hash, existing)) {
+    if (!existing.empty() && events_.preview_ready) {
+      events_.preview_ready(job.chat_id, job.message_id, job.attachment_id);
+    }
+    return;
+  }
+
+  auto preview = render(blobs_->pathFor(ref->hash), job.type);
+  if (!preview) {
+    failed_.inc();
+    spdlog::info("[MediaPipeline] No preview for attachment {}: ffmpeg couldn't decode it", job.attachment_id);
+    record(ref->hash, {});
+    return;
+  }
+
+  {
+    // A preview can have the same content as an upload waiting for its message
+    auto hold = blobs_->hold();
+    auto preview_hash = blobs_->put(*preview);
+    record(ref->hash, preview_hash);
+  }
+  made_.inc();
+  spdlog::debug("[MediaPipeline] Preview of attachment {}: {} bytes", job.attachment_id, preview->size());
+
+  if (events_.preview_ready) {
+    events_.preview_ready(job.chat_id, job.message_id, job.attachment_id);
+  }
+}
+
+std::optional<std::vector<std::uint8_t>> MediaPipeline::render(const std::filesystem::path& input,
+                                                               npchat::ChatAttachmentType type) {
+  auto output = blobs_->tmpDir() / ("preview-" + std::to_string(output_counter++) + ".jpg");
+
+  // Fits the longest side into max_edge without enlarging small pictures
+  auto filter = fmt::format("scale='min({0},iw)':'min({0},ih)':force_original_aspect_ratio=decrease", options_.max_edge);
+  if (type == npchat::ChatAttachmentType::Video) {
+    // Picks the most representative of the first frames instead of a black or blurred first one
+    filter = "thumbnail," + filter;
+  }
+
+  // One thread per job, so the pool size bounds the CPU this takes
+  int status = run_process({
+    ffmpeg_, "-nostdin", "-hide_banner", "-loglevel", "error", "-threads", "1",
+    "-protocol_whitelist", "file", "-format_whitelist", input_formats,
+    "-i", input.string(),
+    "-an", "-frames:v", "1", "-vf", filter, "-q:v", "5",
+    "-f", "image2", "-c:v", "mjpeg", "-y", output.string()
+  }, options_.timeout);
+
+  std::optional<std::vector<std::uint8_t>> preview;
+  if (status == 0) {
+    std::ifstream file(output, std::ios::binary);
+    std::vector<std::uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!bytes.empty() && bytes.size() <= max_preview_size) preview = std::move(bytes);
+  }
+
+  std::error_code ec;
+  std::filesystem::remove(output, ec);
+  return preview;
+}
+
+bool MediaPipeline::lookup(std::string_view hash, std::string& preview_hash) {
+  auto reader = db_->reader();
+  auto stmt = reader.statement(find_preview_sql);
+
+  sqlite3_bind_text(stmt, 1, hash.data(), static_cast<int>(hash.size()), SQLITE_STATIC);
+
+  bool found = false;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    found = true;
+    const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    preview_hash = text ? text : "";
+  }
+  sqlite3_reset(stmt);
+  return found;
+}
+
+void MediaPipeline::record(const std::string& hash, std::string_view preview_hash) {
+  auto now = std::chrono::duration_cast<std::chrono::seconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+
+  std::lock_guard lock(writer_mutex_);
+  sqlite3_bind_text(insert_preview_stmt_, 1, hash.c_str(), static_cast<int>(hash.size()), SQLITE_STATIC);
+  // Empty, not NULL, for content without a preview
+  sqlite3_bind_text(insert_preview_stmt_, 2, preview_hash.empty() ? "" : preview_hash.data(),
+                    static_cast<int>(preview_hash.size()), SQLITE_STATIC);
+  sqlite3_bind_int64(insert_preview_stmt_, 3, now);
+
+  auto rc = sqlite3_step(insert_preview_stmt_);
+  sqlite3_reset(insert_preview_stmt_);
+  if (rc != SQLITE_DONE) {
+    throw std::runtime_error(std::string("Failed to record preview: ") + sqlite3_errmsg(writer_->handle()));
+  }
+}
+
+std::optional<std::string> MediaPipeline::previewOf(std::string_view hash) {
+  std::string preview_hash;
+  if (!lookup(hash, preview_hash) || preview_hash.empty()) return std::nullopt;
+  return preview_hash;
+}
+
+npchat::bytestream MediaPipeline::readPreview(std::uint32_t user_id, npchat::AttachmentId attachment_id) {
+  // Only attachments of messages in chats the user participates in
+  auto ref = store_->findAttachment(attachment_id);
+  if (!ref || ref->hash.empty() || !membership_->isParticipant(ref->chat_id, user_id)) {
+    throw std::runtime_error("Attachment not found");
+  }
+
+  auto preview_hash = previewOf(ref->hash);
+  if (!preview_hash) return {};
+
+  auto blob = blobs_->open(*preview_hash);
+  if (!blob) {
+    spdlog::error("[MediaPipeline] Preview of attachment {} is missing from the blob store", attachment_id);
+    return {};
+  }
+
+  auto bytes = blob->bytes();
+  if (bytes.size() > max_preview_size) return {};
+  return npchat::bytestream(bytes.begin(), bytes.end());
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/thread_pool.hpp>
+#include "BlobStore.hpp"
+#include "ChatMembership.hpp"
+#include "Database.hpp"
+#include "MessageStore.hpp"
+#include "services/metrics/Metrics.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Previews of Picture and Video attachments, made in the background.
+//
+// submit() queues a sent attachment on a small pool of its own, so the message
+// goes out at once and the RPC threads never wait for a decoder. A job runs
+// ffmpeg on the stored content: a picture is scaled down, a video gives up a
+// representative frame of its beginning, and the resulting JPEG goes into the
+// blob store. Previews are recorded by the hash of the content they were made
+// from, so content sent again, in any chat, is only decoded once; content
+// ffmpeg can't decode is recorded without a preview and not retried.
+//
+// Jobs beyond queue_limit are dropped rather than queued without bound; their
+// attachments simply have no preview. Without ffmpeg, or with threads = 0,
+// nothing is queued at all.
+class MediaPipeline {
+public:
+  struct Options {
+    std::size_t threads = 2;         // 0 = no previews
+    std::size_t queue_limit = 256;   // Jobs waiting or running
+    std::string ffmpeg = "ffmpeg";   // Executable, looked up in PATH
+    unsigned max_edge = 320;         // Longest side of a preview, in pixels
+    std::chrono::seconds timeout{60};
+  };
+
+  struct Events {
+    std::function<void(npchat::ChatId chatId, npchat::MessageId messageId, npchat::AttachmentId attachmentId)> preview_ready;
+  };
+
+  // Largest preview returned; anything bigger wasn't made by us
+  static constexpr std::size_t max_preview_size = 1024 * 1024;
+
+private:
+  struct Job {
+    npchat::ChatId chat_id;
+    npchat::MessageId message_id;
+    npchat::AttachmentId attachment_id;
+    npchat::ChatAttachmentType type;
+  };
+
+  const Options options_;
+  const Events events_;
+  std::shared_ptr<Database> db_;
+  std::shared_ptr<MessageStore> store_;
+  std::shared_ptr<BlobStore> blobs_;
+  std::shared_ptr<ChatMembership> membership_;
+  std::string ffmpeg_; // Resolved path, empty when disabled
+  bool enabled_ = false;
+
+  // Written from the pool only
+  std::mutex writer_mutex_;
+  std::unique_ptr<Database::Connection> writer_;
+  sqlite3_stmt* insert_preview_stmt_ = nullptr;
+
+  std::atomic<std::size_t> queued_{0};
+  metrics::Gauge& queue_depth_;
+  metrics::Counter& made_;
+  metrics::Counter& failed_;
+  metrics::Counter& dropped_;
+  metrics::Histogram& duration_;
+
+  boost::asio::thread_pool pool_;
+
+  void run(const Job& job);
+  // Runs ffmpeg on the content; returns the JPEG, or nothing if it couldn't be decoded
+  std::optional<std::vector<std::uint8_t>> render(const std::filesystem::path& input, npchat::ChatAttachmentType type);
+  // False if the content has no row yet; an empty preview_hash means none could be made
+  bool lookup(std::string_view hash, std::string& preview_hash);
+  void record(const std::string& hash, std::string_view preview_hash);
+
+public:
+  MediaPipeline(const std::shared_ptr<Database>& database,
+                const std::shared_ptr<MessageStore>& store,
+                const std::shared_ptr<BlobStore>& blobs,
+                const std::shared_ptr<ChatMembership>& membership,
+                Options options, Events events);
+  ~MediaPipeline();
+
+  bool enabled() const noexcept { return enabled_; }
+
+  // Queues a preview of a sent Picture or Video attachment; other types are ignored
+  void submit(npchat::ChatId chat_id, npchat::MessageId message_id, const npchat::ChatAttachment& attachment);
+
+  // Blob store key of the preview made from the content, if there is one
+  std::optional<std::string> previewOf(std::string_view hash);
+
+  // The preview of an attachment visible to the user, empty if there is none (yet).
+  // Throws if the attachment doesn't exist or the user isn't in its chat.
+  npchat::bytestream readPreview(std::uint32_t user_id, npchat::AttachmentId attachment_id);
+};
@@ -0,0 +1,804 @@
+#include "MessageArchive.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <tuple>
+
+namespace {
+// Schema of a partition file, attached to the archiver connection as `cold`.
+// Attachment metadata is inlined so a partition doesn't depend on the main database.
+constexpr const char* partition_ddl =
+  "CREATE TABLE IF NOT EXISTS cold.messages ("
+  "  id INTEGER PRIMARY KEY,"
+  "  chat_id INTEGER NOT NULL,"
+  "  sender_id INTEGER NOT NULL,"
+  "  content TEXT NOT NULL,"
+  "  timestamp INTEGER NOT NULL,"
+  "  attachment_id INTEGER NULL,"
+  "  attachment_type INTEGER NULL,"
+  "  attachment_name TEXT NULL,"
+  "  attachment_size INTEGER NULL,"
+  "  attachment_hash TEXT NULL);"
+  "CREATE INDEX IF NOT EXISTS cold.idx_messages_chat_id ON messages(chat_id, id);"
+  "CREATE INDEX IF NOT EXISTS cold.idx_messages_attachment ON messages(attachment_id);";
+
+constexpr const char* archiver_ddl =
+  "CREATE TEMP TABLE IF NOT EXISTS archive_batch (id INTEGER PRIMARY KEY, chat_id INTEGER NOT NULL, attachment_id INTEGER NULL);"
+  "CREATE TEMP TABLE IF NOT EXISTS tombstone_batch (chat_id INTEGER NOT NULL, message_id INTEGER NOT NULL, "
+  "  PRIMARY KEY (chat_id, message_id)) WITHOUT ROWID;";
+
+// A message is archivable once moving it can't change what the triggers maintain:
+// nobody is waiting for it, every participant but the sender has read past it and
+// it isn't its chat's preview. {0} is the messages table or its alias.
+constexpr const char* archivable_sql =
+  "NOT EXISTS (SELECT 1 FROM main.delivery_queue q WHERE q.message_id = {0}.id) "
+  "AND {0}.id != COALESCE((SELECT s.last_message_id FROM main.chat_summary s WHERE s.chat_id = {0}.chat_id), 0) "
+  "AND NOT EXISTS (SELECT 1 FROM main.chat_participants p WHERE p.chat_id = {0}.chat_id "
+  "  AND p.user_id != {0}.sender_id AND p.last_read_message_id < {0}.id) "
+  // Content written inline by older versions stays until it is moved to the BlobStore
+  "AND NOT EXISTS (SELECT 1 FROM main.attachments a WHERE a.id = {0}.attachment_id AND a.hash IS NULL)";
+
+constexpr const char* copy_batch_sql =
+  "INSERT OR IGNORE INTO cold.messages (id, chat_id, sender_id, content, timestamp, "
+  "  attachment_id, attachment_type, attachment_name, attachment_size, attachment_hash) "
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, a.type, a.name, a.size, a.hash "
+  "FROM main.messages m LEFT JOIN main.attachments a ON a.id = m.attachment_id "
+  "WHERE m.id IN (SELECT id FROM temp.archive_batch)";
+
+constexpr const char* partition_bounds_sql =
+  "SELECT MIN(id), MAX(id), COUNT(*) FROM cold.messages";
+
+constexpr const char* record_partition_sql =
+  "INSERT INTO main.message_partitions "
+  "  (month, path, start_time, end_time, first_message_id, last_message_id, message_count, chats_indexed) "
+  "VALUES (?, ?, ?, ?, ?, ?, ?, ?) "
+  "ON CONFLICT (month) DO UPDATE SET first_message_id = excluded.first_message_id, "
+  "  last_message_id = excluded.last_message_id, message_count = excluded.message_count";
+
+// The ranges of the chats in the batch, now that its messages are in the partition
+constexpr const char* record_chat_ranges_sql =
+  "INSERT INTO main.message_partition_chats (chat_id, month, first_message_id, last_message_id) "
+  "SELECT chat_id, ?1, MIN(id), MAX(id) FROM cold.messages "
+  "WHERE chat_id IN (SELECT chat_id FROM temp.archive_batch) GROUP BY chat_id "
+  "ON CONFLICT (chat_id, month) DO UPDATE SET first_message_id = excluded.first_message_id, "
+  "  last_message_id = excluded.last_message_id";
+
+// The ranges of every chat in the partition
+constexpr const char* index_chat_ranges_sql =
+  "INSERT OR REPLACE INTO main.message_partition_chats (chat_id, month, first_message_id, last_message_id) "
+  "SELECT chat_id, ?1, MIN(id), MAX(id) FROM cold.messages GROUP BY chat_id";
+
+constexpr const char* mark_chats_indexed_sql =
+  "UPDATE main.message_partitions SET chats_indexed = 1 WHERE month = ?";
+
+// On the main database: the chat's id range in each partition indexed by chat
+constexpr std::string_view chat_ranges_sql =
+  "SELECT month, first_message_id, last_message_id FROM message_partition_chats WHERE chat_id = ? ORDER BY month";
+
+constexpr const char* insert_tombstone_sql =
+  "INSERT OR IGNORE INTO archive_tombstones (chat_id, message_id) VALUES (?, ?)";
+
+// 0 comes first if the whole chat was deleted
+constexpr std::string_view chat_tombstones_sql =
+  "SELECT message_id FROM archive_tombstones WHERE chat_id = ? ORDER BY message_id";
+
+constexpr std::string_view message_tombstoned_sql =
+  "SELECT 1 FROM archive_tombstones WHERE chat_id = ? AND message_id IN (0, ?)";
+
+// The tombstones one pass applies; those recorded meanwhile wait for the next
+constexpr const char* select_tombstones_sql =
+  "DELETE FROM temp.tombstone_batch;"
+  "INSERT INTO temp.tombstone_batch SELECT chat_id, message_id FROM main.archive_tombstones;";
+
+constexpr std::string_view tombstone_batch_sql =
+  "SELECT message_id FROM temp.tombstone_batch";
+
+constexpr const char* delete_tombstoned_messages_sql =
+  "DELETE FROM cold.messages WHERE id IN (SELECT message_id FROM temp.tombstone_batch WHERE message_id != 0)";
+
+constexpr const char* delete_tombstoned_chats_sql =
+  "DELETE FROM cold.messages WHERE chat_id IN (SELECT chat_id FROM temp.tombstone_batch WHERE message_id = 0)";
+
+// The ranges of the chats that lost messages, recorded anew; none for a chat with nothing left
+constexpr const char* forget_chat_ranges_sql =
+  "DELETE FROM main.message_partition_chats WHERE month = ?1 "
+  "AND chat_id IN (SELECT chat_id FROM temp.tombstone_batch)";
+
+constexpr const char* rerecord_chat_ranges_sql =
+  "INSERT INTO main.message_partition_chats (chat_id, month, first_message_id, last_message_id) "
+  "SELECT chat_id, ?1, MIN(id), MAX(id) FROM cold.messages "
+  "WHERE chat_id IN (SELECT chat_id FROM temp.tombstone_batch) GROUP BY chat_id";
+
+constexpr const char* recount_partition_sql =
+  "UPDATE main.message_partitions SET message_count = (SELECT COUNT(*) FROM cold.messages) WHERE month = ?";
+
+constexpr const char* delete_tombstones_sql =
+  "DELETE FROM main.archive_tombstones "
+  "WHERE (chat_id, message_id) IN (SELECT chat_id, message_id FROM temp.tombstone_batch)";
+
+// Read-only queries on a partition file, returning the columns message_from_row() expects
+constexpr std::string_view partition_before_sql =
+  "SELECT id, chat_id, sender_id, content, timestamp, attachment_id, "
+  "       attachment_type, attachment_name, attachment_size "
+  "FROM messages WHERE chat_id = ? AND id < ? ORDER BY id DESC LIMIT ?";
+
+constexpr std::string_view partition_oldest_sql =
+  "SELECT id, chat_id, sender_id, content, timestamp, attachment_id, "
+  "       attachment_type, attachment_name, attachment_size "
+  "FROM messages WHERE chat_id = ? ORDER BY id ASC LIMIT ?";
+
+constexpr std::string_view partition_range_sql =
+  "SELECT id, chat_id, sender_id, content, timestamp, attachment_id, "
+  "       attachment_type, attachment_name, attachment_size "
+  "FROM messages WHERE chat_id = ? AND timestamp BETWEEN ? AND ? ORDER BY id ASC";
+
+constexpr std::string_view partition_attachment_sql =
+  "SELECT attachment_hash, chat_id, id FROM messages WHERE attachment_id = ? LIMIT 1";
+
+constexpr std::string_view partition_sender_sql =
+  "SELECT chat_id, sender_id FROM messages WHERE id = ?";
+
+constexpr int partition_flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+
+npchat::ChatMessage message_from_row(sqlite3_stmt* stmt) {
+  npchat::ChatMessage msg;
+  msg.messageId = sqlite3_column_int(stmt, 0);
+  msg.chatId = sqlite3_column_int(stmt, 1);
+  msg.senderId = sqlite3_column_int(stmt, 2);
+  const char* content_text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+  msg.content.text = content_text ? content_text : "";
+  msg.timestamp = sqlite3_column_int64(stmt, 4);
+
+  if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+    npchat::ChatAttachment attachment;
+    attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(stmt, 6));
+    const char* attachment_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 7));
+    attachment.name = attachment_name ? attachment_name : "";
+    attachment.id = sqlite3_column_int(stmt, 5);
+    attachment.size = static_cast<std::uint32_t>(sqlite3_column_int64(stmt, 8));
+
+    msg.content.attachment = attachment;
+  }
+
+  return msg;
+}
+
+// Leaves out the `deleted` ids (ascending), which are still in the partition until the next pass
+void append_rows(sqlite3_stmt* stmt, std::vector<npchat::ChatMessage>& messages,
+                 const std::vector<npchat::MessageId>& deleted) {
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto id = static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 0));
+    if (std::binary_search(deleted.begin(), deleted.end(), id)) continue;
+    messages.push_back(message_from_row(stmt));
+  }
+  sqlite3_reset(stmt);
+}
+
+// Rows from the main database come first, so the stable sort keeps them over their archived copies
+void sort_unique(std::vector<npchat::ChatMessage>& messages, auto&& less) {
+  std::stable_sort(messages.begin(), messages.end(), less);
+  auto last = std::unique(messages.begin(), messages.end(),
+    [](const npchat::ChatMessage& a, const npchat::ChatMessage& b) { return a.messageId == b.messageId; });
+  messages.erase(last, messages.end());
+}
+
+bool newer(const npchat::ChatMessage& a, const npchat::ChatMessage& b) {
+  return a.messageId > b.messageId;
+}
+
+bool older(const npchat::ChatMessage& a, const npchat::ChatMessage& b) {
+  return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.messageId < b.messageId;
+}
+
+void step(sqlite3* db, sqlite3_stmt* stmt, const char* what) {
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+    throw std::runtime_error(fmt::format("{}: {}", what, sqlite3_errmsg(db)));
+  }
+}
+
+// Runs f in a write transaction on the connection
+template<typename F>
+void in_transaction(sqlite3* db, F&& f) {
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    throw std::runtime_error(fmt::format("Failed to begin transaction: {}", sqlite3_errmsg(db)));
+  }
+  try {
+    f();
+    if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+      throw std::runtime_error(fmt::format("Failed to commit: {}", sqlite3_errmsg(db)));
+    }
+  } catch (...) {
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    throw;
+  }
+}
+
+// A partition file attached to the archiver connection as `cold`. Statements on
+// `cold` only live while it is attached, so they are prepared through this.
+class AttachedPartition {
+  Database::Connection& conn_;
+  std::vector<sqlite3_stmt*> statements_;
+
+public:
+  AttachedPartition(Database::Connection& conn, const std::string& path)
+    : conn_(conn)
+  {
+    auto attach = conn_.prepareStatement("ATTACH DATABASE ? AS cold");
+    sqlite3_bind_text(attach, 1, path.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(attach);
+    sqlite3_finalize(attach);
+    if (rc != SQLITE_DONE) {
+      throw std::runtime_error(fmt::format("Failed to open partition {}: {}", path, sqlite3_errmsg(conn_.handle())));
+    }
+  }
+
+  ~AttachedPartition() {
+    for (auto stmt : statements_) sqlite3_finalize(stmt);
+    sqlite3_exec(conn_.handle(), "DETACH DATABASE cold", nullptr, nullptr, nullptr);
+  }
+
+  AttachedPartition(const AttachedPartition&) = delete;
+  AttachedPartition& operator=(const AttachedPartition&) = delete;
+
+  sqlite3_stmt* prepare(const char* sql) {
+    return statements_.emplace_back(conn_.prepareStatement(sql));
+  }
+};
+} // namespace
+
+MessageArchive::MessageArchive(const std::shared_ptr<Database>& database, Options options)
+  : db_(database)
+  , options_(std::move(options))
+  , insert_tombstone_stmt_(db_->prepareStatement(insert_tombstone_sql))
+{
+  loadPartitions();
+
+  // Without archiving the worker still removes deleted messages from existing partitions
+  if (options_.hot_months == 0 && partitions_.empty()) return;
+
+  std::filesystem::create_directories(options_.directory);
+  worker_ = std::thread(&MessageArchive::run, this);
+
+  spdlog::info("MessageArchive started: {} hot months, partitions in {}",
+               options_.hot_months, options_.directory.generic_string());
+}
+
+MessageArchive::~MessageArchive() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  if (worker_.joinable()) worker_.join();
+  sqlite3_finalize(insert_tombstone_stmt_);
+}
+
+void MessageArchive::loadPartitions() {
+  auto stmt = db_->prepareStatement(
+    "SELECT month, path, start_time, end_time, first_message_id, last_message_id, chats_indexed "
+    "FROM message_partitions ORDER BY month");
+
+  std::unique_lock lock(partitions_mutex_);
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto partition = std::make_shared<Partition>();
+    partition->month = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    partition->start_time = sqlite3_column_int64(stmt, 2);
+    partition->end_time = sqlite3_column_int64(stmt, 3);
+    partition->first_message_id = static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 4));
+    partition->last_message_id = static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 5));
+    partition->chats_indexed = sqlite3_column_int(stmt, 6) != 0;
+    partition->handle = std::make_shared<Handle>();
+    partition->handle->path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+
+    if (!std::filesystem::exists(partition->handle->path)) {
+      spdlog::error("[MessageArchive] Partition {} is missing: {}", partition->month, partition->handle->path);
+    }
+    partitions_.push_back(std::move(partition));
+  }
+  sqlite3_finalize(stmt);
+
+  if (!partitions_.empty()) {
+    spdlog::info("[MessageArchive] {} partitions, {} to {}",
+                 partitions_.size(), partitions_.front()->month, partitions_.back()->month);
+  }
+}
+
+MessageArchive::Partitions MessageArchive::snapshot() const {
+  std::shared_lock lock(partitions_mutex_);
+  return partitions_;
+}
+
+bool MessageArchive::empty() const {
+  std::shared_lock lock(partitions_mutex_);
+  return partitions_.empty();
+}
+
+void MessageArchive::publish(std::shared_ptr<const Partition> partition) {
+  std::unique_lock lock(partitions_mutex_);
+  auto it = std::lower_bound(partitions_.begin(), partitions_.end(), partition->month,
+    [](const std::shared_ptr<const Partition>& p, const std::string& month) { return p->month < month; });
+  if (it != partitions_.end() && (*it)->month == partition->month) {
+    *it = std::move(partition);
+  } else {
+    partitions_.insert(it, std::move(partition));
+  }
+}
+
+std::vector<MessageArchive::ChatRange> MessageArchive::rangesOf(npchat::ChatId chat_id,
+                                                                std::vector<npchat::MessageId>& deleted) {
+  std::vector<ChatRange> ranges;
+  deleted.clear();
+  auto partitions = snapshot();
+  if (partitions.empty()) return ranges;
+
+  std::vector<std::tuple<std::string, npchat::MessageId, npchat::MessageId>> recorded; // Ascending by month
+  {
+    auto reader = db_->reader();
+    auto tombstones = reader.statement(chat_tombstones_sql);
+    sqlite3_bind_int(tombstones, 1, chat_id);
+    while (sqlite3_step(tombstones) == SQLITE_ROW) {
+      deleted.push_back(static_cast<npchat::MessageId>(sqlite3_column_int64(tombstones, 0)));
+    }
+    sqlite3_reset(tombstones);
+    if (!deleted.empty() && deleted.front() == 0) return ranges;
+
+    auto stmt = reader.statement(chat_ranges_sql);
+    sqlite3_bind_int(stmt, 1, chat_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      recorded.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                            static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 1)),
+                            static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 2)));
+    }
+    sqlite3_reset(stmt);
+  }
+
+  auto row = recorded.begin();
+  for (auto& partition : partitions) {
+    // Without recorded ranges any partition may hold some of the chat
+    if (!partition->chats_indexed) {
+      ranges.push_back({partition, partition->first_message_id, partition->last_message_id});
+      continue;
+    }
+    while (row != recorded.end() && std::get<0>(*row) < partition->month) ++row;
+    if (row != recorded.end() && std::get<0>(*row) == partition->month) {
+      ranges.push_back({std::move(partition), std::get<1>(*row), std::get<2>(*row)});
+    }
+  }
+  return ranges;
+}
+
+template<typename F>
+void MessageArchive::query(const Partition& partition, F&& f) {
+  auto& handle = *partition.handle;
+
+  Database::Connection* conn = nullptr;
+  {
+    std::unique_lock lock(handle.mutex);
+    if (handle.free_conns.empty() && handle.conns.size() < std::max<std::size_t>(1, options_.partition_readers)) {
+      handle.conns.push_back(std::make_unique<Database::Connection>(handle.path, partition_flags));
+      handle.free_conns.push_back(handle.conns.back().get());
+    }
+    handle.cv.wait(lock, [&handle] { return !handle.free_conns.empty(); });
+    conn = handle.free_conns.back();
+    handle.free_conns.pop_back();
+  }
+
+  // Back to the pool even if f throws
+  struct Release {
+    Handle& handle;
+    Database::Connection* conn;
+
+    ~Release() {
+      {
+        std::lock_guard lock(handle.mutex);
+        handle.free_conns.push_back(conn);
+      }
+      handle.cv.notify_one();
+    }
+  } release{handle, conn};
+
+  f(*conn);
+}
+
+void MessageArchive::mergeBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id, std::uint32_t limit,
+                                 std::vector<npchat::ChatMessage>& newest_first) {
+  if (limit == 0) return;
+  const sqlite3_int64 before = before_message_id ? before_message_id : std::numeric_limits<sqlite3_int64>::max();
+
+  std::vector<npchat::MessageId> deleted;
+  auto ranges = rangesOf(chat_id, deleted);
+  for (auto it = ranges.rbegin(); it != ranges.rend(); ++it) {
+    if (it->first_message_id >= before) continue;
+    // The page is full of messages newer than anything of the chat in this partition
+    if (newest_first.size() >= limit && newest_first[limit - 1].messageId > it->last_message_id) continue;
+
+    query(*it->partition, [&](Database::Connection& conn) {
+      auto stmt = conn.statement(partition_before_sql);
+      sqlite3_bind_int(stmt, 1, chat_id);
+      sqlite3_bind_int64(stmt, 2, before);
+      sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit + deleted.size()));
+      append_rows(stmt, newest_first, deleted);
+    });
+
+    sort_unique(newest_first, newer);
+    if (newest_first.size() > limit) newest_first.resize(limit);
+  }
+}
+
+void MessageArchive::mergeOldest(npchat::ChatId chat_id, std::uint32_t count, std::vector<npchat::ChatMessage>& oldest_first) {
+  if (count == 0) return;
+  std::vector<npchat::MessageId> deleted;
+  for (const auto& range : rangesOf(chat_id, deleted)) {
+    const auto& partition = *range.partition;
+    if (oldest_first.size() >= count &&
+        static_cast<std::int64_t>(oldest_first[count - 1].timestamp) < partition.start_time) continue;
+
+    query(partition, [&](Database::Connection& conn) {
+      auto stmt = conn.statement(partition_oldest_sql);
+      sqlite3_bind_int(stmt, 1, chat_id);
+      sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(count + deleted.size()));
+      append_rows(stmt, oldest_first, deleted);
+    });
+
+    sort_unique(oldest_first, older);
+    if (oldest_first.size() > count) oldest_first.resize(count);
+  }
+}
+
+void MessageArchive::mergeRange(npchat::ChatId chat_id, std::uint64_t start_time, std::uint64_t end_time,
+                                std::vector<npchat::ChatMessage>& oldest_first) {
+  bool merged = false;
+  std::vector<npchat::MessageId> deleted;
+  for (const auto& range : rangesOf(chat_id, deleted)) {
+    const auto& partition = *range.partition;
+    if (partition.end_time <= static_cast<std::int64_t>(start_time) ||
+        partition.start_time > static_cast<std::int64_t>(end_time)) continue;
+
+    query(partition, [&](Database::Connection& conn) {
+      auto stmt = conn.statement(partition_range_sql);
+      sqlite3_bind_int(stmt, 1, chat_id);
+      sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(start_time));
+      sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(end_time));
+      append_rows(stmt, oldest_first, deleted);
+    });
+    merged = true;
+  }
+
+  if (merged) sort_unique(oldest_first, older);
+}
+
+std::optional<MessageStore::AttachmentRef> MessageArchive::findAttachment(npchat::AttachmentId attachment_id) {
+  std::optional<MessageStore::AttachmentRef> ref;
+  npchat::MessageId message_id = 0;
+
+  auto partitions = snapshot();
+  for (auto it = partitions.rbegin(); it != partitions.rend() && !ref; ++it) {
+    query(**it, [&](Database::Connection& conn) {
+      auto stmt = conn.statement(partition_attachment_sql);
+      sqlite3_bind_int(stmt, 1, attachment_id);
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        ref = MessageStore::AttachmentRef{hash ? hash : "", static_cast<npchat::ChatId>(sqlite3_column_int(stmt, 1))};
+        message_id = static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 2));
+      }
+      sqlite3_reset(stmt);
+    });
+  }
+  if (ref && tombstoned(ref->chat_id, message_id)) ref.reset();
+  return ref;
+}
+
+bool MessageArchive::tombstoned(npchat::ChatId chat_id, npchat::MessageId message_id) {
+  auto reader = db_->reader();
+  auto stmt = reader.statement(message_tombstoned_sql);
+  sqlite3_bind_int(stmt, 1, chat_id);
+  sqlite3_bind_int64(stmt, 2, message_id);
+  bool found = sqlite3_step(stmt) == SQLITE_ROW;
+  sqlite3_reset(stmt);
+  return found;
+}
+
+void MessageArchive::addTombstone(npchat::ChatId chat_id, npchat::MessageId message_id) {
+  std::lock_guard lock(writer_mutex_);
+  sqlite3_bind_int(insert_tombstone_stmt_, 1, chat_id);
+  sqlite3_bind_int64(insert_tombstone_stmt_, 2, message_id);
+  int rc = sqlite3_step(insert_tombstone_stmt_);
+  sqlite3_reset(insert_tombstone_stmt_);
+  if (rc != SQLITE_DONE) {
+    throw std::runtime_error(fmt::format("Failed to record deleted messages: {}", sqlite3_errmsg(db_->getConnection())));
+  }
+}
+
+void MessageArchive::deleteChat(npchat::ChatId chat_id) {
+  // Nothing is or will be archived
+  if (!worker_.joinable()) return;
+  addTombstone(chat_id, 0);
+}
+
+void MessageArchive::deleteMessage(npchat::ChatId chat_id, npchat::MessageId message_id) {
+  if (!worker_.joinable()) return;
+  addTombstone(chat_id, message_id);
+}
+
+npchat::ChatId MessageArchive::deleteArchivedMessage(npchat::MessageId message_id, std::uint32_t sender_id) {
+  std::optional<std::pair<npchat::ChatId, std::uint32_t>> found; // Chat and sender
+
+  auto partitions = snapshot();
+  for (auto it = partitions.rbegin(); it != partitions.rend() && !found; ++it) {
+    if (message_id < (*it)->first_message_id || message_id > (*it)->last_message_id) continue;
+    query(**it, [&](Database::Connection& conn) {
+      auto stmt = conn.statement(partition_sender_sql);
+      sqlite3_bind_int64(stmt, 1, message_id);
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        found.emplace(static_cast<npchat::ChatId>(sqlite3_column_int(stmt, 0)),
+                      static_cast<std::uint32_t>(sqlite3_column_int(stmt, 1)));
+      }
+      sqlite3_reset(stmt);
+    });
+  }
+
+  if (!found || found->second != sender_id || tombstoned(found->first, message_id)) return 0;
+  addTombstone(found->first, message_id);
+  return found->first;
+}
+
+bool MessageArchive::stopping() {
+  std::lock_guard lock(mutex_);
+  return stop_;
+}
+
+void MessageArchive::run() {
+  std::unique_lock lock(mutex_);
+
+  for (;;) {
+    // The first pass waits too, so it never competes with startup for the writer
+    if (cv_.wait_for(lock, options_.interval, [this] { return stop_; })) break;
+    lock.unlock();
+
+    try {
+      if (!conn_) prepareArchiver();
+      indexPartitions();
+      applyTombstones();
+
+      using namespace std::chrono;
+      const year_month_day today{floor<days>(system_clock::now())};
+      const auto cutoff = sys_seconds{sys_days{(year_month{today.year(), today.month()} - months{options_.hot_months}) / 1}};
+
+      std::size_t moved = 0;
+      // Only tombstones to apply when archiving is off
+      while (options_.hot_months != 0 && !stopping()) {
+        // The oldest archivable message decides which month is archived next
+        std::int64_t timestamp = 0;
+        sqlite3_bind_int64(oldest_archivable_stmt_, 1, cutoff.time_since_epoch().count());
+        bool found = sqlite3_step(oldest_archivable_stmt_) == SQLITE_ROW;
+        if (found) timestamp = sqlite3_column_int64(oldest_archivable_stmt_, 0);
+        sqlite3_reset(oldest_archivable_stmt_);
+
+        if (!found) break;
+        auto month_moved = archiveMonth(timestamp);
+        if (month_moved == 0) break; // Raced with the chat; next pass
+        moved += month_moved;
+      }
+
+      if (moved) spdlog::info("[MessageArchive] Archived {} messages", moved);
+    } catch (const std::exception& e) {
+      spdlog::error("[MessageArchive] Archiving failed: {}", e.what());
+      // Start over with a fresh connection
+      finalizeArchiver();
+    }
+
+    lock.lock();
+  }
+
+  finalizeArchiver();
+}
+
+void MessageArchive::prepareArchiver() {
+  conn_ = db_->openConnection(false);
+  conn_->execute(archiver_ddl);
+
+  oldest_archivable_stmt_ = conn_->prepareStatement(fmt::format(
+    "SELECT m.timestamp FROM main.messages m WHERE m.timestamp < ?1 AND {} ORDER BY m.id LIMIT 1",
+    fmt::format(archivable_sql, "m")));
+
+  select_batch_stmt_ = conn_->prepareStatement(fmt::format(
+    "INSERT INTO temp.archive_batch (id, chat_id, attachment_id) "
+    "SELECT m.id, m.chat_id, m.attachment_id FROM main.messages m "
+    "WHERE m.timestamp >= ?1 AND m.timestamp < ?2 AND {} ORDER BY m.id LIMIT ?3",
+    fmt::format(archivable_sql, "m")));
+
+  // Checked again under the write lock, so a row that changed since the copy stays
+  delete_messages_stmt_ = conn_->prepareStatement(fmt::format(
+    "DELETE FROM main.messages WHERE id IN (SELECT id FROM temp.archive_batch) AND {}",
+    fmt::format(archivable_sql, "messages")));
+
+  delete_attachments_stmt_ = conn_->prepareStatement(
+    "DELETE FROM main.attachments WHERE id IN ("
+    "  SELECT b.attachment_id FROM temp.archive_batch b WHERE b.attachment_id IS NOT NULL "
+    "    AND NOT EXISTS (SELECT 1 FROM main.messages m WHERE m.id = b.id))");
+}
+
+void MessageArchive::finalizeArchiver() noexcept {
+  for (auto stmt : {&oldest_archivable_stmt_, &select_batch_stmt_, &delete_messages_stmt_, &delete_attachments_stmt_}) {
+    sqlite3_finalize(*stmt);
+    *stmt = nullptr;
+  }
+  conn_.reset();
+}
+
+std::size_t MessageArchive::archiveMonth(std::int64_t timestamp) {
+  using namespace std::chrono;
+  const year_month_day day{floor<days>(sys_seconds{seconds{timestamp}})};
+  const year_month month{day.year(), day.month()};
+  const auto start_time = sys_seconds{sys_days{month / 1}}.time_since_epoch().count();
+  const auto end_time = sys_seconds{sys_days{(month + months{1}) / 1}}.time_since_epoch().count();
+  const auto name = fmt::format("{:04}-{:02}", static_cast<int>(month.year()), static_cast<unsigned>(month.month()));
+
+  std::shared_ptr<Handle> handle;
+  bool chats_indexed = true; // A new partition has the ranges of its chats from the start
+  for (const auto& p : snapshot()) {
+    if (p->month == name) {
+      handle = p->handle;
+      chats_indexed = p->chats_indexed;
+    }
+  }
+  if (!handle) {
+    handle = std::make_shared<Handle>();
+    handle->path = (options_.directory / fmt::format("messages-{}.sqlite3", name)).generic_string();
+  }
+
+  auto db = conn_->handle();
+  AttachedPartition cold(*conn_, handle->path);
+
+  conn_->execute(partition_ddl);
+  auto copy_batch = cold.prepare(copy_batch_sql);
+  auto bounds = cold.prepare(partition_bounds_sql);
+  auto record = cold.prepare(record_partition_sql);
+  auto record_chats = cold.prepare(record_chat_ranges_sql);
+
+  std::size_t moved = 0;
+  while (!stopping()) {
+    conn_->execute("DELETE FROM temp.archive_batch;");
+    sqlite3_bind_int64(select_batch_stmt_, 1, start_time);
+    sqlite3_bind_int64(select_batch_stmt_, 2, end_time);
+    sqlite3_bind_int64(select_batch_stmt_, 3, static_cast<sqlite3_int64>(options_.batch_size));
+    step(db, select_batch_stmt_, "Failed to select messages to archive");
+    if (sqlite3_changes(db) == 0) break;
+
+    step(db, copy_batch, "Failed to copy messages to the partition");
+
+    auto partition = std::make_shared<Partition>();
+    partition->month = name;
+    partition->start_time = start_time;
+    partition->end_time = end_time;
+    partition->chats_indexed = chats_indexed;
+    partition->handle = handle;
+    sqlite3_int64 message_count = 0;
+    if (sqlite3_step(bounds) == SQLITE_ROW) {
+      partition->first_message_id = static_cast<npchat::MessageId>(sqlite3_column_int64(bounds, 0));
+      partition->last_message_id = static_cast<npchat::MessageId>(sqlite3_column_int64(bounds, 1));
+      message_count = sqlite3_column_int64(bounds, 2);
+    }
+    sqlite3_reset(bounds);
+
+    // Readers see the copies before the originals go away. The chat ranges only need
+    // to be there once the originals are gone, so they commit with the delete.
+    publish(partition);
+
+    int deleted = 0;
+    in_transaction(db, [&] {
+      step(db, delete_messages_stmt_, "Failed to delete archived messages");
+      deleted = sqlite3_changes(db);
+      step(db, delete_attachments_stmt_, "Failed to delete archived attachments");
+
+      sqlite3_bind_text(record, 1, name.c_str(), -1, SQLITE_STATIC);
+      sqlite3_bind_text(record, 2, handle->path.c_str(), -1, SQLITE_STATIC);
+      sqlite3_bind_int64(record, 3, start_time);
+      sqlite3_bind_int64(record, 4, end_time);
+      sqlite3_bind_int64(record, 5, partition->first_message_id);
+      sqlite3_bind_int64(record, 6, partition->last_message_id);
+      sqlite3_bind_int64(record, 7, message_count);
+      sqlite3_bind_int(record, 8, chats_indexed ? 1 : 0);
+      step(db, record, "Failed to record the partition");
+
+      sqlite3_bind_text(record_chats, 1, name.c_str(), -1, SQLITE_STATIC);
+      step(db, record_chats, "Failed to record the chats of the partition");
+    });
+
+    moved += static_cast<std::size_t>(deleted);
+    if (deleted == 0) break;
+  }
+
+  if (moved) {
+    // Appends leave free pages behind; the partition is read-only from here on
+    conn_->execute("VACUUM cold;");
+    spdlog::info("[MessageArchive] Moved {} messages to {}", moved, handle->path);
+  }
+  return moved;
+}
+
+void MessageArchive::indexPartitions() {
+  for (const auto& p : snapshot()) {
+    if (p->chats_indexed || stopping()) continue;
+    // A missing file was reported at startup; attaching it would create an empty one
+    if (!std::filesystem::exists(p->handle->path)) continue;
+
+    auto db = conn_->handle();
+    AttachedPartition cold(*conn_, p->handle->path);
+    auto index = cold.prepare(index_chat_ranges_sql);
+    auto mark = cold.prepare(mark_chats_indexed_sql);
+
+    in_transaction(db, [&] {
+      sqlite3_bind_text(index, 1, p->month.c_str(), -1, SQLITE_STATIC);
+      step(db, index, "Failed to record the chats of the partition");
+      sqlite3_bind_text(mark, 1, p->month.c_str(), -1, SQLITE_STATIC);
+      step(db, mark, "Failed to record the partition");
+    });
+
+    auto partition = std::make_shared<Partition>(*p);
+    partition->chats_indexed = true;
+    publish(std::move(partition));
+    spdlog::info("[MessageArchive] Recorded the chats of partition {}", p->month);
+  }
+}
+
+void MessageArchive::applyTombstones() {
+  auto db = conn_->handle();
+  conn_->execute(select_tombstones_sql);
+
+  bool whole_chats = false;
+  std::vector<npchat::MessageId> message_ids;
+  {
+    auto stmt = conn_->statement(tombstone_batch_sql);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      auto id = static_cast<npchat::MessageId>(sqlite3_column_int64(stmt, 0));
+      if (id == 0) {
+        whole_chats = true;
+      } else {
+        message_ids.push_back(id);
+      }
+    }
+    sqlite3_reset(stmt);
+  }
+  if (!whole_chats && message_ids.empty()) return;
+
+  for (const auto& p : snapshot()) {
+    if (stopping()) return; // The tombstones stay for the next pass
+    bool touched = whole_chats || std::any_of(message_ids.begin(), message_ids.end(), [&p](npchat::MessageId id) {
+      return id >= p->first_message_id && id <= p->last_message_id;
+    });
+    if (!touched || !std::filesystem::exists(p->handle->path)) continue;
+
+    AttachedPartition cold(*conn_, p->handle->path);
+    auto delete_messages = cold.prepare(delete_tombstoned_messages_sql);
+    auto delete_chats = cold.prepare(delete_tombstoned_chats_sql);
+    auto forget_chats = cold.prepare(forget_chat_ranges_sql);
+    auto record_chats = cold.prepare(rerecord_chat_ranges_sql);
+    auto recount = cold.prepare(recount_partition_sql);
+
+    int removed = 0;
+    in_transaction(db, [&] {
+      step(db, delete_messages, "Failed to remove deleted messages from the partition");
+      removed = sqlite3_changes(db);
+      step(db, delete_chats, "Failed to remove deleted chats from the partition");
+      removed += sqlite3_changes(db);
+      if (removed == 0) return;
+
+      sqlite3_bind_text(forget_chats, 1, p->month.c_str(), -1, SQLITE_STATIC);
+      step(db, forget_chats, "Failed to record the chats of the partition");
+      sqlite3_bind_text(record_chats, 1, p->month.c_str(), -1, SQLITE_STATIC);
+      step(db, record_chats, "Failed to record the chats of the partition");
+      sqlite3_bind_text(recount, 1, p->month.c_str(), -1, SQLITE_STATIC);
+      step(db, recount, "Failed to record the partition");
+    });
+
+    if (removed) {
+      conn_->execute("VACUUM cold;");
+      spdlog::info("[MessageArchive] Removed {} deleted messages from {}", removed, p->handle->path);
+    }
+  }
+
+  conn_->execute(delete_tombstones_sql);
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sqlite3.h>
+#include "Database.hpp"
+#include "MessageStore.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Cold tier of the messages table: one SQLite file per calendar month.
+//
+// Every `interval` the worker moves messages older than the last `hot_months` whole
+// months out of the main database into messages-YYYY-MM.sqlite3 and compacts the
+// file. Only settled messages are moved: read by every participant, delivered to
+// all of them and not the last message of their chat, so the unread counters and
+// chat previews kept by the triggers stay exact. Attachment metadata goes with the
+// message; the content stays in the BlobStore.
+//
+// Partition files are only ever opened read-only for queries, through a small pool
+// of connections per file. message_partition_chats records each chat's id range in
+// each partition, so reading a chat only opens the partitions that hold some of it.
+// Archived messages can still be paged, fetched and deleted but no longer be edited
+// or found by search. A deletion records a tombstone in the main database that
+// readers filter on; the worker removes the rows from the partitions on its next
+// pass and drops the tombstone.
+//
+// A batch is copied to its partition before it is deleted from the main database,
+// in two transactions since WAL doesn't make them atomic across files. A message
+// can briefly be in both; readers merge the tiers and keep the main database's row.
+class MessageArchive {
+public:
+  struct Options {
+    std::filesystem::path directory;
+    unsigned hot_months = 0;                 // Whole months kept before the current one; 0 disables archiving
+    std::chrono::minutes interval{60};
+    std::size_t batch_size = 2000;           // Messages moved per transaction
+    std::size_t partition_readers = 1;       // Read-only connections per partition file, opened as needed
+  };
+
+private:
+  // The read-only connections of a partition file, shared by its snapshots
+  struct Handle {
+    std::string path;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::unique_ptr<Database::Connection>> conns;
+    std::vector<Database::Connection*> free_conns;
+  };
+
+  struct Partition {
+    std::string month; // YYYY-MM
+    std::int64_t start_time;  // [start_time, end_time) in unix seconds
+    std::int64_t end_time;
+    npchat::MessageId first_message_id;
+    npchat::MessageId last_message_id;
+    bool chats_indexed; // message_partition_chats has the ranges of all its chats
+    std::shared_ptr<Handle> handle;
+  };
+
+  using Partitions = std::vector<std::shared_ptr<const Partition>>;
+
+  // Where one chat's messages are in a partition
+  struct ChatRange {
+    std::shared_ptr<const Partition> partition;
+    npchat::MessageId first_message_id;
+    npchat::MessageId last_message_id;
+  };
+
+  std::shared_ptr<Database> db_;
+  const Options options_;
+
+  std::mutex writer_mutex_; // Serializes insert_tombstone_stmt_ on the shared writer
+  sqlite3_stmt* insert_tombstone_stmt_;
+
+  mutable std::shared_mutex partitions_mutex_;
+  Partitions partitions_; // Ascending by month
+
+  // Archiver state, used by the worker thread only
+  std::unique_ptr<Database::Connection> conn_;
+  sqlite3_stmt* oldest_archivable_stmt_ = nullptr;
+  sqlite3_stmt* select_batch_stmt_ = nullptr;
+  sqlite3_stmt* copy_batch_stmt_ = nullptr;
+  sqlite3_stmt* delete_messages_stmt_ = nullptr;
+  sqlite3_stmt* delete_attachments_stmt_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread worker_;
+
+  void loadPartitions();
+  Partitions snapshot() const;
+  void publish(std::shared_ptr<const Partition> partition);
+  // The partitions that may hold messages of the chat, ascending by month, and the
+  // ids of its archived messages that were deleted since, ascending. No ranges if
+  // the chat was deleted.
+  std::vector<ChatRange> rangesOf(npchat::ChatId chat_id, std::vector<npchat::MessageId>& deleted);
+  void addTombstone(npchat::ChatId chat_id, npchat::MessageId message_id);
+  // The message or its whole chat has a tombstone
+  bool tombstoned(npchat::ChatId chat_id, npchat::MessageId message_id);
+
+  void run();
+  void prepareArchiver();
+  bool stopping();
+  // Moves every archivable message of one month; returns how many were moved
+  std::size_t archiveMonth(std::int64_t timestamp);
+  // Records the chat ranges of partitions archived before they were kept
+  void indexPartitions();
+  // Removes the messages of the tombstones from the partitions, then the tombstones
+  void applyTombstones();
+  void finalizeArchiver() noexcept;
+
+  template<typename F>
+  void query(const Partition& partition, F&& f);
+
+public:
+  MessageArchive(const std::shared_ptr<Database>& database, Options options);
+  ~MessageArchive();
+
+  MessageArchive(const MessageArchive&) = delete;
+  MessageArchive& operator=(const MessageArchive&) = delete;
+
+  // No messages have been archived; callers can skip merging
+  bool empty() const;
+
+  // Merges archived messages into rows read from the main database. Each takes the
+  // main database's rows in the order described and leaves the result in that order.
+
+  // `newest_first`: the chat's messages before `before_message_id` (0 = newest), id descending, at most `limit`
+  void mergeBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id, std::uint32_t limit,
+                   std::vector<npchat::ChatMessage>& newest_first);
+  // `oldest_first`: the chat's `count` oldest messages, by timestamp
+  void mergeOldest(npchat::ChatId chat_id, std::uint32_t count, std::vector<npchat::ChatMessage>& oldest_first);
+  // `oldest_first`: the chat's messages with timestamps in [start_time, end_time], by timestamp
+  void mergeRange(npchat::ChatId chat_id, std::uint64_t start_time, std::uint64_t end_time,
+                  std::vector<npchat::ChatMessage>& oldest_first);
+
+  std::optional<MessageStore::AttachmentRef> findAttachment(npchat::AttachmentId attachment_id);
+
+  // After ChatService deleted the chat from the main database
+  void deleteChat(npchat::ChatId chat_id);
+  // After MessageService deleted the message from the main database; a copy may be in a partition already
+  void deleteMessage(npchat::ChatId chat_id, npchat::MessageId message_id);
+  // An archived message, if `sender_id` sent it; returns its chat or 0 if there is no such message
+  npchat::ChatId deleteArchivedMessage(npchat::MessageId message_id, std::uint32_t sender_id);
+};
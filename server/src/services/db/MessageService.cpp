@@ -1,290 +1,315 @@
 #include "MessageService.hpp"
+#include <algorithm>
 #include <chrono>
 
-MessageService::MessageService(const std::shared_ptr<Database>& database) : db_(database) {
-  get_undelivered_messages_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       u.username, a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "LEFT JOIN message_delivery md ON m.id = md.message_id AND md.user_id = ? "
-    "JOIN chat_participants cp ON m.chat_id = cp.chat_id "
-    "WHERE cp.user_id = ? AND md.message_id IS NULL "
-    "ORDER BY m.timestamp ASC");
-
-  mark_message_read_stmt_ = db_->prepareStatement(
-    "INSERT OR REPLACE INTO message_read (message_id, user_id, read_at) VALUES (?, ?, ?)");
-
-  get_unread_count_stmt_ = db_->prepareStatement(
-    "SELECT COUNT(*) FROM messages m "
-    "JOIN chat_participants cp ON m.chat_id = cp.chat_id "
-    "LEFT JOIN message_read mr ON m.id = mr.message_id AND mr.user_id = ? "
-    "WHERE cp.user_id = ? AND mr.message_id IS NULL AND m.sender_id != ?");
-
-  get_last_message_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       u.username, a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "WHERE m.chat_id = ? "
-    "ORDER BY m.timestamp DESC LIMIT 1");
-
+namespace {
+// Read-only queries, prepared on every reader connection on first use
+// Sum of the per-chat counters kept against the read watermarks
+constexpr std::string_view get_unread_count_sql =
+  "SELECT COALESCE(SUM(unread_count), 0) FROM chat_participants WHERE user_id = ?";
+
+constexpr std::string_view get_last_message_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       u.username, a.type, a.name, a.size "
+  "FROM messages m "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE m.chat_id = ? "
+  "ORDER BY m.timestamp DESC LIMIT 1";
+
+constexpr std::string_view get_message_history_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       u.username, a.type, a.name, a.size "
+  "FROM messages m "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE m.chat_id = ? AND m.timestamp BETWEEN ? AND ? "
+  "ORDER BY m.timestamp ASC";
+
+// Ranked full-text search over the chats the user participates in (?3 = 0: all of them)
+constexpr std::string_view search_messages_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       u.username, a.type, a.name, a.size, "
+  "       snippet(messages_fts, 0, char(2), char(3), '...', 16) "
+  "FROM messages_fts "
+  "JOIN messages m ON m.id = messages_fts.rowid "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE messages_fts MATCH ?1 "
+  "  AND m.chat_id IN (SELECT chat_id FROM chat_participants WHERE user_id = ?2) "
+  "  AND (?3 = 0 OR m.chat_id = ?3) "
+  "ORDER BY bm25(messages_fts) LIMIT ?4";
+
+constexpr std::string_view get_chat_last_activity_sql =
+  "SELECT MAX(timestamp) FROM messages WHERE chat_id = ?";
+
+// Moves the user's watermark in the message's chat forward to the message. The
+// recount only visits messages after it, none when the newest one is read.
+constexpr const char* mark_message_read_sql =
+  "UPDATE chat_participants SET last_read_message_id = ?1, "
+  "  unread_count = (SELECT COUNT(*) FROM messages m "
+  "    WHERE m.chat_id = chat_participants.chat_id AND m.id > ?1 AND m.sender_id != ?2) "
+  "WHERE user_id = ?2 AND last_read_message_id < ?1 "
+  "  AND chat_id = (SELECT chat_id FROM messages WHERE id = ?1)";
+
+constexpr std::uint32_t max_search_results = 100;
+constexpr std::uint32_t max_pending_messages = 500;
+
+// Turns user input into an FTS5 query: every word is quoted, so FTS5 operators in
+// the input are matched literally, and the last word also matches as a prefix
+std::string to_fts_query(std::string_view input) {
+  std::string query;
+  std::size_t pos = 0;
+  while (pos < input.size()) {
+    auto begin = input.find_first_not_of(" \t\r\n", pos);
+    if (begin == std::string_view::npos) break;
+    auto end = std::min(input.find_first_of(" \t\r\n", begin), input.size());
+
+    if (!query.empty()) query += ' ';
+    query += '"';
+    for (char c : input.substr(begin, end - begin)) {
+      if (c == '"') query += '"';
+      query += c;
+    }
+    query += '"';
+    pos = end;
+  }
+  if (!query.empty()) query += '*';
+  return query;
+}
+} // namespace
+
+MessageService::MessageService(const std::shared_ptr<Database>& database, const std::shared_ptr<MessageStore>& store,
+                               const std::shared_ptr<MessageArchive>& archive,
+                               const std::shared_ptr<ChatTailCache>& tail)
+  : db_(database)
+  , store_(store)
+  , archive_(archive)
+  , tail_(tail)
+  , lock_wait_(metrics::lock_wait("MessageService"))
+{
+  mark_message_read_stmt_ = db_->prepareStatement(mark_message_read_sql);
+
+  // The chat id tells which cached tail to drop
   delete_message_stmt_ = db_->prepareStatement(
-    "DELETE FROM messages WHERE id = ? AND sender_id = ?");
+    "DELETE FROM messages WHERE id = ? AND sender_id = ? RETURNING chat_id");
 
   update_message_stmt_ = db_->prepareStatement(
-    "UPDATE messages SET content = ? WHERE id = ? AND sender_id = ?");
-
-  get_message_history_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       u.username, a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "WHERE m.chat_id = ? AND m.timestamp BETWEEN ? AND ? "
-    "ORDER BY m.timestamp ASC");
-
-  search_messages_stmt_ = db_->prepareStatement(
-    "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
-    "       u.username, a.type, a.name, a.data "
-    "FROM messages m "
-    "JOIN users u ON m.sender_id = u.id "
-    "LEFT JOIN attachments a ON m.attachment_id = a.id "
-    "JOIN chat_participants cp ON m.chat_id = cp.chat_id "
-    "WHERE cp.user_id = ? AND m.content LIKE ? "
-    "ORDER BY m.timestamp DESC LIMIT ?");
-
-  get_chat_last_activity_stmt_ = db_->prepareStatement(
-    "SELECT MAX(timestamp) FROM messages WHERE chat_id = ?");
+    "UPDATE messages SET content = ? WHERE id = ? AND sender_id = ? RETURNING chat_id");
+
+  batch_writer_ = db_->openConnection(false);
+  batch_read_stmt_ = batch_writer_->prepareStatement(mark_message_read_sql);
 }
 
 MessageService::~MessageService() {
-  sqlite3_finalize(get_undelivered_messages_stmt_);
   sqlite3_finalize(mark_message_read_stmt_);
-  sqlite3_finalize(get_unread_count_stmt_);
-  sqlite3_finalize(get_last_message_stmt_);
   sqlite3_finalize(delete_message_stmt_);
   sqlite3_finalize(update_message_stmt_);
-  sqlite3_finalize(get_message_history_stmt_);
-  sqlite3_finalize(search_messages_stmt_);
-  sqlite3_finalize(get_chat_last_activity_stmt_);
+  sqlite3_finalize(batch_read_stmt_);
 }
 
-std::vector<npchat::ChatMessage> MessageService::getUndeliveredMessages(std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  std::vector<npchat::ChatMessage> messages;
-
-  sqlite3_bind_int(get_undelivered_messages_stmt_, 1, user_id);
-  sqlite3_bind_int(get_undelivered_messages_stmt_, 2, user_id);
-
-  while (sqlite3_step(get_undelivered_messages_stmt_) == SQLITE_ROW) {
-    npchat::ChatMessage msg = buildMessageFromRow(get_undelivered_messages_stmt_);
-    messages.push_back(std::move(msg));
-  }
-
-  sqlite3_reset(get_undelivered_messages_stmt_);
-  return messages;
+std::vector<npchat::ChatMessage> MessageService::getPendingMessages(std::uint32_t user_id,
+                                                                   npchat::MessageId after_message_id,
+                                                                   std::uint32_t limit) {
+  return store_->getPendingMessages(user_id, after_message_id, std::clamp<std::uint32_t>(limit, 1, max_pending_messages));
 }
 
 void MessageService::markMessageAsRead(npchat::MessageId message_id, std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
-    std::chrono::system_clock::now().time_since_epoch()).count();
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_int(mark_message_read_stmt_, 1, message_id);
   sqlite3_bind_int(mark_message_read_stmt_, 2, user_id);
-  sqlite3_bind_int64(mark_message_read_stmt_, 3, timestamp);
 
   sqlite3_step(mark_message_read_stmt_);
   sqlite3_reset(mark_message_read_stmt_);
 }
 
 std::uint32_t MessageService::getUnreadMessageCount(std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_unread_count_sql);
 
-  sqlite3_bind_int(get_unread_count_stmt_, 1, user_id);
-  sqlite3_bind_int(get_unread_count_stmt_, 2, user_id);
-  sqlite3_bind_int(get_unread_count_stmt_, 3, user_id);
+  sqlite3_bind_int(stmt, 1, user_id);
 
   std::uint32_t count = 0;
-  if (sqlite3_step(get_unread_count_stmt_) == SQLITE_ROW) {
-    count = sqlite3_column_int(get_unread_count_stmt_, 0);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    count = sqlite3_column_int(stmt, 0);
   }
 
-  sqlite3_reset(get_unread_count_stmt_);
+  sqlite3_reset(stmt);
   return count;
 }
 
 std::optional<npchat::ChatMessage> MessageService::getLastMessage(npchat::ChatId chat_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_last_message_sql);
 
-  sqlite3_bind_int(get_last_message_stmt_, 1, chat_id);
+  sqlite3_bind_int(stmt, 1, chat_id);
 
-  if (sqlite3_step(get_last_message_stmt_) == SQLITE_ROW) {
-    npchat::ChatMessage msg = buildMessageFromRow(get_last_message_stmt_);
-    sqlite3_reset(get_last_message_stmt_);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    npchat::ChatMessage msg = buildMessageFromRow(stmt);
+    sqlite3_reset(stmt);
     return msg;
   }
 
-  sqlite3_reset(get_last_message_stmt_);
+  sqlite3_reset(stmt);
   return std::nullopt;
 }
 
 bool MessageService::deleteMessage(npchat::MessageId message_id, std::uint32_t sender_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  npchat::ChatId chat_id = 0;
+  {
+    metrics::TimedLock lock(mutex_, lock_wait_);
 
-  sqlite3_bind_int(delete_message_stmt_, 1, message_id);
-  sqlite3_bind_int(delete_message_stmt_, 2, sender_id);
+    sqlite3_bind_int(delete_message_stmt_, 1, message_id);
+    sqlite3_bind_int(delete_message_stmt_, 2, sender_id);
 
-  bool success = (sqlite3_step(delete_message_stmt_) == SQLITE_DONE);
-  sqlite3_reset(delete_message_stmt_);
+    // A row comes back only if the message was the sender's
+    if (sqlite3_step(delete_message_stmt_) == SQLITE_ROW) chat_id = sqlite3_column_int(delete_message_stmt_, 0);
+    sqlite3_reset(delete_message_stmt_);
+  }
 
-  return success && sqlite3_changes(db_->getConnection()) > 0;
+  if (chat_id != 0) {
+    archive_->deleteMessage(chat_id, message_id);
+  } else {
+    // Not in the main database, so maybe archived; the partitions are read without mutex_
+    chat_id = archive_->deleteArchivedMessage(message_id, sender_id);
+  }
+
+  if (chat_id != 0) tail_->invalidate(chat_id);
+  return chat_id != 0;
 }
 
 bool MessageService::updateMessage(npchat::MessageId message_id, std::uint32_t sender_id, const std::string& new_content) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  metrics::TimedLock lock(mutex_, lock_wait_);
 
   sqlite3_bind_text(update_message_stmt_, 1, new_content.c_str(), -1, SQLITE_STATIC);
   sqlite3_bind_int(update_message_stmt_, 2, message_id);
   sqlite3_bind_int(update_message_stmt_, 3, sender_id);
 
-  bool success = (sqlite3_step(update_message_stmt_) == SQLITE_DONE);
+  // A row comes back only if the message was the sender's
+  bool success = (sqlite3_step(update_message_stmt_) == SQLITE_ROW);
+  npchat::ChatId chat_id = success ? sqlite3_column_int(update_message_stmt_, 0) : 0;
   sqlite3_reset(update_message_stmt_);
 
-  return success && sqlite3_changes(db_->getConnection()) > 0;
+  if (success) tail_->invalidate(chat_id);
+  return success;
 }
 
 std::vector<npchat::ChatMessage> MessageService::getMessageHistory(npchat::ChatId chat_id, std::uint64_t start_time, std::uint64_t end_time) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
   std::vector<npchat::ChatMessage> messages;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_message_history_sql);
+
+    sqlite3_bind_int(stmt, 1, chat_id);
+    sqlite3_bind_int64(stmt, 2, start_time);
+    sqlite3_bind_int64(stmt, 3, end_time);
 
-  sqlite3_bind_int(get_message_history_stmt_, 1, chat_id);
-  sqlite3_bind_int64(get_message_history_stmt_, 2, start_time);
-  sqlite3_bind_int64(get_message_history_stmt_, 3, end_time);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      npchat::ChatMessage msg = buildMessageFromRow(stmt);
+      messages.push_back(std::move(msg));
+    }
 
-  while (sqlite3_step(get_message_history_stmt_) == SQLITE_ROW) {
-    npchat::ChatMessage msg = buildMessageFromRow(get_message_history_stmt_);
-    messages.push_back(std::move(msg));
+    sqlite3_reset(stmt);
   }
 
-  sqlite3_reset(get_message_history_stmt_);
+  // Only opens the partitions of the months in the range
+  archive_->mergeRange(chat_id, start_time, end_time, messages);
   return messages;
 }
 
-std::vector<npchat::ChatMessage> MessageService::searchMessages(std::uint32_t user_id, const std::string& query, std::uint32_t limit) {
-  std::lock_guard<std::mutex> lock(mutex_);
+std::vector<npchat::MessageSearchResult> MessageService::searchMessages(std::uint32_t user_id, std::string_view query,
+                                                                       npchat::ChatId chat_id, std::uint32_t limit) {
+  std::vector<npchat::MessageSearchResult> results;
 
-  std::vector<npchat::ChatMessage> messages;
+  auto fts_query = to_fts_query(query);
+  if (fts_query.empty()) {
+    return results;
+  }
 
-  std::string search_pattern = "%" + query + "%";
+  auto reader = db_->reader();
+  auto stmt = reader.statement(search_messages_sql);
 
-  sqlite3_bind_int(search_messages_stmt_, 1, user_id);
-  sqlite3_bind_text(search_messages_stmt_, 2, search_pattern.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(search_messages_stmt_, 3, limit);
+  sqlite3_bind_text(stmt, 1, fts_query.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, user_id);
+  sqlite3_bind_int(stmt, 3, chat_id);
+  sqlite3_bind_int(stmt, 4, std::min(limit, max_search_results));
 
-  while (sqlite3_step(search_messages_stmt_) == SQLITE_ROW) {
-    npchat::ChatMessage msg = buildMessageFromRow(search_messages_stmt_);
-    messages.push_back(std::move(msg));
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    npchat::MessageSearchResult result;
+    result.message = buildMessageFromRow(stmt);
+    const char* snippet = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 10));
+    result.snippet = snippet ? snippet : "";
+    results.push_back(std::move(result));
   }
 
-  sqlite3_reset(search_messages_stmt_);
-  return messages;
+  sqlite3_reset(stmt);
+  return results;
 }
 
 std::uint64_t MessageService::getChatLastActivity(npchat::ChatId chat_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_chat_last_activity_sql);
 
-  sqlite3_bind_int(get_chat_last_activity_stmt_, 1, chat_id);
+  sqlite3_bind_int(stmt, 1, chat_id);
 
   std::uint64_t timestamp = 0;
-  if (sqlite3_step(get_chat_last_activity_stmt_) == SQLITE_ROW) {
-    timestamp = sqlite3_column_int64(get_chat_last_activity_stmt_, 0);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    timestamp = sqlite3_column_int64(stmt, 0);
   }
 
-  sqlite3_reset(get_chat_last_activity_stmt_);
+  sqlite3_reset(stmt);
   return timestamp;
 }
 
-void MessageService::setUserOnline(std::uint32_t user_id, std::function<void(const npchat::ChatMessage&)> callback) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  online_users_.insert(user_id);
-  delivery_callbacks_[user_id] = callback;
-}
-
-void MessageService::setUserOffline(std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  online_users_.erase(user_id);
-  delivery_callbacks_.erase(user_id);
-}
-
-bool MessageService::isUserOnline(std::uint32_t user_id) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return online_users_.find(user_id) != online_users_.end();
-}
-
-void MessageService::deliverMessage(const npchat::ChatMessage& message, const std::vector<std::uint32_t>& recipients) {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  for (std::uint32_t recipient_id : recipients) {
-    auto it = delivery_callbacks_.find(recipient_id);
-    if (it != delivery_callbacks_.end()) {
-      // User is online, deliver immediately
-      try {
-        it->second(message);
-      } catch (const std::exception& e) {
-        spdlog::error("Failed to deliver message to user {}: {}", recipient_id, e.what());
-      }
-    }
-    // If user is offline, message will be delivered when they come online via getUndeliveredMessages
-  }
-}
-
 void MessageService::markMultipleMessagesAsRead(const std::vector<npchat::MessageId>& message_ids, std::uint32_t user_id) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  // Newest first: the first message of each chat moves its watermark, the
+  // older ones are then below it and don't match the update
+  auto sorted = message_ids;
+  std::sort(sorted.begin(), sorted.end(), std::greater<>());
 
-  std::uint64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
-    std::chrono::system_clock::now().time_since_epoch()).count();
+  std::lock_guard lock(batch_mutex_);
+  auto db = batch_writer_->handle();
 
-  // Begin transaction
-  sqlite3_exec(db_->getConnection(), "BEGIN TRANSACTION", nullptr, nullptr, nullptr);
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    throw std::runtime_error(fmt::format("Failed to begin marking messages as read: {}", sqlite3_errmsg(db)));
+  }
 
-  for (npchat::MessageId message_id : message_ids) {
-    sqlite3_bind_int(mark_message_read_stmt_, 1, message_id);
-    sqlite3_bind_int(mark_message_read_stmt_, 2, user_id);
-    sqlite3_bind_int64(mark_message_read_stmt_, 3, timestamp);
+  for (npchat::MessageId message_id : sorted) {
+    sqlite3_bind_int(batch_read_stmt_, 1, message_id);
+    sqlite3_bind_int(batch_read_stmt_, 2, user_id);
 
-    sqlite3_step(mark_message_read_stmt_);
-    sqlite3_reset(mark_message_read_stmt_);
+    auto rc = sqlite3_step(batch_read_stmt_);
+    sqlite3_reset(batch_read_stmt_);
+    if (rc != SQLITE_DONE) {
+      auto error = fmt::format("Failed to mark message {} as read: {}", message_id, sqlite3_errmsg(db));
+      sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+      throw std::runtime_error(error);
+    }
   }
 
-  // Commit transaction
-  sqlite3_exec(db_->getConnection(), "COMMIT", nullptr, nullptr, nullptr);
+  if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    auto error = fmt::format("Failed to commit {} read marks: {}", sorted.size(), sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    throw std::runtime_error(error);
+  }
 }
 
 npchat::ChatMessage MessageService::buildMessageFromRow(sqlite3_stmt* stmt) {
   npchat::ChatMessage msg;
+  msg.messageId = sqlite3_column_int(stmt, 0);
   msg.chatId = sqlite3_column_int(stmt, 1);
+  msg.senderId = sqlite3_column_int(stmt, 2);
   msg.timestamp = sqlite3_column_int64(stmt, 4);
   msg.content.text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
 
-  // Handle attachment if present
+  // Handle attachment if present; the content is fetched separately with GetAttachment
   if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
     npchat::ChatAttachment attachment;
     attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(stmt, 7));
     attachment.name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 8));
-
-    const void* blob_data = sqlite3_column_blob(stmt, 9);
-    int blob_size = sqlite3_column_bytes(stmt, 9);
-    attachment.data.assign(
-      static_cast<const std::uint8_t*>(blob_data),
-      static_cast<const std::uint8_t*>(blob_data) + blob_size
-    );
+    attachment.id = sqlite3_column_int(stmt, 5);
+    attachment.size = static_cast<std::uint32_t>(sqlite3_column_int64(stmt, 9));
 
     msg.content.attachment = attachment;
   }
@@ -3,55 +3,58 @@
 #include <memory>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
-#include <functional>
 #include <mutex>
 #include <optional>
 #include <sqlite3.h>
 #include <spdlog/spdlog.h>
+#include "ChatTailCache.hpp"
 #include "Database.hpp"
+#include "services/metrics/Metrics.hpp"
+#include "MessageArchive.hpp"
+#include "MessageStore.hpp"
 #include "npchat_stub/npchat.hpp"
 
 class MessageService {
 private:
   std::shared_ptr<Database> db_;
+  std::shared_ptr<MessageStore> store_;
+  std::shared_ptr<MessageArchive> archive_;
+  std::shared_ptr<ChatTailCache> tail_;
   mutable std::mutex mutex_;
+  metrics::Histogram& lock_wait_; // Time spent waiting for mutex_
 
   // Prepared statements
-  sqlite3_stmt* get_undelivered_messages_stmt_;
   sqlite3_stmt* mark_message_read_stmt_;
-  sqlite3_stmt* get_unread_count_stmt_;
-  sqlite3_stmt* get_last_message_stmt_;
   sqlite3_stmt* delete_message_stmt_;
   sqlite3_stmt* update_message_stmt_;
-  sqlite3_stmt* get_message_history_stmt_;
-  sqlite3_stmt* search_messages_stmt_;
-  sqlite3_stmt* get_chat_last_activity_stmt_;
 
-  // Message delivery callbacks
-  std::unordered_map<std::uint32_t, std::function<void(const npchat::ChatMessage&)>> delivery_callbacks_;
-  std::unordered_set<std::uint32_t> online_users_;
+  // Batches of read marks run in a transaction on a connection of their own, with
+  // batch_read_stmt_ prepared on it, so they never span other writes of the shared writer
+  std::mutex batch_mutex_;
+  std::unique_ptr<Database::Connection> batch_writer_;
+  sqlite3_stmt* batch_read_stmt_;
 
 public:
-  explicit MessageService(const std::shared_ptr<Database>& database);
+  MessageService(const std::shared_ptr<Database>& database, const std::shared_ptr<MessageStore>& store,
+                 const std::shared_ptr<MessageArchive>& archive, const std::shared_ptr<ChatTailCache>& tail);
   ~MessageService();
 
-  std::vector<npchat::ChatMessage> getUndeliveredMessages(std::uint32_t user_id);
+  // Messages queued for the user and not acknowledged yet, oldest first
+  std::vector<npchat::ChatMessage> getPendingMessages(std::uint32_t user_id, npchat::MessageId after_message_id,
+                                                      std::uint32_t limit = 100);
+  // Marks the message and everything before it in its chat as read
   void markMessageAsRead(npchat::MessageId message_id, std::uint32_t user_id);
   std::uint32_t getUnreadMessageCount(std::uint32_t user_id);
   std::optional<npchat::ChatMessage> getLastMessage(npchat::ChatId chat_id);
   bool deleteMessage(npchat::MessageId message_id, std::uint32_t sender_id);
   bool updateMessage(npchat::MessageId message_id, std::uint32_t sender_id, const std::string& new_content);
+  // Spans the archived months; archived messages can't be edited or searched
   std::vector<npchat::ChatMessage> getMessageHistory(npchat::ChatId chat_id, std::uint64_t start_time, std::uint64_t end_time);
-  std::vector<npchat::ChatMessage> searchMessages(std::uint32_t user_id, const std::string& query, std::uint32_t limit = 50);
+  // Ranked full-text search; chat_id == 0 searches all of the user's chats
+  std::vector<npchat::MessageSearchResult> searchMessages(std::uint32_t user_id, std::string_view query,
+                                                          npchat::ChatId chat_id = 0, std::uint32_t limit = 50);
   std::uint64_t getChatLastActivity(npchat::ChatId chat_id);
 
-  // Real-time messaging functionality
-  void setUserOnline(std::uint32_t user_id, std::function<void(const npchat::ChatMessage&)> callback);
-  void setUserOffline(std::uint32_t user_id);
-  bool isUserOnline(std::uint32_t user_id) const;
-  void deliverMessage(const npchat::ChatMessage& message, const std::vector<std::uint32_t>& recipients);
-
   // Batch operations for efficiency
   void markMultipleMessagesAsRead(const std::vector<npchat::MessageId>& message_ids, std::uint32_t user_id);
 
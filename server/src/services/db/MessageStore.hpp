@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "npchat_stub/npchat.hpp"
+
+// Storage engine for the message ingest and history path.
+//
+// ChatService and MessageService insert, page and acknowledge messages through
+// this interface rather than through SQLite statements. The only engine is
+// SqliteMessageStore, on the main database through the WriteBatcher; editing,
+// deleting, read state, search and the chat summary triggers still work on the
+// SQLite tables directly, so another engine needs those moved behind it first.
+class MessageStore {
+public:
+  // Everything the message and attachment rows are made of.
+  // The viewed data is owned by the caller, which blocks on the future until the row is committed.
+  struct NewMessage {
+    std::uint32_t sender_id;
+    npchat::ChatId chat_id;
+    std::string_view text;
+    std::uint64_t timestamp;
+    bool has_attachment = false;
+    npchat::ChatAttachmentType attachment_type{};
+    std::string_view attachment_name;
+    std::string_view attachment_hash;
+    std::uint64_t attachment_size = 0;
+  };
+
+  struct InsertedMessage {
+    npchat::MessageId message_id;
+    npchat::AttachmentId attachment_id; // 0 if the message has no attachment
+  };
+
+  struct AttachmentRef {
+    std::string hash; // Key of the content in the BlobStore
+    npchat::ChatId chat_id;
+  };
+
+  virtual ~MessageStore() = default;
+
+  // Stores a message and queues it for its recipients; `message` must stay alive until the future is ready
+  virtual std::future<InsertedMessage> insertMessage(const NewMessage& message) = 0;
+  // Removes a message from the user's delivery queue, fire-and-forget
+  virtual void ackDelivery(npchat::MessageId message_id, std::uint32_t user_id) = 0;
+
+  // Oldest first
+  virtual std::vector<npchat::ChatMessage> getMessages(npchat::ChatId chat_id, std::uint32_t limit, std::uint32_t offset) = 0;
+  // Up to `limit` messages older than `before_message_id` (0 = newest), oldest first
+  virtual std::vector<npchat::ChatMessage> getMessagesBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                             std::uint32_t limit) = 0;
+  // The newest `limit` messages of each chat in one query, by chat id and oldest first within a chat
+  virtual std::vector<npchat::ChatMessage> getLatestMessages(std::span<const npchat::ChatId> chat_ids, std::uint32_t limit) = 0;
+  // Messages queued for the user after `after_message_id`, oldest first
+  virtual std::vector<npchat::ChatMessage> getPendingMessages(std::uint32_t user_id, npchat::MessageId after_message_id,
+                                                              std::uint32_t limit) = 0;
+
+  // Where an attachment's content is and which chat it was sent to
+  virtual std::optional<AttachmentRef> findAttachment(npchat::AttachmentId attachment_id) = 0;
+  // Whether an attachment or a preview on the hot tables uses the content
+  virtual bool referencesBlob(std::string_view hash) = 0;
+};
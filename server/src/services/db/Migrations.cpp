@@ -0,0 +1,333 @@
+#include "Migrations.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+
+namespace {
+void exec(sqlite3* db, const std::string& sql) {
+  char* error = nullptr;
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK) {
+    std::string message = error ? error : sqlite3_errmsg(db);
+    sqlite3_free(error);
+    throw std::runtime_error(message);
+  }
+}
+
+int query_int(sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    throw std::runtime_error(sqlite3_errmsg(db));
+  }
+  int value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+// Availability checks compare case-insensitively; these let them use an index
+constexpr std::string_view pending_registrations_lower_sql = R"sql(
+CREATE INDEX idx_pending_registrations_username_lower ON pending_registrations(LOWER(username));
+CREATE INDEX idx_pending_registrations_email_lower ON pending_registrations(LOWER(email));
+)sql";
+
+// Attachment content moves to the blob store (<data-dir>/blobs), addressed by its SHA-256.
+// ChatService moves the inline data of existing rows out and empties `data`; the rows
+// left to move are listed by migration 13.
+constexpr std::string_view attachment_blobs_sql = R"sql(
+ALTER TABLE attachments ADD COLUMN hash TEXT NULL; -- Hex SHA-256 of the content in the blob store
+ALTER TABLE attachments ADD COLUMN size INTEGER NOT NULL DEFAULT 0;
+CREATE INDEX idx_messages_attachment ON messages(attachment_id);
+)sql";
+
+constexpr std::string_view keyset_pagination_sql = R"sql(
+CREATE INDEX idx_messages_chat_id ON messages(chat_id, id);
+)sql";
+
+// External content index over messages.content, kept in sync by triggers.
+// A B-tree index can't serve infix matches, the full-text index replaces it.
+constexpr std::string_view messages_fts_sql = R"sql(
+DROP INDEX IF EXISTS idx_messages_content;
+
+CREATE VIRTUAL TABLE messages_fts USING fts5(
+    content,
+    content = 'messages',
+    content_rowid = 'id',
+    tokenize = 'unicode61 remove_diacritics 2',
+    prefix = '2 3'
+);
+
+CREATE TRIGGER messages_fts_insert
+AFTER INSERT ON messages
+BEGIN
+    INSERT INTO messages_fts (rowid, content) VALUES (new.id, new.content);
+END;
+
+CREATE TRIGGER messages_fts_delete
+AFTER DELETE ON messages
+BEGIN
+    INSERT INTO messages_fts (messages_fts, rowid, content) VALUES ('delete', old.id, old.content);
+END;
+
+CREATE TRIGGER messages_fts_update
+AFTER UPDATE OF content ON messages
+BEGIN
+    INSERT INTO messages_fts (messages_fts, rowid, content) VALUES ('delete', old.id, old.content);
+    INSERT INTO messages_fts (rowid, content) VALUES (new.id, new.content);
+END;
+
+INSERT INTO messages_fts (messages_fts) VALUES ('rebuild');
+)sql";
+
+// chat_summary becomes a table of per-chat totals, and chat_participants gets per-user
+// read watermarks, unread counters and a copy of the chat's last message time to sort
+// the chat list by. All are maintained by triggers, so every writer of the underlying
+// tables keeps them exact. A user has read everything up to their watermark, which
+// joining or sending a message moves to the end of the chat. Reads were recorded per
+// message before; the watermark is the newest message the user has read or sent.
+constexpr std::string_view chat_summary_sql = R"sql(
+ALTER TABLE chat_participants ADD COLUMN last_read_message_id INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE chat_participants ADD COLUMN unread_count INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE chat_participants ADD COLUMN last_message_time INTEGER NULL;
+
+UPDATE chat_participants SET last_read_message_id = COALESCE((
+    SELECT MAX(m.id) FROM messages m
+    WHERE m.chat_id = chat_participants.chat_id AND (m.sender_id = chat_participants.user_id OR EXISTS (
+        SELECT 1 FROM message_read r WHERE r.message_id = m.id AND r.user_id = chat_participants.user_id))), 0);
+DROP TABLE message_read;
+
+DROP VIEW chat_summary;
+CREATE TABLE chat_summary (
+    chat_id INTEGER PRIMARY KEY,
+    created_by INTEGER NOT NULL,
+    created_at INTEGER NOT NULL,
+    participant_count INTEGER NOT NULL DEFAULT 0,
+    last_message_id INTEGER NULL,
+    last_message_time INTEGER NULL,
+    FOREIGN KEY (chat_id) REFERENCES chats(id) ON DELETE CASCADE
+);
+
+INSERT INTO chat_summary (chat_id, created_by, created_at, participant_count, last_message_id, last_message_time)
+SELECT c.id, c.created_by, c.created_at,
+       (SELECT COUNT(*) FROM chat_participants cp WHERE cp.chat_id = c.id), m.id, m.timestamp
+FROM chats c
+LEFT JOIN messages m ON m.id = (SELECT MAX(id) FROM messages WHERE chat_id = c.id);
+
+UPDATE chat_participants SET
+    last_message_time = (SELECT last_message_time FROM chat_summary s WHERE s.chat_id = chat_participants.chat_id),
+    unread_count = (SELECT COUNT(*) FROM messages m
+        WHERE m.chat_id = chat_participants.chat_id AND m.id > chat_participants.last_read_message_id
+            AND m.sender_id != chat_participants.user_id);
+
+-- The chat list; covers idx_chat_participants_user
+DROP INDEX idx_chat_participants_user;
+CREATE INDEX idx_chat_participants_recent ON chat_participants(user_id, last_message_time DESC);
+
+CREATE TRIGGER chat_summary_chat_insert
+AFTER INSERT ON chats
+BEGIN
+    INSERT INTO chat_summary (chat_id, created_by, created_at) VALUES (new.id, new.created_by, new.created_at);
+END;
+
+CREATE TRIGGER chat_summary_participant_insert
+AFTER INSERT ON chat_participants
+BEGIN
+    UPDATE chat_summary SET participant_count = participant_count + 1 WHERE chat_id = new.chat_id;
+    UPDATE chat_participants SET (last_message_time, last_read_message_id) =
+        (SELECT last_message_time, COALESCE(last_message_id, 0) FROM chat_summary WHERE chat_id = new.chat_id)
+    WHERE id = new.id;
+END;
+
+CREATE TRIGGER chat_summary_participant_delete
+AFTER DELETE ON chat_participants
+BEGIN
+    UPDATE chat_summary SET participant_count = participant_count - 1 WHERE chat_id = old.chat_id;
+END;
+
+CREATE TRIGGER chat_summary_message_insert
+AFTER INSERT ON messages
+BEGIN
+    UPDATE chat_summary SET last_message_id = new.id, last_message_time = new.timestamp WHERE chat_id = new.chat_id;
+    -- Sending a message reads the chat up to it
+    UPDATE chat_participants SET last_message_time = new.timestamp,
+        last_read_message_id = CASE WHEN user_id = new.sender_id THEN new.id ELSE last_read_message_id END,
+        unread_count = CASE WHEN user_id = new.sender_id THEN 0 ELSE unread_count + 1 END
+    WHERE chat_id = new.chat_id;
+END;
+
+CREATE TRIGGER chat_summary_message_delete
+AFTER DELETE ON messages
+BEGIN
+    UPDATE chat_participants SET unread_count = unread_count - 1
+    WHERE chat_id = old.chat_id AND user_id != old.sender_id AND last_read_message_id < old.id
+        AND unread_count > 0;
+END;
+
+CREATE TRIGGER chat_summary_last_message_delete
+AFTER DELETE ON messages
+WHEN old.id = (SELECT last_message_id FROM chat_summary WHERE chat_id = old.chat_id)
+BEGIN
+    UPDATE chat_summary SET (last_message_id, last_message_time) =
+        (SELECT id, timestamp FROM messages WHERE chat_id = old.chat_id ORDER BY id DESC LIMIT 1)
+    WHERE chat_id = old.chat_id;
+    UPDATE chat_participants SET last_message_time =
+        (SELECT last_message_time FROM chat_summary WHERE chat_id = old.chat_id) WHERE chat_id = old.chat_id;
+END;
+)sql";
+
+// Every message is queued for each participant except its sender when it's inserted,
+// in the same transaction, and stays queued until the recipient acknowledges it or the
+// WriteBatcher prunes it for age or size. Leaving a chat drops what is still queued from it.
+// message_delivery only recorded receipts, so "undelivered" was every message ever sent
+// to the user without one; the queue starts empty instead of inheriting all of it.
+constexpr std::string_view delivery_queue_sql = R"sql(
+DROP TABLE message_delivery;
+
+CREATE TABLE delivery_queue (
+    user_id INTEGER NOT NULL,
+    message_id INTEGER NOT NULL,
+    PRIMARY KEY (user_id, message_id),
+    FOREIGN KEY (user_id) REFERENCES users(id) ON DELETE CASCADE,
+    FOREIGN KEY (message_id) REFERENCES messages(id) ON DELETE CASCADE
+) WITHOUT ROWID;
+
+CREATE INDEX idx_delivery_queue_message ON delivery_queue(message_id);
+
+CREATE TRIGGER delivery_queue_message_insert
+AFTER INSERT ON messages
+BEGIN
+    INSERT INTO delivery_queue (user_id, message_id)
+    SELECT user_id, new.id FROM chat_participants WHERE chat_id = new.chat_id AND user_id != new.sender_id;
+END;
+
+CREATE TRIGGER delivery_queue_participant_delete
+AFTER DELETE ON chat_participants
+BEGIN
+    DELETE FROM delivery_queue WHERE user_id = old.user_id AND message_id IN (
+        SELECT q.message_id FROM delivery_queue q JOIN messages m ON m.id = q.message_id
+        WHERE q.user_id = old.user_id AND m.chat_id = old.chat_id);
+END;
+)sql";
+
+// Months of messages moved to read-only files by the MessageArchive (YYYY-MM, [start_time, end_time) in unix seconds)
+constexpr std::string_view message_partitions_sql = R"sql(
+CREATE TABLE message_partitions (
+    month TEXT PRIMARY KEY,
+    path TEXT NOT NULL,
+    start_time INTEGER NOT NULL,
+    end_time INTEGER NOT NULL,
+    first_message_id INTEGER NOT NULL,
+    last_message_id INTEGER NOT NULL,
+    message_count INTEGER NOT NULL
+);
+)sql";
+
+// Previews of Picture and Video content, made by MediaPipeline
+constexpr std::string_view media_previews_sql = R"sql(
+CREATE TABLE media_previews (
+    hash TEXT PRIMARY KEY, -- Hex SHA-256 of the attachment content
+    preview_hash TEXT NOT NULL, -- Blob store key of the JPEG preview, empty if none could be made
+    created_at INTEGER NOT NULL
+) WITHOUT ROWID;
+)sql";
+
+// Each chat's id range in each partition, so reading a chat only opens the partitions
+// that hold some of its messages. Partitions archived before this have chats_indexed = 0
+// and are read for every chat until the MessageArchive has filled in their ranges.
+constexpr std::string_view partition_chats_sql = R"sql(
+ALTER TABLE message_partitions ADD COLUMN chats_indexed INTEGER NOT NULL DEFAULT 0;
+
+CREATE TABLE message_partition_chats (
+    chat_id INTEGER NOT NULL,
+    month TEXT NOT NULL,
+    first_message_id INTEGER NOT NULL,
+    last_message_id INTEGER NOT NULL,
+    PRIMARY KEY (chat_id, month),
+    FOREIGN KEY (month) REFERENCES message_partitions(month) ON DELETE CASCADE
+) WITHOUT ROWID;
+)sql";
+
+// Lookups by content, for removing content of uploads that were never sent
+constexpr std::string_view blob_references_sql = R"sql(
+CREATE INDEX idx_attachments_hash ON attachments(hash);
+CREATE INDEX idx_media_previews_preview ON media_previews(preview_hash);
+)sql";
+
+// Archived messages deleted since the MessageArchive last removed them from their
+// partitions; message_id 0 stands for the whole chat. Readers leave them out meanwhile.
+constexpr std::string_view archive_tombstones_sql = R"sql(
+CREATE TABLE archive_tombstones (
+    chat_id INTEGER NOT NULL,
+    message_id INTEGER NOT NULL,
+    PRIMARY KEY (chat_id, message_id)
+) WITHOUT ROWID;
+)sql";
+
+// Attachments whose content is still inline. ChatService moves each one to the blob
+// store at startup and takes it off this list, so attachments are only searched once.
+constexpr std::string_view inline_attachments_sql = R"sql(
+CREATE TABLE inline_attachments (
+    id INTEGER PRIMARY KEY -- attachments.id
+);
+INSERT INTO inline_attachments (id) SELECT id FROM attachments WHERE hash IS NULL;
+)sql";
+} // namespace
+
+std::span<const Migration> schemaMigrations() {
+  static const Migration migrations[] = {
+    {1, "schema.sql", schema_sql},
+    {2, "case-insensitive registration indexes", pending_registrations_lower_sql},
+    {3, "attachments in the blob store", attachment_blobs_sql},
+    {4, "keyset pagination index", keyset_pagination_sql},
+    {5, "full-text search", messages_fts_sql},
+    {6, "chat summary and read watermarks", chat_summary_sql},
+    {7, "delivery queue", delivery_queue_sql},
+    {8, "message partitions", message_partitions_sql},
+    {9, "media previews", media_previews_sql},
+    {10, "chat ranges of message partitions", partition_chats_sql},
+    {11, "blob reference indexes", blob_references_sql},
+    {12, "archive tombstones", archive_tombstones_sql},
+    {13, "inline attachments left to move", inline_attachments_sql},
+  };
+  return migrations;
+}
+
+int migrateSchema(Database& database) {
+  auto db = database.getConnection();
+  const auto migrations = schemaMigrations();
+  const int latest = migrations.back().version;
+
+  int version = query_int(db, "PRAGMA user_version");
+  if (version > latest) {
+    throw std::runtime_error(fmt::format("The database is at schema version {}, this build only knows up to {}",
+                                         version, latest));
+  }
+
+  if (version == 0 && query_int(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'users'") != 0) {
+    spdlog::info("[Migrations] Database predates schema versioning, marking it as version 1");
+    exec(db, "PRAGMA user_version = 1");
+    version = 1;
+  }
+
+  for (const auto& migration : migrations) {
+    if (migration.version <= version) continue;
+
+    auto started = std::chrono::steady_clock::now();
+    exec(db, "BEGIN IMMEDIATE");
+    try {
+      exec(db, std::string(migration.sql));
+      exec(db, fmt::format("PRAGMA user_version = {}", migration.version));
+      exec(db, "COMMIT");
+    } catch (const std::exception& e) {
+      sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+      throw std::runtime_error(fmt::format("Schema migration {} ({}) failed: {}",
+                                           migration.version, migration.description, e.what()));
+    }
+    version = migration.version;
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    spdlog::info("[Migrations] Applied {} ({}) in {} ms", migration.version, migration.description, ms);
+  }
+
+  spdlog::info("[Migrations] Schema version {}", version);
+  return version;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <span>
+#include <string_view>
+#include "Database.hpp"
+
+// Versioned schema migrations, run at startup before any service is created.
+//
+// PRAGMA user_version holds the number of the last migration applied to the
+// file. Version 1 is schema.sql, compiled in, as it was when versioning began;
+// it is never edited. Files from before versioning have exactly that schema,
+// so they are only stamped as version 1. Every later schema change, including
+// moving existing rows to the new layout, is appended as a numbered migration
+// and runs in its own transaction together with the user_version update, on
+// fresh and old files alike. Services never change the schema themselves.
+struct Migration {
+  int version;
+  std::string_view description;
+  std::string_view sql;
+};
+
+// Migration 1, generated from src/database/schema.sql at configure time
+extern const std::string_view schema_sql;
+
+// Every migration, in order
+std::span<const Migration> schemaMigrations();
+
+// Applies the pending migrations on the writer connection; returns the version the database is at.
+// Throws if a migration fails or the file was written by a newer version.
+int migrateSchema(Database& database);
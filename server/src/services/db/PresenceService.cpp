@@ -0,0 +1,159 @@
+#include "PresenceService.hpp"
+
+#include <nplib/utils/thread_pool.hpp>
+#include <spdlog/spdlog.h>
+
+PresenceService::PresenceService(const std::shared_ptr<ChatMembership>& membership,
+                                 const std::shared_ptr<PresenceDirectory>& directory,
+                                 Options options, Events events)
+  : options_(options)
+  , events_(std::move(events))
+  , membership_(membership)
+  , directory_(directory)
+  , flush_timer_(thread_pool::get_instance().executor())
+  , sweep_timer_(thread_pool::get_instance().executor())
+{
+  scheduleSweep();
+}
+
+PresenceService::~PresenceService() {
+  std::lock_guard lock(mutex_);
+  flush_timer_.cancel();
+  sweep_timer_.cancel();
+}
+
+bool PresenceService::isOnline(std::uint32_t userId) {
+  return !directory_->nodesOf({&userId, 1}).empty();
+}
+
+bool PresenceService::queueLocked(npchat::ChatId chatId, std::uint32_t userId, bool online, bool typing) {
+  bool first_in_batch = pending_.empty();
+  auto& update = pending_[Key{chatId, userId}];
+  update.chatId = chatId;
+  update.userId = userId;
+  update.online = online;
+  update.typing = typing;
+  return first_in_batch;
+}
+
+// The first change of a batch arms its flush; the rest just join it
+void PresenceService::armFlush() {
+  std::lock_guard lock(mutex_);
+  flush_timer_.expires_after(options_.batch_window);
+  flush_timer_.async_wait([this] (const boost::system::error_code& ec) {
+    if (ec) return; // Cancelled on shutdown
+    flush();
+  });
+}
+
+void PresenceService::flush() {
+  std::vector<npchat::PresenceUpdate> updates;
+  {
+    std::lock_guard lock(mutex_);
+    updates.reserve(pending_.size());
+    for (auto& [key, update] : pending_) updates.push_back(std::move(update));
+    pending_.clear();
+  }
+
+  if (!updates.empty() && events_.presence_batch) {
+    spdlog::trace("Pushing {} presence updates", updates.size());
+    events_.presence_batch(std::move(updates));
+  }
+}
+
+void PresenceService::scheduleSweep() {
+  sweep_timer_.expires_after(sweep_tick);
+  sweep_timer_.async_wait([this] (const boost::system::error_code& ec) {
+    if (ec) return; // Cancelled on shutdown
+    sweep();
+    scheduleSweep();
+  });
+}
+
+void PresenceService::sweep() {
+  auto now = std::chrono::steady_clock::now();
+  bool arm = false;
+  {
+    std::lock_guard lock(mutex_);
+    for (auto it = typing_.begin(); it != typing_.end();) {
+      if (it->second > now) {
+        ++it;
+        continue;
+      }
+      // Only users who are still connected can be typing
+      arm |= queueLocked(it->first.chatId, it->first.userId, true, false);
+      it = typing_.erase(it);
+    }
+  }
+  if (arm) armFlush();
+}
+
+void PresenceService::userAttached(std::uint32_t userId) {
+  auto chats = membership_->chatsOf(userId);
+  if (chats->empty()) return;
+
+  bool arm = false;
+  {
+    std::lock_guard lock(mutex_);
+    for (auto chatId : *chats) {
+      arm |= queueLocked(chatId, userId, true, typing_.contains(Key{chatId, userId}));
+    }
+  }
+  if (arm) armFlush();
+}
+
+void PresenceService::userDetached(std::uint32_t userId) {
+  // Still online through another node
+  if (isOnline(userId)) return;
+
+  auto chats = membership_->chatsOf(userId);
+  if (chats->empty()) return;
+
+  bool arm = false;
+  {
+    std::lock_guard lock(mutex_);
+    for (auto chatId : *chats) {
+      typing_.erase(Key{chatId, userId});
+      arm |= queueLocked(chatId, userId, false, false);
+    }
+  }
+  if (arm) armFlush();
+}
+
+void PresenceService::setTyping(std::uint32_t userId, npchat::ChatId chatId, bool typing) {
+  Key key{chatId, userId};
+  bool arm = false;
+  {
+    std::lock_guard lock(mutex_);
+    if (typing) {
+      auto [it, started] = typing_.insert_or_assign(key, std::chrono::steady_clock::now() + options_.typing_timeout);
+      if (!started) return; // Only extended
+    } else if (typing_.erase(key) == 0) {
+      return; // Wasn't typing
+    }
+    arm = queueLocked(chatId, userId, true, typing);
+  }
+  if (arm) armFlush();
+}
+
+std::vector<npchat::PresenceUpdate> PresenceService::chatPresence(npchat::ChatId chatId, std::uint32_t except) {
+  auto participants = membership_->participants(chatId);
+
+  std::vector<npchat::PresenceUpdate> result;
+  result.reserve(participants->size());
+  for (auto userId : *participants) {
+    if (userId == except) continue;
+    npchat::PresenceUpdate update;
+    update.chatId = chatId;
+    update.userId = userId;
+    update.online = isOnline(userId);
+    update.typing = false;
+    result.push_back(update);
+  }
+
+  std::lock_guard lock(mutex_);
+  for (auto& update : result) {
+    update.typing = update.online && typing_.contains(Key{chatId, update.userId});
+  }
+  return result;
+}
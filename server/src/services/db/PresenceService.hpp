@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
+#include "ChatMembership.hpp"
+#include "services/client/EventBus.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Online state and typing indicators.
+//
+// A user is online while a node hosts one of their event listeners, as the
+// presence directory reports, and typing in a chat until they say they stopped,
+// send a message there, or typing_timeout passes. Changes aren't pushed as they
+// happen: they are collected per chat and user, keeping only the newest state,
+// and handed on in one batch once batch_window has passed since the first of
+// them. Expired typing indicators are swept once a second.
+class PresenceService {
+public:
+  struct Options {
+    std::chrono::milliseconds batch_window{200};
+    std::chrono::seconds typing_timeout{6};
+  };
+
+  struct Events {
+    std::function<void(std::vector<npchat::PresenceUpdate> updates)> presence_batch;
+  };
+
+private:
+  static constexpr std::chrono::seconds sweep_tick{1};
+
+  struct Key {
+    npchat::ChatId chatId;
+    std::uint32_t userId;
+    bool operator==(const Key&) const noexcept = default;
+  };
+
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const noexcept {
+      return std::hash<std::uint64_t>{}(static_cast<std::uint64_t>(key.chatId) << 32 | key.userId);
+    }
+  };
+
+  const Options options_;
+  const Events events_;
+  std::shared_ptr<ChatMembership> membership_;
+  std::shared_ptr<PresenceDirectory> directory_;
+
+  std::mutex mutex_;
+  std::unordered_map<Key, std::chrono::steady_clock::time_point, KeyHash> typing_; // Until when
+  std::unordered_map<Key, npchat::PresenceUpdate, KeyHash> pending_;              // Next batch
+  boost::asio::steady_timer flush_timer_; // Armed under mutex_ by the first change of a batch
+  boost::asio::steady_timer sweep_timer_;
+
+  bool isOnline(std::uint32_t userId);
+  // Queues the state of a user in a chat; the caller holds mutex_. Returns true if it starts a batch.
+  bool queueLocked(npchat::ChatId chatId, std::uint32_t userId, bool online, bool typing);
+  void armFlush();
+  void flush();
+  void scheduleSweep();
+  void sweep();
+
+public:
+  PresenceService(const std::shared_ptr<ChatMembership>& membership,
+                  const std::shared_ptr<PresenceDirectory>& directory,
+                  Options options, Events events);
+  ~PresenceService();
+
+  // Called as the user's first listener on this node arrives and their last one goes away,
+  // after the directory has been updated
+  void userAttached(std::uint32_t userId);
+  void userDetached(std::uint32_t userId);
+
+  // The caller checks that the user is a participant
+  void setTyping(std::uint32_t userId, npchat::ChatId chatId, bool typing);
+
+  // State of every participant except `except`
+  std::vector<npchat::PresenceUpdate> chatPresence(npchat::ChatId chatId, std::uint32_t except);
+};
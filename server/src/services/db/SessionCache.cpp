@@ -0,0 +1,108 @@
+#include "SessionCache.hpp"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+void SessionCache::record(Shard& shard, std::string_view token, std::uint64_t now) {
+  if (auto a = shard.activity.find(token); a != shard.activity.end()) {
+    a->second = now;
+  } else {
+    shard.activity.emplace(token, now);
+  }
+}
+
+SessionCache::SessionCache(Options options)
+  : options_(options)
+  , shard_capacity_(std::max<std::size_t>(1, options.capacity / std::max<std::size_t>(1, options.shard_count)))
+{
+  auto shard_count = std::max<std::size_t>(1, options_.shard_count);
+  shards_.reserve(shard_count);
+  for (std::size_t i = 0; i < shard_count; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+  }
+
+  spdlog::info("Session cache: {} shards of {} sessions, ttl {} s",
+               shard_count, shard_capacity_, options_.ttl.count());
+}
+
+std::optional<SessionCache::Session> SessionCache::find(std::string_view token, std::uint64_t now) {
+  auto& shard = shard_for(token);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.index.find(token);
+  if (it == shard.index.end()) return std::nullopt;
+
+  auto entry = it->second;
+  if (entry->session.expires_at <= now ||
+      std::chrono::steady_clock::now() - entry->loaded_at >= options_.ttl) {
+    shard.index.erase(it);
+    shard.lru.erase(entry);
+    return std::nullopt;
+  }
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+  record(shard, token, now);
+
+  return entry->session;
+}
+
+void SessionCache::insert(std::string_view token, Session session) {
+  auto& shard = shard_for(token);
+  std::lock_guard lock(shard.mutex);
+
+  auto loaded_at = std::chrono::steady_clock::now();
+
+  if (auto it = shard.index.find(token); it != shard.index.end()) {
+    it->second->session = std::move(session);
+    it->second->loaded_at = loaded_at;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return;
+  }
+
+  if (shard.lru.size() >= shard_capacity_) {
+    // Its recorded activity, if any, stays in shard.activity until the next flush
+    shard.index.erase(shard.lru.back().token);
+    shard.lru.pop_back();
+  }
+
+  shard.lru.push_front(Entry{std::string(token), std::move(session), loaded_at});
+  shard.index.emplace(shard.lru.front().token, shard.lru.begin());
+}
+
+void SessionCache::erase(std::string_view token) {
+  auto& shard = shard_for(token);
+  std::lock_guard lock(shard.mutex);
+
+  if (auto it = shard.index.find(token); it != shard.index.end()) {
+    auto entry = it->second;
+    shard.index.erase(it);
+    shard.lru.erase(entry);
+  }
+
+  if (auto a = shard.activity.find(token); a != shard.activity.end()) {
+    shard.activity.erase(a);
+  }
+}
+
+void SessionCache::touch(std::string_view token, std::uint64_t now) {
+  auto& shard = shard_for(token);
+  std::lock_guard lock(shard.mutex);
+  record(shard, token, now);
+}
+
+SessionCache::Activity SessionCache::takeActivity() {
+  Activity result;
+
+  for (auto& shard : shards_) {
+    decltype(Shard::activity) activity;
+    {
+      std::lock_guard lock(shard->mutex);
+      activity.swap(shard->activity);
+    }
+    for (auto& [token, time] : activity) {
+      result.emplace_back(token, time);
+    }
+  }
+
+  return result;
+}
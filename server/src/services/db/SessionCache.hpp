@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bounded cache of authenticated sessions in front of user_sessions.
+//
+// Entries are spread over shards by token hash, each with its own lock and LRU
+// list, so reconnecting clients only contend when their tokens land on the same
+// shard. An entry is trusted until its session expires or for `ttl` after it
+// was loaded, whichever comes first; after that it has to be looked up again.
+//
+// Activity is recorded in memory only. takeActivity() hands out everything
+// recorded since the previous call, so the owner can write it in one batch.
+class SessionCache {
+public:
+  struct Options {
+    std::size_t capacity = 100000;
+    std::size_t shard_count = 16;
+    std::chrono::seconds ttl{300};
+    // How often recorded activity is written back by the owner
+    std::chrono::seconds flush_interval{30};
+  };
+
+  struct Session {
+    std::uint32_t user_id;
+    std::string username;
+    std::uint64_t expires_at; // Unix time
+  };
+
+  using Activity = std::vector<std::pair<std::string, std::uint64_t>>; // token, last activity
+
+private:
+  struct StringHash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view s) const noexcept { return std::hash<std::string_view>{}(s); }
+  };
+
+  struct Entry {
+    std::string token;
+    Session session;
+    std::chrono::steady_clock::time_point loaded_at;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; // Most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator, StringHash> index; // Keys view Entry::token
+    std::unordered_map<std::string, std::uint64_t, StringHash, std::equal_to<>> activity;
+  };
+
+  const Options options_;
+  const std::size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  Shard& shard_for(std::string_view token) noexcept {
+    return *shards_[StringHash{}(token) % shards_.size()];
+  }
+
+  // Must be called with the shard locked
+  static void record(Shard& shard, std::string_view token, std::uint64_t now);
+
+public:
+  explicit SessionCache(Options options);
+
+  const Options& options() const noexcept { return options_; }
+
+  // The cached session, if it's still valid at `now` (Unix time); records activity on a hit
+  std::optional<Session> find(std::string_view token, std::uint64_t now);
+
+  // Caches a session loaded from or just written to the database
+  void insert(std::string_view token, Session session);
+
+  void erase(std::string_view token);
+
+  // Records activity for a session without looking it up
+  void touch(std::string_view token, std::uint64_t now);
+
+  // Activity recorded since the last call, including that of evicted sessions
+  Activity takeActivity();
+};
@@ -0,0 +1,239 @@
+#include "SqliteMessageStore.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <string>
+
+namespace {
+// Read-only queries, prepared on every reader connection on first use.
+// All of them return the columns message_from_row() expects.
+constexpr std::string_view get_messages_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       a.type, a.name, a.size "
+  "FROM messages m "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE m.chat_id = ? ORDER BY m.timestamp ASC LIMIT ? OFFSET ?";
+
+// Seeks on idx_messages_chat_id, so a page costs the same at any depth
+constexpr std::string_view get_messages_before_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       a.type, a.name, a.size "
+  "FROM messages m "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE m.chat_id = ? AND m.id < ? ORDER BY m.id DESC LIMIT ?";
+
+// The chat ids are bound as a JSON array. Each chat's ids come from its own
+// LIMIT on idx_messages_chat_id, so the cost is the rows returned rather than
+// every message of the chats, as ROW_NUMBER() OVER (PARTITION BY chat_id) would be.
+constexpr std::string_view get_latest_messages_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       a.type, a.name, a.size "
+  "FROM json_each(?1) c "
+  "JOIN messages m ON m.id IN (SELECT id FROM messages WHERE chat_id = c.value ORDER BY id DESC LIMIT ?2) "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "ORDER BY m.chat_id, m.id";
+
+// A range of the user's delivery queue, so paging costs O(page) however much is pending
+constexpr std::string_view get_pending_messages_sql =
+  "SELECT m.id, m.chat_id, m.sender_id, m.content, m.timestamp, m.attachment_id, "
+  "       a.type, a.name, a.size "
+  "FROM delivery_queue q "
+  "JOIN messages m ON m.id = q.message_id "
+  "JOIN users u ON m.sender_id = u.id "
+  "LEFT JOIN attachments a ON m.attachment_id = a.id "
+  "WHERE q.user_id = ? AND q.message_id > ? "
+  "ORDER BY q.message_id LIMIT ?";
+
+constexpr std::string_view find_attachment_sql =
+  "SELECT a.hash, m.chat_id FROM attachments a "
+  "JOIN messages m ON m.attachment_id = a.id "
+  "WHERE a.id = ? LIMIT 1";
+
+constexpr std::string_view references_blob_sql =
+  "SELECT EXISTS (SELECT 1 FROM attachments WHERE hash = ?1) "
+  "OR EXISTS (SELECT 1 FROM media_previews WHERE preview_hash = ?1)";
+
+npchat::ChatMessage message_from_row(sqlite3_stmt* stmt) {
+  npchat::ChatMessage msg;
+  msg.messageId = sqlite3_column_int(stmt, 0);
+  msg.chatId = sqlite3_column_int(stmt, 1);
+  msg.senderId = sqlite3_column_int(stmt, 2);
+  const char* content_text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+  msg.content.text = content_text ? content_text : "";
+  msg.timestamp = sqlite3_column_int64(stmt, 4);
+
+  // The content itself is fetched separately with GetAttachment
+  if (sqlite3_column_type(stmt, 5) != SQLITE_NULL) {
+    npchat::ChatAttachment attachment;
+    attachment.type = static_cast<npchat::ChatAttachmentType>(sqlite3_column_int(stmt, 6));
+    const char* attachment_name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 7));
+    attachment.name = attachment_name ? attachment_name : "";
+    attachment.id = sqlite3_column_int(stmt, 5);
+    attachment.size = static_cast<std::uint32_t>(sqlite3_column_int64(stmt, 8));
+
+    msg.content.attachment = attachment;
+  }
+
+  return msg;
+}
+
+std::vector<npchat::ChatMessage> collect(sqlite3_stmt* stmt) {
+  std::vector<npchat::ChatMessage> messages;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    messages.push_back(message_from_row(stmt));
+  }
+  sqlite3_reset(stmt);
+  return messages;
+}
+} // namespace
+
+SqliteMessageStore::SqliteMessageStore(const std::shared_ptr<Database>& database, const std::shared_ptr<WriteBatcher>& batcher,
+                                       const std::shared_ptr<MessageArchive>& archive)
+  : db_(database)
+  , batcher_(batcher)
+  , archive_(archive)
+{
+}
+
+std::future<MessageStore::InsertedMessage> SqliteMessageStore::insertMessage(const NewMessage& message) {
+  // The delivery_queue_message_insert trigger queues it for the participants
+  return batcher_->insertMessage(message);
+}
+
+void SqliteMessageStore::ackDelivery(npchat::MessageId message_id, std::uint32_t user_id) {
+  batcher_->ackDelivery(message_id, user_id);
+}
+
+std::vector<npchat::ChatMessage> SqliteMessageStore::getMessages(npchat::ChatId chat_id, std::uint32_t limit, std::uint32_t offset) {
+  const bool archived = !archive_->empty();
+  // Saturates instead of wrapping around for offsets near the top of the range
+  const auto prefix = static_cast<std::uint32_t>(
+    std::min<std::uint64_t>(std::uint64_t{offset} + limit, std::numeric_limits<std::uint32_t>::max()));
+  std::vector<npchat::ChatMessage> messages;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_messages_sql);
+
+    sqlite3_bind_int(stmt, 1, chat_id);
+    // With archived months the offset counts across both tiers, so take the whole prefix
+    sqlite3_bind_int64(stmt, 2, archived ? prefix : limit);
+    sqlite3_bind_int64(stmt, 3, archived ? 0 : offset);
+
+    messages = collect(stmt);
+  }
+  if (!archived) return messages;
+
+  archive_->mergeOldest(chat_id, prefix, messages);
+  messages.erase(messages.begin(), messages.begin() + std::min<std::size_t>(offset, messages.size()));
+  return messages;
+}
+
+std::vector<npchat::ChatMessage> SqliteMessageStore::getMessagesBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                                       std::uint32_t limit) {
+  std::vector<npchat::ChatMessage> messages;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_messages_before_sql);
+
+    sqlite3_bind_int(stmt, 1, chat_id);
+    // 0 means "from the newest message"
+    sqlite3_bind_int64(stmt, 2, before_message_id ? before_message_id : std::numeric_limits<sqlite3_int64>::max());
+    sqlite3_bind_int(stmt, 3, limit);
+
+    messages = collect(stmt);
+  }
+
+  // Pages that reach past the main database continue into the archived months;
+  // the partitions' id ranges skip the ones that can't be on this page
+  archive_->mergeBefore(chat_id, before_message_id, limit, messages);
+
+  // Walked newest to oldest, returned oldest first like getMessages()
+  std::reverse(messages.begin(), messages.end());
+  return messages;
+}
+
+std::vector<npchat::ChatMessage> SqliteMessageStore::getLatestMessages(std::span<const npchat::ChatId> chat_ids,
+                                                                       std::uint32_t limit) {
+  if (chat_ids.empty() || limit == 0) return {};
+
+  std::string ids = "[";
+  for (auto chat_id : chat_ids) {
+    if (ids.size() > 1) ids += ',';
+    ids += std::to_string(chat_id);
+  }
+  ids += ']';
+
+  std::vector<npchat::ChatMessage> messages;
+  {
+    auto reader = db_->reader();
+    auto stmt = reader.statement(get_latest_messages_sql);
+
+    sqlite3_bind_text(stmt, 1, ids.c_str(), static_cast<int>(ids.size()), SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit);
+
+    messages = collect(stmt);
+  }
+  if (archive_->empty()) return messages;
+
+  // Chats whose newest messages are partly archived are completed one by one;
+  // mergeBefore() returns at once for the ones the main database has filled
+  std::vector<npchat::ChatId> sorted(chat_ids.begin(), chat_ids.end());
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  std::vector<npchat::ChatMessage> merged;
+  merged.reserve(messages.size());
+  auto it = messages.begin();
+  for (auto chat_id : sorted) {
+    auto end = std::find_if(it, messages.end(), [chat_id] (const auto& m) { return m.chatId != chat_id; });
+    std::vector<npchat::ChatMessage> newest_first(std::make_reverse_iterator(end), std::make_reverse_iterator(it));
+    it = end;
+    archive_->mergeBefore(chat_id, 0, limit, newest_first);
+    merged.insert(merged.end(), newest_first.rbegin(), newest_first.rend());
+  }
+  return merged;
+}
+
+std::vector<npchat::ChatMessage> SqliteMessageStore::getPendingMessages(std::uint32_t user_id, npchat::MessageId after_message_id,
+                                                                        std::uint32_t limit) {
+  auto reader = db_->reader();
+  auto stmt = reader.statement(get_pending_messages_sql);
+
+  sqlite3_bind_int(stmt, 1, user_id);
+  sqlite3_bind_int(stmt, 2, after_message_id);
+  sqlite3_bind_int(stmt, 3, limit);
+
+  return collect(stmt);
+}
+
+std::optional<MessageStore::AttachmentRef> SqliteMessageStore::findAttachment(npchat::AttachmentId attachment_id) {
+  auto reader = db_->reader();
+  auto stmt = reader.statement(find_attachment_sql);
+
+  sqlite3_bind_int(stmt, 1, attachment_id);
+
+  std::optional<AttachmentRef> ref;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char* hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+    ref = AttachmentRef{hash ? hash : "", static_cast<npchat::ChatId>(sqlite3_column_int(stmt, 1))};
+  }
+  sqlite3_reset(stmt);
+  if (!ref) ref = archive_->findAttachment(attachment_id);
+  return ref;
+}
+
+bool SqliteMessageStore::referencesBlob(std::string_view hash) {
+  auto reader = db_->reader();
+  auto stmt = reader.statement(references_blob_sql);
+
+  sqlite3_bind_text(stmt, 1, hash.data(), static_cast<int>(hash.size()), SQLITE_STATIC);
+
+  // Keeps the content if the query fails
+  bool referenced = sqlite3_step(stmt) != SQLITE_ROW || sqlite3_column_int(stmt, 0) != 0;
+  sqlite3_reset(stmt);
+  return referenced;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+#include "Database.hpp"
+#include "MessageArchive.hpp"
+#include "MessageStore.hpp"
+#include "WriteBatcher.hpp"
+
+// Messages in the main SQLite database. Writes go through the WriteBatcher's group
+// commit, reads through the reader pool; delivery queue rows and the per-chat
+// counters are maintained by the triggers on messages. History queries also read
+// the months the MessageArchive has moved out of the main database.
+class SqliteMessageStore final : public MessageStore {
+  std::shared_ptr<Database> db_;
+  std::shared_ptr<WriteBatcher> batcher_;
+  std::shared_ptr<MessageArchive> archive_;
+
+public:
+  SqliteMessageStore(const std::shared_ptr<Database>& database, const std::shared_ptr<WriteBatcher>& batcher,
+                     const std::shared_ptr<MessageArchive>& archive);
+
+  std::future<InsertedMessage> insertMessage(const NewMessage& message) override;
+  void ackDelivery(npchat::MessageId message_id, std::uint32_t user_id) override;
+
+  std::vector<npchat::ChatMessage> getMessages(npchat::ChatId chat_id, std::uint32_t limit, std::uint32_t offset) override;
+  std::vector<npchat::ChatMessage> getMessagesBefore(npchat::ChatId chat_id, npchat::MessageId before_message_id,
+                                                     std::uint32_t limit) override;
+  std::vector<npchat::ChatMessage> getLatestMessages(std::span<const npchat::ChatId> chat_ids, std::uint32_t limit) override;
+  std::vector<npchat::ChatMessage> getPendingMessages(std::uint32_t user_id, npchat::MessageId after_message_id,
+                                                      std::uint32_t limit) override;
+
+  std::optional<AttachmentRef> findAttachment(npchat::AttachmentId attachment_id) override;
+  bool referencesBlob(std::string_view hash) override;
+};
@@ -0,0 +1,202 @@
+#include "UploadService.hpp"
+
+#include <algorithm>
+#include <nplib/utils/thread_pool.hpp>
+#include <spdlog/spdlog.h>
+
+UploadService::UploadService(const std::shared_ptr<BlobStore>& blobs, Options options)
+  : blobs_(blobs)
+  , options_(options)
+  , sweep_timer_(thread_pool::get_instance().executor())
+{
+  scheduleSweep();
+}
+
+UploadService::~UploadService() {
+  sweep_timer_.cancel();
+}
+
+void UploadService::scheduleSweep() {
+  sweep_timer_.expires_after(options_.sweep_interval);
+  sweep_timer_.async_wait([this] (const boost::system::error_code& ec) {
+    if (ec) return; // Cancelled on shutdown
+    std::vector<Committed> expired;
+    {
+      std::lock_guard lock(mutex_);
+      expired = expire(Clock::now());
+    }
+    for (const auto& committed : expired) discard(committed);
+    scheduleSweep();
+  });
+}
+
+std::vector<UploadService::Committed> UploadService::expire(Clock::time_point now) {
+  std::vector<Committed> expired;
+  std::erase_if(uploads_, [&](const auto& entry) {
+    const auto& upload = *entry.second;
+    if (upload.expires_at.load() > now) return false;
+
+    if (upload.committed) {
+      forget(*upload.committed);
+      expired.push_back(*upload.committed);
+    }
+    return true;
+  });
+  return expired;
+}
+
+void UploadService::forget(const Committed& committed) {
+  auto it = committed_hashes_.find(committed.hash);
+  if (it != committed_hashes_.end() && --it->second == 0) committed_hashes_.erase(it);
+}
+
+void UploadService::discard(const Committed& committed) {
+  if (!committed.created || !options_.referenced) return;
+
+  bool removed = blobs_->removeUnreferenced(committed.hash, [this] (std::string_view hash) {
+    {
+      std::lock_guard lock(mutex_);
+      if (committed_hashes_.contains(std::string(hash))) return true;
+    }
+    return options_.referenced(hash);
+  });
+  if (removed) spdlog::info("[UploadService] Removed content {} that was never sent", committed.hash);
+}
+
+std::shared_ptr<UploadService::Upload> UploadService::find(std::uint32_t user_id, npchat::UploadId upload_id) {
+  std::lock_guard lock(mutex_);
+
+  auto it = uploads_.find(upload_id);
+  if (it == uploads_.end() || it->second->owner != user_id) {
+    throw std::runtime_error("Unknown upload");
+  }
+  return it->second;
+}
+
+npchat::UploadId UploadService::beginUpload(std::uint32_t user_id, std::uint32_t size) {
+  if (size > options_.max_size) {
+    throw std::runtime_error("Upload is too large");
+  }
+
+  auto now = Clock::now();
+  std::unique_lock lock(mutex_);
+
+  // Also swept periodically; here so abandoned uploads never count against anyone
+  auto expired = expire(now);
+  if (!expired.empty()) {
+    lock.unlock();
+    for (const auto& committed : expired) discard(committed);
+    lock.lock();
+  }
+
+  auto owned = std::count_if(uploads_.begin(), uploads_.end(),
+    [user_id](const auto& entry) { return entry.second->owner == user_id; });
+  if (static_cast<std::size_t>(owned) >= options_.max_uploads_per_user) {
+    throw std::runtime_error("Too many uploads in progress");
+  }
+
+  auto upload = std::make_shared<Upload>();
+  upload->owner = user_id;
+  upload->size = size;
+  upload->writer = blobs_->writer();
+  upload->expires_at = now + options_.idle_timeout;
+
+  auto upload_id = next_id_++;
+  uploads_.emplace(upload_id, std::move(upload));
+  return upload_id;
+}
+
+std::uint32_t UploadService::uploadChunk(std::uint32_t user_id, npchat::UploadId upload_id, std::uint32_t offset,
+                                         std::span<const std::uint8_t> data) {
+  if (data.size() > max_chunk) {
+    throw std::runtime_error("Chunk is too large");
+  }
+
+  auto upload = find(user_id, upload_id);
+  bool failed = false;
+  std::uint32_t received = 0;
+  {
+    std::lock_guard lock(upload->mutex);
+    if (!upload->writer) {
+      throw std::runtime_error("Upload is already committed");
+    }
+
+    received = static_cast<std::uint32_t>(upload->writer->size());
+    // A gap means an earlier chunk was lost; the reply tells the client where to resume
+    if (offset > received) return received;
+
+    auto skip = std::min<std::size_t>(received - offset, data.size());
+    auto fresh = data.subspan(skip);
+    if (fresh.size() > upload->size - received) {
+      throw std::runtime_error("Chunk is past the end of the upload");
+    }
+
+    try {
+      upload->writer->write(fresh);
+      received += static_cast<std::uint32_t>(fresh.size());
+      upload->expires_at = Clock::now() + options_.idle_timeout;
+    } catch (const std::exception& e) {
+      spdlog::error("[UploadService] Upload {} of user {} failed: {}", upload_id, user_id, e.what());
+      failed = true;
+    }
+  }
+
+  if (failed) {
+    // Part of the chunk may be on disk; the upload can't be resumed
+    std::lock_guard lock(mutex_);
+    uploads_.erase(upload_id);
+    throw std::runtime_error("Failed to store upload");
+  }
+  return received;
+}
+
+void UploadService::commitUpload(std::uint32_t user_id, npchat::UploadId upload_id) {
+  auto upload = find(user_id, upload_id);
+
+  // Until the upload is counted in committed_hashes_
+  auto hold = blobs_->hold();
+  std::unique_lock upload_lock(upload->mutex);
+  if (upload->committed) return; // Retried after a lost reply
+  if (!upload->writer || upload->writer->size() != upload->size) {
+    throw std::runtime_error("Upload is incomplete");
+  }
+
+  Committed committed{upload->writer->commit(), upload->size, upload->writer->created()};
+  upload->writer.reset();
+  {
+    std::lock_guard lock(mutex_);
+    auto it = uploads_.find(upload_id);
+    if (it != uploads_.end() && it->second == upload) {
+      ++committed_hashes_[committed.hash];
+      upload->committed = std::move(committed);
+      upload->expires_at = Clock::now() + options_.committed_ttl;
+      return;
+    }
+  }
+
+  // Expired while the content was being stored
+  upload_lock.unlock();
+  hold.unlock();
+  discard(committed);
+  throw std::runtime_error("Unknown upload");
+}
+
+std::optional<UploadService::Committed> UploadService::take(std::uint32_t user_id, npchat::UploadId upload_id) {
+  std::shared_ptr<Upload> upload;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = uploads_.find(upload_id);
+    if (it == uploads_.end() || it->second->owner != user_id) return std::nullopt;
+    upload = it->second;
+  }
+
+  std::optional<Committed> committed;
+  std::lock_guard upload_lock(upload->mutex);
+  std::lock_guard lock(mutex_);
+  committed.swap(upload->committed);
+  if (!committed) return std::nullopt;
+
+  forget(*committed);
+  uploads_.erase(upload_id);
+  return committed;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
+#include "BlobStore.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Attachment content uploaded in chunks ahead of the message that carries it.
+//
+// Each chunk goes straight to a BlobStore::Writer, so an upload costs a file
+// descriptor and a hash state however large it is. Chunks carry their offset:
+// resending one that already arrived is a no-op, and uploadChunk() always
+// answers with the number of bytes received, which is where a client picks up
+// after losing a reply or its connection.
+//
+// A committed upload is content in the BlobStore waiting for its message;
+// sendMessage() takes it by id. Uploads left idle or never sent expire; they are
+// swept every sweep_interval and before a new upload counts against its user.
+// Content that a commit stored anew is removed again when its upload expires or
+// its message can't be stored, unless Options::referenced finds a row using it
+// or another committed upload has the same content. Content that was already in
+// the store before the commit is never removed here.
+class UploadService {
+public:
+  struct Options {
+    std::uint32_t max_size = 512 * 1024 * 1024;
+    std::size_t max_uploads_per_user = 8; // In progress at the same time
+    std::chrono::seconds idle_timeout{600};
+    std::chrono::seconds committed_ttl{3600};
+    std::chrono::seconds sweep_interval{60};
+    // Whether a stored row refers to the content; unset keeps all content
+    std::function<bool(std::string_view hash)> referenced;
+  };
+
+  struct Committed {
+    std::string hash;
+    std::uint32_t size;
+    bool created; // The commit stored new content
+  };
+
+  // Upper bound on the length of one chunk
+  static constexpr std::uint32_t max_chunk = 1024 * 1024;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Upload {
+    std::uint32_t owner;
+    std::uint32_t size;
+    std::mutex mutex; // Serializes the chunks of this upload only
+    std::unique_ptr<BlobStore::Writer> writer;
+    std::optional<Committed> committed; // Written with both mutex and UploadService::mutex_ locked
+    // Pushed back by every chunk and by the commit; read by expire() without the upload's lock
+    std::atomic<Clock::time_point> expires_at;
+  };
+
+  std::shared_ptr<BlobStore> blobs_;
+  const Options options_;
+
+  std::mutex mutex_;
+  std::unordered_map<npchat::UploadId, std::shared_ptr<Upload>> uploads_;
+  std::unordered_map<std::string, std::size_t> committed_hashes_; // Committed uploads by content
+  npchat::UploadId next_id_ = 1;
+  boost::asio::steady_timer sweep_timer_;
+
+  // The caller's upload; throws if it doesn't exist or belongs to someone else
+  std::shared_ptr<Upload> find(std::uint32_t user_id, npchat::UploadId upload_id);
+  // Must be called with mutex_ locked; returns the committed uploads it dropped
+  std::vector<Committed> expire(Clock::time_point now);
+  // Must be called with mutex_ locked
+  void forget(const Committed& committed);
+  void scheduleSweep();
+
+public:
+  UploadService(const std::shared_ptr<BlobStore>& blobs, Options options);
+  ~UploadService();
+
+  npchat::UploadId beginUpload(std::uint32_t user_id, std::uint32_t size);
+  // Writes the part of `data` at `offset` that hasn't been received yet; returns the bytes received so far
+  std::uint32_t uploadChunk(std::uint32_t user_id, npchat::UploadId upload_id, std::uint32_t offset,
+                            std::span<const std::uint8_t> data);
+  // Stores the content once all of it has been received
+  void commitUpload(std::uint32_t user_id, npchat::UploadId upload_id);
+  // Hands a committed upload over to a message; nullopt if there is none.
+  // The caller holds the BlobStore until the message referring to it is stored.
+  std::optional<Committed> take(std::uint32_t user_id, npchat::UploadId upload_id);
+  // Removes the content of a taken upload whose message couldn't be stored, unless
+  // something else refers to it. The caller must not hold the BlobStore.
+  void discard(const Committed& committed);
+};
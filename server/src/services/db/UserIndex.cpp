@@ -0,0 +1,132 @@
+#include "UserIndex.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+namespace {
+// What LIKE and LOWER() compare: only ASCII letters are folded
+std::string lowercase(std::string_view s) {
+  std::string lower(s);
+  for (auto& c : lower) {
+    if (c >= 'A' && c <= 'Z') c = static_cast<char>(c - 'A' + 'a');
+  }
+  return lower;
+}
+
+std::uint32_t trigram(std::string_view s, std::size_t i) noexcept {
+  return static_cast<std::uint32_t>(static_cast<unsigned char>(s[i])) << 16
+       | static_cast<std::uint32_t>(static_cast<unsigned char>(s[i + 1])) << 8
+       | static_cast<std::uint32_t>(static_cast<unsigned char>(s[i + 2]));
+}
+} // namespace
+
+UserIndex::UserIndex(const std::shared_ptr<Database>& database) {
+  auto start = std::chrono::steady_clock::now();
+
+  {
+    auto reader = database->reader();
+    // In id order, so the posting lists come out sorted
+    auto stmt = reader->prepareStatement("SELECT id, username, email FROM users ORDER BY id");
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      insert(sqlite3_column_int(stmt, 0),
+             reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+             reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)));
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  spdlog::info("User index loaded: {} users, {} trigrams in {} ms", by_name_.size(), trigrams_.size(), elapsed.count());
+}
+
+void UserIndex::insert(std::uint32_t id, std::string_view username, std::string_view email) {
+  if (usernames_.size() <= id) usernames_.resize(id + 1);
+  usernames_[id] = username;
+
+  auto lower = lowercase(username);
+  for (std::size_t i = 0; i + 3 <= lower.size(); ++i) {
+    auto& postings = trigrams_[trigram(lower, i)];
+    // Ids normally arrive in ascending order, so this is an append
+    auto pos = std::lower_bound(postings.begin(), postings.end(), id);
+    if (pos == postings.end() || *pos != id) postings.insert(pos, id);
+  }
+  by_name_.emplace(std::move(lower), id);
+  by_email_.emplace(lowercase(email), id);
+}
+
+bool UserIndex::hasUsername(std::string_view username) const {
+  auto lower = lowercase(username);
+  std::shared_lock lock(mutex_);
+  return by_name_.find(lower) != by_name_.end();
+}
+
+bool UserIndex::hasEmail(std::string_view email) const {
+  auto lower = lowercase(email);
+  std::shared_lock lock(mutex_);
+  return by_email_.contains(lower);
+}
+
+std::vector<UserIndex::Entry> UserIndex::search(std::string_view query, std::uint32_t except, std::size_t limit) const {
+  auto q = lowercase(query);
+  std::vector<Entry> found;
+  if (limit == 0) return found;
+
+  std::shared_lock lock(mutex_);
+
+  for (auto it = by_name_.lower_bound(q); it != by_name_.end() && it->first.starts_with(q); ++it) {
+    if (it->second == except) continue;
+    found.push_back({it->second, usernames_[it->second]});
+    if (found.size() == limit) return found;
+  }
+  auto already_found = [&found] (std::uint32_t id) {
+    return std::any_of(found.begin(), found.end(), [id] (const Entry& e) { return e.id == id; });
+  };
+
+  if (auto it = by_email_.find(q); it != by_email_.end() && it->second != except && !already_found(it->second)) {
+    found.push_back({it->second, usernames_[it->second]});
+    if (found.size() == limit) return found;
+  }
+
+  if (q.size() < 3) return found;
+
+  // Walk the shortest posting list and check each candidate against the others
+  std::vector<const std::vector<std::uint32_t>*> lists;
+  for (std::size_t i = 0; i + 3 <= q.size(); ++i) {
+    auto it = trigrams_.find(trigram(q, i));
+    if (it == trigrams_.end()) return found;
+    lists.push_back(&it->second);
+  }
+  std::sort(lists.begin(), lists.end(), [] (auto a, auto b) { return a->size() < b->size(); });
+
+  const auto infix_begin = found.size();
+  for (auto id : *lists.front()) {
+    if (id == except) continue;
+    bool in_all = std::all_of(lists.begin() + 1, lists.end(), [id] (auto list) {
+      return std::binary_search(list->begin(), list->end(), id);
+    });
+    if (!in_all) continue;
+
+    // Trigrams may match out of order; the substring check is exact
+    auto lower = lowercase(usernames_[id]);
+    auto pos = lower.find(q);
+    if (pos == std::string::npos || pos == 0 || already_found(id)) continue; // Prefix matches are in already
+    found.push_back({id, usernames_[id]});
+    if (found.size() == limit) break;
+  }
+
+  // The infix matches found first are the oldest accounts; show them in username order too
+  std::sort(found.begin() + infix_begin, found.end(),
+            [] (const Entry& a, const Entry& b) { return a.username < b.username; });
+  return found;
+}
+
+std::size_t UserIndex::size() const {
+  std::shared_lock lock(mutex_);
+  return by_name_.size();
+}
+
+void UserIndex::add(std::uint32_t id, std::string_view username, std::string_view email) {
+  std::unique_lock lock(mutex_);
+  insert(id, username, email);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "Database.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// In-memory index of usernames and emails for user search and availability checks.
+//
+// Loaded from users at startup and kept up to date by AuthService, which adds
+// every account it registers. Matching is ASCII case-insensitive, as LIKE and
+// LOWER() were before:
+// - a query matches every username starting with it, found by walking an
+//   ordered map from the query, so results come out in username order;
+// - queries of three characters or more also match inside usernames, through
+//   posting lists of the username trigrams (ids in ascending order, since ids
+//   only grow);
+// - an email matches only as a whole, so searching by email finds one account
+//   instead of everyone at the same domain.
+class UserIndex {
+public:
+  struct Entry {
+    std::uint32_t id;
+    std::string username;
+  };
+
+private:
+  mutable std::shared_mutex mutex_;
+  std::vector<std::string> usernames_;                               // By id, as registered; empty if none
+  std::multimap<std::string, std::uint32_t, std::less<>> by_name_;   // Lowercase username -> id
+  std::unordered_map<std::string, std::uint32_t> by_email_;          // Lowercase email -> id
+  std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> trigrams_;
+
+  void insert(std::uint32_t id, std::string_view username, std::string_view email);
+
+public:
+  explicit UserIndex(const std::shared_ptr<Database>& database);
+
+  // Any case; pending registrations are not included
+  bool hasUsername(std::string_view username) const;
+  bool hasEmail(std::string_view email) const;
+
+  // Prefix matches in username order, then email and infix matches; never `except`
+  std::vector<Entry> search(std::string_view query, std::uint32_t except, std::size_t limit) const;
+
+  std::size_t size() const;
+
+  // Write-through update, called after the user is committed
+  void add(std::uint32_t id, std::string_view username, std::string_view email);
+};
@@ -1,143 +1,298 @@
 #include "WebRTCService.hpp"
+#include <algorithm>
 #include <spdlog/spdlog.h>
-#include <sstream>
-#include <iomanip>
+#include <nplib/utils/thread_pool.hpp>
 
-WebRTCService::WebRTCService() {
+namespace {
+template <typename Shard>
+std::vector<std::unique_ptr<Shard>> make_shards(std::size_t count) {
+  std::vector<std::unique_ptr<Shard>> shards;
+  shards.reserve(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    shards.push_back(std::make_unique<Shard>());
+  }
+  return shards;
+}
+}
+
+WebRTCService::WebRTCService(Options options, Events events)
+  : options_(options)
+  , events_(std::move(events))
+  , call_shards_(make_shards<CallShard>(std::max<std::size_t>(1, options.shard_count)))
+  , user_index_(make_shards<IndexShard>(std::max<std::size_t>(1, options.shard_count)))
+  , chat_index_(make_shards<IndexShard>(std::max<std::size_t>(1, options.shard_count)))
+  , wheel_(wheel_slots)
+  , wheel_timer_(thread_pool::get_instance().executor())
+{
+  scheduleTick();
   spdlog::info("WebRTCService initialized");
 }
 
 WebRTCService::~WebRTCService() {
+  wheel_timer_.cancel();
+  for (auto& shard : call_shards_) {
+    std::lock_guard lock(shard->mutex);
+    for (auto& [callId, call] : shard->calls) call.cancel_flushes();
+  }
   spdlog::info("WebRTCService destroyed");
 }
 
 std::string WebRTCService::generateCallId() {
-  thread_local static std::random_device rd;
-  std::mt19937 gen(rd());
+  static constexpr char digits[] = "0123456789abcdef";
+  thread_local std::mt19937 gen{std::random_device{}()};
   std::uniform_int_distribution<> dis(0, 15);
 
-  std::stringstream ss;
-  ss << std::hex << std::setfill('0');
-  for (int i = 0; i < 32; ++i) {
-    ss << dis(gen);
+  std::string id(32, '0');
+  for (auto& c : id) {
+    c = digits[dis(gen)];
   }
-  return ss.str();
+  return id;
 }
 
-std::string WebRTCService::initiateCall(npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId calleeId, std::string_view offer) {
-  std::lock_guard<std::mutex> lock(mutex_);
+void WebRTCService::index_add(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key, const std::string& callId) {
+  auto& shard = index_for(index, key);
+  std::lock_guard lock(shard.mutex);
+  shard.calls[key].push_back(callId);
+}
+
+void WebRTCService::index_remove(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key, std::string_view callId) {
+  auto& shard = index_for(index, key);
+  std::lock_guard lock(shard.mutex);
+
+  auto it = shard.calls.find(key);
+  if (it == shard.calls.end()) return;
+
+  std::erase(it->second, callId);
+  if (it->second.empty()) {
+    shard.calls.erase(it);
+  }
+}
+
+std::vector<CallInfo> WebRTCService::lookup(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key) {
+  std::vector<std::string> callIds;
+  {
+    auto& shard = index_for(index, key);
+    std::lock_guard lock(shard.mutex);
+    if (auto it = shard.calls.find(key); it != shard.calls.end()) {
+      callIds = it->second;
+    }
+  }
+
+  std::vector<CallInfo> result;
+  for (const auto& callId : callIds) {
+    if (auto call = getCall(callId); call && call->isActive) {
+      result.push_back(std::move(*call));
+    }
+  }
+  return result;
+}
 
+void WebRTCService::schedule(std::string callId, std::chrono::steady_clock::duration after) {
+  auto ticks = std::max<std::size_t>(1, (after + wheel_tick - std::chrono::nanoseconds(1)) / wheel_tick);
+
+  std::lock_guard lock(wheel_mutex_);
+  wheel_[(wheel_cursor_ + ticks) % wheel_slots].push_back({std::move(callId), (ticks - 1) / wheel_slots});
+}
+
+void WebRTCService::scheduleTick() {
+  wheel_timer_.expires_after(wheel_tick);
+  wheel_timer_.async_wait([this] (const boost::system::error_code& ec) {
+    if (ec) return; // Cancelled on shutdown
+    onTick();
+    scheduleTick();
+  });
+}
+
+void WebRTCService::onTick() {
+  std::vector<std::string> due;
+  {
+    std::lock_guard lock(wheel_mutex_);
+    wheel_cursor_ = (wheel_cursor_ + 1) % wheel_slots;
+
+    auto& slot = wheel_[wheel_cursor_];
+    std::erase_if(slot, [&due] (WheelEntry& entry) {
+      if (entry.rounds > 0) {
+        --entry.rounds;
+        return false;
+      }
+      due.push_back(std::move(entry.callId));
+      return true;
+    });
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  for (const auto& callId : due) {
+    {
+      // The deadline moves when a call is answered; its earlier entry is then stale
+      auto& shard = shard_for(callId);
+      std::lock_guard lock(shard.mutex);
+      auto it = shard.calls.find(callId);
+      if (it == shard.calls.end() || it->second.expires_at > now) continue;
+    }
+
+    if (auto call = removeCall(callId)) {
+      spdlog::info("Call expired: {}", callId);
+      if (events_.call_expired) events_.call_expired(*call);
+    }
+  }
+}
+
+std::string WebRTCService::initiateCall(npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId calleeId, std::string_view offer) {
   std::string callId = generateCallId();
 
-  CallInfo callInfo{
-    callId,
-    chatId,
-    callerId,
-    calleeId,
-    std::string(offer),
-    "",
+  Call call{
+    CallInfo{
+      callId,
+      chatId,
+      callerId,
+      calleeId,
+      std::string(offer),
+      "",
+      true,
+      std::chrono::system_clock::now()
+    },
+    std::chrono::steady_clock::now() + options_.ring_timeout,
     {},
-    true,
-    std::chrono::system_clock::now()
+    {}
   };
 
-  activeCalls_[callId] = callInfo;
+  {
+    auto& shard = shard_for(callId);
+    std::lock_guard lock(shard.mutex);
+    shard.calls.emplace(callId, std::move(call));
+  }
+
+  index_add(user_index_, callerId, callId);
+  index_add(user_index_, calleeId, callId);
+  index_add(chat_index_, chatId, callId);
+  schedule(callId, options_.ring_timeout);
 
   spdlog::info("Call initiated: {} in chat {} from {} to {}", callId, chatId, callerId, calleeId);
   return callId;
 }
 
 bool WebRTCService::answerCall(std::string_view callId, std::string_view answer) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  {
+    auto& shard = shard_for(callId);
+    std::lock_guard lock(shard.mutex);
 
-  auto it = activeCalls_.find(callId);
-  if (it == activeCalls_.end()) {
-    spdlog::warn("Call not found for answering: {}", callId);
-    return false;
+    auto it = shard.calls.find(callId);
+    if (it == shard.calls.end()) {
+      spdlog::warn("Call not found for answering: {}", callId);
+      return false;
+    }
+
+    it->second.info.answer = answer;
+    it->second.expires_at = std::chrono::steady_clock::now() + options_.max_duration;
   }
 
-  it->second.answer = answer;
+  schedule(std::string(callId), options_.max_duration);
   spdlog::info("Call answered: {}", callId);
   return true;
 }
 
-bool WebRTCService::addIceCandidate(std::string_view callId, std::string_view candidate) {
-  std::lock_guard<std::mutex> lock(mutex_);
+bool WebRTCService::addIceCandidate(std::string_view callId, npchat::UserId fromUserId, std::string_view candidate) {
+  npchat::UserId targetUserId;
+  {
+    auto& shard = shard_for(callId);
+    std::lock_guard lock(shard.mutex);
 
-  auto it = activeCalls_.find(callId);
-  if (it == activeCalls_.end()) {
-    spdlog::warn("Call not found for ICE candidate: {}", callId);
-    return false;
+    auto it = shard.calls.find(callId);
+    if (it == shard.calls.end()) {
+      spdlog::warn("Call not found for ICE candidate: {}", callId);
+      return false;
+    }
+
+    auto& call = it->second;
+    bool from_caller = call.info.callerId == fromUserId;
+    targetUserId = from_caller ? call.info.calleeId : call.info.callerId;
+
+    auto& pending = from_caller ? call.pending_to_callee : call.pending_to_caller;
+    pending.emplace_back(candidate);
+
+    // The first candidate of a batch arms its flush; the rest just join it
+    if (pending.size() == 1) {
+      auto& timer = from_caller ? call.flush_to_callee : call.flush_to_caller;
+      if (!timer) timer = std::make_unique<boost::asio::steady_timer>(thread_pool::get_instance().executor());
+      timer->expires_after(options_.ice_batch_window);
+      timer->async_wait([this, callId = std::string(callId), targetUserId] (const boost::system::error_code& ec) {
+        if (ec) return; // Cancelled: the call ended or the service is going away
+        flushIceCandidates(callId, targetUserId);
+      });
+    }
   }
 
-  it->second.iceCandidates.emplace_back(candidate);
-  spdlog::debug("ICE candidate added to call: {}", callId);
+  spdlog::debug("ICE candidate queued for call: {}", callId);
   return true;
 }
 
-bool WebRTCService::endCall(std::string_view callId) {
-  std::lock_guard<std::mutex> lock(mutex_);
+void WebRTCService::flushIceCandidates(const std::string& callId, npchat::UserId targetUserId) {
+  std::vector<std::string> candidates;
+  {
+    auto& shard = shard_for(callId);
+    std::lock_guard lock(shard.mutex);
+
+    auto it = shard.calls.find(callId);
+    if (it == shard.calls.end()) return; // Ended in the meantime
+
+    auto& call = it->second;
+    candidates.swap(call.info.callerId == targetUserId ? call.pending_to_caller : call.pending_to_callee);
+  }
+
+  if (!candidates.empty() && events_.ice_candidates) {
+    spdlog::debug("Pushing {} ICE candidates for call {} to user {}", candidates.size(), callId, targetUserId);
+    events_.ice_candidates(callId, targetUserId, std::move(candidates));
+  }
+}
+
+std::optional<CallInfo> WebRTCService::removeCall(std::string_view callId) {
+  std::optional<CallInfo> info;
+  {
+    auto& shard = shard_for(callId);
+    std::lock_guard lock(shard.mutex);
+
+    auto it = shard.calls.find(callId);
+    if (it == shard.calls.end()) return std::nullopt;
+
+    it->second.cancel_flushes();
+    info = std::move(it->second.info);
+    shard.calls.erase(it);
+  }
+
+  index_remove(user_index_, info->callerId, callId);
+  index_remove(user_index_, info->calleeId, callId);
+  index_remove(chat_index_, info->chatId, callId);
 
-  auto it = activeCalls_.find(callId);
-  if (it == activeCalls_.end()) {
+  info->isActive = false;
+  return info;
+}
+
+bool WebRTCService::endCall(std::string_view callId) {
+  if (!removeCall(callId)) {
     spdlog::warn("Call not found for ending: {}", callId);
     return false;
   }
 
-  it->second.isActive = false;
   spdlog::info("Call ended: {}", callId);
   return true;
 }
 
 std::optional<CallInfo> WebRTCService::getCall(std::string_view callId) {
-  std::lock_guard<std::mutex> lock(mutex_);
+  auto& shard = shard_for(callId);
+  std::lock_guard lock(shard.mutex);
 
-  auto it = activeCalls_.find(callId);
-  if (it == activeCalls_.end()) {
+  auto it = shard.calls.find(callId);
+  if (it == shard.calls.end()) {
     return std::nullopt;
   }
 
-  return it->second;
+  return it->second.info;
 }
 
 std::vector<CallInfo> WebRTCService::getActiveCallsForUser(npchat::UserId userId) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  std::vector<CallInfo> userCalls;
-
-  for (const auto& [callId, callInfo] : activeCalls_) {
-    if (callInfo.isActive && (callInfo.callerId == userId || callInfo.calleeId == userId)) {
-      userCalls.push_back(callInfo);
-    }
-  }
-
-  return userCalls;
+  return lookup(user_index_, userId);
 }
 
 std::vector<CallInfo> WebRTCService::getActiveCallsForChat(npchat::ChatId chatId) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  std::vector<CallInfo> chatCalls;
-
-  for (const auto& [callId, callInfo] : activeCalls_) {
-    if (callInfo.isActive && callInfo.chatId == chatId) {
-      chatCalls.push_back(callInfo);
-    }
-  }
-
-  return chatCalls;
+  return lookup(chat_index_, chatId);
 }
-
-void WebRTCService::cleanupExpiredCalls() {
-  std::lock_guard<std::mutex> lock(mutex_);
-
-  auto now = std::chrono::system_clock::now();
-  auto cutoff = now - std::chrono::hours(24); // Calls older than 24 hours
-
-  for (auto it = activeCalls_.begin(); it != activeCalls_.end();) {
-    if (it->second.createdAt < cutoff) {
-      spdlog::info("Cleaning up expired call: {}", it->first);
-      it = activeCalls_.erase(it);
-    } else {
-      ++it;
-    }
-  }
-}
\ No newline at end of file
@@ -6,6 +6,10 @@
 #include <mutex>
 #include <random>
 #include <chrono>
+#include <functional>
+#include <optional>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
 #include "npchat_stub/npchat.hpp"
 
 #include <nplib/utils/unordered.hpp>
@@ -17,33 +21,120 @@ struct CallInfo {
   npchat::UserId calleeId;
   std::string offer;
   std::string answer;
-  std::vector<std::string> iceCandidates;
   bool isActive;
   std::chrono::system_clock::time_point createdAt;
 };
 
+// Registry of calls being set up or in progress.
+//
+// Calls are sharded by id; users and chats have their own sharded indexes, so
+// per-user and per-chat queries don't scan every call. No two shard locks are
+// ever held together, which means an index may briefly name a call that was just
+// removed; lookups skip those.
+//
+// Calls expire on a timing wheel ticked from the thread pool: an unanswered call
+// after ring_timeout, an answered one after max_duration. Ended and expired calls
+// are dropped from the registry.
+//
+// ICE candidates aren't stored. They are queued per recipient and pushed in one
+// batch once ice_batch_window has passed since the first of them.
 class WebRTCService {
+public:
+  struct Options {
+    std::size_t shard_count = 16;
+    std::chrono::seconds ring_timeout{60};
+    std::chrono::seconds max_duration{24 * 60 * 60};
+    std::chrono::milliseconds ice_batch_window{5};
+  };
+
+  struct Events {
+    std::function<void(const std::string& callId, npchat::UserId targetUserId, std::vector<std::string> candidates)> ice_candidates;
+    std::function<void(const CallInfo& call)> call_expired;
+  };
+
 private:
-  std::unordered_map<std::string, CallInfo, nplib::utils::string_hash, std::equal_to<>> activeCalls_;
-  mutable std::mutex mutex_;
+  static constexpr std::size_t wheel_slots = 512;
+  static constexpr std::chrono::seconds wheel_tick{1};
+
+  struct Call {
+    CallInfo info;
+    std::chrono::steady_clock::time_point expires_at;
+    // ICE candidates waiting for the next push, per recipient, and the timers that push them.
+    // The timers go with the call, so ending it or destroying the service cancels them.
+    std::vector<std::string> pending_to_caller;
+    std::vector<std::string> pending_to_callee;
+    std::unique_ptr<boost::asio::steady_timer> flush_to_caller;
+    std::unique_ptr<boost::asio::steady_timer> flush_to_callee;
+
+    void cancel_flushes() {
+      if (flush_to_caller) flush_to_caller->cancel();
+      if (flush_to_callee) flush_to_callee->cancel();
+    }
+  };
+
+  struct CallShard {
+    std::mutex mutex;
+    std::unordered_map<std::string, Call, nplib::utils::string_hash, std::equal_to<>> calls;
+  };
+
+  // Call ids by user or chat id
+  struct IndexShard {
+    std::mutex mutex;
+    std::unordered_map<std::uint32_t, std::vector<std::string>> calls;
+  };
+
+  struct WheelEntry {
+    std::string callId;
+    std::size_t rounds; // Full turns of the wheel left before it is due
+  };
+
+  const Options options_;
+  const Events events_;
+
+  std::vector<std::unique_ptr<CallShard>> call_shards_;
+  std::vector<std::unique_ptr<IndexShard>> user_index_;
+  std::vector<std::unique_ptr<IndexShard>> chat_index_;
+
+  std::mutex wheel_mutex_;
+  std::vector<std::vector<WheelEntry>> wheel_;
+  std::size_t wheel_cursor_ = 0;
+  boost::asio::steady_timer wheel_timer_;
+
+  CallShard& shard_for(std::string_view callId) noexcept {
+    return *call_shards_[nplib::utils::string_hash{}(callId) % call_shards_.size()];
+  }
+
+  static IndexShard& index_for(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key) noexcept {
+    return *index[key % index.size()];
+  }
+
+  static void index_add(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key, const std::string& callId);
+  static void index_remove(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key, std::string_view callId);
+
+  // Active calls named by an index entry
+  std::vector<CallInfo> lookup(std::vector<std::unique_ptr<IndexShard>>& index, std::uint32_t key);
 
   std::string generateCallId();
+  std::optional<CallInfo> removeCall(std::string_view callId);
+
+  void schedule(std::string callId, std::chrono::steady_clock::duration after);
+  void scheduleTick();
+  void onTick();
+  void flushIceCandidates(const std::string& callId, npchat::UserId targetUserId);
 
 public:
-  WebRTCService();
+  WebRTCService(Options options, Events events);
   ~WebRTCService();
 
   // Call management
   std::string initiateCall(npchat::ChatId chatId, npchat::UserId callerId, npchat::UserId calleeId, std::string_view offer);
   bool answerCall(std::string_view callId, std::string_view answer);
-  bool addIceCandidate(std::string_view callId, std::string_view candidate);
+  // Queues a candidate from one participant for the other
+  bool addIceCandidate(std::string_view callId, npchat::UserId fromUserId, std::string_view candidate);
   bool endCall(std::string_view callId);
 
   // Call queries
   std::optional<CallInfo> getCall(std::string_view callId);
   std::vector<CallInfo> getActiveCallsForUser(npchat::UserId userId);
   std::vector<CallInfo> getActiveCallsForChat(npchat::ChatId chatId);
-
-  // Cleanup old calls
-  void cleanupExpiredCalls();
-};
\ No newline at end of file
+};
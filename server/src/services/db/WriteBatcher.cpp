@@ -0,0 +1,284 @@
+#include "WriteBatcher.hpp"
+#include "services/metrics/Metrics.hpp"
+
+namespace {
+// Message ids grow with their timestamps, so everything queued before the oldest
+// queued message that is still young enough has expired
+constexpr const char* prune_expired_sql =
+  "DELETE FROM delivery_queue WHERE message_id < COALESCE("
+  "  (SELECT q.message_id FROM delivery_queue q JOIN messages m ON m.id = q.message_id"
+  "   WHERE m.timestamp >= ? ORDER BY q.message_id LIMIT 1),"
+  "  (SELECT MAX(message_id) + 1 FROM delivery_queue))";
+
+constexpr const char* over_limit_sql =
+  "SELECT user_id FROM delivery_queue GROUP BY user_id HAVING COUNT(*) > ?";
+
+// Keeps the user's newest `limit` queued messages
+constexpr const char* prune_user_sql =
+  "DELETE FROM delivery_queue WHERE user_id = ?1 AND message_id <= "
+  "  (SELECT message_id FROM delivery_queue WHERE user_id = ?1 ORDER BY message_id DESC LIMIT 1 OFFSET ?2)";
+} // namespace
+
+WriteBatcher::WriteBatcher(const std::shared_ptr<Database>& database, Options options)
+  : db_(database)
+  , conn_(database->openConnection(false))
+  , options_(options)
+{
+  insert_message_stmt_ = conn_->prepareStatement(
+    "INSERT INTO messages (chat_id, sender_id, content, timestamp, attachment_id) "
+    "VALUES (?, ?, ?, ?, ?)");
+
+  insert_attachment_stmt_ = conn_->prepareStatement(
+    "INSERT INTO attachments (type, name, data, hash, size) VALUES (?, ?, x'', ?, ?)");
+
+  delete_delivery_stmt_ = conn_->prepareStatement(
+    "DELETE FROM delivery_queue WHERE user_id = ? AND message_id = ?");
+
+  prune_expired_stmt_ = conn_->prepareStatement(prune_expired_sql);
+  over_limit_stmt_ = conn_->prepareStatement(over_limit_sql);
+  prune_user_stmt_ = conn_->prepareStatement(prune_user_sql);
+
+  worker_ = std::thread(&WriteBatcher::run, this);
+
+  spdlog::info("WriteBatcher started: batch size {}, window {} ms",
+               options_.batch_size, options_.window.count());
+}
+
+WriteBatcher::~WriteBatcher() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  // The worker drains whatever is still queued before exiting
+  worker_.join();
+
+  sqlite3_finalize(insert_message_stmt_);
+  sqlite3_finalize(insert_attachment_stmt_);
+  sqlite3_finalize(delete_delivery_stmt_);
+  sqlite3_finalize(prune_expired_stmt_);
+  sqlite3_finalize(over_limit_stmt_);
+  sqlite3_finalize(prune_user_stmt_);
+}
+
+std::future<WriteBatcher::InsertedMessage> WriteBatcher::insertMessage(const NewMessage& message) {
+  MessageInsert op{&message, {}};
+  auto future = op.result.get_future();
+  enqueue(std::move(op));
+  return future;
+}
+
+void WriteBatcher::ackDelivery(npchat::MessageId message_id, std::uint32_t user_id) {
+  enqueue(DeliveryAck{message_id, user_id});
+}
+
+void WriteBatcher::enqueue(Operation&& op) {
+  bool wake = false;
+  {
+    std::lock_guard lock(mutex_);
+    pending_.push_back(std::move(op));
+    // Wake the worker for the first row of a batch, and again once the batch is full
+    wake = pending_.size() == 1 || pending_.size() >= options_.batch_size;
+  }
+  if (wake) cv_.notify_one();
+}
+
+void WriteBatcher::run() {
+  std::vector<Operation> batch;
+  std::unique_lock lock(mutex_);
+  auto next_prune = std::chrono::steady_clock::now();
+
+  for (;;) {
+    if (!cv_.wait_until(lock, next_prune, [this] { return stop_ || !pending_.empty(); })) {
+      lock.unlock();
+      pruneDeliveryQueue();
+      lock.lock();
+      next_prune = std::chrono::steady_clock::now() + options_.prune_interval;
+      continue;
+    }
+    if (pending_.empty()) break; // stopped and fully drained
+
+    // Let other sessions join this transaction for up to one window
+    auto deadline = std::chrono::steady_clock::now() + options_.window;
+    cv_.wait_until(lock, deadline, [this] { return stop_ || pending_.size() >= options_.batch_size; });
+
+    batch.swap(pending_);
+    lock.unlock();
+
+    commit(batch);
+    batch.clear();
+
+    // A busy queue never times out above
+    if (std::chrono::steady_clock::now() >= next_prune) {
+      pruneDeliveryQueue();
+      next_prune = std::chrono::steady_clock::now() + options_.prune_interval;
+    }
+
+    lock.lock();
+  }
+}
+
+void WriteBatcher::commit(std::vector<Operation>& batch) {
+  auto db = conn_->handle();
+
+  auto fail_all = [&batch](const char* what) {
+    for (auto& op : batch) {
+      if (auto msg = std::get_if<MessageInsert>(&op)) {
+        msg->result.set_exception(std::make_exception_ptr(std::runtime_error(what)));
+      }
+    }
+  };
+
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("[WriteBatcher] Failed to begin transaction: {}", sqlite3_errmsg(db));
+    fail_all("Failed to send message");
+    return;
+  }
+
+  // Results are only published after COMMIT, so a caller never sees an id that could be rolled back
+  std::vector<std::pair<MessageInsert*, InsertedMessage>> inserted;
+  std::vector<MessageInsert*> failed;
+  inserted.reserve(batch.size());
+
+  for (auto& op : batch) {
+    if (auto msg = std::get_if<MessageInsert>(&op)) {
+      // Keep a failed row from leaving an orphaned attachment behind without aborting the batch
+      sqlite3_exec(db, "SAVEPOINT message_insert", nullptr, nullptr, nullptr);
+      try {
+        inserted.emplace_back(msg, execute(*msg));
+        sqlite3_exec(db, "RELEASE message_insert", nullptr, nullptr, nullptr);
+      } catch (const std::exception& e) {
+        spdlog::warn("[WriteBatcher] {}: {}", e.what(), sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK TO message_insert", nullptr, nullptr, nullptr);
+        sqlite3_exec(db, "RELEASE message_insert", nullptr, nullptr, nullptr);
+        failed.push_back(msg);
+      }
+    } else {
+      execute(std::get<DeliveryAck>(op));
+    }
+  }
+
+  if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("[WriteBatcher] Failed to commit {} rows: {}", batch.size(), sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    fail_all("Failed to send message");
+    return;
+  }
+
+  for (auto& [msg, ids] : inserted) {
+    msg->result.set_value(ids);
+  }
+  for (auto msg : failed) {
+    msg->result.set_exception(std::make_exception_ptr(std::runtime_error("Failed to send message")));
+  }
+}
+
+WriteBatcher::InsertedMessage WriteBatcher::execute(const MessageInsert& op) {
+  auto db = conn_->handle();
+  const auto& message = *op.message;
+
+  std::uint32_t attachment_id = 0;
+
+  // Handle attachment if present
+  if (message.has_attachment) {
+    sqlite3_bind_int(insert_attachment_stmt_, 1, static_cast<int>(message.attachment_type));
+    sqlite3_bind_text(insert_attachment_stmt_, 2, message.attachment_name.data(),
+                      static_cast<int>(message.attachment_name.size()), SQLITE_STATIC);
+    sqlite3_bind_text(insert_attachment_stmt_, 3, message.attachment_hash.data(),
+                      static_cast<int>(message.attachment_hash.size()), SQLITE_STATIC);
+    sqlite3_bind_int64(insert_attachment_stmt_, 4, static_cast<sqlite3_int64>(message.attachment_size));
+
+    bool ok = sqlite3_step(insert_attachment_stmt_) == SQLITE_DONE;
+    sqlite3_reset(insert_attachment_stmt_);
+    if (!ok) {
+      throw std::runtime_error("Failed to store attachment");
+    }
+    attachment_id = static_cast<std::uint32_t>(sqlite3_last_insert_rowid(db));
+  }
+
+  // Insert message
+  sqlite3_bind_int(insert_message_stmt_, 1, message.chat_id);
+  sqlite3_bind_int(insert_message_stmt_, 2, message.sender_id);
+  sqlite3_bind_text(insert_message_stmt_, 3, message.text.data(), static_cast<int>(message.text.size()), SQLITE_STATIC);
+  sqlite3_bind_int64(insert_message_stmt_, 4, static_cast<sqlite3_int64>(message.timestamp));
+  if (attachment_id > 0) {
+    sqlite3_bind_int(insert_message_stmt_, 5, attachment_id);
+  } else {
+    sqlite3_bind_null(insert_message_stmt_, 5);
+  }
+
+  bool ok = sqlite3_step(insert_message_stmt_) == SQLITE_DONE;
+  sqlite3_reset(insert_message_stmt_);
+  if (!ok) {
+    throw std::runtime_error("Failed to insert message");
+  }
+
+  return {static_cast<npchat::MessageId>(sqlite3_last_insert_rowid(db)), attachment_id};
+}
+
+void WriteBatcher::execute(const DeliveryAck& op) {
+  sqlite3_bind_int(delete_delivery_stmt_, 1, op.user_id);
+  sqlite3_bind_int(delete_delivery_stmt_, 2, op.message_id);
+
+  if (sqlite3_step(delete_delivery_stmt_) != SQLITE_DONE) {
+    spdlog::warn("[WriteBatcher] Failed to record delivery of message {} to user {}: {}",
+                 op.message_id, op.user_id, sqlite3_errmsg(conn_->handle()));
+  }
+  sqlite3_reset(delete_delivery_stmt_);
+}
+
+void WriteBatcher::pruneDeliveryQueue() {
+  static auto& pruned = metrics::Registry::instance().counter(
+    "npchat_delivery_queue_pruned_total", "Queued deliveries dropped for age or the per-user limit");
+
+  if (options_.delivery_ttl.count() == 0 && options_.delivery_queue_limit == 0) return;
+
+  auto db = conn_->handle();
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("[WriteBatcher] Failed to begin pruning the delivery queue: {}", sqlite3_errmsg(db));
+    return;
+  }
+
+  std::int64_t removed = 0;
+  bool ok = true;
+
+  if (options_.delivery_ttl.count() > 0) {
+    auto cutoff = std::chrono::duration_cast<std::chrono::seconds>(
+      (std::chrono::system_clock::now() - options_.delivery_ttl).time_since_epoch()).count();
+    sqlite3_bind_int64(prune_expired_stmt_, 1, cutoff);
+    ok = sqlite3_step(prune_expired_stmt_) == SQLITE_DONE;
+    sqlite3_reset(prune_expired_stmt_);
+    if (ok) removed += sqlite3_changes(db);
+  }
+
+  if (ok && options_.delivery_queue_limit > 0) {
+    std::vector<std::uint32_t> users;
+    sqlite3_bind_int64(over_limit_stmt_, 1, static_cast<sqlite3_int64>(options_.delivery_queue_limit));
+    int rc;
+    while ((rc = sqlite3_step(over_limit_stmt_)) == SQLITE_ROW) {
+      users.push_back(static_cast<std::uint32_t>(sqlite3_column_int(over_limit_stmt_, 0)));
+    }
+    sqlite3_reset(over_limit_stmt_);
+    ok = rc == SQLITE_DONE;
+
+    for (auto user_id : users) {
+      if (!ok) break;
+      sqlite3_bind_int(prune_user_stmt_, 1, user_id);
+      sqlite3_bind_int64(prune_user_stmt_, 2, static_cast<sqlite3_int64>(options_.delivery_queue_limit));
+      ok = sqlite3_step(prune_user_stmt_) == SQLITE_DONE;
+      sqlite3_reset(prune_user_stmt_);
+      if (ok) removed += sqlite3_changes(db);
+    }
+  }
+
+  if (!ok || sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+    spdlog::error("[WriteBatcher] Failed to prune the delivery queue: {}", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+    return;
+  }
+
+  if (removed > 0) {
+    pruned.inc(static_cast<std::uint64_t>(removed));
+    spdlog::info("[WriteBatcher] Dropped {} stale deliveries from the delivery queue", removed);
+  }
+}
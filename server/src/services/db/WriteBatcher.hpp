@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+#include <sqlite3.h>
+#include "Database.hpp"
+#include "MessageStore.hpp"
+#include "npchat_stub/npchat.hpp"
+
+// Write-behind batcher for the message ingest path.
+//
+// Message and attachment inserts and delivery acks from all sessions are queued and
+// committed together in one transaction on a dedicated connection, either when
+// `batch_size` rows are pending or when the oldest pending row has waited for
+// `window`. Callers of insertMessage() get their MessageId once the batch that
+// contains their row has been committed.
+//
+// Attachment content never goes through here: it is written to the BlobStore
+// beforehand and only its hash and size are recorded in the attachment row.
+//
+// Between batches, every `prune_interval`, the worker also bounds the delivery
+// queue: messages older than `delivery_ttl` are dropped from it, and a user with
+// more than `delivery_queue_limit` queued keeps only the newest. A client away for
+// that long resynchronizes from the chat history instead.
+class WriteBatcher {
+public:
+  struct Options {
+    std::size_t batch_size = 64;
+    std::chrono::milliseconds window{2};
+    std::chrono::hours delivery_ttl{24 * 30};        // 0 = no age limit
+    std::size_t delivery_queue_limit = 10000;        // Per user; 0 = no limit
+    std::chrono::minutes prune_interval{10};
+  };
+
+  using NewMessage = MessageStore::NewMessage;
+  using InsertedMessage = MessageStore::InsertedMessage;
+
+private:
+  struct MessageInsert {
+    const NewMessage* message;
+    std::promise<InsertedMessage> result;
+  };
+
+  struct DeliveryAck {
+    npchat::MessageId message_id;
+    std::uint32_t user_id;
+  };
+
+  using Operation = std::variant<MessageInsert, DeliveryAck>;
+
+  std::shared_ptr<Database> db_;
+  std::unique_ptr<Database::Connection> conn_;
+  const Options options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Operation> pending_;
+  bool stop_ = false;
+  std::thread worker_;
+
+  // Prepared statements (on conn_, used by the worker thread only)
+  sqlite3_stmt* insert_message_stmt_;
+  sqlite3_stmt* insert_attachment_stmt_;
+  sqlite3_stmt* delete_delivery_stmt_;
+  sqlite3_stmt* prune_expired_stmt_;
+  sqlite3_stmt* over_limit_stmt_;
+  sqlite3_stmt* prune_user_stmt_;
+
+  void run();
+  // Drops queued deliveries beyond delivery_ttl and delivery_queue_limit
+  void pruneDeliveryQueue();
+  void commit(std::vector<Operation>& batch);
+  void enqueue(Operation&& op);
+
+  InsertedMessage execute(const MessageInsert& op);
+  void execute(const DeliveryAck& op);
+
+public:
+  WriteBatcher(const std::shared_ptr<Database>& database, Options options);
+  ~WriteBatcher();
+
+  WriteBatcher(const WriteBatcher&) = delete;
+  WriteBatcher& operator=(const WriteBatcher&) = delete;
+
+  // Queue a message (and its attachment row, if any); `message` must stay alive until the future is ready
+  std::future<InsertedMessage> insertMessage(const NewMessage& message);
+  // Queue the removal of a message from the user's delivery queue, fire-and-forget
+  void ackDelivery(npchat::MessageId message_id, std::uint32_t user_id);
+};
@@ -0,0 +1,133 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <fmt/format.h>
+
+namespace metrics {
+
+Histogram::Histogram(std::vector<std::uint64_t> bounds)
+  : bounds_(std::move(bounds))
+  , buckets_(std::make_unique<std::atomic<std::uint64_t>[]>(bounds_.size() + 1))
+{
+  if (!std::is_sorted(bounds_.begin(), bounds_.end())) {
+    throw std::invalid_argument("Histogram bounds must be ascending");
+  }
+}
+
+void Histogram::observe(std::uint64_t value) noexcept {
+  auto bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+  buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+std::vector<std::uint64_t> Histogram::counts() const {
+  std::vector<std::uint64_t> counts(bounds_.size() + 1);
+  for (std::size_t i = 0; i < counts.size(); ++i) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+  return counts;
+}
+
+const std::vector<std::uint64_t>& latency_buckets() {
+  static const std::vector<std::uint64_t> bounds = {
+    10'000, 25'000, 50'000, 100'000, 250'000, 500'000,
+    1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000, 50'000'000,
+    100'000'000, 250'000'000, 500'000'000, 1'000'000'000, 2'500'000'000, 10'000'000'000,
+  };
+  return bounds;
+}
+
+const std::vector<std::uint64_t>& count_buckets() {
+  static const std::vector<std::uint64_t> bounds = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+  return bounds;
+}
+
+Registry& Registry::instance() {
+  static Registry registry;
+  return registry;
+}
+
+Registry::Series& Registry::series(std::string_view name, std::string_view help, Type type, std::string_view labels,
+                                   double scale) {
+  std::lock_guard lock(mutex_);
+
+  auto it = families_.find(name);
+  if (it == families_.end()) {
+    it = families_.emplace(std::string(name), Family{.type = type, .help = std::string(help), .scale = scale}).first;
+  } else if (it->second.type != type) {
+    throw std::logic_error(fmt::format("Metric {} is already registered with another type", name));
+  }
+
+  auto& family = it->second;
+  for (auto& series : family.series) {
+    if (series->labels == labels) return *series;
+  }
+  family.series.push_back(std::make_unique<Series>(Series{.labels = std::string(labels)}));
+  return *family.series.back();
+}
+
+Counter& Registry::counter(std::string_view name, std::string_view help, std::string_view labels) {
+  auto& s = series(name, help, Type::counter, labels, 1);
+  std::lock_guard lock(mutex_);
+  if (!s.counter) s.counter = std::make_unique<Counter>();
+  return *s.counter;
+}
+
+Gauge& Registry::gauge(std::string_view name, std::string_view help, std::string_view labels) {
+  auto& s = series(name, help, Type::gauge, labels, 1);
+  std::lock_guard lock(mutex_);
+  if (!s.gauge) s.gauge = std::make_unique<Gauge>();
+  return *s.gauge;
+}
+
+Histogram& Registry::histogram(std::string_view name, std::string_view help, const std::vector<std::uint64_t>& bounds,
+                               std::string_view labels, double scale) {
+  auto& s = series(name, help, Type::histogram, labels, scale);
+  std::lock_guard lock(mutex_);
+  if (!s.histogram) s.histogram = std::make_unique<Histogram>(bounds);
+  return *s.histogram;
+}
+
+std::string Registry::render() const {
+  std::lock_guard lock(mutex_);
+  std::string out;
+
+  // {labels} with `extra` appended, or nothing if both are empty
+  auto label_set = [] (const std::string& labels, std::string_view extra) {
+    if (labels.empty() && extra.empty()) return std::string();
+    if (labels.empty()) return fmt::format("{{{}}}", extra);
+    if (extra.empty()) return fmt::format("{{{}}}", labels);
+    return fmt::format("{{{},{}}}", labels, extra);
+  };
+
+  for (const auto& [name, family] : families_) {
+    static constexpr std::string_view type_names[] = {"counter", "gauge", "histogram"};
+    fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n",
+                   name, family.help, name, type_names[static_cast<int>(family.type)]);
+
+    for (const auto& series : family.series) {
+      if (series->counter) {
+        fmt::format_to(std::back_inserter(out), "{}{} {}\n", name, label_set(series->labels, {}), series->counter->value());
+      } else if (series->gauge) {
+        fmt::format_to(std::back_inserter(out), "{}{} {}\n", name, label_set(series->labels, {}), series->gauge->value());
+      } else if (series->histogram) {
+        const auto& bounds = series->histogram->bounds();
+        auto counts = series->histogram->counts();
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < counts.size(); ++i) {
+          cumulative += counts[i];
+          auto le = i < bounds.size() ? fmt::format("le=\"{}\"", static_cast<double>(bounds[i]) * family.scale)
+                                      : std::string("le=\"+Inf\"");
+          fmt::format_to(std::back_inserter(out), "{}_bucket{} {}\n", name, label_set(series->labels, le), cumulative);
+        }
+        fmt::format_to(std::back_inserter(out), "{}_sum{} {}\n", name, label_set(series->labels, {}),
+                       static_cast<double>(series->histogram->sum()) * family.scale);
+        fmt::format_to(std::back_inserter(out), "{}_count{} {}\n", name, label_set(series->labels, {}), cumulative);
+      }
+    }
+  }
+  return out;
+}
+
+} // namespace metrics
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Process-wide counters, gauges and histograms, exposed in the Prometheus
+// text format by MetricsServer.
+//
+// Updating a metric is a few relaxed atomic increments and never takes a lock,
+// so it is cheap enough for every call on the hot paths. Looking one up by name
+// does lock: callers keep the reference, typically in a function-local static
+// or a member, and only update it afterwards.
+namespace metrics {
+
+class Counter {
+  std::atomic<std::uint64_t> value_{0};
+
+public:
+  void inc(std::uint64_t n = 1) noexcept { value_.fetch_add(n, std::memory_order_relaxed); }
+  std::uint64_t value() const noexcept { return value_.load(std::memory_order_relaxed); }
+};
+
+class Gauge {
+  std::atomic<std::int64_t> value_{0};
+
+public:
+  void add(std::int64_t n = 1) noexcept { value_.fetch_add(n, std::memory_order_relaxed); }
+  void sub(std::int64_t n = 1) noexcept { value_.fetch_sub(n, std::memory_order_relaxed); }
+  void set(std::int64_t n) noexcept { value_.store(n, std::memory_order_relaxed); }
+  std::int64_t value() const noexcept { return value_.load(std::memory_order_relaxed); }
+};
+
+// Fixed buckets over integer observations (nanoseconds, counts, bytes)
+class Histogram {
+  const std::vector<std::uint64_t> bounds_; // Inclusive upper bounds, ascending
+  std::unique_ptr<std::atomic<std::uint64_t>[]> buckets_; // bounds_.size() + 1, the last one unbounded
+  std::atomic<std::uint64_t> sum_{0};
+
+public:
+  explicit Histogram(std::vector<std::uint64_t> bounds);
+
+  void observe(std::uint64_t value) noexcept;
+  void observe(std::chrono::nanoseconds elapsed) noexcept {
+    observe(static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(0, elapsed.count())));
+  }
+
+  const std::vector<std::uint64_t>& bounds() const noexcept { return bounds_; }
+  // Per-bucket counts, not cumulative
+  std::vector<std::uint64_t> counts() const;
+  std::uint64_t sum() const noexcept { return sum_.load(std::memory_order_relaxed); }
+};
+
+// 10 us .. 10 s, in nanoseconds
+const std::vector<std::uint64_t>& latency_buckets();
+// 1 .. 10000
+const std::vector<std::uint64_t>& count_buckets();
+
+class Registry {
+  enum class Type { counter, gauge, histogram };
+
+  struct Series {
+    std::string labels; // Rendered label set: key="value",...
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  struct Family {
+    Type type;
+    std::string help;
+    double scale = 1; // Histogram observations times scale is the exposed unit
+    std::vector<std::unique_ptr<Series>> series;
+  };
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Family, std::less<>> families_;
+
+  Series& series(std::string_view name, std::string_view help, Type type, std::string_view labels, double scale);
+
+public:
+  static Registry& instance();
+
+  // The same name and labels always return the same metric.
+  // `labels` is the inside of a Prometheus label set: method="SendMessage",kind="select"
+  Counter& counter(std::string_view name, std::string_view help, std::string_view labels = {});
+  Gauge& gauge(std::string_view name, std::string_view help, std::string_view labels = {});
+  // Latency histograms observe nanoseconds and are exposed in seconds (scale 1e-9)
+  Histogram& histogram(std::string_view name, std::string_view help, const std::vector<std::uint64_t>& bounds,
+                       std::string_view labels = {}, double scale = 1);
+  Histogram& latency(std::string_view name, std::string_view help, std::string_view labels = {}) {
+    return histogram(name, help, latency_buckets(), labels, 1e-9);
+  }
+
+  // Prometheus text exposition format 0.0.4
+  std::string render() const;
+};
+
+// Observes the time from construction to destruction
+class Timer {
+  Histogram& histogram_;
+  const std::chrono::steady_clock::time_point started_;
+
+public:
+  explicit Timer(Histogram& histogram) noexcept
+    : histogram_(histogram)
+    , started_(std::chrono::steady_clock::now()) {}
+  ~Timer() { histogram_.observe(std::chrono::steady_clock::now() - started_); }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+};
+
+// A scoped lock that records how long it waited for the mutex; uncontended acquisitions count as zero
+template <typename Mutex>
+class TimedLock {
+  std::unique_lock<Mutex> lock_;
+
+public:
+  TimedLock(Mutex& mutex, Histogram& wait)
+    : lock_(mutex, std::try_to_lock)
+  {
+    if (lock_.owns_lock()) {
+      wait.observe(std::uint64_t{0});
+      return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    lock_.lock();
+    wait.observe(std::chrono::steady_clock::now() - started);
+  }
+};
+
+// Wait time histogram of a named service lock
+inline Histogram& lock_wait(std::string_view lock) {
+  return Registry::instance().latency("npchat_lock_wait_seconds", "Time spent waiting for a service mutex",
+                                      std::string("lock=\"").append(lock).append("\""));
+}
+
+} // namespace metrics
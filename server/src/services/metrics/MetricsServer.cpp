@@ -0,0 +1,78 @@
+#include "MetricsServer.hpp"
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <spdlog/spdlog.h>
+
+#include "Metrics.hpp"
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = boost::asio::ip::tcp;
+
+namespace {
+
+// One request per connection: scrapers reconnect every interval anyway
+class Session : public std::enable_shared_from_this<Session> {
+  tcp::socket socket_;
+  beast::flat_buffer buffer_;
+  http::request<http::empty_body> request_;
+  http::response<http::string_body> response_;
+
+public:
+  explicit Session(tcp::socket socket)
+    : socket_(std::move(socket)) {}
+
+  void start() {
+    http::async_read(socket_, buffer_, request_,
+      [self = shared_from_this()] (beast::error_code ec, std::size_t) {
+        if (!ec) self->respond();
+      });
+  }
+
+private:
+  void respond() {
+    response_.version(request_.version());
+    response_.keep_alive(false);
+
+    if (request_.method() != http::verb::get) {
+      response_.result(http::status::method_not_allowed);
+    } else if (request_.target() != "/metrics") {
+      response_.result(http::status::not_found);
+    } else {
+      response_.result(http::status::ok);
+      response_.set(http::field::content_type, "text/plain; version=0.0.4");
+      response_.body() = metrics::Registry::instance().render();
+    }
+    response_.prepare_payload();
+
+    http::async_write(socket_, response_,
+      [self = shared_from_this()] (beast::error_code, std::size_t) {
+        beast::error_code ignored;
+        self->socket_.shutdown(tcp::socket::shutdown_send, ignored);
+      });
+  }
+};
+
+} // namespace
+
+MetricsServer::MetricsServer(boost::asio::io_context& ctx, const Options& options)
+  : acceptor_(ctx, tcp::endpoint(boost::asio::ip::make_address(options.address), options.port))
+{
+}
+
+void MetricsServer::start() {
+  spdlog::info("Metrics are served at http://{}:{}/metrics",
+               acceptor_.local_endpoint().address().to_string(), acceptor_.local_endpoint().port());
+  accept();
+}
+
+void MetricsServer::accept() {
+  acceptor_.async_accept(
+    [self = shared_from_this()] (beast::error_code ec, tcp::socket socket) {
+      if (ec == boost::asio::error::operation_aborted) return;
+      if (!ec) std::make_shared<Session>(std::move(socket))->start();
+      self->accept();
+    });
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+// Serves GET /metrics (Registry::render) over plain HTTP for a Prometheus scraper.
+//
+// It listens on its own port, kept apart from the nprpc one so that it is never
+// exposed to browsers; bind it to a loopback or internal address.
+class MetricsServer : public std::enable_shared_from_this<MetricsServer> {
+public:
+  struct Options {
+    std::string address = "127.0.0.1";
+    unsigned short port = 0;
+  };
+
+  MetricsServer(boost::asio::io_context& ctx, const Options& options);
+
+  // Starts accepting; the server stays alive while it has a pending accept
+  void start();
+
+private:
+  boost::asio::ip::tcp::acceptor acceptor_;
+
+  void accept();
+};
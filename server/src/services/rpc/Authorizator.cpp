@@ -1,97 +1,113 @@
 #include "Authorizator.hpp"
+#include "RpcMetrics.hpp"
 #include "RegisteredUser.hpp"
 #include "services/db/AuthService.hpp"
 #include "services/db/ContactService.hpp"
 #include "services/db/MessageService.hpp"
 #include "services/db/ChatService.hpp"
+#include "services/db/UploadService.hpp"
 #include "services/client/ChatObserver.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <memory>
 
-AuthorizatorImpl::AuthorizatorImpl(nprpc::Rpc& rpc,
-                                   std::shared_ptr<AuthService> authService,
-                                   std::shared_ptr<ContactService> contactService,
-                                   std::shared_ptr<MessageService> messageService,
-                                   std::shared_ptr<ChatService> chatService,
-                                   std::shared_ptr<ChatObservers> chatObservers,
-                                   std::shared_ptr<WebRTCService> webrtcService)
+AuthorizatorImpl::AuthorizatorImpl(nprpc::Rpc& rpc, ServiceContext services, const Options& options)
   : rpc_(rpc)
-  , authService_(authService)
-  , contactService_(contactService)
-  , messageService_(messageService)
-  , chatService_(chatService)
-  , chatObservers_(chatObservers)
-  , webrtcService_(webrtcService)
+  , services_(std::move(services))
+  , options_{.poa_size = std::max<std::uint32_t>(1, options.poa_size)}
 {
+  std::lock_guard lock(poa_mutex_);
+  addUserPoa();
+}
+
+AuthorizatorImpl::UserPoa& AuthorizatorImpl::addUserPoa() {
   // Create POA for user objects (RegisteredUser instances)
-  user_poa_ = nprpc::PoaBuilder(&rpc)
-    .with_max_objects(1024)
+  auto poa = nprpc::PoaBuilder(&rpc_)
+    .with_max_objects(options_.poa_size)
     .with_lifespan(nprpc::PoaPolicy::Lifespan::Transient)
     .build();
+  user_poas_.push_back({poa, std::make_shared<std::atomic<std::uint32_t>>(0)});
+  current_poa_ = user_poas_.size() - 1;
+  if (user_poas_.size() > 1) {
+    spdlog::info("User POA {} added, room for {} sessions now", user_poas_.size(),
+                 user_poas_.size() * options_.poa_size);
+  }
+  return user_poas_.back();
 }
 
-npchat::UserData AuthorizatorImpl::LogIn (::nprpc::flat::Span<char> login, ::nprpc::flat::Span<char> password) {
-  auto userData = authService_->logIn(std::string_view(login), std::string_view(password));
-
-  // Get user ID from the login
-  std::uint32_t userId = authService_->getUserIdFromLogin(std::string_view(login));
-
-  // Create a new RegisteredUser object
-  auto registeredUser = new RegisteredUserImpl(rpc_, contactService_, messageService_,
-                                               chatService_, chatObservers_, authService_,
-                                               webrtcService_, userId);
-
-  // Activate the object with the POA
-  auto oid = user_poa_->activate_object(registeredUser,
+nprpc::ObjectId AuthorizatorImpl::activateUser(std::uint32_t userId) {
+  auto registeredUser = std::make_unique<RegisteredUserImpl>(services_, userId);
+
+  std::lock_guard lock(poa_mutex_);
+  // Sessions that closed may have left room in any of them
+  UserPoa* target = nullptr;
+  for (std::size_t tried = 0; tried < user_poas_.size(); ++tried) {
+    auto& candidate = user_poas_[current_poa_];
+    if (candidate.live->load(std::memory_order_relaxed) < options_.poa_size) {
+      target = &candidate;
+      break;
+    }
+    current_poa_ = (current_poa_ + 1) % user_poas_.size();
+  }
+  if (!target) target = &addUserPoa();
+
+  // Counted before activating: the servant gives it back when it is destroyed, whether
+  // activation fails here or the session closes right after. Other errors propagate.
+  target->live->fetch_add(1, std::memory_order_relaxed);
+  registeredUser->track(target->live);
+  auto oid = target->poa->activate_object(registeredUser.get(),
     nprpc::ObjectActivationFlags::SESSION_SPECIFIC,
     &nprpc::get_context()
   );
+  registeredUser.release(); // Owned by the POA until the session closes
+  return oid;
+}
 
-  // Set the registeredUser field to the activated object
-  userData.registeredUser = oid;
-
+npchat::UserData AuthorizatorImpl::LogIn (::nprpc::flat::Span<char> login, ::nprpc::flat::Span<char> password) {
+  static auto& latency = rpc_latency("Authorizator", "LogIn");
+  metrics::Timer timer(latency);
+  // Blocks this dispatch thread only; the KDF itself runs on the auth crypto pool
+  auto userData = services_.auth->logIn(std::string_view(login), std::string_view(password));
+  userData.registeredUser = activateUser(userData.userId);
   return userData;
 }
 
 npchat::UserData AuthorizatorImpl::LogInWithSessionId (::nprpc::flat::Span<char> session_id) {
-  auto userData = authService_->logInWithSessionId(std::string_view(session_id));
-
-  // Get user ID from the session
-  std::uint32_t userId = authService_->getUserIdFromSession(std::string_view(session_id));
-
-  // Create a new RegisteredUser object
-  auto registeredUser = new RegisteredUserImpl(rpc_, contactService_, messageService_,
-                                               chatService_, chatObservers_, authService_,
-                                               webrtcService_, userId);
-
-  // Activate the object with the POA
-  auto oid = user_poa_->activate_object(registeredUser,
-    nprpc::ObjectActivationFlags::SESSION_SPECIFIC,
-    &nprpc::get_context()
-  );
-
-  // Set the registeredUser field to the activated object
-  userData.registeredUser = oid;
-
+  static auto& latency = rpc_latency("Authorizator", "LogInWithSessionId");
+  metrics::Timer timer(latency);
+  auto userData = services_.auth->logInWithSessionId(std::string_view(session_id));
+  userData.registeredUser = activateUser(userData.userId);
   return userData;
 }
 
 bool AuthorizatorImpl::LogOut (::nprpc::flat::Span<char> session_id) {
-  return authService_->logOut(std::string_view(session_id));
+  static auto& latency = rpc_latency("Authorizator", "LogOut");
+  metrics::Timer timer(latency);
+  return services_.auth->logOut(std::string_view(session_id));
 }
 
 bool AuthorizatorImpl::CheckUsername (::nprpc::flat::Span<char> username) {
-  return authService_->checkUsername(std::string_view(username));
+  static auto& latency = rpc_latency("Authorizator", "CheckUsername");
+  metrics::Timer timer(latency);
+  return services_.auth->checkUsername(std::string_view(username));
 }
 
 bool AuthorizatorImpl::CheckEmail (::nprpc::flat::Span<char> email) {
-  return authService_->checkEmail(std::string_view(email));
+  static auto& latency = rpc_latency("Authorizator", "CheckEmail");
+  metrics::Timer timer(latency);
+  return services_.auth->checkEmail(std::string_view(email));
 }
 
 void AuthorizatorImpl::RegisterStepOne (::nprpc::flat::Span<char> username,
   ::nprpc::flat::Span<char> email,::nprpc::flat::Span<char> password)
 {
-  authService_->registerStepOne(std::string_view(username), std::string_view(email), std::string_view(password));
+  static auto& latency = rpc_latency("Authorizator", "RegisterStepOne");
+  metrics::Timer timer(latency);
+  services_.auth->registerStepOne(std::string_view(username), std::string_view(email), std::string_view(password));
 }
 
 void AuthorizatorImpl::RegisterStepTwo (::nprpc::flat::Span<char> username, uint32_t code) {
-  authService_->registerStepTwo(std::string_view(username), code);
+  static auto& latency = rpc_latency("Authorizator", "RegisterStepTwo");
+  metrics::Timer timer(latency);
+  services_.auth->registerStepTwo(std::string_view(username), code);
 }
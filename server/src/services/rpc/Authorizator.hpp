@@ -1,31 +1,42 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include "npchat_stub/npchat.hpp"
-class AuthService;
-class ContactService;
-class MessageService;
-class ChatService;
-class ChatObservers;
-class WebRTCService;
+#include "ServiceContext.hpp"
 
 class AuthorizatorImpl : public npchat::IAuthorizator_Servant {
+public:
+  struct Options {
+    std::uint32_t poa_size = 1024; // RegisteredUser objects per user POA
+  };
+
+private:
   nprpc::Rpc& rpc_;
-  std::shared_ptr<AuthService> authService_;
-  std::shared_ptr<ContactService> contactService_;
-  std::shared_ptr<MessageService> messageService_;
-  std::shared_ptr<ChatService> chatService_;
-  std::shared_ptr<ChatObservers> chatObservers_;
-  std::shared_ptr<WebRTCService> webrtcService_;
-  nprpc::Poa* user_poa_;
+  const ServiceContext services_;
+  const Options options_;
+
+  // A POA holds a fixed number of objects; when every one is full another is added
+  struct UserPoa {
+    nprpc::Poa* poa;
+    // Activated and not yet destroyed; never below the POA's own count, since
+    // a servant is only destroyed after the POA let go of it
+    std::shared_ptr<std::atomic<std::uint32_t>> live;
+  };
+
+  std::mutex poa_mutex_;
+  std::vector<UserPoa> user_poas_;
+  std::size_t current_poa_ = 0; // Tried first: the one the last session went into
+
+  UserPoa& addUserPoa();
+  // Creates the session's RegisteredUser and activates it for the calling session
+  nprpc::ObjectId activateUser(std::uint32_t userId);
 
 public:
-  AuthorizatorImpl(nprpc::Rpc& rpc,
-                   std::shared_ptr<AuthService> authService,
-                   std::shared_ptr<ContactService> contactService,
-                   std::shared_ptr<MessageService> messageService,
-                   std::shared_ptr<ChatService> chatService,
-                   std::shared_ptr<ChatObservers> chatObservers,
-                   std::shared_ptr<WebRTCService> webrtcService);
+  AuthorizatorImpl(nprpc::Rpc& rpc, ServiceContext services, const Options& options);
 
   virtual npchat::UserData LogIn (::nprpc::flat::Span<char> login, ::nprpc::flat::Span<char> password) override;
 
@@ -40,4 +51,4 @@ public:
   virtual void RegisterStepOne (::nprpc::flat::Span<char> username, ::nprpc::flat::Span<char> email, ::nprpc::flat::Span<char> password) override;
 
   virtual void RegisterStepTwo (::nprpc::flat::Span<char> username, uint32_t code) override;
-};
\ No newline at end of file
+};
@@ -0,0 +1,182 @@
+#include "PayloadCodec.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+#include "services/metrics/Metrics.hpp"
+
+#ifdef NPCHAT_WITH_ZSTD
+# include <zstd.h>
+#endif
+
+namespace {
+metrics::Counter& payload_bytes(const char* stage) {
+  return metrics::Registry::instance().counter("npchat_payload_bytes_total",
+    "Bytes of Encoded* reply payloads before (raw) and after (encoded) compression",
+    std::string("stage=\"").append(stage).append("\""));
+}
+
+#ifdef NPCHAT_WITH_ZSTD
+// Contexts are reused by the calls on one thread; they hold the compression state between frames
+ZSTD_CCtx* cctx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+ZSTD_DCtx* dctx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> ctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+  return ctx.get();
+}
+#endif
+
+void put_u32(std::vector<std::uint8_t>& out, std::uint32_t value) {
+  for (int i = 0; i < 4; ++i) out.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+}
+} // namespace
+
+PayloadCodec::PayloadCodec(Options options)
+  : options_(std::move(options))
+{
+  if (options_.dictionary.empty()) return;
+
+#ifdef NPCHAT_WITH_ZSTD
+  std::ifstream file(options_.dictionary, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to open the zstd dictionary " + options_.dictionary);
+  }
+  dictionary_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+  dictionary_id_ = ZSTD_getDictID_fromDict(dictionary_.data(), dictionary_.size());
+  if (dictionary_id_ == 0) {
+    throw std::runtime_error("Not a zstd dictionary: " + options_.dictionary);
+  }
+  cdict_ = ZSTD_createCDict(dictionary_.data(), dictionary_.size(), options_.level);
+  ddict_ = ZSTD_createDDict(dictionary_.data(), dictionary_.size());
+  if (!cdict_ || !ddict_) {
+    throw std::runtime_error("Failed to load the zstd dictionary " + options_.dictionary);
+  }
+  spdlog::info("zstd dictionary {} loaded: id {}, {} bytes", options_.dictionary, dictionary_id_, dictionary_.size());
+#else
+  spdlog::warn("Built without zstd, ignoring the dictionary {}", options_.dictionary);
+#endif
+}
+
+PayloadCodec::~PayloadCodec() {
+#ifdef NPCHAT_WITH_ZSTD
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+#endif
+}
+
+bool PayloadCodec::available() noexcept {
+#ifdef NPCHAT_WITH_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+PayloadCodec::Session PayloadCodec::negotiate(npchat::PayloadEncoding accepted, std::uint32_t dictionary_id) const noexcept {
+  Session session;
+  session.compress = available() && accepted == npchat::PayloadEncoding::Zstd;
+  session.dictionary = session.compress && dictionary_id != 0 && dictionary_id == dictionary_id_;
+  return session;
+}
+
+npchat::EncodedPayload PayloadCodec::encode(std::span<const std::uint8_t> raw, Session session) const {
+  static auto& raw_bytes = payload_bytes("raw");
+  static auto& encoded_bytes = payload_bytes("encoded");
+
+  npchat::EncodedPayload payload;
+  payload.encoding = npchat::PayloadEncoding::Identity;
+  payload.rawSize = static_cast<std::uint32_t>(raw.size());
+  raw_bytes.inc(raw.size());
+
+#ifdef NPCHAT_WITH_ZSTD
+  if (session.compress && raw.size() >= options_.threshold) {
+    payload.data.resize(ZSTD_compressBound(raw.size()));
+    auto size = session.dictionary
+      ? ZSTD_compress_usingCDict(cctx(), payload.data.data(), payload.data.size(), raw.data(), raw.size(), cdict_)
+      : ZSTD_compressCCtx(cctx(), payload.data.data(), payload.data.size(), raw.data(), raw.size(), options_.level);
+    // Incompressible content goes out as it is
+    if (!ZSTD_isError(size) && size < raw.size()) {
+      payload.data.resize(size);
+      payload.encoding = npchat::PayloadEncoding::Zstd;
+      encoded_bytes.inc(size);
+      return payload;
+    }
+  }
+#endif
+
+  payload.data.assign(raw.begin(), raw.end());
+  encoded_bytes.inc(raw.size());
+  return payload;
+}
+
+std::vector<std::uint8_t> PayloadCodec::decode(const npchat::EncodedPayload& payload) const {
+  // rawSize comes from the peer; it must not decide how much is allocated
+  if (payload.rawSize > options_.max_raw_size) {
+    throw std::runtime_error("Payload is too large");
+  }
+
+  if (payload.encoding == npchat::PayloadEncoding::Identity) {
+    if (payload.data.size() != payload.rawSize) throw std::runtime_error("Corrupt payload");
+    return payload.data;
+  }
+
+#ifdef NPCHAT_WITH_ZSTD
+  // encode() makes single-shot frames, which record their content size
+  if (ZSTD_getFrameContentSize(payload.data.data(), payload.data.size()) != payload.rawSize) {
+    throw std::runtime_error("Corrupt zstd payload");
+  }
+
+  std::vector<std::uint8_t> raw(payload.rawSize);
+  // Frames made with the dictionary carry its id
+  auto size = ddict_ && ZSTD_getDictID_fromFrame(payload.data.data(), payload.data.size()) != 0
+    ? ZSTD_decompress_usingDDict(dctx(), raw.data(), raw.size(), payload.data.data(), payload.data.size(), ddict_)
+    : ZSTD_decompressDCtx(dctx(), raw.data(), raw.size(), payload.data.data(), payload.data.size());
+  if (ZSTD_isError(size) || size != raw.size()) {
+    throw std::runtime_error("Corrupt zstd payload");
+  }
+  return raw;
+#else
+  throw std::runtime_error("Built without zstd");
+#endif
+}
+
+npchat::EncodedMessageList PayloadCodec::encodeMessages(npchat::MessageList messages, Session session) const {
+  std::size_t size = 0;
+  for (const auto& message : messages) size += 4 + message.content.text.size();
+
+  std::vector<std::uint8_t> texts;
+  texts.reserve(size);
+  for (auto& message : messages) {
+    auto& text = message.content.text;
+    put_u32(texts, static_cast<std::uint32_t>(text.size()));
+    texts.insert(texts.end(), text.begin(), text.end());
+    text.clear();
+  }
+
+  npchat::EncodedMessageList encoded;
+  encoded.texts = encode(texts, session);
+  encoded.messages = std::move(messages);
+  return encoded;
+}
+
+npchat::MessageList PayloadCodec::decodeMessages(npchat::EncodedMessageList encoded) const {
+  auto texts = decode(encoded.texts);
+
+  std::size_t pos = 0;
+  for (auto& message : encoded.messages) {
+    if (texts.size() - pos < 4) throw std::runtime_error("Truncated message texts");
+    std::uint32_t length = 0;
+    for (int i = 0; i < 4; ++i) length |= std::uint32_t{texts[pos + i]} << (8 * i);
+    pos += 4;
+    if (texts.size() - pos < length) throw std::runtime_error("Truncated message texts");
+    message.content.text.assign(reinterpret_cast<const char*>(texts.data() + pos), length);
+    pos += length;
+  }
+  return std::move(encoded.messages);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+#include "npchat_stub/npchat.hpp"
+
+typedef struct ZSTD_CDict_s ZSTD_CDict;
+typedef struct ZSTD_DDict_s ZSTD_DDict;
+
+// Optional zstd compression of the Encoded* replies of RegisteredUser.
+//
+// A session opts in with SetPayloadEncoding; without that, or in a build
+// without zstd (NPCHAT_WITH_ZSTD), every payload goes out as Identity. Payloads
+// below the threshold aren't worth a frame header and are sent as they are.
+// Only these replies are encoded; listener pushes always go out as they are.
+//
+// Chat texts are short and alike, which plain zstd barely gets a grip on; a
+// dictionary trained on them (zstd --train) fixes that. It is used for the
+// sessions that hold the same dictionary, by id.
+//
+// decode() is the client side, for native clients such as the load generator.
+// It refuses payloads that claim to be larger than max_raw_size.
+class PayloadCodec {
+public:
+  struct Options {
+    std::size_t threshold = 1024; // Smallest payload that is compressed, in bytes
+    int level = 3;
+    std::string dictionary;       // Path of a zstd dictionary, empty for none
+    std::uint32_t max_raw_size = 64 * 1024 * 1024; // Largest payload decode() accepts
+  };
+
+  // What a session negotiated
+  struct Session {
+    bool compress = false;
+    bool dictionary = false;
+  };
+
+private:
+  const Options options_;
+  std::vector<std::uint8_t> dictionary_;
+  std::uint32_t dictionary_id_ = 0;
+  ZSTD_CDict* cdict_ = nullptr;
+  ZSTD_DDict* ddict_ = nullptr;
+
+public:
+  explicit PayloadCodec(Options options);
+  ~PayloadCodec();
+
+  PayloadCodec(const PayloadCodec&) = delete;
+  PayloadCodec& operator=(const PayloadCodec&) = delete;
+
+  // Built with zstd
+  static bool available() noexcept;
+
+  // 0 without a dictionary
+  std::uint32_t dictionaryId() const noexcept { return dictionary_id_; }
+  const std::vector<std::uint8_t>& dictionary() const noexcept { return dictionary_; }
+
+  // The session a client gets for the encoding it accepts and the dictionary it holds
+  Session negotiate(npchat::PayloadEncoding accepted, std::uint32_t dictionary_id) const noexcept;
+
+  npchat::EncodedPayload encode(std::span<const std::uint8_t> raw, Session session) const;
+  // Throws on corrupt payloads and on ones larger than max_raw_size
+  std::vector<std::uint8_t> decode(const npchat::EncodedPayload& payload) const;
+
+  // Moves the texts of `messages` into one payload: per message a u32 little-endian length and the bytes
+  npchat::EncodedMessageList encodeMessages(npchat::MessageList messages, Session session) const;
+  npchat::MessageList decodeMessages(npchat::EncodedMessageList encoded) const;
+};
@@ -1,39 +1,100 @@
 #include "RegisteredUser.hpp"
+#include "RpcMetrics.hpp"
 #include "services/db/ContactService.hpp"
 #include "services/db/MessageService.hpp"
 #include "services/db/ChatService.hpp"
 #include "services/db/AuthService.hpp"
+#include "services/db/PresenceService.hpp"
+#include "services/db/UploadService.hpp"
+#include "services/db/MediaPipeline.hpp"
 #include "services/client/ChatObserver.hpp"
 #include <spdlog/spdlog.h>
 #include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace {
+// Fixed-size blocks carved out of slabs and recycled through a free list.
+// Memory is kept for reuse rather than returned, so the pool stays as large as
+// the peak number of sessions.
+class ServantPool {
+  static constexpr std::size_t slab_blocks = 64;
+  const std::size_t block_size_;
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<std::byte[]>> slabs_;
+  std::vector<void*> free_;
+
+public:
+  explicit ServantPool(std::size_t object_size)
+    : block_size_((object_size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t)) {}
+
+  void* allocate() {
+    std::lock_guard lock(mutex_);
+    if (free_.empty()) {
+      // operator new[] storage is aligned for std::max_align_t, and so is every block in it
+      auto& slab = slabs_.emplace_back(new std::byte[block_size_ * slab_blocks]);
+      free_.reserve(slabs_.size() * slab_blocks);
+      for (std::size_t i = slab_blocks; i-- > 0;) free_.push_back(slab.get() + i * block_size_);
+    }
+    auto p = free_.back();
+    free_.pop_back();
+    return p;
+  }
 
-RegisteredUserImpl::RegisteredUserImpl(nprpc::Rpc& rpc,
-                                       std::shared_ptr<ContactService> contactService,
-                                       std::shared_ptr<MessageService> messageService,
-                                       std::shared_ptr<ChatService> chatService,
-                                       std::shared_ptr<ChatObservers> chatObservers,
-                                       std::shared_ptr<AuthService> authService,
-                                       std::shared_ptr<WebRTCService> webrtcService,
-                                       std::uint32_t userId)
-  : rpc_(rpc)
-  , contactService_(contactService)
-  , messageService_(messageService)
-  , chatService_(chatService)
-  , chatObservers_(chatObservers)
-  , authService_(authService)
-  , webrtcService_(webrtcService)
+  void release(void* p) noexcept {
+    std::lock_guard lock(mutex_);
+    free_.push_back(p); // Reserved for every block when its slab was added, so this never allocates
+  }
+};
+
+// Never destroyed: servants of sessions still open at exit are released into it
+ServantPool& servant_pool() {
+  static auto pool = new ServantPool(sizeof(RegisteredUserImpl));
+  return *pool;
+}
+
+metrics::Gauge& servant_count() {
+  static auto& gauge = metrics::Registry::instance().gauge(
+    "npchat_registered_user_servants", "RegisteredUser objects alive, one per logged-in session");
+  return gauge;
+}
+} // namespace
+
+void* RegisteredUserImpl::operator new(std::size_t size) {
+  // Classes derived from this one don't fit the blocks
+  if (size != sizeof(RegisteredUserImpl)) return ::operator new(size);
+  return servant_pool().allocate();
+}
+
+void RegisteredUserImpl::operator delete(void* p, std::size_t size) noexcept {
+  if (!p) return;
+  if (size != sizeof(RegisteredUserImpl)) return ::operator delete(p);
+  servant_pool().release(p);
+}
+
+RegisteredUserImpl::RegisteredUserImpl(const ServiceContext& services, std::uint32_t userId)
+  : services_(services)
   , userId_(userId)
 {
-  spdlog::info("RegisteredUser created for user ID: {}", userId_);
+  servant_count().add();
+  spdlog::trace("RegisteredUser created for user ID: {}", userId_);
+}
+
+RegisteredUserImpl::~RegisteredUserImpl() {
+  servant_count().sub();
+  if (poa_live_) poa_live_->fetch_sub(1, std::memory_order_relaxed);
 }
 
 // Contact management
 npchat::ContactList RegisteredUserImpl::GetContacts() {
-  spdlog::info("GetContacts called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "GetContacts");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetContacts called for user ID: {}", userId_);
 
   try {
-    auto contacts = contactService_->getContacts(userId_);
-    spdlog::info("Retrieved {} contacts for user ID: {}", contacts.size(), userId_);
+    auto contacts = services_.contacts->getContacts(userId_);
+    spdlog::trace("Retrieved {} contacts for user ID: {}", contacts.size(), userId_);
     return contacts;
   } catch (const std::exception& e) {
     spdlog::error("Error getting contacts for user ID {}: {}", userId_, e.what());
@@ -42,12 +103,14 @@ npchat::ContactList RegisteredUserImpl::GetContacts() {
 }
 
 npchat::ContactList RegisteredUserImpl::SearchUsers(::nprpc::flat::Span<char> query, std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "SearchUsers");
+  metrics::Timer timer(latency);
   std::string queryStr(query);
-  spdlog::info("SearchUsers called for user ID: {}, query: '{}', limit: {}", userId_, queryStr, limit);
+  spdlog::trace("SearchUsers called for user ID: {}, query: '{}', limit: {}", userId_, queryStr, limit);
 
   try {
-    auto users = contactService_->searchUsers(userId_, queryStr, limit);
-    spdlog::info("Found {} users for query '{}' by user ID: {}", users.size(), queryStr, userId_);
+    auto users = services_.contacts->searchUsers(userId_, queryStr, limit);
+    spdlog::trace("Found {} users for query '{}' by user ID: {}", users.size(), queryStr, userId_);
     return users;
   } catch (const std::exception& e) {
     spdlog::error("Error searching users for user ID {}, query '{}': {}", userId_, queryStr, e.what());
@@ -56,12 +119,14 @@ npchat::ContactList RegisteredUserImpl::SearchUsers(::nprpc::flat::Span<char> qu
 }
 
 void RegisteredUserImpl::AddContact(npchat::UserId contactUserId) {
-  spdlog::info("AddContact called for user ID: {}, adding contact: {}", userId_, contactUserId);
+  static auto& latency = rpc_latency("RegisteredUser", "AddContact");
+  metrics::Timer timer(latency);
+  spdlog::trace("AddContact called for user ID: {}, adding contact: {}", userId_, contactUserId);
 
   try {
-    bool success = contactService_->addContact(userId_, contactUserId);
+    bool success = services_.contacts->addContact(userId_, contactUserId);
     if (success) {
-      spdlog::info("Successfully added contact {} for user ID: {}", contactUserId, userId_);
+      spdlog::trace("Successfully added contact {} for user ID: {}", contactUserId, userId_);
     } else {
       spdlog::warn("Failed to add contact {} for user ID: {} (might already exist)", contactUserId, userId_);
     }
@@ -72,12 +137,14 @@ void RegisteredUserImpl::AddContact(npchat::UserId contactUserId) {
 }
 
 void RegisteredUserImpl::RemoveContact(npchat::UserId contactUserId) {
-  spdlog::info("RemoveContact called for user ID: {}, removing contact: {}", userId_, contactUserId);
+  static auto& latency = rpc_latency("RegisteredUser", "RemoveContact");
+  metrics::Timer timer(latency);
+  spdlog::trace("RemoveContact called for user ID: {}, removing contact: {}", userId_, contactUserId);
 
   try {
-    bool success = contactService_->removeContact(userId_, contactUserId);
+    bool success = services_.contacts->removeContact(userId_, contactUserId);
     if (success) {
-      spdlog::info("Successfully removed contact {} for user ID: {}", contactUserId, userId_);
+      spdlog::trace("Successfully removed contact {} for user ID: {}", contactUserId, userId_);
     } else {
       spdlog::warn("Failed to remove contact {} for user ID: {} (might not exist)", contactUserId, userId_);
     }
@@ -88,12 +155,14 @@ void RegisteredUserImpl::RemoveContact(npchat::UserId contactUserId) {
 }
 
 npchat::Contact RegisteredUserImpl::GetCurrentUser() {
-  spdlog::info("GetCurrentUser called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "GetCurrentUser");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetCurrentUser called for user ID: {}", userId_);
 
   try {
-    auto user = authService_->getUserById(userId_);
+    auto user = services_.auth->getUserById(userId_);
     if (user) {
-      spdlog::info("Retrieved current user info for user ID: {}", userId_);
+      spdlog::trace("Retrieved current user info for user ID: {}", userId_);
       return *user;
     } else {
       spdlog::error("User not found for ID: {}", userId_);
@@ -106,12 +175,14 @@ npchat::Contact RegisteredUserImpl::GetCurrentUser() {
 }
 
 npchat::Contact RegisteredUserImpl::GetUserById(npchat::UserId userId) {
-  spdlog::info("GetUserById called for user ID: {} by user ID: {}", userId, userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "GetUserById");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetUserById called for user ID: {} by user ID: {}", userId, userId_);
 
   try {
-    auto user = authService_->getUserById(userId);
+    auto user = services_.auth->getUserById(userId);
     if (user) {
-      spdlog::info("Retrieved user info for user ID: {}", userId);
+      spdlog::trace("Retrieved user info for user ID: {}", userId);
       return *user;
     } else {
       spdlog::error("User not found for ID: {}", userId);
@@ -125,12 +196,14 @@ npchat::Contact RegisteredUserImpl::GetUserById(npchat::UserId userId) {
 
 // Chat management
 npchat::ChatList RegisteredUserImpl::GetChats() {
-  spdlog::info("GetChats called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "GetChats");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetChats called for user ID: {}", userId_);
 
   try {
     // Use the new method that returns full chat details
-    auto chats = chatService_->getUserChatsWithDetails(userId_);
-    spdlog::info("Retrieved {} chats for user ID: {}", chats.size(), userId_);
+    auto chats = services_.chats->getUserChatsWithDetails(userId_);
+    spdlog::trace("Retrieved {} chats for user ID: {}", chats.size(), userId_);
     return chats;
   } catch (const std::exception& e) {
     spdlog::error("Error getting chats for user ID {}: {}", userId_, e.what());
@@ -138,18 +211,32 @@ npchat::ChatList RegisteredUserImpl::GetChats() {
   }
 }
 
+npchat::ChatPreviewList RegisteredUserImpl::GetChatsWithPreview(std::uint32_t limitPerChat) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetChatsWithPreview");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetChatsWithPreview called for user ID: {}, limit per chat: {}", userId_, limitPerChat);
+
+  try {
+    auto previews = services_.chats->getUserChatsWithPreview(userId_, limitPerChat);
+    spdlog::trace("Retrieved {} chat previews for user ID: {}", previews.size(), userId_);
+    return previews;
+  } catch (const std::exception& e) {
+    spdlog::error("Error getting chat previews for user ID {}: {}", userId_, e.what());
+    throw;
+  }
+}
+
 npchat::ChatId RegisteredUserImpl::CreateChat() {
-  spdlog::info("CreateChat called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "CreateChat");
+  metrics::Timer timer(latency);
+  spdlog::trace("CreateChat called for user ID: {}", userId_);
 
   try {
     // Create a chat with just the current user as participant
     std::vector<std::uint32_t> participants = {userId_};
-    auto chatId = chatService_->createChat(userId_, participants);
-
-    // Register chat participants with the observer system
-    chatObservers_->add_chat_participants(chatId, participants);
+    auto chatId = services_.chats->createChat(userId_, participants);
 
-    spdlog::info("Created chat {} for user ID: {}, registered with observers", chatId, userId_);
+    spdlog::trace("Created chat {} for user ID: {}", chatId, userId_);
     return chatId;
   } catch (const std::exception& e) {
     spdlog::error("Error creating chat for user ID {}: {}", userId_, e.what());
@@ -158,17 +245,15 @@ npchat::ChatId RegisteredUserImpl::CreateChat() {
 }
 
 npchat::ChatId RegisteredUserImpl::CreateChatWith(npchat::UserId otherUserId) {
-  spdlog::info("CreateChatWith called for user ID: {} with user: {}", userId_, otherUserId);
+  static auto& latency = rpc_latency("RegisteredUser", "CreateChatWith");
+  metrics::Timer timer(latency);
+  spdlog::trace("CreateChatWith called for user ID: {} with user: {}", userId_, otherUserId);
 
   try {
     // Find existing chat or create a new one
-    auto chatId = chatService_->findOrCreateChatBetween(userId_, otherUserId);
+    auto chatId = services_.chats->findOrCreateChatBetween(userId_, otherUserId);
 
-    // Get the participants to register with observer system
-    auto participants = chatService_->getChatParticipants(chatId);
-    chatObservers_->add_chat_participants(chatId, participants);
-
-    spdlog::info("Found/created chat {} between user {} and user {}, registered with observers",
+    spdlog::trace("Found/created chat {} between user {} and user {}",
                  chatId, userId_, otherUserId);
     return chatId;
   } catch (const std::exception& e) {
@@ -178,32 +263,42 @@ npchat::ChatId RegisteredUserImpl::CreateChatWith(npchat::UserId otherUserId) {
 }
 
 void RegisteredUserImpl::AddChatParticipant(npchat::ChatId chatId, npchat::UserId participantUserId) {
-  spdlog::info("AddChatParticipant called for user ID: {}, chat: {}, participant: {}",
+  static auto& latency = rpc_latency("RegisteredUser", "AddChatParticipant");
+  metrics::Timer timer(latency);
+  spdlog::trace("AddChatParticipant called for user ID: {}, chat: {}, participant: {}",
                userId_, chatId, participantUserId);
 
   try {
-    // TODO: Add method to ChatService to add a single participant
-    spdlog::info("Added participant {} to chat {} by user ID: {}", participantUserId, chatId, userId_);
-  } catch (const std::exception& e) {
+    services_.chats->addParticipant(userId_, chatId, participantUserId);
+    spdlog::trace("Added participant {} to chat {} by user ID: {}", participantUserId, chatId, userId_);
+  } catch (const std::runtime_error& e) {
+    std::string errorMsg = e.what();
     spdlog::error("Error adding participant {} to chat {} by user ID {}: {}",
-                  participantUserId, chatId, userId_, e.what());
-    throw;
+                  participantUserId, chatId, userId_, errorMsg);
+
+    if (errorMsg.find("not found") != std::string::npos) {
+      throw npchat::ChatOperationFailed(npchat::ChatError::ChatNotFound);
+    } else if (errorMsg.find("already a participant") != std::string::npos) {
+      throw npchat::ChatOperationFailed(npchat::ChatError::InvalidMessage);
+    } else {
+      throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
+    }
   }
 }
 
 void RegisteredUserImpl::LeaveChatParticipant(npchat::ChatId chatId, npchat::UserId participantUserId) {
-  spdlog::info("LeaveChatParticipant called for user ID: {}, chat: {}, participant: {}",
+  static auto& latency = rpc_latency("RegisteredUser", "LeaveChatParticipant");
+  metrics::Timer timer(latency);
+  spdlog::trace("LeaveChatParticipant called for user ID: {}, chat: {}, participant: {}",
                userId_, chatId, participantUserId);
 
   try {
     // Use ChatService to remove the participant with proper authorization
-    bool success = chatService_->removeParticipant(userId_, chatId, participantUserId);
+    bool success = services_.chats->removeParticipant(userId_, chatId, participantUserId);
 
     if (success) {
-      spdlog::info("Successfully removed participant {} from chat {} by user ID: {}",
+      spdlog::trace("Successfully removed participant {} from chat {} by user ID: {}",
                    participantUserId, chatId, userId_);
-      // Also update observers mapping so future notifications respect current participants
-      chatObservers_->remove_chat_participant(chatId, participantUserId);
     } else {
       spdlog::warn("Failed to remove participant {} from chat {} by user ID: {}",
                    participantUserId, chatId, userId_);
@@ -232,31 +327,21 @@ void RegisteredUserImpl::LeaveChatParticipant(npchat::ChatId chatId, npchat::Use
 
 // Message operations
 void RegisteredUserImpl::SubscribeToEvents(nprpc::Object* obj) {
-  spdlog::info("SubscribeToEvents called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "SubscribeToEvents");
+  metrics::Timer timer(latency);
+  spdlog::trace("SubscribeToEvents called for user ID: {}", userId_);
 
   try {
     if (auto listener = nprpc::narrow<npchat::ChatListener>(obj)) {
       listener->add_ref();
+      // Calls are sent from the listener's own queue, so a timeout only delays this client
       listener->set_timeout(250);
 
-      // Subscribe this user's listener to chat events
-      chatObservers_->subscribe_user(userId_, listener);
-
-      // Prime observer with all existing chats and their participants so
-      // messages from existing chats are delivered even if the chat wasn't just created.
-      try {
-        auto chats = chatService_->getUserChatsWithDetails(userId_);
-        for (const auto& chat : chats) {
-          // Fetch participants for each chat and register them in the observer mapping
-          auto participants = chatService_->getChatParticipants(chat.id);
-          chatObservers_->add_chat_participants(chat.id, participants);
-        }
-        spdlog::info("Registered {} existing chats for user {} in observers", chats.size(), userId_);
-      } catch (const std::exception& e) {
-        spdlog::warn("Failed to pre-register existing chats for user {}: {}", userId_, e.what());
-      }
+      // Subscribe this user's listener to chat events. Chat membership comes from
+      // the shared index, so there is nothing to prime per chat.
+      services_.observers->subscribe_user(userId_, listener);
 
-      spdlog::info("Successfully subscribed user ID: {} to chat events", userId_);
+      spdlog::trace("Successfully subscribed user ID: {} to chat events", userId_);
     } else {
       spdlog::error("Failed to narrow object to ChatListener for user ID: {}", userId_);
       throw std::invalid_argument("Object is not a valid ChatListener");
@@ -269,28 +354,34 @@ void RegisteredUserImpl::SubscribeToEvents(nprpc::Object* obj) {
 
 npchat::MessageId RegisteredUserImpl::SendMessage(npchat::ChatId chatId,
                                                   npchat::flat::ChatMessageContent_Direct content) {
-  spdlog::info("SendMessage called for user ID: {}, chat ID: {}", userId_, chatId);
+  static auto& latency = rpc_latency("RegisteredUser", "SendMessage");
+  metrics::Timer timer(latency);
+  spdlog::trace("SendMessage called for user ID: {}, chat ID: {}", userId_, chatId);
 
   try {
     // Convert flat message to regular ChatMessage for ChatService
     npchat::ChatMessageContent messageContent;
     npchat::helpers::assign_from_flat_ChatMessageContent(content, messageContent);
 
-    auto messageId = chatService_->sendMessage(userId_, chatId, messageContent);
+    // The stored message references the attachment by id, so the content isn't pushed to every participant
+    auto chatMessage = services_.chats->sendMessage(userId_, chatId, messageContent);
+    auto messageId = chatMessage.messageId;
 
     // Notify all chat participants about the new message
-    npchat::ChatMessage chatMessage {
-      .messageId = messageId,
-      .senderId = userId_,
-      .chatId = chatId,
-      .content = std::move(messageContent)
-    };
-    chatObservers_->notify_message_received(messageId, chatMessage, userId_);
+    services_.observers->notify_message_received(messageId, chatMessage, userId_);
 
     // Notify sender about successful delivery
-    chatObservers_->notify_message_delivered(chatId, messageId, userId_);
+    services_.observers->notify_message_delivered(chatId, messageId, userId_);
+
+    // The message is what the user was typing
+    services_.presence->setTyping(userId_, chatId, false);
+
+    // Its preview is made in the background and announced with OnAttachmentPreviewReady
+    if (chatMessage.content.attachment) {
+      services_.media->submit(chatId, messageId, *chatMessage.content.attachment);
+    }
 
-    spdlog::info("Message sent with ID: {} for user ID: {}, chat ID: {}, participants notified",
+    spdlog::trace("Message sent with ID: {} for user ID: {}, chat ID: {}, participants notified",
                  messageId, userId_, chatId);
     return messageId;
   } catch (const std::runtime_error& e) {
@@ -314,22 +405,21 @@ npchat::MessageId RegisteredUserImpl::SendMessage(npchat::ChatId chatId,
 }
 
 npchat::MessageList RegisteredUserImpl::GetChatHistory(npchat::ChatId chatId, std::uint32_t limit, std::uint32_t offset) {
-  spdlog::info("GetChatHistory called for user ID: {}, chat ID: {}, limit: {}, offset: {}",
+  static auto& latency = rpc_latency("RegisteredUser", "GetChatHistory");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetChatHistory called for user ID: {}, chat ID: {}, limit: {}, offset: {}",
                userId_, chatId, limit, offset);
 
   try {
     // First, verify that the user is a participant in this chat
-    auto participants = chatService_->getChatParticipants(chatId);
-    bool isParticipant = std::find(participants.begin(), participants.end(), userId_) != participants.end();
-
-    if (!isParticipant) {
+    if (!services_.chats->isParticipant(chatId, userId_)) {
       spdlog::warn("User {} attempted to access chat history for chat {} without being a participant",
                    userId_, chatId);
       throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
     }
 
-    auto messages = chatService_->getMessages(chatId, limit, offset);
-    spdlog::info("Retrieved {} messages for chat {} by user ID: {}", messages.size(), chatId, userId_);
+    auto messages = services_.chats->getMessages(chatId, limit, offset);
+    spdlog::trace("Retrieved {} messages for chat {} by user ID: {}", messages.size(), chatId, userId_);
     return messages;
   } catch (const npchat::ChatOperationFailed&) {
     // Re-throw NPRPC exceptions as-is
@@ -341,12 +431,133 @@ npchat::MessageList RegisteredUserImpl::GetChatHistory(npchat::ChatId chatId, st
   }
 }
 
+npchat::MessageList RegisteredUserImpl::GetChatHistoryBefore(npchat::ChatId chatId, npchat::MessageId beforeMessageId,
+                                                             std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetChatHistoryBefore");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetChatHistoryBefore called for user ID: {}, chat ID: {}, before: {}, limit: {}",
+               userId_, chatId, beforeMessageId, limit);
+
+  try {
+    if (!services_.chats->isParticipant(chatId, userId_)) {
+      spdlog::warn("User {} attempted to access chat history for chat {} without being a participant",
+                   userId_, chatId);
+      throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
+    }
+
+    auto messages = services_.chats->getMessagesBefore(chatId, beforeMessageId, limit);
+    spdlog::trace("Retrieved {} messages for chat {} by user ID: {}", messages.size(), chatId, userId_);
+    return messages;
+  } catch (const npchat::ChatOperationFailed&) {
+    throw;
+  } catch (const std::exception& e) {
+    spdlog::error("Error getting chat history for user ID {}, chat ID {}: {}",
+                  userId_, chatId, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::ChatNotFound);
+  }
+}
+
+npchat::bytestream RegisteredUserImpl::GetAttachment(npchat::AttachmentId attachmentId, std::uint32_t offset, std::uint32_t length) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetAttachment");
+  metrics::Timer timer(latency);
+  spdlog::debug("GetAttachment called for user ID: {}, attachment ID: {}, offset: {}, length: {}",
+                userId_, attachmentId, offset, length);
+
+  try {
+    return services_.chats->readAttachment(userId_, attachmentId, offset, length);
+  } catch (const std::exception& e) {
+    spdlog::warn("Error reading attachment {} for user ID {}: {}", attachmentId, userId_, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
+  }
+}
+
+npchat::bytestream RegisteredUserImpl::GetAttachmentPreview(npchat::AttachmentId attachmentId) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetAttachmentPreview");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetAttachmentPreview called for user ID: {}, attachment ID: {}", userId_, attachmentId);
+
+  try {
+    return services_.media->readPreview(userId_, attachmentId);
+  } catch (const std::exception& e) {
+    spdlog::warn("Error reading the preview of attachment {} for user ID {}: {}", attachmentId, userId_, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
+  }
+}
+
+npchat::UploadId RegisteredUserImpl::BeginUpload(std::uint32_t size) {
+  static auto& latency = rpc_latency("RegisteredUser", "BeginUpload");
+  metrics::Timer timer(latency);
+  spdlog::trace("BeginUpload called for user ID: {}, size: {}", userId_, size);
+
+  try {
+    return services_.uploads->beginUpload(userId_, size);
+  } catch (const std::exception& e) {
+    spdlog::warn("Error starting upload for user ID {}: {}", userId_, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::MessageTooLong);
+  }
+}
+
+std::uint32_t RegisteredUserImpl::UploadChunk(npchat::UploadId uploadId, std::uint32_t offset,
+                                              ::nprpc::flat::Span<std::uint8_t> data) {
+  static auto& latency = rpc_latency("RegisteredUser", "UploadChunk");
+  metrics::Timer timer(latency);
+  spdlog::debug("UploadChunk called for user ID: {}, upload ID: {}, offset: {}, length: {}",
+                userId_, uploadId, offset, data.size());
+
+  try {
+    // Written to disk straight from the request buffer
+    return services_.uploads->uploadChunk(userId_, uploadId, offset, std::span<const std::uint8_t>(data.data(), data.size()));
+  } catch (const std::exception& e) {
+    spdlog::warn("Error writing chunk of upload {} for user ID {}: {}", uploadId, userId_, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::InvalidMessage);
+  }
+}
+
+void RegisteredUserImpl::CommitUpload(npchat::UploadId uploadId) {
+  static auto& latency = rpc_latency("RegisteredUser", "CommitUpload");
+  metrics::Timer timer(latency);
+  spdlog::trace("CommitUpload called for user ID: {}, upload ID: {}", userId_, uploadId);
+
+  try {
+    services_.uploads->commitUpload(userId_, uploadId);
+  } catch (const std::exception& e) {
+    spdlog::warn("Error committing upload {} for user ID {}: {}", uploadId, userId_, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::InvalidMessage);
+  }
+}
+
+npchat::MessageSearchResultList RegisteredUserImpl::SearchMessages(::nprpc::flat::Span<char> query, npchat::ChatId chatId,
+                                                                  std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "SearchMessages");
+  metrics::Timer timer(latency);
+  std::string queryStr(query);
+  spdlog::trace("SearchMessages called for user ID: {}, query: '{}', chat ID: {}, limit: {}",
+               userId_, queryStr, chatId, limit);
+
+  if (chatId != 0) {
+    if (!services_.chats->isParticipant(chatId, userId_)) {
+      throw npchat::ChatOperationFailed(npchat::ChatError::UserNotParticipant);
+    }
+  }
+
+  try {
+    auto results = services_.messages->searchMessages(userId_, queryStr, chatId, limit);
+    spdlog::trace("Found {} messages for query '{}' by user ID: {}", results.size(), queryStr, userId_);
+    return results;
+  } catch (const std::exception& e) {
+    spdlog::error("Error searching messages for user ID {}, query '{}': {}", userId_, queryStr, e.what());
+    throw npchat::ChatOperationFailed(npchat::ChatError::InvalidMessage);
+  }
+}
+
 std::uint32_t RegisteredUserImpl::GetUnreadMessageCount() {
-  spdlog::info("GetUnreadMessageCount called for user ID: {}", userId_);
+  static auto& latency = rpc_latency("RegisteredUser", "GetUnreadMessageCount");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetUnreadMessageCount called for user ID: {}", userId_);
 
   try {
-    auto count = messageService_->getUnreadMessageCount(userId_);
-    spdlog::info("User ID: {} has {} unread messages", userId_, count);
+    auto count = services_.messages->getUnreadMessageCount(userId_);
+    spdlog::trace("User ID: {} has {} unread messages", userId_, count);
     return count;
   } catch (const std::exception& e) {
     spdlog::error("Error getting unread message count for user ID {}: {}", userId_, e.what());
@@ -355,32 +566,120 @@ std::uint32_t RegisteredUserImpl::GetUnreadMessageCount() {
 }
 
 void RegisteredUserImpl::MarkMessageAsRead(npchat::MessageId messageId) {
-  spdlog::info("MarkMessageAsRead called for user ID: {}, message ID: {}", userId_, messageId);
+  static auto& latency = rpc_latency("RegisteredUser", "MarkMessageAsRead");
+  metrics::Timer timer(latency);
+  spdlog::trace("MarkMessageAsRead called for user ID: {}, message ID: {}", userId_, messageId);
 
   try {
-    messageService_->markMessageAsRead(messageId, userId_);
-    spdlog::info("Marked message {} as read for user ID: {}", messageId, userId_);
+    services_.messages->markMessageAsRead(messageId, userId_);
+    spdlog::trace("Marked message {} as read for user ID: {}", messageId, userId_);
   } catch (const std::exception& e) {
     spdlog::error("Error marking message {} as read for user ID {}: {}", messageId, userId_, e.what());
     throw;
   }
 }
 
+npchat::MessageList RegisteredUserImpl::GetPendingMessages(npchat::MessageId afterMessageId, std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetPendingMessages");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetPendingMessages called for user ID: {}, after: {}, limit: {}", userId_, afterMessageId, limit);
+
+  try {
+    auto messages = services_.messages->getPendingMessages(userId_, afterMessageId, limit);
+    spdlog::trace("Returning {} pending messages for user ID: {}", messages.size(), userId_);
+    return messages;
+  } catch (const std::exception& e) {
+    spdlog::error("Error getting pending messages for user ID {}: {}", userId_, e.what());
+    throw;
+  }
+}
+
+void RegisteredUserImpl::AckMessages(::nprpc::flat::Span<npchat::MessageId> messageIds) {
+  static auto& latency = rpc_latency("RegisteredUser", "AckMessages");
+  metrics::Timer timer(latency);
+  spdlog::debug("AckMessages called for user ID: {}, {} messages", userId_, messageIds.size());
+
+  // Only removes entries from this user's own queue, so unknown ids are harmless
+  for (auto messageId : messageIds) {
+    services_.chats->markMessageDelivered(messageId, userId_);
+  }
+}
+
+// Presence
+void RegisteredUserImpl::SetTyping(npchat::ChatId chatId, bool typing) {
+  static auto& latency = rpc_latency("RegisteredUser", "SetTyping");
+  metrics::Timer timer(latency);
+
+  if (!services_.chats->isParticipant(chatId, userId_)) {
+    throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
+  }
+  services_.presence->setTyping(userId_, chatId, typing);
+}
+
+npchat::PresenceUpdateList RegisteredUserImpl::GetChatPresence(npchat::ChatId chatId) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetChatPresence");
+  metrics::Timer timer(latency);
+  spdlog::trace("GetChatPresence called for user ID: {}, chat ID: {}", userId_, chatId);
+
+  if (!services_.chats->isParticipant(chatId, userId_)) {
+    throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
+  }
+  return services_.presence->chatPresence(chatId, userId_);
+}
+
+// Payload encoding
+npchat::PayloadEncoding RegisteredUserImpl::SetPayloadEncoding(npchat::PayloadEncoding accepted, std::uint32_t dictionaryId) {
+  static auto& latency = rpc_latency("RegisteredUser", "SetPayloadEncoding");
+  metrics::Timer timer(latency);
+
+  auto session = services_.codec->negotiate(accepted, dictionaryId);
+  encoding_.store(session, std::memory_order_relaxed);
+  spdlog::trace("SetPayloadEncoding for user ID: {}: compress {}, dictionary {}", userId_, session.compress, session.dictionary);
+  return session.compress ? npchat::PayloadEncoding::Zstd : npchat::PayloadEncoding::Identity;
+}
+
+npchat::CompressionDictionary RegisteredUserImpl::GetCompressionDictionary() {
+  static auto& latency = rpc_latency("RegisteredUser", "GetCompressionDictionary");
+  metrics::Timer timer(latency);
+
+  npchat::CompressionDictionary dictionary;
+  dictionary.id = services_.codec->dictionaryId();
+  dictionary.data = services_.codec->dictionary();
+  return dictionary;
+}
+
+npchat::EncodedMessageList RegisteredUserImpl::GetChatHistoryBeforeEncoded(npchat::ChatId chatId, npchat::MessageId beforeMessageId,
+                                                                           std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetChatHistoryBeforeEncoded");
+  metrics::Timer timer(latency);
+
+  return services_.codec->encodeMessages(GetChatHistoryBefore(chatId, beforeMessageId, limit),
+                                         encoding_.load(std::memory_order_relaxed));
+}
+
+npchat::EncodedMessageList RegisteredUserImpl::GetPendingMessagesEncoded(npchat::MessageId afterMessageId, std::uint32_t limit) {
+  static auto& latency = rpc_latency("RegisteredUser", "GetPendingMessagesEncoded");
+  metrics::Timer timer(latency);
+
+  return services_.codec->encodeMessages(GetPendingMessages(afterMessageId, limit),
+                                         encoding_.load(std::memory_order_relaxed));
+}
+
 // WebRTC video calling
 std::string RegisteredUserImpl::InitiateCall(npchat::ChatId chatId, ::nprpc::flat::Span<char> offer) {
-  spdlog::info("InitiateCall called for user ID: {}, chat ID: {}", userId_, chatId);
+  static auto& latency = rpc_latency("RegisteredUser", "InitiateCall");
+  metrics::Timer timer(latency);
+  spdlog::trace("InitiateCall called for user ID: {}, chat ID: {}", userId_, chatId);
 
   try {
     // Check if user is a participant in the chat
-    auto chatParticipants = chatService_->getChatParticipants(chatId);
-    bool isParticipant = std::find(chatParticipants.begin(), chatParticipants.end(), userId_) != chatParticipants.end();
-
-    if (!isParticipant) {
+    if (!services_.chats->isParticipant(chatId, userId_)) {
       spdlog::error("User {} is not a participant in chat {}", userId_, chatId);
       throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
     }
 
     // Find the other participant (assuming 1-on-1 chat for now)
+    auto chatParticipants = services_.chats->getChatParticipants(chatId);
     npchat::UserId otherUserId = 0;
     for (auto participantId : chatParticipants) {
       if (participantId != userId_) {
@@ -395,18 +694,18 @@ std::string RegisteredUserImpl::InitiateCall(npchat::ChatId chatId, ::nprpc::fla
     }
 
     // Check if there's already an active call in this chat
-    auto activeCalls = webrtcService_->getActiveCallsForChat(chatId);
+    auto activeCalls = services_.webrtc->getActiveCallsForChat(chatId);
     if (!activeCalls.empty()) {
       spdlog::error("Call already active in chat {}", chatId);
       throw npchat::ChatOperationFailed{npchat::ChatError::InvalidMessage};
     }
 
-    std::string callId = webrtcService_->initiateCall(chatId, userId_, otherUserId, offer);
+    std::string callId = services_.webrtc->initiateCall(chatId, userId_, otherUserId, offer);
 
     // Notify all chat participants about the call initiation
-    chatObservers_->notify_call_initiated(callId, chatId, userId_, otherUserId, offer);
+    services_.observers->notify_call_initiated(callId, chatId, userId_, otherUserId, offer);
 
-    spdlog::info("Call initiated: {} in chat {} from {} to {}", callId, chatId, userId_, otherUserId);
+    spdlog::trace("Call initiated: {} in chat {} from {} to {}", callId, chatId, userId_, otherUserId);
     return callId;
   } catch (const std::exception& e) {
     spdlog::error("Error initiating call for user ID {} in chat {}: {}", userId_, chatId, e.what());
@@ -415,13 +714,15 @@ std::string RegisteredUserImpl::InitiateCall(npchat::ChatId chatId, ::nprpc::fla
 }
 
 void RegisteredUserImpl::AnswerCall(::nprpc::flat::Span<char> callId, ::nprpc::flat::Span<char> answer) {
+  static auto& latency = rpc_latency("RegisteredUser", "AnswerCall");
+  metrics::Timer timer(latency);
   auto callIdStr = (std::string_view)callId;
   auto answerStr = (std::string_view)answer;
 
-  spdlog::info("AnswerCall called for user ID: {}, call ID: {}", userId_, callIdStr);
+  spdlog::trace("AnswerCall called for user ID: {}, call ID: {}", userId_, callIdStr);
 
   try {
-    auto callOpt = webrtcService_->getCall(callIdStr);
+    auto callOpt = services_.webrtc->getCall(callIdStr);
     if (!callOpt) {
       spdlog::error("Call not found: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::ChatNotFound};
@@ -435,15 +736,15 @@ void RegisteredUserImpl::AnswerCall(::nprpc::flat::Span<char> callId, ::nprpc::f
       throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
     }
 
-    if (!webrtcService_->answerCall(callIdStr, answerStr)) {
+    if (!services_.webrtc->answerCall(callIdStr, answerStr)) {
       spdlog::error("Failed to answer call: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::InvalidMessage};
     }
 
     // Notify the caller about the answer
-    chatObservers_->notify_call_answered(callIdStr, answerStr, call.callerId);
+    services_.observers->notify_call_answered(callIdStr, answerStr, call.callerId);
 
-    spdlog::info("Call answered: {}", callIdStr);
+    spdlog::trace("Call answered: {}", callIdStr);
   } catch (const std::exception& e) {
     spdlog::error("Error answering call {} for user ID {}: {}", callIdStr, userId_, e.what());
     throw;
@@ -451,13 +752,15 @@ void RegisteredUserImpl::AnswerCall(::nprpc::flat::Span<char> callId, ::nprpc::f
 }
 
 void RegisteredUserImpl::SendIceCandidate(::nprpc::flat::Span<char> callId, ::nprpc::flat::Span<char> candidate) {
+  static auto& latency = rpc_latency("RegisteredUser", "SendIceCandidate");
+  metrics::Timer timer(latency);
   auto callIdStr = (std::string_view)callId;
   auto candidateStr = (std::string_view)candidate;
 
-  spdlog::info("SendIceCandidate called for user ID: {}, call ID: {}", userId_, callIdStr);
+  spdlog::debug("SendIceCandidate called for user ID: {}, call ID: {}", userId_, callIdStr);
 
   try {
-    auto callOpt = webrtcService_->getCall(callIdStr);
+    auto callOpt = services_.webrtc->getCall(callIdStr);
     if (!callOpt) {
       spdlog::error("Call not found: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::ChatNotFound};
@@ -471,18 +774,13 @@ void RegisteredUserImpl::SendIceCandidate(::nprpc::flat::Span<char> callId, ::np
       throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
     }
 
-    if (!webrtcService_->addIceCandidate(callIdStr, candidateStr)) {
+    // Pushed to the other participant together with any candidates that follow shortly
+    if (!services_.webrtc->addIceCandidate(callIdStr, userId_, candidateStr)) {
       spdlog::error("Failed to add ICE candidate to call: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::InvalidMessage};
     }
 
-    // Determine the target user (the other participant)
-    npchat::UserId targetUserId = (call.callerId == userId_) ? call.calleeId : call.callerId;
-
-    // Notify the other participant about the ICE candidate
-    chatObservers_->notify_ice_candidate(callIdStr, candidateStr, targetUserId);
-
-    spdlog::info("ICE candidate sent for call: {}", callIdStr);
+    spdlog::debug("ICE candidate queued for call: {}", callIdStr);
   } catch (const std::exception& e) {
     spdlog::error("Error sending ICE candidate for call {} by user ID {}: {}", callIdStr, userId_, e.what());
     throw;
@@ -490,12 +788,14 @@ void RegisteredUserImpl::SendIceCandidate(::nprpc::flat::Span<char> callId, ::np
 }
 
 void RegisteredUserImpl::EndCall(::nprpc::flat::Span<char> callId) {
+  static auto& latency = rpc_latency("RegisteredUser", "EndCall");
+  metrics::Timer timer(latency);
   auto callIdStr = (std::string_view)callId;
 
-  spdlog::info("EndCall called for user ID: {}, call ID: {}", userId_, callIdStr);
+  spdlog::trace("EndCall called for user ID: {}, call ID: {}", userId_, callIdStr);
 
   try {
-    auto callOpt = webrtcService_->getCall(callIdStr);
+    auto callOpt = services_.webrtc->getCall(callIdStr);
     if (!callOpt) {
       spdlog::error("Call not found: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::ChatNotFound};
@@ -509,15 +809,15 @@ void RegisteredUserImpl::EndCall(::nprpc::flat::Span<char> callId) {
       throw npchat::ChatOperationFailed{npchat::ChatError::UserNotParticipant};
     }
 
-    if (!webrtcService_->endCall(callIdStr)) {
+    if (!services_.webrtc->endCall(callIdStr)) {
       spdlog::error("Failed to end call: {}", callIdStr);
       throw npchat::ChatOperationFailed{npchat::ChatError::InvalidMessage};
     }
 
     // Notify all participants about the call ending
-    chatObservers_->notify_call_ended(callIdStr, "ended", call.chatId);
+    services_.observers->notify_call_ended(callIdStr, "ended", call.chatId);
 
-    spdlog::info("Call ended: {}", callIdStr);
+    spdlog::trace("Call ended: {}", callIdStr);
   } catch (const std::exception& e) {
     spdlog::error("Error ending call {} by user ID {}: {}", callIdStr, userId_, e.what());
     throw;
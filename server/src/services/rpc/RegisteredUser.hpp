@@ -1,33 +1,32 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include "npchat_stub/npchat.hpp"
 #include "services/db/WebRTCService.hpp"
+#include "PayloadCodec.hpp"
+#include "ServiceContext.hpp"
 
-class ContactService;
-class MessageService;
-class ChatService;
-class ChatObservers;
-class AuthService;
-
+// The object a logged-in session talks to; one per session, destroyed by the
+// user POA when the session closes. Servants are recycled through a slab pool,
+// since every login and reconnect creates one.
 class RegisteredUserImpl : public npchat::IRegisteredUser_Servant {
-  nprpc::Rpc& rpc_;
-  std::shared_ptr<ContactService> contactService_;
-  std::shared_ptr<MessageService> messageService_;
-  std::shared_ptr<ChatService> chatService_;
-  std::shared_ptr<ChatObservers> chatObservers_;
-  std::shared_ptr<AuthService> authService_;
-  std::shared_ptr<WebRTCService> webrtcService_;
+  const ServiceContext& services_;
   std::uint32_t userId_;
+  std::atomic<PayloadCodec::Session> encoding_{}; // Set by SetPayloadEncoding
+  std::shared_ptr<std::atomic<std::uint32_t>> poa_live_; // Objects in the POA holding this one
 
 public:
-  RegisteredUserImpl(nprpc::Rpc& rpc,
-                     std::shared_ptr<ContactService> contactService,
-                     std::shared_ptr<MessageService> messageService,
-                     std::shared_ptr<ChatService> chatService,
-                     std::shared_ptr<ChatObservers> chatObservers,
-                     std::shared_ptr<AuthService> authService,
-                     std::shared_ptr<WebRTCService> webrtcService,
-                     std::uint32_t userId);
+  RegisteredUserImpl(const ServiceContext& services, std::uint32_t userId);
+  ~RegisteredUserImpl() override;
+
+  // Set before activation: the count of the POA's live objects, decremented when it is destroyed
+  void track(std::shared_ptr<std::atomic<std::uint32_t>> poa_live) noexcept { poa_live_ = std::move(poa_live); }
+
+  static void* operator new(std::size_t size);
+  static void operator delete(void* p, std::size_t size) noexcept;
 
   // Contact management
   virtual npchat::ContactList GetContacts() override;
@@ -43,6 +42,7 @@ public:
 
   // Chat management
   virtual npchat::ChatList GetChats() override;
+  virtual npchat::ChatPreviewList GetChatsWithPreview(std::uint32_t limitPerChat) override;
   virtual npchat::ChatId CreateChat() override;
   virtual npchat::ChatId CreateChatWith(npchat::UserId userId) override;
   virtual void AddChatParticipant(npchat::ChatId chatId, npchat::UserId userId) override;
@@ -53,8 +53,27 @@ public:
   virtual npchat::MessageId SendMessage(npchat::ChatId chatId,
                                         npchat::flat::ChatMessageContent_Direct content) override;
   virtual npchat::MessageList GetChatHistory(npchat::ChatId chatId, std::uint32_t limit, std::uint32_t offset) override;
+  virtual npchat::MessageList GetChatHistoryBefore(npchat::ChatId chatId, npchat::MessageId beforeMessageId, std::uint32_t limit) override;
+  virtual npchat::bytestream GetAttachment(npchat::AttachmentId attachmentId, std::uint32_t offset, std::uint32_t length) override;
+  virtual npchat::bytestream GetAttachmentPreview(npchat::AttachmentId attachmentId) override;
+  virtual npchat::UploadId BeginUpload(std::uint32_t size) override;
+  virtual std::uint32_t UploadChunk(npchat::UploadId uploadId, std::uint32_t offset, ::nprpc::flat::Span<std::uint8_t> data) override;
+  virtual void CommitUpload(npchat::UploadId uploadId) override;
+  virtual npchat::MessageSearchResultList SearchMessages(::nprpc::flat::Span<char> query, npchat::ChatId chatId, std::uint32_t limit) override;
   virtual std::uint32_t GetUnreadMessageCount() override;
   virtual void MarkMessageAsRead(npchat::MessageId messageId) override;
+  virtual npchat::MessageList GetPendingMessages(npchat::MessageId afterMessageId, std::uint32_t limit) override;
+  virtual void AckMessages(::nprpc::flat::Span<npchat::MessageId> messageIds) override;
+
+  // Presence
+  virtual void SetTyping(npchat::ChatId chatId, bool typing) override;
+  virtual npchat::PresenceUpdateList GetChatPresence(npchat::ChatId chatId) override;
+
+  // Payload encoding
+  virtual npchat::PayloadEncoding SetPayloadEncoding(npchat::PayloadEncoding accepted, std::uint32_t dictionaryId) override;
+  virtual npchat::CompressionDictionary GetCompressionDictionary() override;
+  virtual npchat::EncodedMessageList GetChatHistoryBeforeEncoded(npchat::ChatId chatId, npchat::MessageId beforeMessageId, std::uint32_t limit) override;
+  virtual npchat::EncodedMessageList GetPendingMessagesEncoded(npchat::MessageId afterMessageId, std::uint32_t limit) override;
 
   // WebRTC video calling
 
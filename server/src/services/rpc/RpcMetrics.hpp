@@ -0,0 +1,14 @@
+#pragma once
+
+#include <string_view>
+#include <fmt/format.h>
+#include "services/metrics/Metrics.hpp"
+
+// Latency histogram of one RPC method; each method looks its own up once:
+//   static auto& latency = rpc_latency("RegisteredUser", "GetChats");
+//   metrics::Timer timer(latency);
+inline metrics::Histogram& rpc_latency(std::string_view interface, std::string_view method) {
+  return metrics::Registry::instance().latency(
+    "npchat_rpc_duration_seconds", "Time spent serving an RPC call, failed ones included",
+    fmt::format("interface=\"{}\",method=\"{}\"", interface, method));
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+
+class AuthService;
+class ContactService;
+class MessageService;
+class ChatService;
+class ChatObservers;
+class WebRTCService;
+class UploadService;
+class PresenceService;
+class PayloadCodec;
+class MediaPipeline;
+
+// Handles to the services the RPC servants work with.
+//
+// One instance is owned by AuthorizatorImpl for the life of the process, and
+// every RegisteredUserImpl keeps a reference to it instead of copying each
+// handle, so creating a session servant touches no reference counts.
+struct ServiceContext {
+  std::shared_ptr<AuthService> auth;
+  std::shared_ptr<ContactService> contacts;
+  std::shared_ptr<MessageService> messages;
+  std::shared_ptr<ChatService> chats;
+  std::shared_ptr<ChatObservers> observers;
+  std::shared_ptr<WebRTCService> webrtc;
+  std::shared_ptr<UploadService> uploads;
+  std::shared_ptr<PresenceService> presence;
+  std::shared_ptr<PayloadCodec> codec;
+  std::shared_ptr<MediaPipeline> media;
+
+  ServiceContext(std::shared_ptr<AuthService> auth,
+                 std::shared_ptr<ContactService> contacts,
+                 std::shared_ptr<MessageService> messages,
+                 std::shared_ptr<ChatService> chats,
+                 std::shared_ptr<ChatObservers> observers,
+                 std::shared_ptr<WebRTCService> webrtc,
+                 std::shared_ptr<UploadService> uploads,
+                 std::shared_ptr<PresenceService> presence,
+                 std::shared_ptr<PayloadCodec> codec,
+                 std::shared_ptr<MediaPipeline> media)
+    : auth(std::move(auth))
+    , contacts(std::move(contacts))
+    , messages(std::move(messages))
+    , chats(std::move(chats))
+    , observers(std::move(observers))
+    , webrtc(std::move(webrtc))
+    , uploads(std::move(uploads))
+    , presence(std::move(presence))
+    , codec(std::move(codec))
+    , media(std::move(media)) {}
+};